@@ -0,0 +1,141 @@
+/* Task queue throughput: the previous mutex + condvar circular buffer
+ * against the lock-free ring, with half the threads producing and half
+ * consuming. Build with "make bench". */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "queue.h"
+
+#define BENCH_CAPACITY 200          // Same as TASK_QUEUE_SIZE in server.c
+#define BENCH_OPS 2000000L
+
+/* ===== BASELINE: MUTEX QUEUE ===== */
+
+typedef struct {
+    Task **tasks;
+    int front, rear, count, capacity;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} MutexQueue;
+
+static MutexQueue* mutex_queue_create(int capacity) {
+    MutexQueue *queue = malloc(sizeof(MutexQueue));
+    queue->tasks = malloc(sizeof(Task*) * capacity);
+    queue->front = queue->rear = queue->count = 0;
+    queue->capacity = capacity;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return queue;
+}
+
+static void mutex_queue_destroy(MutexQueue *queue) {
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+    free(queue->tasks);
+    free(queue);
+}
+
+static void mutex_queue_push(MutexQueue *queue, Task *task) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count >= queue->capacity) {
+        pthread_cond_wait(&queue->not_full, &queue->mutex);
+    }
+    queue->tasks[queue->rear] = task;
+    queue->rear = (queue->rear + 1) % queue->capacity;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+static Task* mutex_queue_pop(MutexQueue *queue) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == 0) {
+        pthread_cond_wait(&queue->not_empty, &queue->mutex);
+    }
+    Task *task = queue->tasks[queue->front];
+    queue->front = (queue->front + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+    return task;
+}
+
+/* ===== HARNESS ===== */
+
+typedef struct {
+    void *queue;
+    int lock_free;
+    long ops;
+} BenchArg;
+
+static Task dummy_task;
+
+static void* producer(void *arg) {
+    BenchArg *a = arg;
+    for (long i = 0; i < a->ops; i++) {
+        if (a->lock_free) task_queue_push(a->queue, &dummy_task);
+        else mutex_queue_push(a->queue, &dummy_task);
+    }
+    return NULL;
+}
+
+static void* consumer(void *arg) {
+    BenchArg *a = arg;
+    for (long i = 0; i < a->ops; i++) {
+        if (a->lock_free) task_queue_pop(a->queue);
+        else mutex_queue_pop(a->queue);
+    }
+    return NULL;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns millions of push+pop pairs per second */
+static double run(int threads, int lock_free) {
+    int pairs = threads / 2;
+    long per_thread = BENCH_OPS / pairs;
+    pthread_t *tids = malloc(sizeof(pthread_t) * threads);
+    BenchArg arg;
+
+    arg.lock_free = lock_free;
+    arg.ops = per_thread;
+    arg.queue = lock_free ? (void*)task_queue_create(BENCH_CAPACITY)
+                          : (void*)mutex_queue_create(BENCH_CAPACITY);
+
+    double start = now_sec();
+    for (int i = 0; i < pairs; i++) {
+        pthread_create(&tids[i], NULL, producer, &arg);
+        pthread_create(&tids[pairs + i], NULL, consumer, &arg);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now_sec() - start;
+
+    if (lock_free) task_queue_destroy(arg.queue);
+    else mutex_queue_destroy(arg.queue);
+    free(tids);
+
+    return (per_thread * pairs) / elapsed / 1e6;
+}
+
+int main(void) {
+    int counts[] = {2, 8, 32, 64};
+
+    printf("%-8s %14s %14s %8s\n", "threads", "mutex Mops/s", "ring Mops/s", "speedup");
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        double before = run(counts[i], 0);
+        double after = run(counts[i], 1);
+        printf("%-8d %14.2f %14.2f %7.2fx\n", counts[i], before, after, after / before);
+    }
+    return 0;
+}
@@ -0,0 +1,621 @@
+#include "chunkstore.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define RECIPE_MAGIC "DBXCHUNK"
+#define RECIPE_VERSION 1
+#define CHUNKSTORE_MIN_BUCKETS 1024
+#define PACK_BUFFER_SIZE (4 * CHUNK_MAX_SIZE)
+
+/* Header of a recipe; the chunk list follows */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_count;
+    int64_t size;               // Sum of the chunk lengths
+} RecipeHeader;
+
+/* One chunk of a recipe */
+typedef struct {
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    uint32_t length;
+} ChunkRef;
+
+struct ChunkEntry {
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    uint32_t length;
+    long refs;                  // Recipes (and packs in progress) using it
+    int ready;                  // 0 while the first user is still writing it
+    ChunkEntry *next;           // Bucket chain
+};
+
+/* ===== CUT POINTS ===== */
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/* Fixed seed: cut points must not change between runs */
+static void gear_init(void) {
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* Length of the chunk starting at data. The top bits of the gear hash
+ * depend on the last 64 bytes only, so equal content cuts equally
+ * wherever it sits in the file. */
+static size_t chunk_cut(const unsigned char *data, size_t len) {
+    if (len <= CHUNK_MIN_SIZE) return len;
+
+    size_t max = len < CHUNK_MAX_SIZE ? len : CHUNK_MAX_SIZE;
+    uint64_t hash = 0;
+    for (size_t i = CHUNK_MIN_SIZE; i < max; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash >> (64 - CHUNK_AVG_BITS)) == 0) return i + 1;
+    }
+    return max;
+}
+
+/* ===== TABLE ===== */
+
+static size_t digest_bucket(ChunkStore *store, const unsigned char *digest) {
+    size_t h;
+    memcpy(&h, digest, sizeof(h)); // Already uniformly distributed
+    return h & (store->bucket_count - 1);
+}
+
+static ChunkEntry** entry_find(ChunkStore *store, const unsigned char *digest) {
+    ChunkEntry **link = &store->buckets[digest_bucket(store, digest)];
+    while (*link && memcmp((*link)->digest, digest, SHA256_DIGEST_SIZE) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static void table_grow(ChunkStore *store) {
+    size_t count = store->bucket_count * 2;
+    ChunkEntry **buckets = calloc(count, sizeof(ChunkEntry*));
+    if (!buckets) return; // Chains just get longer
+
+    for (size_t i = 0; i < store->bucket_count; i++) {
+        ChunkEntry *e = store->buckets[i];
+        while (e) {
+            ChunkEntry *next = e->next;
+            size_t h;
+            memcpy(&h, e->digest, sizeof(h));
+            e->next = buckets[h & (count - 1)];
+            buckets[h & (count - 1)] = e;
+            e = next;
+        }
+    }
+    free(store->buckets);
+    store->buckets = buckets;
+    store->bucket_count = count;
+}
+
+/* New entry in the slot entry_find() returned (caller holds the mutex) */
+static ChunkEntry* entry_insert(ChunkStore *store, ChunkEntry **link,
+                                const unsigned char *digest, uint32_t length) {
+    ChunkEntry *e = calloc(1, sizeof(ChunkEntry));
+    if (!e) return NULL;
+    memcpy(e->digest, digest, SHA256_DIGEST_SIZE);
+    e->length = length;
+    *link = e;
+    store->chunk_count++;
+    store->stored_bytes += length;
+
+    if (store->chunk_count > store->bucket_count) table_grow(store);
+    return e;
+}
+
+static void chunk_path(ChunkStore *store, const unsigned char *digest,
+                       char *path, size_t size) {
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) sprintf(hex + 2 * i, "%02x", digest[i]);
+    snprintf(path, size, "%s/%.2s/%s", store->dir, hex, hex);
+}
+
+/* Store a chunk under a temporary name, then rename it into place so a
+ * crash never leaves a truncated chunk under its digest */
+static int chunk_write(ChunkStore *store, const unsigned char *digest,
+                       const unsigned char *data, size_t len) {
+    char path[512], tmp[520];
+    chunk_path(store, digest, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 && errno == ENOENT) {
+        char dir[512];
+        snprintf(dir, sizeof(dir), "%s", path);
+        *strrchr(dir, '/') = '\0';
+        mkdir(dir, 0755);
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd == -1) return -1;
+
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            close(fd);
+            unlink(tmp);
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    close(fd);
+
+    if (rename(tmp, path) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Take a reference on a chunk, writing it first if nobody has it */
+static int chunk_acquire(ChunkStore *store, const unsigned char *digest,
+                         const unsigned char *data, uint32_t len) {
+    pthread_mutex_lock(&store->mutex);
+    for (;;) {
+        ChunkEntry **link = entry_find(store, digest);
+        ChunkEntry *e = *link;
+        if (e && e->ready) {
+            e->refs++;
+            store->referenced_bytes += len;
+            pthread_mutex_unlock(&store->mutex);
+            return 0;
+        }
+        if (!e) {
+            e = entry_insert(store, link, digest, len);
+            if (!e) {
+                pthread_mutex_unlock(&store->mutex);
+                return -1;
+            }
+            e->refs = 1;
+            store->referenced_bytes += len;
+            break;
+        }
+        /* Someone else is writing this chunk right now */
+        pthread_cond_wait(&store->written, &store->mutex);
+    }
+    pthread_mutex_unlock(&store->mutex);
+
+    int status = chunk_write(store, digest, data, len);
+
+    pthread_mutex_lock(&store->mutex);
+    ChunkEntry **link = entry_find(store, digest);
+    if (status == 0) {
+        (*link)->ready = 1;
+    } else {
+        ChunkEntry *e = *link;
+        *link = e->next;
+        store->chunk_count--;
+        store->stored_bytes -= e->length;
+        store->referenced_bytes -= e->length;
+        free(e);
+    }
+    pthread_cond_broadcast(&store->written);
+    pthread_mutex_unlock(&store->mutex);
+    return status;
+}
+
+/* Drop a reference, a recipe's (counted in referenced_bytes) or a
+ * download's; the last one deletes the chunk. The unlink happens under
+ * the mutex so it cannot race with a new writer of the same chunk. */
+static void chunk_drop(ChunkStore *store, const unsigned char *digest, int recipe) {
+    pthread_mutex_lock(&store->mutex);
+    ChunkEntry **link = entry_find(store, digest);
+    ChunkEntry *e = *link;
+    if (e) {
+        if (recipe) store->referenced_bytes -= e->length;
+        if (--e->refs == 0) {
+            char path[512];
+            chunk_path(store, digest, path, sizeof(path));
+            unlink(path);
+            *link = e->next;
+            store->chunk_count--;
+            store->stored_bytes -= e->length;
+            free(e);
+        }
+    }
+    pthread_mutex_unlock(&store->mutex);
+}
+
+static void chunk_release(ChunkStore *store, const unsigned char *digest) {
+    chunk_drop(store, digest, 1);
+}
+
+/* Keep chunks first..end-1 of a recipe on disk while a download reads
+ * them: a DELETE meanwhile then only drops the recipe's references.
+ * Fails (-1) if one is gone already, i.e. the file was deleted. */
+static int chunks_hold(ChunkStore *store, const ChunkRef *refs, uint32_t first,
+                       uint32_t end) {
+    uint32_t i;
+    pthread_mutex_lock(&store->mutex);
+    for (i = first; i < end; i++) {
+        ChunkEntry *e = *entry_find(store, refs[i].digest);
+        if (!e || !e->ready) break;
+        e->refs++;
+    }
+    pthread_mutex_unlock(&store->mutex);
+
+    if (i == end) return 0;
+    for (uint32_t j = first; j < i; j++) chunk_drop(store, refs[j].digest, 0);
+    return -1;
+}
+
+/* ===== RECIPES ===== */
+
+/* Load the recipe at path: 0 with the chunk list, 1 if path is a plain
+ * file, -1 on error */
+static int recipe_read(const char *path, RecipeHeader *h, ChunkRef **refs) {
+    *refs = NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    int status = 1;
+    if ((size_t)st.st_size >= sizeof(*h) &&
+        pread(fd, h, sizeof(*h), 0) == (ssize_t)sizeof(*h) &&
+        memcmp(h->magic, RECIPE_MAGIC, sizeof(h->magic)) == 0 &&
+        h->version == RECIPE_VERSION &&
+        (size_t)st.st_size == sizeof(*h) + (size_t)h->chunk_count * sizeof(ChunkRef)) {
+        size_t bytes = (size_t)h->chunk_count * sizeof(ChunkRef);
+        *refs = malloc(bytes ? bytes : 1);
+        if (*refs && pread(fd, *refs, bytes, sizeof(*h)) == (ssize_t)bytes) {
+            status = 0;
+        } else {
+            free(*refs);
+            *refs = NULL;
+            status = -1;
+        }
+    }
+    close(fd);
+    return status;
+}
+
+/* Write a recipe next to path and rename it over the file */
+static int recipe_write(const char *path, int64_t size, const ChunkRef *refs,
+                        uint32_t count) {
+    char tmp[600];
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash ? (int)(slash - path + 1) : 0;
+    snprintf(tmp, sizeof(tmp), "%.*s.%s.recipe", dir_len, path, path + dir_len);
+
+    RecipeHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, RECIPE_MAGIC, sizeof(h.magic));
+    h.version = RECIPE_VERSION;
+    h.chunk_count = count;
+    h.size = size;
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) return -1;
+    int ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+             fwrite(refs, sizeof(ChunkRef), count, fp) == count;
+    if (fclose(fp) != 0) ok = 0;
+
+    if (!ok || rename(tmp, path) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int chunkstore_pack(ChunkStore *store, const char *path) {
+    pthread_once(&gear_once, gear_init);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    unsigned char *buffer = malloc(PACK_BUFFER_SIZE);
+    ChunkRef *refs = NULL;
+    uint32_t count = 0, capacity = 0;
+    int64_t size = 0;
+    int status = buffer ? 0 : -1;
+
+    /* Chunks are cut from [pos, end); the buffer is refilled whenever
+     * less than a maximal chunk is left, so every cut sees enough data */
+    size_t pos = 0, end = 0;
+    int eof = 0;
+    while (status == 0) {
+        if (!eof && end - pos < CHUNK_MAX_SIZE) {
+            memmove(buffer, buffer + pos, end - pos);
+            end -= pos;
+            pos = 0;
+            while (!eof && end < PACK_BUFFER_SIZE) {
+                ssize_t n = read(fd, buffer + end, PACK_BUFFER_SIZE - end);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) status = -1;
+                if (n <= 0) {
+                    eof = 1;
+                    break;
+                }
+                end += n;
+            }
+            if (status == -1) break;
+        }
+        if (pos == end) break;
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            ChunkRef *grown = realloc(refs, sizeof(ChunkRef) * capacity);
+            if (!grown) {
+                status = -1;
+                break;
+            }
+            refs = grown;
+        }
+
+        size_t len = chunk_cut(buffer + pos, end - pos);
+        ChunkRef *ref = &refs[count];
+        sha256(buffer + pos, len, ref->digest);
+        ref->length = (uint32_t)len;
+        if (chunk_acquire(store, ref->digest, buffer + pos, ref->length) == -1) {
+            status = -1;
+            break;
+        }
+        count++;
+        size += len;
+        pos += len;
+    }
+    close(fd);
+    free(buffer);
+
+    if (status == 0) status = recipe_write(path, size, refs, count);
+    if (status == -1) {
+        for (uint32_t i = 0; i < count; i++) chunk_release(store, refs[i].digest);
+    }
+    free(refs);
+    return status;
+}
+
+/* ===== READING ===== */
+
+/* Walks a recipe for transfer_open_parts() */
+typedef struct {
+    ChunkStore *store;
+    ChunkRef *refs;
+    uint32_t count;
+    uint32_t next;              // Next chunk to open
+    off_t skip;                 // Offset into the first chunk opened
+    uint32_t first, end;        // Chunks of the range, held until release
+} ChunkReader;
+
+static int reader_next(void *ctx, off_t *offset, long *length) {
+    ChunkReader *r = ctx;
+    if (r->next >= r->count) return -1;
+
+    ChunkRef *ref = &r->refs[r->next++];
+    char path[512];
+    chunk_path(r->store, ref->digest, path, sizeof(path));
+
+    *offset = r->skip;
+    *length = ref->length - r->skip;
+    r->skip = 0;
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+static void reader_release(void *ctx) {
+    ChunkReader *r = ctx;
+    for (uint32_t i = r->first; i < r->end; i++) chunk_drop(r->store, r->refs[i].digest, 0);
+    free(r->refs);
+    free(r);
+}
+
+int chunkstore_open_read(ChunkStore *store, const char *path, off_t offset,
+                         long length, FileTransfer *t) {
+    RecipeHeader h;
+    ChunkRef *refs;
+    int status = recipe_read(path, &h, &refs);
+    if (status == 1) return transfer_open_read(t, path, offset, length);
+    if (status == -1) return -1;
+
+    ChunkReader *r = calloc(1, sizeof(ChunkReader));
+    if (!r) {
+        free(refs);
+        return -1;
+    }
+    r->store = store;
+    r->refs = refs;
+    r->count = h.chunk_count;
+
+    /* Start inside the chunk that holds offset */
+    while (r->next < r->count && offset >= (off_t)refs[r->next].length) {
+        offset -= refs[r->next].length;
+        r->next++;
+    }
+    r->skip = offset;
+
+    /* The SIZE line promises the whole range: chunks are opened one at
+     * a time as the download reaches them, so hold them all now */
+    long left = offset + length;
+    r->first = r->end = r->next;
+    while (r->end < r->count && left > 0) left -= refs[r->end++].length;
+    if (chunks_hold(store, refs, r->first, r->end) == -1) {
+        free(refs);
+        free(r);
+        return -1;
+    }
+
+    return transfer_open_parts(t, length, reader_next, reader_release, r);
+}
+
+int chunkstore_remove(ChunkStore *store, const char *path) {
+    RecipeHeader h;
+    ChunkRef *refs;
+    int status = recipe_read(path, &h, &refs);
+    if (status == -1) return -1;
+
+    /* Recipe first: a crash in between only leaves unreferenced chunks,
+     * which the next startup sweeps */
+    if (unlink(path) == -1) {
+        free(refs);
+        return -1;
+    }
+    if (status == 0) {
+        for (uint32_t i = 0; i < h.chunk_count; i++) chunk_release(store, refs[i].digest);
+    }
+    free(refs);
+    return 0;
+}
+
+long chunkstore_file_size(const char *path) {
+    RecipeHeader h;
+    ChunkRef *refs;
+    int status = recipe_read(path, &h, &refs);
+    free(refs);
+    if (status == 0) return h.size;
+
+    struct stat st;
+    if (status == -1 || stat(path, &st) != 0) return -1;
+    return st.st_size;
+}
+
+/* ===== STARTUP ===== */
+
+/* Count the references held by every recipe under root/<user>/ */
+static void store_count_refs(ChunkStore *store, const char *root) {
+    DIR *users = opendir(root);
+    if (!users) return;
+
+    struct dirent *user;
+    while ((user = readdir(users)) != NULL) {
+        if (user->d_name[0] == '.') continue;
+
+        char dir[512];
+        snprintf(dir, sizeof(dir), "%s/%s", root, user->d_name);
+        DIR *files = opendir(dir);
+        if (!files) continue;
+
+        struct dirent *file;
+        while ((file = readdir(files)) != NULL) {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", dir, file->d_name);
+
+            if (file->d_name[0] == '.') {
+                /* Recipe a crash left before its rename */
+                size_t len = strlen(file->d_name);
+                if (len > 7 && strcmp(file->d_name + len - 7, ".recipe") == 0) unlink(path);
+                continue;
+            }
+
+            RecipeHeader h;
+            ChunkRef *refs;
+            if (recipe_read(path, &h, &refs) != 0) continue;
+
+            for (uint32_t i = 0; i < h.chunk_count; i++) {
+                ChunkEntry **link = entry_find(store, refs[i].digest);
+                ChunkEntry *e = *link;
+                if (!e) e = entry_insert(store, link, refs[i].digest, refs[i].length);
+                if (!e) break;
+                e->ready = 1;
+                e->refs++;
+                store->referenced_bytes += e->length;
+            }
+            free(refs);
+        }
+        closedir(files);
+    }
+    closedir(users);
+}
+
+/* Delete chunks no recipe refers to and writes a crash interrupted */
+static int store_sweep(ChunkStore *store) {
+    DIR *top = opendir(store->dir);
+    if (!top) return 0;
+
+    int swept = 0;
+    struct dirent *sub;
+    while ((sub = readdir(top)) != NULL) {
+        if (sub->d_name[0] == '.') continue;
+
+        char dir[512];
+        snprintf(dir, sizeof(dir), "%s/%s", store->dir, sub->d_name);
+        DIR *chunks = opendir(dir);
+        if (!chunks) continue;
+
+        struct dirent *chunk;
+        while ((chunk = readdir(chunks)) != NULL) {
+            if (chunk->d_name[0] == '.') continue;
+
+            unsigned char digest[SHA256_DIGEST_SIZE];
+            int valid = strlen(chunk->d_name) == SHA256_DIGEST_SIZE * 2;
+            for (int i = 0; valid && i < SHA256_DIGEST_SIZE; i++) {
+                unsigned int byte;
+                valid = sscanf(chunk->d_name + 2 * i, "%2x", &byte) == 1;
+                digest[i] = (unsigned char)byte;
+            }
+            if (valid && *entry_find(store, digest)) continue;
+
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", dir, chunk->d_name);
+            if (unlink(path) == 0) swept++;
+        }
+        closedir(chunks);
+    }
+    closedir(top);
+    return swept;
+}
+
+ChunkStore* chunkstore_open(const char *dir, const char *files_root) {
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) return NULL;
+
+    ChunkStore *store = calloc(1, sizeof(ChunkStore));
+    if (!store) return NULL;
+    store->bucket_count = CHUNKSTORE_MIN_BUCKETS;
+    store->buckets = calloc(store->bucket_count, sizeof(ChunkEntry*));
+    if (!store->buckets) {
+        free(store);
+        return NULL;
+    }
+    snprintf(store->dir, sizeof(store->dir), "%s", dir);
+    pthread_mutex_init(&store->mutex, NULL);
+    pthread_cond_init(&store->written, NULL);
+
+    store_count_refs(store, files_root);
+    int swept = store_sweep(store);
+
+    printf("[ChunkStore] %zu chunks (%.2f MB) hold %.2f MB of files, %d stale removed\n",
+           store->chunk_count, store->stored_bytes / (1024.0*1024.0),
+           store->referenced_bytes / (1024.0*1024.0), swept);
+    return store;
+}
+
+void chunkstore_close(ChunkStore *store) {
+    if (!store) return;
+
+    printf("[ChunkStore] %zu chunks (%.2f MB) hold %.2f MB of files\n",
+           store->chunk_count, store->stored_bytes / (1024.0*1024.0),
+           store->referenced_bytes / (1024.0*1024.0));
+
+    for (size_t i = 0; i < store->bucket_count; i++) {
+        ChunkEntry *e = store->buckets[i];
+        while (e) {
+            ChunkEntry *next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    free(store->buckets);
+    pthread_mutex_destroy(&store->mutex);
+    pthread_cond_destroy(&store->written);
+    free(store);
+}
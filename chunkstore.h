@@ -0,0 +1,56 @@
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "sha256.h"
+#include "transfer.h"
+
+/* Deduplicating file storage. A stored file is split into
+ * content-defined chunks (a gear rolling hash picks the cut points, so an
+ * insertion only changes the chunks around it) and each distinct chunk is
+ * kept once under chunks/<xx>/<sha256>. The file itself is replaced by a
+ * recipe listing its chunks. Reference counts are not persisted: they are
+ * rebuilt from the recipes at startup, which also sweeps chunks left
+ * behind by a crash. Plain files stay readable, so the mode can be turned
+ * on for an existing tree. */
+
+#define CHUNKSTORE_DIR "chunks"
+#define CHUNK_MIN_SIZE (16 * 1024)
+#define CHUNK_AVG_BITS 16               // Cut on average every 64 KB after the minimum
+#define CHUNK_MAX_SIZE (256 * 1024)
+
+typedef struct ChunkEntry ChunkEntry;
+
+typedef struct {
+    char dir[256];
+    pthread_mutex_t mutex;      // Protects the table and the counters
+    pthread_cond_t written;     // A pending chunk was written (or failed)
+    ChunkEntry **buckets;       // Chained hash table on the chunk digest
+    size_t bucket_count;        // Power of two
+    size_t chunk_count;
+    long stored_bytes;          // Bytes of distinct chunks on disk
+    long referenced_bytes;      // Bytes of all files built from them
+} ChunkStore;
+
+/* Open the store in dir and count the references held by the recipes
+ * under files_root/<user>/ (NULL on error) */
+ChunkStore* chunkstore_open(const char *dir, const char *files_root);
+void chunkstore_close(ChunkStore *store);
+
+/* Replace the plain file at path by a recipe, storing its new chunks (0 or -1) */
+int chunkstore_pack(ChunkStore *store, const char *path);
+
+/* Open length bytes of the file at path from offset for sending */
+int chunkstore_open_read(ChunkStore *store, const char *path, off_t offset,
+                         long length, FileTransfer *t);
+
+/* Delete the file at path and drop its chunk references (0 or -1) */
+int chunkstore_remove(ChunkStore *store, const char *path);
+
+/* Size of the file at path as the user sees it (-1 on error) */
+long chunkstore_file_size(const char *path);
+
+#endif
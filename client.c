@@ -2,22 +2,220 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include "linereader.h"
 
 #define BUFFER_SIZE 4096
+#define PARALLEL_STREAMS 4                      // Sessions moving one large file
+#define PARALLEL_MIN_SIZE (8 * 1024 * 1024)     // Smaller files use one stream
+#define CONNECT_RETRIES 3                       // Reconnects a busy server is worth
 
-/* Helper to receive a line from server */
-int recv_line(int sock, char *buffer, size_t size) {
-    memset(buffer, 0, size);
-    int n = recv(sock, buffer, size - 1, 0);
+/* Server and account, so large transfers can open extra sessions */
+static struct sockaddr_in server_addr;
+static char login_user[64], login_pass[64];
+
+/* Read one reply line, newline included; whatever the server sent
+ * behind it (more replies, file data) stays in the reader */
+static int recv_reply(LineReader *r, char *buffer, size_t size) {
+    int n = line_reader_next(r, buffer, size - 1);
+    if (n < 0) {
+        buffer[0] = '\0';
+        return -1;
+    }
+    buffer[n++] = '\n';
+    buffer[n] = '\0';
     return n;
 }
 
-/* Upload a local file to the server */
-int handle_upload(int sock, const char *filename) {
+/* Connect, read through r, and receive the welcome into welcome. A
+ * server shedding load answers with a retry-after hint instead: wait
+ * that long and try again, a few times (-1 on error) */
+static int connect_server(LineReader *r, char *welcome, size_t size) {
+    for (int attempt = 0; ; attempt++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) return -1;
+        if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+            close(sock);
+            return -1;
+        }
+        line_reader_init(r, sock);
+        if (recv_reply(r, welcome, size) <= 0) {
+            close(sock);
+            return -1;
+        }
+
+        long retry_ms;
+        if (sscanf(welcome, "ERROR: Server busy, retry after %ld ms", &retry_ms) != 1) {
+            return sock;
+        }
+        close(sock);
+        if (attempt == CONNECT_RETRIES) return -1;
+        usleep(retry_ms * 1000);
+    }
+}
+
+/* Open and log in one more session for a parallel transfer, read
+ * through r (-1 on error) */
+static int open_session(LineReader *r) {
+    char line[512];
+    int sock = connect_server(r, line, sizeof(line));
+    if (sock < 0) return -1;
+
+    snprintf(line, sizeof(line), "LOGIN %s %s\n", login_user, login_pass);
+    if (send(sock, line, strlen(line), 0) <= 0 ||
+        recv_reply(r, line, sizeof(line)) <= 0 || strncmp(line, "OK", 2) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+
+/* Send len bytes, however many calls it takes (-1 on error) */
+static int send_all(int sock, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, data, len, 0);
+        if (n <= 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* A chunked upload shared by the sessions sending its chunks */
+typedef struct {
+    int fd;
+    unsigned int id;
+    long file_size;
+    long chunk_size;
+    long count;
+    long next;                  // Next chunk index to hand out
+    long sent;                  // Bytes the server confirmed
+    int failed;
+} ChunkedUpload;
+
+/* Send chunks until none are left; progress is shown by one session only */
+static int send_chunks(ChunkedUpload *u, LineReader *r, int show_progress) {
+    char buffer[64 * 1024];
+    char line[256];
+    int sock = r->fd;
+
+    for (;;) {
+        long index = __atomic_fetch_add(&u->next, 1, __ATOMIC_RELAXED);
+        if (index >= u->count || __atomic_load_n(&u->failed, __ATOMIC_RELAXED)) return 0;
+
+        snprintf(line, sizeof(line), "UPLOAD-CHUNK %u %ld\n", u->id, index);
+        send(sock, line, strlen(line), 0);
+        if (recv_reply(r, line, sizeof(line)) <= 0 || strncmp(line, "READY", 5) != 0) {
+            printf("\nServer: %s", line);
+            break;
+        }
+
+        long offset = index * u->chunk_size;
+        long left = u->file_size - offset < u->chunk_size ? u->file_size - offset
+                                                           : u->chunk_size;
+        while (left > 0) {
+            size_t want = left < (long)sizeof(buffer) ? (size_t)left : sizeof(buffer);
+            ssize_t n = pread(u->fd, buffer, want, offset);
+            if (n <= 0 || send_all(sock, buffer, n) == -1) break;
+            offset += n;
+            left -= n;
+        }
+        if (left > 0 || recv_reply(r, line, sizeof(line)) <= 0 ||
+            strncmp(line, "OK", 2) != 0) {
+            printf("\nServer: %s", left > 0 ? "connection lost\n" : line);
+            break;
+        }
+
+        long sent = __atomic_add_fetch(&u->sent, offset - index * u->chunk_size,
+                                       __ATOMIC_RELAXED);
+        if (show_progress) {
+            printf("\rProgress: %ld / %ld bytes (%.1f%%)",
+                   sent, u->file_size, (sent * 100.0) / u->file_size);
+            fflush(stdout);
+        }
+    }
+    __atomic_store_n(&u->failed, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+typedef struct {
+    ChunkedUpload *upload;
+    LineReader session;
+    pthread_t thread;
+} ChunkSender;
+
+static void* chunk_thread(void *arg) {
+    ChunkSender *sender = arg;
+    send_chunks(sender->upload, &sender->session, 0);
+    send(sender->session.fd, "QUIT\n", 5, 0);
+    close(sender->session.fd);
+    return NULL;
+}
+
+/* Upload a large file as chunks sent over several sessions at once; the
+ * server assembles them and stores the file on UPLOAD-COMMIT */
+static int upload_chunked(LineReader *r, const char *filename, long file_size) {
+    int sock = r->fd;
+    ChunkedUpload u;
+    memset(&u, 0, sizeof(u));
+    u.fd = open(filename, O_RDONLY);
+    u.file_size = file_size;
+    if (u.fd == -1) {
+        printf("ERROR: Cannot open local file '%s'\n", filename);
+        return -1;
+    }
+
+    char line[512];
+    snprintf(line, sizeof(line), "UPLOAD-INIT %s %ld\n", filename, file_size);
+    send(sock, line, strlen(line), 0);
+    if (recv_reply(r, line, sizeof(line)) <= 0 ||
+        sscanf(line, "OK: UPLOAD-ID %u CHUNK %ld COUNT %ld",
+               &u.id, &u.chunk_size, &u.count) != 3) {
+        printf("Server: %s", line);
+        close(u.fd);
+        return -1;
+    }
+    printf("Server: %s", line);
+
+    ChunkSender senders[PARALLEL_STREAMS - 1];
+    int started = 0;
+    for (int i = 0; i < PARALLEL_STREAMS - 1 && i + 1 < u.count; i++) {
+        ChunkSender *sender = &senders[started];
+        sender->upload = &u;
+        if (open_session(&sender->session) == -1) break;
+        if (pthread_create(&sender->thread, NULL, chunk_thread, sender) != 0) {
+            close(sender->session.fd);
+            break;
+        }
+        started++;
+    }
+    printf("Uploading '%s' (%ld bytes, %ld chunks, %d streams)...\n",
+           filename, file_size, u.count, started + 1);
+
+    send_chunks(&u, r, 1);
+    for (int i = 0; i < started; i++) pthread_join(senders[i].thread, NULL);
+    printf("\n");
+    close(u.fd);
+
+    snprintf(line, sizeof(line), "%s %u\n", u.failed ? "UPLOAD-ABORT" : "UPLOAD-COMMIT", u.id);
+    send(sock, line, strlen(line), 0);
+    if (recv_reply(r, line, sizeof(line)) > 0) {
+        printf("Server: %s", line);
+    }
+    return u.failed ? -1 : 0;
+}
+
+/* Upload a local file to the server. With resume set, the server first
+ * reports how much of an interrupted upload it kept and only the rest is
+ * sent; large files otherwise go up in parallel chunks. */
+int handle_upload(LineReader *r, const char *filename, int resume) {
+    int sock = r->fd;
     FILE *fp = fopen(filename, "rb");
     if (!fp) {
         printf("ERROR: Cannot open local file '%s'\n", filename);
@@ -29,16 +227,21 @@ int handle_upload(int sock, const char *filename) {
     long file_size = ftell(fp);
     fseek(fp, 0, SEEK_SET);
     
+    if (!resume && file_size >= PARALLEL_MIN_SIZE && login_user[0] != '\0') {
+        fclose(fp);
+        return upload_chunked(r, filename, file_size);
+    }
+    
     printf("Uploading '%s' (%ld bytes)...\n", filename, file_size);
     
     /* Send UPLOAD command */
     char cmd[512];
-    snprintf(cmd, sizeof(cmd), "UPLOAD %s\n", filename);
+    snprintf(cmd, sizeof(cmd), "%s %s\n", resume ? "UPLOAD-RESUME" : "UPLOAD", filename);
     send(sock, cmd, strlen(cmd), 0);
     
-    /* Receive READY response */
+    /* Receive READY (or OFFSET) response */
     char buffer[BUFFER_SIZE];
-    int n = recv_line(sock, buffer, sizeof(buffer));
+    int n = recv_reply(r, buffer, sizeof(buffer));
     if (n <= 0) {
         fclose(fp);
         return -1;
@@ -46,7 +249,18 @@ int handle_upload(int sock, const char *filename) {
     
     printf("Server: %s", buffer);
     
-    if (strncmp(buffer, "READY:", 6) != 0) {
+    long sent = 0;
+    if (resume) {
+        if (sscanf(buffer, "OFFSET %ld", &sent) != 1) {
+            fclose(fp);
+            return -1;
+        }
+        if (sent > file_size) {
+            printf("ERROR: Server holds more than the local file\n");
+            sent = file_size;
+        }
+        fseek(fp, sent, SEEK_SET);
+    } else if (strncmp(buffer, "READY:", 6) != 0) {
         fclose(fp);
         return -1;
     }
@@ -56,7 +270,7 @@ int handle_upload(int sock, const char *filename) {
     send(sock, cmd, strlen(cmd), 0);
     
     /* Receive OK response */
-    n = recv_line(sock, buffer, sizeof(buffer));
+    n = recv_reply(r, buffer, sizeof(buffer));
     if (n <= 0 || strncmp(buffer, "OK:", 3) != 0) {
         printf("Server: %s", buffer);
         fclose(fp);
@@ -68,7 +282,6 @@ int handle_upload(int sock, const char *filename) {
     /* Send file data */
     char chunk[4096];
     size_t bytes;
-    long sent = 0;
     
     while ((bytes = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
         send(sock, chunk, bytes, 0);
@@ -82,7 +295,7 @@ int handle_upload(int sock, const char *filename) {
     fclose(fp);
     
     /* Receive final response */
-    n = recv_line(sock, buffer, sizeof(buffer));
+    n = recv_reply(r, buffer, sizeof(buffer));
     if (n > 0) {
         printf("Server: %s", buffer);
     }
@@ -90,58 +303,167 @@ int handle_upload(int sock, const char *filename) {
     return 0;
 }
 
-/* Download a file from the server */
-int handle_download(int sock, const char *filename) {
-    /* Send DOWNLOAD command */
+/* List files: the reply is streamed and ends with an END, NEXT <cursor>
+ * or ERROR line */
+int handle_list(LineReader *r, const char *input) {
     char cmd[512];
-    snprintf(cmd, sizeof(cmd), "DOWNLOAD %s\n", filename);
-    send(sock, cmd, strlen(cmd), 0);
-    
-    /* Receive SIZE response */
-    char buffer[BUFFER_SIZE];
-    int n = recv_line(sock, buffer, sizeof(buffer));
-    if (n <= 0) return -1;
+    snprintf(cmd, sizeof(cmd), "%s\n", input);
+    send(r->fd, cmd, strlen(cmd), 0);
     
-    printf("Server: %s", buffer);
-    
-    long file_size;
-    if (sscanf(buffer, "SIZE: %ld", &file_size) != 1) {
+    char line[BUFFER_SIZE];
+    while (1) {
+        if (recv_reply(r, line, sizeof(line)) <= 0) {
+            printf("Server disconnected\n");
+            return -1;
+        }
+        fputs(line, stdout);
+        
+        if (strcmp(line, "END\n") == 0 || strncmp(line, "NEXT ", 5) == 0 ||
+            strncmp(line, "ERROR", 5) == 0) {
+            printf("\n");
+            return 0;
+        }
+    }
+}
+
+/* Ask for length bytes of filename from offset; returns the size of the
+ * whole file (-1 on error) */
+static long request_range(LineReader *r, const char *filename, long offset, long length) {
+    char line[512];
+    snprintf(line, sizeof(line), "DOWNLOAD %s %ld %ld\n", filename, offset, length);
+    send(r->fd, line, strlen(line), 0);
+
+    long size, start, total;
+    if (recv_reply(r, line, sizeof(line)) <= 0) return -1;
+    if (sscanf(line, "SIZE: %ld RANGE %ld/%ld", &size, &start, &total) != 3 ||
+        size != length || start != offset) {
+        printf("Server: %s", line);
         return -1;
     }
-    
+    return total;
+}
+
+/* One slice of a download, received into fd at its own offsets */
+typedef struct {
+    const char *filename;
+    int fd;
+    long offset;
+    long length;
+    long received;              // Read by the progress display
+    LineReader *reader;         // The main session, or session below
+    LineReader session;         // Extra session of a threaded range
+    int threaded;               // Fetched by thread over an extra session
+    pthread_t thread;
+} DownloadRange;
+
+/* Receive range r; with all set, show the progress of all count ranges */
+static int recv_range(DownloadRange *r, DownloadRange *all, int count, long file_size) {
+    char buffer[64 * 1024];
+    while (r->received < r->length) {
+        long to_recv = r->length - r->received;
+        if (to_recv > (long)sizeof(buffer)) to_recv = sizeof(buffer);
+
+        long bytes = line_reader_read(r->reader, buffer, to_recv);
+        if (bytes <= 0) return -1;
+        if (pwrite(r->fd, buffer, bytes, r->offset + r->received) != bytes) return -1;
+        __atomic_add_fetch(&r->received, bytes, __ATOMIC_RELAXED);
+
+        if (!all) continue;
+        long received = 0;
+        for (int i = 0; i < count; i++) {
+            received += __atomic_load_n(&all[i].received, __ATOMIC_RELAXED);
+        }
+        printf("\rProgress: %ld / %ld bytes (%.1f%%)",
+               received, file_size, (received * 100.0) / file_size);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+static void* range_thread(void *arg) {
+    DownloadRange *r = arg;
+    if (request_range(r->reader, r->filename, r->offset, r->length) == -1 ||
+        recv_range(r, NULL, 0, 0) == -1) {
+        r->length = -1;
+    }
+    send(r->reader->fd, "QUIT\n", 5, 0);
+    close(r->reader->fd);
+    return NULL;
+}
+
+/* Download a remote file. Large files are split into ranges fetched over
+ * several sessions at once, each written at its offset: one TCP stream
+ * rarely fills a high-latency link. */
+int handle_download(LineReader *reader, const char *filename) {
+    /* An empty range tells the size */
+    long file_size = request_range(reader, filename, 0, 0);
+    if (file_size == -1) return -1;
+
     /* Create local file */
     char local_filename[256];
     snprintf(local_filename, sizeof(local_filename), "downloaded_%s", filename);
-    
-    FILE *fp = fopen(local_filename, "wb");
-    if (!fp) {
+
+    int fd = open(local_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, file_size) == -1) {
         printf("ERROR: Cannot create local file\n");
+        if (fd != -1) close(fd);
         return -1;
     }
-    
-    printf("Downloading to '%s' (%ld bytes)...\n", local_filename, file_size);
-    
-    /* Receive file data */
+
+    int streams = 1;
+    if (file_size >= PARALLEL_MIN_SIZE && login_user[0] != '\0') {
+        streams = PARALLEL_STREAMS;
+    }
+    printf("Downloading to '%s' (%ld bytes, %d stream%s)...\n",
+           local_filename, file_size, streams, streams > 1 ? "s" : "");
+
+    /* Range 0 stays on this session; the others get their own */
+    DownloadRange ranges[PARALLEL_STREAMS];
+    long per_range = file_size / streams;
+    for (int i = 0; i < streams; i++) {
+        DownloadRange *r = &ranges[i];
+        r->filename = filename;
+        r->fd = fd;
+        r->offset = i * per_range;
+        r->length = i == streams - 1 ? file_size - r->offset : per_range;
+        r->received = 0;
+        r->reader = reader;
+        r->threaded = 0;
+        if (i > 0 && open_session(&r->session) != -1) {
+            r->reader = &r->session;
+            r->threaded = pthread_create(&r->thread, NULL, range_thread, r) == 0;
+            if (!r->threaded) {
+                close(r->session.fd);
+                r->reader = reader;
+            }
+        }
+    }
+
+    /* Ranges without a session of their own come over this one */
+    int status = 0;
+    for (int i = 0; i < streams && status == 0; i++) {
+        DownloadRange *r = &ranges[i];
+        if (r->threaded) continue;
+        if (request_range(reader, filename, r->offset, r->length) == -1 ||
+            recv_range(r, ranges, streams, file_size) == -1) {
+            status = -1;
+        }
+    }
+
     long received = 0;
-    while (received < file_size) {
-        long to_recv = file_size - received;
-        if (to_recv > sizeof(buffer)) to_recv = sizeof(buffer);
-        
-        int bytes = recv(sock, buffer, to_recv, 0);
-        if (bytes <= 0) break;
-        
-        fwrite(buffer, 1, bytes, fp);
-        received += bytes;
-        
-        printf("\rProgress: %ld / %ld bytes (%.1f%%)",
-               received, file_size, (received * 100.0) / file_size);
-        fflush(stdout);
+    for (int i = 0; i < streams; i++) {
+        DownloadRange *r = &ranges[i];
+        if (r->threaded) {
+            pthread_join(r->thread, NULL);
+            if (r->length == -1) status = -1;
+        }
+        received += r->received;
     }
-    
+
     printf("\n");
-    fclose(fp);
-    
-    if (received == file_size) {
+    close(fd);
+
+    if (status == 0 && received == file_size) {
         printf("SUCCESS: Download complete\n");
         return 0;
     } else {
@@ -152,7 +474,6 @@ int handle_download(int sock, const char *filename) {
 
 int main(int argc, char *argv[]) {
     int sock;
-    struct sockaddr_in server_addr;
     char buffer[BUFFER_SIZE];
     char input[BUFFER_SIZE];
     int port = 8080;
@@ -165,13 +486,6 @@ int main(int argc, char *argv[]) {
         port = atoi(argv[2]);
     }
     
-    /* Create socket */
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("socket");
-        return 1;
-    }
-    
     /* Connect to server */
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
@@ -179,34 +493,38 @@ int main(int argc, char *argv[]) {
     
     if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
         perror("inet_pton");
-        close(sock);
         return 1;
     }
     
+    /* Every reply is read through here, so none is merged with the next */
+    LineReader reader;
+    
     printf("Connecting to %s:%d...\n", host, port);
-    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("connect");
-        close(sock);
+    buffer[0] = '\0';
+    sock = connect_server(&reader, buffer, sizeof(buffer));
+    if (sock < 0) {
+        if (buffer[0]) {
+            printf("%s", buffer);       // Still busy after the retries
+        } else {
+            perror("connect");
+        }
         return 1;
     }
     
     printf("Connected!\n\n");
     
-    /* Receive welcome message */
-    memset(buffer, 0, sizeof(buffer));
-    int n = recv(sock, buffer, sizeof(buffer) - 1, 0);
-    if (n > 0) {
-        printf("%s\n", buffer);
-    }
+    /* Welcome message */
+    printf("%s\n", buffer);
     
     /* Interactive command loop */
     printf("Commands:\n");
     printf("  REGISTER <user> <pass>\n");
     printf("  LOGIN <user> <pass>\n");
     printf("  UPLOAD <local_file>\n");
+    printf("  UPLOAD-RESUME <local_file>\n");
     printf("  DOWNLOAD <remote_file>\n");
     printf("  DELETE <file>\n");
-    printf("  LIST\n");
+    printf("  LIST [<cursor> [<limit> [<prefix>]]]\n");
     printf("  QUIT\n\n");
     
     while (1) {
@@ -233,12 +551,12 @@ int main(int argc, char *argv[]) {
         }
         
         /* Handle special commands */
-        if (strcmp(cmd, "UPLOAD") == 0) {
+        if (strcmp(cmd, "UPLOAD") == 0 || strcmp(cmd, "UPLOAD-RESUME") == 0) {
             if (strlen(arg) == 0) {
-                printf("Usage: UPLOAD <local_filename>\n");
+                printf("Usage: %s <local_filename>\n", cmd);
                 continue;
             }
-            handle_upload(sock, arg);
+            handle_upload(&reader, arg, strcmp(cmd, "UPLOAD-RESUME") == 0);
             continue;
         }
         
@@ -247,7 +565,12 @@ int main(int argc, char *argv[]) {
                 printf("Usage: DOWNLOAD <remote_filename>\n");
                 continue;
             }
-            handle_download(sock, arg);
+            handle_download(&reader, arg);
+            continue;
+        }
+        
+        if (strcmp(cmd, "LIST") == 0) {
+            if (handle_list(&reader, input) == -1) break;
             continue;
         }
         
@@ -256,14 +579,18 @@ int main(int argc, char *argv[]) {
         send(sock, input, strlen(input), 0);
         
         /* Receive response */
-        memset(buffer, 0, sizeof(buffer));
-        n = recv(sock, buffer, sizeof(buffer) - 1, 0);
+        int n = recv_reply(&reader, buffer, sizeof(buffer));
         if (n <= 0) {
             printf("Server disconnected\n");
             break;
         }
         
         printf("%s\n", buffer);
+        
+        /* Remembered for the extra sessions of parallel downloads */
+        if (strcmp(cmd, "LOGIN") == 0 && strncmp(buffer, "OK", 2) == 0) {
+            sscanf(input, "%*s %63s %63s", login_user, login_pass);
+        }
     }
     
     close(sock);
@@ -0,0 +1,241 @@
+#include "filecache.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define FILECACHE_MIN_BUCKETS 64
+#define FILECACHE_ENTRY_COST 128    // Bookkeeping charged on top of the data
+
+static unsigned int path_hash(const char *path) {
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static FileCacheShard* shard_of(FileCache *cache, unsigned int hash) {
+    return &cache->shards[hash % FILECACHE_SHARDS];
+}
+
+/* Bucket index from the bits the shard choice did not use */
+static size_t bucket_of(FileCacheShard *shard, unsigned int hash) {
+    return (hash / FILECACHE_SHARDS) & (shard->bucket_count - 1);
+}
+
+static size_t entry_cost(const FileCacheEntry *e) {
+    return (size_t)e->size + FILECACHE_ENTRY_COST;
+}
+
+FileCache* filecache_create(size_t capacity) {
+    FileCache *cache = calloc(1, sizeof(FileCache));
+    if (!cache) return NULL;
+
+    cache->shard_limit = capacity / FILECACHE_SHARDS;
+    for (int i = 0; i < FILECACHE_SHARDS; i++) {
+        FileCacheShard *shard = &cache->shards[i];
+        pthread_mutex_init(&shard->mutex, NULL);
+        shard->bucket_count = FILECACHE_MIN_BUCKETS;
+        shard->buckets = calloc(shard->bucket_count, sizeof(FileCacheEntry*));
+        if (!shard->buckets) {
+            filecache_destroy(cache);
+            return NULL;
+        }
+    }
+    atomic_init(&cache->hits, 0);
+    atomic_init(&cache->misses, 0);
+    atomic_init(&cache->evictions, 0);
+    atomic_init(&cache->invalidations, 0);
+    return cache;
+}
+
+static void entry_free(FileCacheEntry *e) {
+    free(e->path);
+    free(e->data);
+    free(e);
+}
+
+void filecache_destroy(FileCache *cache) {
+    if (!cache) return;
+    for (int i = 0; i < FILECACHE_SHARDS; i++) {
+        FileCacheShard *shard = &cache->shards[i];
+        FileCacheEntry *e = shard->head;
+        while (e) {
+            FileCacheEntry *next = e->next;
+            entry_free(e);
+            e = next;
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->mutex);
+    }
+    free(cache);
+}
+
+/* ===== SHARD INTERNALS (caller holds shard->mutex) ===== */
+
+static FileCacheEntry** entry_link(FileCacheShard *shard, const char *path, unsigned int hash) {
+    FileCacheEntry **link = &shard->buckets[bucket_of(shard, hash)];
+    while (*link && strcmp((*link)->path, path) != 0) link = &(*link)->hash_next;
+    return link;
+}
+
+static void lru_remove(FileCacheShard *shard, FileCacheEntry *e) {
+    if (e->prev) e->prev->next = e->next;
+    else shard->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else shard->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(FileCacheShard *shard, FileCacheEntry *e) {
+    e->prev = NULL;
+    e->next = shard->head;
+    if (shard->head) shard->head->prev = e;
+    shard->head = e;
+    if (!shard->tail) shard->tail = e;
+}
+
+/* Take e out of the table and the list; it is freed with its last reference */
+static void entry_unlink(FileCacheShard *shard, FileCacheEntry *e) {
+    FileCacheEntry **link = entry_link(shard, e->path, path_hash(e->path));
+    *link = e->hash_next;
+    lru_remove(shard, e);
+    shard->count--;
+    shard->bytes -= entry_cost(e);
+    if (--e->refs == 0) entry_free(e);
+}
+
+/* Double the buckets once entries outnumber them (best effort) */
+static void shard_grow(FileCacheShard *shard) {
+    size_t count = shard->bucket_count * 2;
+    FileCacheEntry **buckets = calloc(count, sizeof(FileCacheEntry*));
+    if (!buckets) return;
+
+    shard->bucket_count = count;
+    for (FileCacheEntry *e = shard->head; e; e = e->next) {
+        size_t b = bucket_of(shard, path_hash(e->path));
+        e->hash_next = buckets[b];
+        buckets[b] = e;
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+}
+
+/* ===== OPERATIONS ===== */
+
+FileCacheEntry* filecache_get(FileCache *cache, const char *path) {
+    unsigned int hash = path_hash(path);
+    FileCacheShard *shard = shard_of(cache, hash);
+
+    pthread_mutex_lock(&shard->mutex);
+    FileCacheEntry *e = *entry_link(shard, path, hash);
+    if (e) {
+        e->refs++;
+        lru_remove(shard, e);
+        lru_push_front(shard, e);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    atomic_fetch_add_explicit(e ? &cache->hits : &cache->misses, 1, memory_order_relaxed);
+    return e;
+}
+
+unsigned long filecache_generation(FileCache *cache, const char *path) {
+    FileCacheShard *shard = shard_of(cache, path_hash(path));
+    pthread_mutex_lock(&shard->mutex);
+    unsigned long generation = shard->generation;
+    pthread_mutex_unlock(&shard->mutex);
+    return generation;
+}
+
+FileCacheEntry* filecache_put(FileCache *cache, const char *path, char *data, long size,
+                              unsigned long generation) {
+    FileCacheEntry *e = calloc(1, sizeof(FileCacheEntry));
+    char *copy = e ? strdup(path) : NULL;
+    if (!copy) {
+        free(e);
+        free(data);
+        return NULL;
+    }
+    e->path = copy;
+    e->data = data;
+    e->size = size;
+    e->refs = 1;                // The caller's
+
+    unsigned int hash = path_hash(path);
+    FileCacheShard *shard = shard_of(cache, hash);
+    e->shard = shard;
+
+    pthread_mutex_lock(&shard->mutex);
+    /* A file changed while it was read must not be cached; another fill
+     * of the same path may also have won the race */
+    if (shard->generation == generation && entry_cost(e) <= cache->shard_limit &&
+        *entry_link(shard, path, hash) == NULL) {
+        while (shard->bytes + entry_cost(e) > cache->shard_limit) {
+            entry_unlink(shard, shard->tail);
+            atomic_fetch_add_explicit(&cache->evictions, 1, memory_order_relaxed);
+        }
+        if (shard->count >= shard->bucket_count) shard_grow(shard);
+
+        FileCacheEntry **link = entry_link(shard, path, hash);
+        *link = e;
+        lru_push_front(shard, e);
+        shard->count++;
+        shard->bytes += entry_cost(e);
+        e->refs++;              // The cache's
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return e;
+}
+
+int filecache_begin_fill(FileCache *cache, const char *path) {
+    unsigned int hash = path_hash(path);
+    FileCacheShard *shard = shard_of(cache, hash);
+
+    pthread_mutex_lock(&shard->mutex);
+    int claimed = shard->fills < FILECACHE_FILLS;
+    for (int i = 0; i < shard->fills && claimed; i++) {
+        if (shard->filling[i] == hash) claimed = 0;
+    }
+    if (claimed) shard->filling[shard->fills++] = hash;
+    pthread_mutex_unlock(&shard->mutex);
+    return claimed;
+}
+
+void filecache_end_fill(FileCache *cache, const char *path) {
+    unsigned int hash = path_hash(path);
+    FileCacheShard *shard = shard_of(cache, hash);
+
+    pthread_mutex_lock(&shard->mutex);
+    for (int i = 0; i < shard->fills; i++) {
+        if (shard->filling[i] == hash) {
+            shard->filling[i] = shard->filling[--shard->fills];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void filecache_release(void *entry) {
+    FileCacheEntry *e = entry;
+    FileCacheShard *shard = e->shard;
+
+    pthread_mutex_lock(&shard->mutex);
+    int last = --e->refs == 0;
+    pthread_mutex_unlock(&shard->mutex);
+    if (last) entry_free(e);
+}
+
+void filecache_invalidate(FileCache *cache, const char *path) {
+    unsigned int hash = path_hash(path);
+    FileCacheShard *shard = shard_of(cache, hash);
+
+    pthread_mutex_lock(&shard->mutex);
+    shard->generation++;
+    FileCacheEntry *e = *entry_link(shard, path, hash);
+    if (e) {
+        entry_unlink(shard, e);
+        atomic_fetch_add_explicit(&cache->invalidations, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
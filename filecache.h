@@ -0,0 +1,82 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/* Read cache of whole small files for DOWNLOAD. The access pattern is
+ * skewed, so a few popular files take most requests; a hit is sent from
+ * memory without opening anything. Paths hash to one of several shards,
+ * each with its own lock, hash table, LRU list and byte budget. Uploads
+ * and deletes invalidate the path; entries are reference counted, so an
+ * eviction never frees a buffer that is still being sent. */
+
+#define FILECACHE_SHARDS 16
+#define FILECACHE_MAX_FILE (256 * 1024)     // Larger files are streamed from disk
+#define FILECACHE_DEFAULT_MB 64
+#define FILECACHE_FILLS 8                   // Background fills pending per shard
+
+typedef struct FileCacheShard FileCacheShard;
+
+typedef struct FileCacheEntry {
+    char *path;
+    char *data;
+    long size;
+    int refs;                   // Cache link + downloads in progress
+    FileCacheShard *shard;
+    struct FileCacheEntry *hash_next;
+    struct FileCacheEntry *prev, *next;     // LRU list, most recent first
+} FileCacheEntry;
+
+struct FileCacheShard {
+    pthread_mutex_t mutex;
+    FileCacheEntry **buckets;
+    size_t bucket_count;        // Power of two, grown with the entries
+    size_t count;
+    FileCacheEntry *head, *tail;
+    size_t bytes;               // Charged for the linked entries
+    unsigned long generation;   // Bumped by every invalidation
+    unsigned int filling[FILECACHE_FILLS];  // Path hashes of pending fills
+    int fills;
+};
+
+typedef struct {
+    FileCacheShard shards[FILECACHE_SHARDS];
+    size_t shard_limit;         // Byte budget of each shard
+    atomic_long hits;
+    atomic_long misses;
+    atomic_long evictions;
+    atomic_long invalidations;
+} FileCache;
+
+/* Cache up to capacity bytes (NULL on error) */
+FileCache* filecache_create(size_t capacity);
+void filecache_destroy(FileCache *cache);
+
+/* Referenced entry for path, or NULL on a miss (counted either way) */
+FileCacheEntry* filecache_get(FileCache *cache, const char *path);
+
+/* Note before reading path from disk; pass to filecache_put */
+unsigned long filecache_generation(FileCache *cache, const char *path);
+
+/* Add size bytes of data (now owned by the cache) read from path. If
+ * path was invalidated since generation, the entry only serves the
+ * caller. Returns it referenced (NULL if out of memory: data is freed). */
+FileCacheEntry* filecache_put(FileCache *cache, const char *path, char *data, long size,
+                              unsigned long generation);
+
+/* Claim the background fill of path after a miss: 1 if the caller
+ * should queue it, 0 if one is already pending (paths are told apart by
+ * hash, so a rare collision only skips a fill) or the shard has
+ * FILECACHE_FILLS pending. A claim is ended by filecache_end_fill. */
+int filecache_begin_fill(FileCache *cache, const char *path);
+void filecache_end_fill(FileCache *cache, const char *path);
+
+/* Drop a reference from get or put; the signature fits FileTransfer.release */
+void filecache_release(void *entry);
+
+/* Forget path after its file changed */
+void filecache_invalidate(FileCache *cache, const char *path);
+
+#endif
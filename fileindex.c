@@ -0,0 +1,394 @@
+#define _GNU_SOURCE
+#include "fileindex.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define FILEINDEX_MAGIC "DBXFILES"
+#define FILEINDEX_VERSION 1
+#define FILEINDEX_MIN_SLOTS 16
+
+/* Header of a saved index. The directory's mtime at save time tells
+ * whether the directory changed since (e.g. a crash after uploads), in
+ * which case the saved index is ignored and the directory rescanned. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    int64_t count;
+    int64_t dir_mtime_sec;
+    int64_t dir_mtime_nsec;
+} FileIndexHeader;
+
+/* FNV-1a over the file name */
+static unsigned int name_hash(const char *name) {
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char*)name; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Slot holding name, or the empty slot where it would go */
+static int slot_find(FileIndex *idx, const char *name) {
+    unsigned int mask = idx->slot_count - 1;
+    unsigned int i = name_hash(name) & mask;
+
+    while (idx->slots[i] != -1 && strcmp(idx->entries[idx->slots[i]].name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int slots_rebuild(FileIndex *idx, int slot_count) {
+    int *slots = malloc(sizeof(int) * slot_count);
+    if (!slots) return -1;
+
+    for (int i = 0; i < slot_count; i++) slots[i] = -1;
+    for (int pos = 0; pos < idx->count; pos++) {
+        unsigned int i = name_hash(idx->entries[pos].name) & (slot_count - 1);
+        while (slots[i] != -1) i = (i + 1) & (slot_count - 1);
+        slots[i] = pos;
+    }
+
+    free(idx->slots);
+    idx->slots = slots;
+    idx->slot_count = slot_count;
+    return 0;
+}
+
+/* First place in the first n of order whose name is not below name
+ * (strict: above name) */
+static int order_search(FileIndex *idx, const char *name, int strict, int n) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(idx->entries[idx->order[mid]].name, name);
+        if (cmp < 0 || (strict && cmp == 0)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Put the entry at pos, the only one not ordered yet, into order */
+static void order_insert(FileIndex *idx, int pos) {
+    int n = idx->count - 1;
+    int at = order_search(idx, idx->entries[pos].name, 0, n);
+    memmove(&idx->order[at + 1], &idx->order[at], (n - at) * sizeof(int));
+    idx->order[at] = pos;
+}
+
+static int order_compare(const void *a, const void *b, void *arg) {
+    const FileIndex *idx = arg;
+    return strcmp(idx->entries[*(const int*)a].name, idx->entries[*(const int*)b].name);
+}
+
+/* Sort once after a load or scan added entries in directory order */
+static void order_rebuild(FileIndex *idx) {
+    for (int pos = 0; pos < idx->count; pos++) idx->order[pos] = pos;
+    qsort_r(idx->order, idx->count, sizeof(int), order_compare, idx);
+}
+
+/* Append an entry whose name is not indexed yet (order is left to the
+ * caller: order_insert for one, order_rebuild after many) */
+static int entry_add(FileIndex *idx, const FileEntry *entry) {
+    if (idx->count == idx->capacity) {
+        int capacity = idx->capacity ? idx->capacity * 2 : FILEINDEX_MIN_SLOTS;
+        FileEntry *entries = realloc(idx->entries, sizeof(FileEntry) * capacity);
+        if (!entries) return -1;
+        idx->entries = entries;
+        int *order = realloc(idx->order, sizeof(int) * capacity);
+        if (!order) return -1;
+        idx->order = order;
+        idx->capacity = capacity;
+    }
+    if ((idx->count + 1) * 2 > idx->slot_count &&
+        slots_rebuild(idx, idx->slot_count * 2) == -1) {
+        return -1;
+    }
+
+    int slot = slot_find(idx, entry->name);
+    idx->entries[idx->count] = *entry;
+    idx->entries[idx->count].name[FILEINDEX_MAX_NAME - 1] = '\0';
+    idx->slots[slot] = idx->count;
+    idx->count++;
+    idx->total_size += entry->size;
+    return 0;
+}
+
+/* Remove the entry in slot: backward-shift the probe chain so no
+ * tombstones are needed, then move the last entry into the hole */
+static void entry_remove(FileIndex *idx, int slot) {
+    unsigned int mask = idx->slot_count - 1;
+    int pos = idx->slots[slot];
+    idx->total_size -= idx->entries[pos].size;
+
+    int at = order_search(idx, idx->entries[pos].name, 0, idx->count);
+    memmove(&idx->order[at], &idx->order[at + 1], (idx->count - at - 1) * sizeof(int));
+
+    unsigned int hole = slot;
+    unsigned int j = slot;
+    idx->slots[hole] = -1;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (idx->slots[j] == -1) break;
+
+        /* Entries whose home lies cyclically in (hole, j] stay put */
+        unsigned int home = name_hash(idx->entries[idx->slots[j]].name) & mask;
+        int stays = hole <= j ? (hole < home && home <= j) : (hole < home || home <= j);
+        if (stays) continue;
+
+        idx->slots[hole] = idx->slots[j];
+        idx->slots[j] = -1;
+        hole = j;
+    }
+
+    int last = idx->count - 1;
+    if (pos != last) {
+        idx->order[order_search(idx, idx->entries[last].name, 0, last)] = pos;
+        idx->entries[pos] = idx->entries[last];
+        idx->slots[slot_find(idx, idx->entries[pos].name)] = pos;
+    }
+    idx->count--;
+}
+
+static FileIndex* fileindex_alloc(const char *dir, const char *path) {
+    FileIndex *idx = calloc(1, sizeof(FileIndex));
+    if (!idx) return NULL;
+
+    snprintf(idx->dir, sizeof(idx->dir), "%s", dir);
+    snprintf(idx->path, sizeof(idx->path), "%s", path);
+    if (slots_rebuild(idx, FILEINDEX_MIN_SLOTS) == -1) {
+        free(idx);
+        return NULL;
+    }
+    pthread_rwlock_init(&idx->lock, NULL);
+    return idx;
+}
+
+/* Saved index, if it describes the directory as it is now */
+static int fileindex_load(FileIndex *idx, const struct stat *dir_st) {
+    FILE *fp = fopen(idx->path, "rb");
+    if (!fp) return -1;
+
+    FileIndexHeader h;
+    int status = -1;
+    if (fread(&h, sizeof(h), 1, fp) == 1 &&
+        memcmp(h.magic, FILEINDEX_MAGIC, sizeof(h.magic)) == 0 &&
+        h.version == FILEINDEX_VERSION &&
+        h.record_size == sizeof(FileEntry) &&
+        h.count >= 0 &&
+        h.dir_mtime_sec == (int64_t)dir_st->st_mtim.tv_sec &&
+        h.dir_mtime_nsec == (int64_t)dir_st->st_mtim.tv_nsec) {
+        status = 0;
+        FileEntry entry;
+        for (int64_t i = 0; i < h.count && status == 0; i++) {
+            if (fread(&entry, sizeof(entry), 1, fp) != 1 || entry_add(idx, &entry) == -1) {
+                status = -1;
+            }
+        }
+    }
+    fclose(fp);
+    return status;
+}
+
+/* One pass over the directory; checksums stay unknown */
+static int fileindex_scan(FileIndex *idx, FileSizeFn file_size) {
+    DIR *dir = opendir(idx->dir);
+    if (!dir) return -1;
+
+    struct dirent *dent;
+    while ((dent = readdir(dir)) != NULL) {
+        if (dent->d_name[0] == '.') continue; // Skip hidden files
+
+        char full_path[600];
+        snprintf(full_path, sizeof(full_path), "%s/%s", idx->dir, dent->d_name);
+
+        struct stat st;
+        if (stat(full_path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+        FileEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        snprintf(entry.name, sizeof(entry.name), "%s", dent->d_name);
+        entry.size = file_size ? file_size(full_path) : st.st_size;
+        entry.mtime = st.st_mtime;
+        if (entry.size < 0) continue;
+        if (entry_add(idx, &entry) == -1) break;
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+FileIndex* fileindex_open(const char *dir, const char *path, FileSizeFn file_size) {
+    FileIndex *idx = fileindex_alloc(dir, path);
+    if (!idx) return NULL;
+
+    struct stat st;
+    if (stat(dir, &st) != 0) return idx; // No directory: no files
+
+    if (fileindex_load(idx, &st) == 0) {
+        order_rebuild(idx);
+        printf("[FileIndex] Loaded %d entries for %s\n", idx->count, dir);
+        return idx;
+    }
+
+    /* Stale or missing: start over from the directory */
+    idx->count = 0;
+    idx->total_size = 0;
+    for (int i = 0; i < idx->slot_count; i++) idx->slots[i] = -1;
+
+    fileindex_scan(idx, file_size);
+    order_rebuild(idx);
+    idx->dirty = 1;
+    printf("[FileIndex] Scanned %d entries for %s\n", idx->count, dir);
+    return idx;
+}
+
+void fileindex_close(FileIndex *idx) {
+    if (!idx) return;
+    fileindex_save(idx);
+    pthread_rwlock_destroy(&idx->lock);
+    free(idx->entries);
+    free(idx->order);
+    free(idx->slots);
+    free(idx);
+}
+
+int fileindex_lookup(FileIndex *idx, const char *name, FileEntry *entry) {
+    pthread_rwlock_rdlock(&idx->lock);
+    int pos = idx->slots[slot_find(idx, name)];
+    if (pos != -1 && entry) *entry = idx->entries[pos];
+    pthread_rwlock_unlock(&idx->lock);
+    return pos == -1 ? -1 : 0;
+}
+
+int fileindex_put(FileIndex *idx, const FileEntry *entry) {
+    int status = 0;
+
+    pthread_rwlock_wrlock(&idx->lock);
+    int slot = slot_find(idx, entry->name);
+    if (idx->slots[slot] != -1) {
+        FileEntry *old = &idx->entries[idx->slots[slot]];
+        idx->total_size += entry->size - old->size;
+        *old = *entry;
+    } else if ((status = entry_add(idx, entry)) == 0) {
+        order_insert(idx, idx->count - 1);
+    }
+    idx->dirty = 1;
+    pthread_rwlock_unlock(&idx->lock);
+
+    return status;
+}
+
+int fileindex_set_checksum(FileIndex *idx, const FileEntry *entry, uint32_t checksum) {
+    int status = -1;
+
+    pthread_rwlock_wrlock(&idx->lock);
+    int pos = idx->slots[slot_find(idx, entry->name)];
+    if (pos != -1) {
+        FileEntry *current = &idx->entries[pos];
+        if (current->size == entry->size && current->mtime == entry->mtime &&
+            current->checksum == 0) {
+            current->checksum = checksum;
+            idx->dirty = 1;
+            status = 0;
+        }
+    }
+    pthread_rwlock_unlock(&idx->lock);
+
+    return status;
+}
+
+int fileindex_remove(FileIndex *idx, const char *name, FileEntry *entry) {
+    pthread_rwlock_wrlock(&idx->lock);
+    int slot = slot_find(idx, name);
+    int pos = idx->slots[slot];
+    if (pos != -1) {
+        if (entry) *entry = idx->entries[pos];
+        entry_remove(idx, slot);
+        idx->dirty = 1;
+    }
+    pthread_rwlock_unlock(&idx->lock);
+
+    return pos == -1 ? -1 : 0;
+}
+
+int fileindex_list(FileIndex *idx, const char *after, const char *prefix,
+                   FileEntry *entries, int max, int *more) {
+    size_t prefix_len = strlen(prefix);
+    int n = 0;
+    *more = 0;
+
+    /* Names sharing the prefix are adjacent in name order: start at the
+     * first one past after and stop at the first that does not match */
+    pthread_rwlock_rdlock(&idx->lock);
+    int at = after[0] && strcmp(after, prefix) >= 0
+             ? order_search(idx, after, 1, idx->count)
+             : order_search(idx, prefix, 0, idx->count);
+    for (; at < idx->count; at++) {
+        const FileEntry *entry = &idx->entries[idx->order[at]];
+        if (strncmp(entry->name, prefix, prefix_len) != 0) break;
+        if (n == max) {
+            *more = 1;
+            break;
+        }
+        entries[n++] = *entry;
+    }
+    pthread_rwlock_unlock(&idx->lock);
+    return n;
+}
+
+void fileindex_totals(FileIndex *idx, int *count, long *total_size) {
+    pthread_rwlock_rdlock(&idx->lock);
+    *count = idx->count;
+    *total_size = idx->total_size;
+    pthread_rwlock_unlock(&idx->lock);
+}
+
+int fileindex_save(FileIndex *idx) {
+    pthread_rwlock_wrlock(&idx->lock);
+    if (!idx->dirty) {
+        pthread_rwlock_unlock(&idx->lock);
+        return 0;
+    }
+
+    struct stat st;
+    char tmp[340];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", idx->path);
+    FILE *fp = stat(idx->dir, &st) == 0 ? fopen(tmp, "wb") : NULL;
+    if (!fp) {
+        pthread_rwlock_unlock(&idx->lock);
+        return -1;
+    }
+
+    FileIndexHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, FILEINDEX_MAGIC, sizeof(h.magic));
+    h.version = FILEINDEX_VERSION;
+    h.record_size = sizeof(FileEntry);
+    h.count = idx->count;
+    h.dir_mtime_sec = st.st_mtim.tv_sec;
+    h.dir_mtime_nsec = st.st_mtim.tv_nsec;
+
+    int status = 0;
+    if (fwrite(&h, sizeof(h), 1, fp) != 1 ||
+        fwrite(idx->entries, sizeof(FileEntry), idx->count, fp) != (size_t)idx->count) {
+        status = -1;
+    }
+    if (fclose(fp) != 0) status = -1;
+
+    if (status == 0 && rename(tmp, idx->path) == 0) {
+        idx->dirty = 0;
+    } else {
+        unlink(tmp);
+        status = -1;
+    }
+
+    pthread_rwlock_unlock(&idx->lock);
+    return status;
+}
@@ -0,0 +1,73 @@
+#ifndef FILEINDEX_H
+#define FILEINDEX_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* In-memory metadata index of one user's files, so LIST and the
+ * existence/size checks of UPLOAD, DOWNLOAD and DELETE never touch the
+ * directory. Built on first use, either from the file saved at the last
+ * clean shutdown or by one readdir+stat pass, then kept current by
+ * uploads and deletes. */
+
+#define FILEINDEX_DIR "index"           // index/<username> holds saved indexes
+#define FILEINDEX_MAX_NAME 256
+
+/* Metadata of one stored file */
+typedef struct {
+    char name[FILEINDEX_MAX_NAME];
+    int64_t size;
+    int64_t mtime;
+    uint32_t checksum;          // CRC32 of the content (0 = not known)
+} FileEntry;
+
+typedef struct FileIndex {
+    pthread_rwlock_t lock;
+    char dir[320];              // The directory indexed (users/<name>)
+    char path[320];             // Where the index is saved
+    FileEntry *entries;         // Unordered, densely packed
+    int *order;                 // Positions in entries, sorted by name (LIST pages)
+    int count;
+    int capacity;
+    int *slots;                 // Open-addressing hash on name -> entry (-1 = empty)
+    int slot_count;             // Power of two, at most half full
+    long total_size;            // Sum of all sizes
+    int dirty;                  // Changed since last saved
+} FileIndex;
+
+/* Size a scan records for a file (-1 to skip it); NULL means st_size */
+typedef long (*FileSizeFn)(const char *path);
+
+/* Load the saved index of dir if it is still current, else scan dir */
+FileIndex* fileindex_open(const char *dir, const char *path, FileSizeFn file_size);
+
+/* Save if dirty and free */
+void fileindex_close(FileIndex *idx);
+
+/* Copy out the entry for name (0, or -1 if there is none) */
+int fileindex_lookup(FileIndex *idx, const char *name, FileEntry *entry);
+
+/* Add or replace the entry for entry->name */
+int fileindex_put(FileIndex *idx, const FileEntry *entry);
+
+/* Record the checksum of entry->name if it is still the file entry
+ * describes (same size and mtime) and has none yet (0, or -1) */
+int fileindex_set_checksum(FileIndex *idx, const FileEntry *entry, uint32_t checksum);
+
+/* Drop the entry for name, copying it out first if entry is set (0 or -1) */
+int fileindex_remove(FileIndex *idx, const char *name, FileEntry *entry);
+
+/* Copy out, sorted by name, the first max entries whose name starts with
+ * prefix and sorts after after ("" = from the start). Returns how many;
+ * *more is set if further matches were left out. A page costs a binary
+ * search plus max entries, whatever the size of the index. */
+int fileindex_list(FileIndex *idx, const char *after, const char *prefix,
+                   FileEntry *entries, int max, int *more);
+
+/* Number of files and bytes they hold */
+void fileindex_totals(FileIndex *idx, int *count, long *total_size);
+
+/* Persist the index if it changed (0 or -1) */
+int fileindex_save(FileIndex *idx);
+
+#endif
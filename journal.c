@@ -0,0 +1,273 @@
+#include "journal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Replay complete records after checkpoint_lsn; returns the offset just
+ * past the last good record */
+static long journal_replay(Journal *j, const char *path, long checkpoint_lsn,
+                           JournalReplayFn replay, void *ctx) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+
+    char line[JOURNAL_MAX_RECORD + 32];
+    long good = 0;
+    long last_lsn = 0;
+
+    while (fgets(line, sizeof(line), fp)) {
+        size_t len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n') break; // Torn record
+        line[len - 1] = '\0';
+
+        long lsn;
+        char type;
+        int payload = 0;
+        if (sscanf(line, "%ld %c %n", &lsn, &type, &payload) < 2 || payload == 0) break;
+        if (lsn <= last_lsn) break; // Out of order: treat as garbage
+        last_lsn = lsn;
+
+        if (lsn > checkpoint_lsn) {
+            replay(ctx, type, line + payload);
+            j->pending++;
+        }
+        good = ftell(fp);
+    }
+
+    fclose(fp);
+    if (last_lsn >= j->next_lsn) j->next_lsn = last_lsn + 1;
+    return good;
+}
+
+int journal_open(Journal *j, const char *path, long checkpoint_lsn,
+                 JournalReplayFn replay, void *ctx) {
+    j->next_lsn = checkpoint_lsn + 1;
+    j->pending = 0;
+    j->syncing = 0;
+    j->stop = 0;
+    j->waiters = 0;
+    j->sync_failed = 0;
+    j->checkpoint = NULL;
+    j->checkpoint_ctx = NULL;
+    j->syncs = 0;
+    j->synced_records = 0;
+    pthread_mutex_init(&j->mutex, NULL);
+    pthread_cond_init(&j->synced_cond, NULL);
+
+    /* The sync thread sleeps with a timeout: use a clock that never jumps */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&j->work_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    long good = journal_replay(j, path, checkpoint_lsn, replay, ctx);
+    j->synced_lsn = j->next_lsn - 1;
+
+    j->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (j->fd == -1) {
+        pthread_mutex_destroy(&j->mutex);
+        pthread_cond_destroy(&j->work_cond);
+        pthread_cond_destroy(&j->synced_cond);
+        return -1;
+    }
+
+    /* Cut a half-written tail so new records start on a clean line */
+    off_t end = lseek(j->fd, 0, SEEK_END);
+    if (end > good) {
+        printf("[Journal] Dropping %ld bytes of torn records\n", (long)(end - good));
+        if (ftruncate(j->fd, good) == -1) perror("ftruncate");
+    }
+
+    if (j->pending > 0) {
+        printf("[Journal] Replayed %ld records after checkpoint %ld\n",
+               j->pending, checkpoint_lsn);
+    }
+    return 0;
+}
+
+void journal_close(Journal *j) {
+    journal_stop_sync(j);
+    if (j->fd != -1) close(j->fd);
+    j->fd = -1;
+    pthread_mutex_destroy(&j->mutex);
+    pthread_cond_destroy(&j->work_cond);
+    pthread_cond_destroy(&j->synced_cond);
+}
+
+/* ===== GROUP COMMIT ===== */
+
+static long journal_unsynced(Journal *j) {
+    return j->next_lsn - 1 - j->synced_lsn;
+}
+
+/* fdatasync everything appended so far (called and returns with mutex
+ * held, drops it around the syscall so appends keep flowing) */
+static void journal_sync_locked(Journal *j) {
+    long target = j->next_lsn - 1;
+    if (target <= j->synced_lsn) return;
+
+    int fd = j->fd;
+    pthread_mutex_unlock(&j->mutex);
+    int status = fdatasync(fd);
+    pthread_mutex_lock(&j->mutex);
+
+    if (status == -1) {
+        perror("[Journal] fdatasync");
+        j->sync_failed = 1;
+    } else if (target > j->synced_lsn) {
+        j->syncs++;
+        j->synced_records += target - j->synced_lsn;
+        j->synced_lsn = target;
+    }
+    pthread_cond_broadcast(&j->synced_cond);
+}
+
+static void* journal_sync_thread(void *arg) {
+    Journal *j = (Journal*)arg;
+
+    pthread_mutex_lock(&j->mutex);
+    for (;;) {
+        while (!j->stop && journal_unsynced(j) == 0) {
+            pthread_cond_wait(&j->work_cond, &j->mutex);
+        }
+
+        /* Let a batch build up, unless someone is waiting on it */
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += j->window_ms * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (!j->stop && j->waiters == 0 && journal_unsynced(j) < j->batch_records) {
+            if (pthread_cond_timedwait(&j->work_cond, &j->mutex, &deadline) == ETIMEDOUT) break;
+        }
+
+        journal_sync_locked(j);
+        if (j->stop) break;
+
+        if (j->checkpoint && j->pending >= JOURNAL_CHECKPOINT_RECORDS) {
+            pthread_mutex_unlock(&j->mutex);
+            j->checkpoint(j->checkpoint_ctx);
+            pthread_mutex_lock(&j->mutex);
+        }
+    }
+    pthread_mutex_unlock(&j->mutex);
+
+    return NULL;
+}
+
+int journal_start_sync(Journal *j, long window_ms, long batch_records,
+                       JournalCheckpointFn checkpoint, void *ctx) {
+    j->window_ms = window_ms;
+    j->batch_records = batch_records > 0 ? batch_records : 1;
+    j->checkpoint = checkpoint;
+    j->checkpoint_ctx = ctx;
+    j->stop = 0;
+
+    if (pthread_create(&j->sync_thread, NULL, journal_sync_thread, j) != 0) return -1;
+    j->syncing = 1;
+    return 0;
+}
+
+void journal_stop_sync(Journal *j) {
+    if (!j->syncing) return;
+
+    pthread_mutex_lock(&j->mutex);
+    j->stop = 1;
+    pthread_cond_signal(&j->work_cond);
+    pthread_mutex_unlock(&j->mutex);
+
+    pthread_join(j->sync_thread, NULL);
+    j->syncing = 0;
+
+    if (j->syncs > 0) {
+        printf("[Journal] %ld records made durable in %ld syncs\n",
+               j->synced_records, j->syncs);
+    }
+}
+
+int journal_wait(Journal *j, long lsn) {
+    pthread_mutex_lock(&j->mutex);
+
+    if (!j->syncing) {
+        /* No group commit running: flush inline */
+        journal_sync_locked(j);
+    } else {
+        j->waiters++;
+        pthread_cond_signal(&j->work_cond);
+        while (j->synced_lsn < lsn && !j->sync_failed) {
+            pthread_cond_wait(&j->synced_cond, &j->mutex);
+        }
+        j->waiters--;
+    }
+
+    int status = j->synced_lsn >= lsn ? 0 : -1;
+    pthread_mutex_unlock(&j->mutex);
+    return status;
+}
+
+long journal_append(Journal *j, char type, const char *payload) {
+    char record[JOURNAL_MAX_RECORD + 32];
+
+    pthread_mutex_lock(&j->mutex);
+    long lsn = j->next_lsn;
+    int len = snprintf(record, sizeof(record), "%ld %c %s\n", lsn, type, payload);
+    if (len < 0 || len >= (int)sizeof(record)) {
+        pthread_mutex_unlock(&j->mutex);
+        return -1;
+    }
+
+    /* O_APPEND: each record lands at the end in one write */
+    const char *p = record;
+    while (len > 0) {
+        ssize_t n = write(j->fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            pthread_mutex_unlock(&j->mutex);
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    j->next_lsn++;
+    j->pending++;
+
+    /* Wake the sync thread for the first record of a batch, and again
+     * when the batch is full */
+    long unsynced = journal_unsynced(j);
+    if (j->syncing && (unsynced == 1 || unsynced == j->batch_records)) {
+        pthread_cond_signal(&j->work_cond);
+    }
+    pthread_mutex_unlock(&j->mutex);
+    return lsn;
+}
+
+int journal_checkpoint_due(Journal *j) {
+    pthread_mutex_lock(&j->mutex);
+    int due = !j->syncing && j->pending >= JOURNAL_CHECKPOINT_RECORDS;
+    pthread_mutex_unlock(&j->mutex);
+    return due;
+}
+
+long journal_last_lsn(Journal *j) {
+    pthread_mutex_lock(&j->mutex);
+    long lsn = j->next_lsn - 1;
+    pthread_mutex_unlock(&j->mutex);
+    return lsn;
+}
+
+int journal_reset(Journal *j) {
+    pthread_mutex_lock(&j->mutex);
+    int status = ftruncate(j->fd, 0);
+    if (status == 0) {
+        /* The checkpoint holds everything, durably */
+        j->pending = 0;
+        j->synced_lsn = j->next_lsn - 1;
+        pthread_cond_broadcast(&j->synced_cond);
+    }
+    pthread_mutex_unlock(&j->mutex);
+    return status;
+}
@@ -0,0 +1,79 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <pthread.h>
+
+/* Append-only write-ahead journal. Each record is one text line
+ * "<lsn> <type> <payload>\n" with a strictly increasing log sequence
+ * number, so a checkpoint only has to remember the last LSN it covers
+ * and replay skips everything up to it. */
+
+#define JOURNAL_CHECKPOINT_RECORDS 4096  // Records before a checkpoint is due
+#define JOURNAL_MAX_RECORD 256
+#define JOURNAL_SYNC_WINDOW_MS 5         // Group commit: max delay before fsync
+#define JOURNAL_SYNC_RECORDS 256         // Group commit: or this many records
+
+/* Called for every record newer than the checkpoint, in LSN order */
+typedef void (*JournalReplayFn)(void *ctx, char type, const char *payload);
+
+/* Called from the sync thread once a checkpoint is due */
+typedef void (*JournalCheckpointFn)(void *ctx);
+
+typedef struct {
+    int fd;
+    long next_lsn;              // LSN given to the next record
+    long synced_lsn;            // Everything up to here is on disk
+    long pending;               // Records appended since the last checkpoint
+    pthread_mutex_t mutex;      // Serializes appends, protects the fields
+    
+    /* Group commit: one thread fsyncs batches of records so appends
+     * never wait for the disk unless the caller asks to */
+    pthread_t sync_thread;
+    int syncing;                // Sync thread is running
+    int stop;                   // Asks the sync thread to flush and exit
+    int waiters;                // Callers blocked in journal_wait()
+    int sync_failed;            // fdatasync() failed: waiters give up
+    long window_ms;
+    long batch_records;
+    JournalCheckpointFn checkpoint;
+    void *checkpoint_ctx;
+    pthread_cond_t work_cond;   // Sync thread sleeps here
+    pthread_cond_t synced_cond; // journal_wait() sleeps here
+    long syncs;                 // fdatasync() calls made
+    long synced_records;        // Records they covered
+} Journal;
+
+/* Open (or create) path and replay records after checkpoint_lsn.
+ * A torn record at the end (crash mid-append) is cut off. */
+int journal_open(Journal *j, const char *path, long checkpoint_lsn,
+                 JournalReplayFn replay, void *ctx);
+void journal_close(Journal *j);
+
+/* Start the group-commit thread: unsynced records are flushed after
+ * window_ms or once batch_records pile up, whichever comes first, and
+ * due checkpoints are taken on the same thread */
+int journal_start_sync(Journal *j, long window_ms, long batch_records,
+                       JournalCheckpointFn checkpoint, void *ctx);
+
+/* Flush what is left and stop the group-commit thread */
+void journal_stop_sync(Journal *j);
+
+/* Append one record (returns its LSN or -1 on error). The record is in
+ * the page cache on return; use journal_wait() for durability. */
+long journal_append(Journal *j, char type, const char *payload);
+
+/* Block until the record with this LSN is on disk (0, or -1 on error) */
+int journal_wait(Journal *j, long lsn);
+
+/* True once enough records piled up to be worth a checkpoint (never
+ * while the sync thread runs: it takes checkpoints itself) */
+int journal_checkpoint_due(Journal *j);
+
+/* LSN of the last record appended (what a checkpoint taken now covers) */
+long journal_last_lsn(Journal *j);
+
+/* Drop all records after a durable checkpoint has made them redundant;
+ * caller must keep appends out until it returns */
+int journal_reset(Journal *j);
+
+#endif
@@ -0,0 +1,83 @@
+#include "linereader.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+void line_reader_init(LineReader *r, int fd) {
+    r->fd = fd;
+    r->start = 0;
+    r->len = 0;
+}
+
+/* Receive more bytes behind the buffered ones (count, 0 on close, -1) */
+static long line_reader_fill(LineReader *r) {
+    if (r->start > 0) {
+        memmove(r->buf, r->buf + r->start, r->len);
+        r->start = 0;
+    }
+    for (;;) {
+        ssize_t n = recv(r->fd, r->buf + r->len, sizeof(r->buf) - r->len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n > 0) r->len += n;
+        return n;
+    }
+}
+
+int line_reader_next(LineReader *r, char *line, size_t size) {
+    size_t scanned = 0;
+    for (;;) {
+        char *nl = memchr(r->buf + r->start + scanned, '\n', r->len - scanned);
+        if (nl) {
+            size_t len = nl - (r->buf + r->start);
+            size_t consumed = len + 1;
+            if (len > 0 && r->buf[r->start + len - 1] == '\r') len--;
+            if (len >= size) {
+                r->start += consumed;
+                r->len -= consumed;
+                return -2;
+            }
+            memcpy(line, r->buf + r->start, len);
+            line[len] = '\0';
+            r->start += consumed;
+            r->len -= consumed;
+            if (r->len == 0) r->start = 0;
+            return (int)len;
+        }
+
+        scanned = r->len;
+        if (r->len == sizeof(r->buf)) return -2;
+        if (line_reader_fill(r) <= 0) return -1;
+    }
+}
+
+size_t line_reader_take(LineReader *r, void *buf, size_t len) {
+    if (len > r->len) len = r->len;
+    memcpy(buf, r->buf + r->start, len);
+    r->start += len;
+    r->len -= len;
+    if (r->len == 0) r->start = 0;
+    return len;
+}
+
+long line_reader_read(LineReader *r, void *buf, size_t len) {
+    if (r->len > 0) return (long)line_reader_take(r, buf, len);
+    for (;;) {
+        ssize_t n = recv(r->fd, buf, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        return n;
+    }
+}
+
+int line_reader_read_all(LineReader *r, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        long n = line_reader_read(r, (char*)buf + got, len - got);
+        if (n <= 0) return -1;
+        got += n;
+    }
+    return 0;
+}
+
+size_t line_reader_pending(const LineReader *r) {
+    return r->len;
+}
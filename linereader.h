@@ -0,0 +1,41 @@
+#ifndef LINEREADER_H
+#define LINEREADER_H
+
+#include <stddef.h>
+
+/* Buffered reader for the line-based text protocol. TCP has no message
+ * boundaries: one recv() can return half a line, several pipelined
+ * commands, or a SIZE line together with the first bytes of the upload
+ * behind it. Bytes past the current line stay buffered until they are
+ * asked for, as a line or as raw data. */
+
+#define LINEREADER_SIZE 4096        // Buffer size, and the longest line accepted
+
+typedef struct {
+    int fd;
+    char buf[LINEREADER_SIZE];
+    size_t start;               // First unconsumed byte
+    size_t len;                 // Unconsumed bytes from start
+} LineReader;
+
+void line_reader_init(LineReader *r, int fd);
+
+/* Next line into line, without its "\r\n": returns its length, -1 if
+ * the peer closed or failed first, -2 if the line does not fit in size
+ * bytes or in the buffer (the stream is then out of step: drop it) */
+int line_reader_next(LineReader *r, char *line, size_t size);
+
+/* Move up to len bytes that are already buffered into buf (no recv) */
+size_t line_reader_take(LineReader *r, void *buf, size_t len);
+
+/* Up to len bytes, buffered ones first, else one recv(): returns the
+ * count, 0 if the peer closed, -1 on error */
+long line_reader_read(LineReader *r, void *buf, size_t len);
+
+/* Exactly len bytes (0, or -1 if the peer closed or failed first) */
+int line_reader_read_all(LineReader *r, void *buf, size_t len);
+
+/* Bytes received but not consumed yet */
+size_t line_reader_pending(const LineReader *r);
+
+#endif
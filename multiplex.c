@@ -0,0 +1,723 @@
+#include "multiplex.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "session.h"
+#include "transfer.h"
+
+/* A LIST or DOWNLOAD reply being sent, a frame at a time */
+typedef struct MuxStream {
+    uint32_t request_id;
+    uint16_t opcode;
+    ListCursor list;
+    FileTransfer transfer;
+    struct MuxStream *next;
+} MuxStream;
+
+/* One v2 connection. Lives on the client thread's stack: workers use it
+ * until they have handed their task back, and the client thread does
+ * not return before that. Workers only produce results; every frame is
+ * written by the client thread, so a client that stops reading stalls
+ * its own thread and not a shared worker. Replies of many frames take
+ * turns, so one big DOWNLOAD does not hold up the replies behind it. */
+typedef struct {
+    int socket;
+    UserManager *user_mgr;
+    WorkerThreadPool *worker_pool;
+    int user_id;
+    int broken;                     // A send failed: later frames are dropped
+    int inflight;                   // Requests not answered yet
+    int wake_fd;                    // eventfd, bumped when a worker hands a task back
+    pthread_mutex_t mutex;          // Protects finished
+    Task *finished;                 // Done by workers, not answered yet (newest first)
+    MultiplexUpload *uploads;       // Being checked or receiving DATA
+    int upload_count;
+    char *data;                     // Payload of the DATA frame being read
+    MuxStream *streams;             // Replies being sent, a frame each in turn
+    char *frame;                    // Payload of the DATA frame being sent
+} Multiplexer;
+
+/* Requests map onto the v1 commands */
+static const struct {
+    MultiplexOpcode opcode;
+    const char *command;
+} request_opcodes[] = {
+    { MULTIPLEX_OP_LIST,          "LIST" },
+    { MULTIPLEX_OP_DOWNLOAD,      "DOWNLOAD" },
+    { MULTIPLEX_OP_DELETE,        "DELETE" },
+    { MULTIPLEX_OP_UPLOAD_INIT,   "UPLOAD-INIT" },
+    { MULTIPLEX_OP_UPLOAD_COMMIT, "UPLOAD-COMMIT" },
+    { MULTIPLEX_OP_UPLOAD_ABORT,  "UPLOAD-ABORT" },
+    { MULTIPLEX_OP_UPLOAD,        "UPLOAD" },
+    { MULTIPLEX_OP_UPLOAD_RESUME, "UPLOAD-RESUME" },
+    { MULTIPLEX_OP_UPLOAD_CHUNK,  "UPLOAD-CHUNK" },
+};
+
+static const char* opcode_command(uint16_t opcode) {
+    for (size_t i = 0; i < sizeof(request_opcodes) / sizeof(request_opcodes[0]); i++) {
+        if (request_opcodes[i].opcode == opcode) return request_opcodes[i].command;
+    }
+    return NULL;
+}
+
+void multiplex_pack_header(unsigned char *header, uint32_t length, uint32_t request_id,
+                           uint16_t opcode, uint16_t flags) {
+    uint32_t word = htonl(length);
+    memcpy(header, &word, 4);
+    word = htonl(request_id);
+    memcpy(header + 4, &word, 4);
+    uint16_t half = htons(opcode);
+    memcpy(header + 8, &half, 2);
+    half = htons(flags);
+    memcpy(header + 10, &half, 2);
+}
+
+void multiplex_unpack_header(const unsigned char *header, uint32_t *length,
+                             uint32_t *request_id, uint16_t *opcode, uint16_t *flags) {
+    uint32_t word;
+    uint16_t half;
+    memcpy(&word, header, 4);
+    *length = ntohl(word);
+    memcpy(&word, header + 4, 4);
+    *request_id = ntohl(word);
+    memcpy(&half, header + 8, 2);
+    *opcode = ntohs(half);
+    memcpy(&half, header + 10, 2);
+    *flags = ntohs(half);
+}
+
+int multiplex_is_upload(uint16_t opcode) {
+    return opcode == MULTIPLEX_OP_UPLOAD || opcode == MULTIPLEX_OP_UPLOAD_RESUME ||
+           opcode == MULTIPLEX_OP_UPLOAD_CHUNK;
+}
+
+int multiplex_request_line(uint16_t opcode, const char *payload, char *line, size_t size,
+                           char *size_line, size_t size_line_len) {
+    const char *command = opcode_command(opcode);
+    if (!command) return -1;
+
+    if (opcode == MULTIPLEX_OP_UPLOAD || opcode == MULTIPLEX_OP_UPLOAD_RESUME) {
+        /* "<file> <size>": the size is what a v1 client sends as its SIZE line */
+        const char *space = strrchr(payload, ' ');
+        int name_len = space ? (int)(space - payload) : (int)strlen(payload);
+        snprintf(line, size, "%s %.*s", command, name_len, payload);
+        snprintf(size_line, size_line_len, "SIZE %s", space ? space + 1 : "");
+    } else if (payload[0]) {
+        snprintf(line, size, "%s %s", command, payload);
+    } else {
+        snprintf(line, size, "%s", command);
+    }
+    return 0;
+}
+
+MultiplexUpload* multiplex_upload_create(uint32_t request_id, const char *line,
+                                         const char *size_line, int client_id,
+                                         int user_id) {
+    MultiplexUpload *u = calloc(1, sizeof(MultiplexUpload));
+    if (!u) return NULL;
+
+    u->task = session_create_task(line, client_id, user_id);
+    if (!u->task) {
+        free(u);
+        return NULL;
+    }
+    u->request_id = request_id;
+    snprintf(u->size_line, sizeof(u->size_line), "%s", size_line);
+    transfer_init(&u->transfer);
+    return u;
+}
+
+static int upload_is_chunk(const MultiplexUpload *u) {
+    return strcmp(u->task->command, "UPLOAD-CHUNK") == 0;
+}
+
+int multiplex_upload_open(UserManager *mgr, MultiplexUpload *u, char *reply, size_t size) {
+    Task *task = u->task;
+    reply[0] = '\0';
+
+    if (upload_is_chunk(u)) {
+        /* The task claimed the chunk: offset and file_size are its bytes */
+        if (session_chunked_open(task->filename, task->offset, task->file_size,
+                                 &u->transfer) == -1) {
+            snprintf(reply, size, "ERROR: Cannot open upload\n");
+            return -1;
+        }
+        u->receiving = 1;
+        return 0;
+    }
+
+    /* UPLOAD-RESUME found the bytes already there: file_size holds them */
+    long offset = task->file_size;
+    long file_size;
+    if (session_upload_begin(mgr, task->user_id, u->size_line, offset, &file_size,
+                             reply, size) == -1 ||
+        session_upload_open(mgr, task->user_id, task->filename, offset, file_size,
+                            &u->transfer, reply, size) == -1) {
+        return -1;
+    }
+    task->offset = offset;
+    task->file_size = file_size;
+    u->receiving = 1;
+
+    if (strcmp(task->command, "UPLOAD-RESUME") == 0) {
+        snprintf(reply, size, "OFFSET %ld\n", offset);
+    } else {
+        reply[0] = '\0';
+    }
+    return 0;
+}
+
+int multiplex_upload_write(MultiplexUpload *u, const char *data, size_t len,
+                           char *reply, size_t size) {
+    if (len > (size_t)u->transfer.remaining) {
+        snprintf(reply, size, "ERROR: More data than announced\n");
+        return -1;
+    }
+    if (transfer_write(&u->transfer, data, len) == -1) {
+        snprintf(reply, size, "ERROR: Cannot write file\n");
+        return -1;
+    }
+    return 0;
+}
+
+void multiplex_upload_finish(UserManager *mgr, WorkerThreadPool *pool, MultiplexUpload *u,
+                             char *reply, size_t size) {
+    Task *task = u->task;
+    u->receiving = 0;
+
+    if (upload_is_chunk(u)) {
+        transfer_close(&u->transfer);
+        session_chunked_done(task->filename, task->offset, 1,
+                             transfer_checksum(&u->transfer), reply, size);
+        return;
+    }
+
+    /* Keep the lock until the file has left partial/ */
+    session_upload_finish(mgr, task->user_id, task->filename, task->file_size,
+                          transfer_checksum(&u->transfer), reply, size);
+    if (transfer_checksum(&u->transfer) == 0) {
+        worker_pool_checksum(pool, task->user_id, task->filename);
+    }
+    transfer_close(&u->transfer);
+}
+
+void multiplex_upload_drop(UserManager *mgr, MultiplexUpload *u) {
+    if (!u->receiving) return;
+    u->receiving = 0;
+    transfer_close(&u->transfer);
+
+    if (upload_is_chunk(u)) {
+        char reply[256];
+        session_chunked_done(u->task->filename, u->task->offset, 0, 0, reply, sizeof(reply));
+        printf("[Multiplex] Chunk of upload %s incomplete\n", u->task->filename);
+    } else {
+        session_upload_abort(mgr, u->task->user_id, u->task->file_size);
+        printf("[Multiplex] Upload of %s incomplete, partial kept\n", u->task->filename);
+    }
+}
+
+void multiplex_upload_free(MultiplexUpload *u) {
+    transfer_close(&u->transfer);
+    session_destroy_task(u->task);
+    free(u);
+}
+
+/* Send one whole frame: frames of different requests never interleave */
+static int mux_send(Multiplexer *mux, uint32_t request_id, uint16_t opcode,
+                    uint16_t flags, const void *payload, size_t len) {
+    unsigned char header[MULTIPLEX_HEADER_SIZE];
+    multiplex_pack_header(header, (uint32_t)len, request_id, opcode, flags);
+
+    struct iovec iov[2] = {
+        { header, sizeof(header) },
+        { (void*)payload, len },
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    int status = mux->broken ? -1 : 0;
+    while (status == 0 && iov[0].iov_len + iov[1].iov_len > 0) {
+        ssize_t n = sendmsg(mux->socket, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            mux->broken = 1;
+            status = -1;
+            break;
+        }
+        for (int i = 0; i < 2; i++) {
+            size_t step = (size_t)n < iov[i].iov_len ? (size_t)n : iov[i].iov_len;
+            iov[i].iov_base = (char*)iov[i].iov_base + step;
+            iov[i].iov_len -= step;
+            n -= step;
+        }
+    }
+    return status;
+}
+
+static int mux_reply(Multiplexer *mux, uint32_t request_id, uint16_t opcode,
+                     uint16_t flags, const char *text) {
+    return mux_send(mux, request_id, opcode, flags, text, strlen(text));
+}
+
+static MuxStream* mux_stream_create(uint32_t request_id, uint16_t opcode) {
+    MuxStream *stream = calloc(1, sizeof(MuxStream));
+    if (!stream) return NULL;
+    stream->request_id = request_id;
+    stream->opcode = opcode;
+    transfer_init(&stream->transfer);
+    return stream;
+}
+
+/* Queue a stream behind the others: it gets its turn after theirs */
+static void mux_add_stream(Multiplexer *mux, MuxStream *stream) {
+    MuxStream **link = &mux->streams;
+    while (*link) link = &(*link)->next;
+    stream->next = NULL;
+    *link = stream;
+}
+
+/* Send one frame of the stream whose turn it is. A DOWNLOAD's bytes are
+ * copied into frames: v2 targets many small files; big files are better
+ * off with a v1 DOWNLOAD, which goes out with sendfile. */
+static void mux_pump_stream(Multiplexer *mux) {
+    MuxStream *stream = mux->streams;
+    mux->streams = stream->next;
+    int done;
+
+    if (mux->broken) {
+        done = 1; // Nobody to send the rest to
+    } else if (stream->opcode == MULTIPLEX_OP_LIST) {
+        char chunk[SESSION_LIST_CHUNK];
+        size_t len = session_list_next(mux->user_mgr, mux->user_id, &stream->list,
+                                       chunk, sizeof(chunk));
+        done = stream->list.done;
+        mux_send(mux, stream->request_id, MULTIPLEX_OP_LIST,
+                 done ? 0 : MULTIPLEX_FLAG_MORE, chunk, len);
+    } else {
+        long n = transfer_read(&stream->transfer, mux->frame, MULTIPLEX_DATA_FRAME);
+        if (n <= 0) {
+            /* File ended early: the client must not wait for the rest */
+            mux_reply(mux, stream->request_id, MULTIPLEX_OP_DATA, MULTIPLEX_FLAG_ERROR,
+                      "ERROR: Cannot read file\n");
+            done = 1;
+        } else {
+            done = stream->transfer.remaining == 0;
+            mux_send(mux, stream->request_id, MULTIPLEX_OP_DATA,
+                     done ? 0 : MULTIPLEX_FLAG_MORE, mux->frame, n);
+        }
+    }
+
+    if (done) {
+        transfer_close(&stream->transfer);
+        free(stream);
+    } else {
+        mux_add_stream(mux, stream);
+    }
+}
+
+/* Send what is left of every stream, still in turns */
+static void mux_finish_streams(Multiplexer *mux) {
+    while (mux->streams) mux_pump_stream(mux);
+}
+
+static MultiplexUpload* mux_find_upload(Multiplexer *mux, uint32_t request_id) {
+    MultiplexUpload *u = mux->uploads;
+    while (u && u->request_id != request_id) u = u->next;
+    return u;
+}
+
+static void mux_remove_upload(Multiplexer *mux, MultiplexUpload *u) {
+    MultiplexUpload **link = &mux->uploads;
+    while (*link != u) link = &(*link)->next;
+    *link = u->next;
+    mux->upload_count--;
+    multiplex_upload_free(u);
+}
+
+/* Every byte of an upload is in: store it and answer its request */
+static void mux_upload_done(Multiplexer *mux, MultiplexUpload *u) {
+    char reply[512];
+    multiplex_upload_finish(mux->user_mgr, mux->worker_pool, u, reply, sizeof(reply));
+    uint16_t flags = strncmp(reply, "ERROR", 5) == 0 ? MULTIPLEX_FLAG_ERROR : 0;
+    mux_reply(mux, u->request_id, u->task->opcode, flags, reply);
+    mux_remove_upload(mux, u);
+}
+
+/* An upload's request was checked: open the upload or refuse it */
+static void mux_upload_checked(Multiplexer *mux, Task *task) {
+    MultiplexUpload *u = mux->uploads;
+    while (u->task != task) u = u->next;
+
+    char reply[512];
+    if (task->result_code != 0) {
+        mux_reply(mux, u->request_id, task->opcode, MULTIPLEX_FLAG_ERROR,
+                  task->result_message);
+        mux_remove_upload(mux, u);
+        return;
+    }
+    if (multiplex_upload_open(mux->user_mgr, u, reply, sizeof(reply)) == -1) {
+        mux_reply(mux, u->request_id, task->opcode, MULTIPLEX_FLAG_ERROR, reply);
+        mux_remove_upload(mux, u);
+        return;
+    }
+
+    if (reply[0]) mux_reply(mux, u->request_id, task->opcode, MULTIPLEX_FLAG_MORE, reply);
+    if (u->transfer.remaining == 0) mux_upload_done(mux, u);
+}
+
+/* Reply to a finished request and free its task */
+static void mux_answer(Multiplexer *mux, Task *task) {
+    if (multiplex_is_upload(task->opcode)) {
+        mux->inflight--;
+        mux_upload_checked(mux, task); // The upload owns the task
+        return;
+    }
+
+    int data = strcmp(task->command, "DOWNLOAD") == 0 && task->result_code == 0 &&
+               task->file_size > 0;
+
+    /* Open before the SIZE line goes out: a DELETE answered meanwhile
+     * then turns the reply into an error instead of cutting the data */
+    MuxStream *stream = NULL;
+    if (data) {
+        stream = mux_stream_create(task->request_id, MULTIPLEX_OP_DATA);
+        if (!stream || session_open_download(mux->user_mgr, task->user_id, task->filename,
+                                             task->offset, task->file_size,
+                                             &stream->transfer, 1) == -1) {
+            snprintf(task->result_message, sizeof(task->result_message),
+                     stream ? "ERROR: Cannot read file\n" : "ERROR: Out of memory\n");
+            task->result_code = -1;
+            data = 0;
+            free(stream);
+        }
+    }
+
+    uint16_t flags = (task->result_code != 0 ? MULTIPLEX_FLAG_ERROR : 0) |
+                     (data ? MULTIPLEX_FLAG_MORE : 0);
+    mux_reply(mux, task->request_id, task->opcode, flags, task->result_message);
+    if (data) mux_add_stream(mux, stream); // Its bytes follow in turns
+
+    mux->inflight--;
+    session_destroy_task(task); // Back to the cache of the thread that made it
+}
+
+/* Runs on the worker that finished the task: hand it back only */
+static void mux_task_done(Task *task) {
+    Multiplexer *mux = task->context;
+
+    pthread_mutex_lock(&mux->mutex);
+    task->next = mux->finished;
+    mux->finished = task;
+    pthread_mutex_unlock(&mux->mutex);
+
+    uint64_t one = 1;
+    ssize_t ret = write(mux->wake_fd, &one, sizeof(one));
+    (void)ret; // Counter saturation still leaves the fd readable
+}
+
+/* Answer the tasks workers have handed back, in the order they finished */
+static void mux_answer_finished(Multiplexer *mux) {
+    pthread_mutex_lock(&mux->mutex);
+    Task *list = mux->finished;
+    mux->finished = NULL;
+    pthread_mutex_unlock(&mux->mutex);
+
+    Task *ordered = NULL;
+    while (list) {
+        Task *task = list;
+        list = list->next;
+        task->next = ordered;
+        ordered = task;
+    }
+    while (ordered) {
+        Task *task = ordered;
+        ordered = ordered->next;
+        task->next = NULL;
+        mux_answer(mux, task);
+    }
+}
+
+/* Wait for a worker to hand a task back, sending stream frames while
+ * the socket takes them */
+static void mux_wait_finished(Multiplexer *mux) {
+    struct pollfd fds[2] = {
+        { .fd = mux->wake_fd, .events = POLLIN },
+        { .fd = mux->streams ? mux->socket : -1, .events = POLLOUT },
+    };
+    if (poll(fds, 2, -1) == -1) return; // Interrupted: look again
+    if (fds[0].revents & POLLIN) {
+        uint64_t count;
+        ssize_t ret = read(mux->wake_fd, &count, sizeof(count));
+        (void)ret;
+    }
+    if (fds[1].revents) mux_pump_stream(mux); // Room, or an error the send reports
+}
+
+/* Answer finished requests until at most limit are in flight */
+static void mux_collect(Multiplexer *mux, int limit) {
+    mux_answer_finished(mux);
+    while (mux->inflight > limit) {
+        mux_wait_finished(mux);
+        mux_answer_finished(mux);
+    }
+}
+
+/* Answer finished requests while waiting for the next frame (0), or -1
+ * if the socket cannot be polled. Streams get a frame per turn: one per
+ * request read, or as many as the wait for the next one allows. */
+static int mux_wait_request(Multiplexer *mux, LineReader *reader) {
+    for (;;) {
+        mux_answer_finished(mux);
+        int pending = line_reader_pending(reader) > 0;
+        if (pending && !mux->streams) return 0;
+
+        struct pollfd fds[2] = {
+            { .fd = mux->socket,
+              .events = (pending ? 0 : POLLIN) | (mux->streams ? POLLOUT : 0) },
+            { .fd = mux->wake_fd, .events = POLLIN },
+        };
+        if (poll(fds, 2, pending ? 0 : -1) == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+            ssize_t ret = read(mux->wake_fd, &count, sizeof(count));
+            (void)ret;
+        }
+        if (mux->streams && (fds[0].revents & (POLLOUT | POLLERR | POLLHUP))) {
+            mux_pump_stream(mux);
+        }
+        if (pending || (fds[0].revents & ~POLLOUT)) {
+            return 0; // Data, or a hangup the read reports
+        }
+    }
+}
+
+/* LIST is served from the in-memory index, one frame per batch */
+static void mux_list(Multiplexer *mux, uint32_t request_id, const char *line) {
+    char header[512];
+    MuxStream *stream = mux_stream_create(request_id, MULTIPLEX_OP_LIST);
+    if (!stream) {
+        mux_reply(mux, request_id, MULTIPLEX_OP_LIST, MULTIPLEX_FLAG_ERROR,
+                  "ERROR: Out of memory\n");
+        return;
+    }
+
+    if (session_list_begin(mux->user_mgr, mux->user_id, line, &stream->list,
+                           header, sizeof(header)) == -1) {
+        mux_reply(mux, request_id, MULTIPLEX_OP_LIST, MULTIPLEX_FLAG_ERROR, header);
+        free(stream);
+        return;
+    }
+    mux_reply(mux, request_id, MULTIPLEX_OP_LIST, MULTIPLEX_FLAG_MORE, header);
+    mux_add_stream(mux, stream);
+}
+
+/* Run a request's task; its reply is sent when it completes */
+static void mux_run(Multiplexer *mux, Task *task, uint32_t request_id, uint16_t opcode) {
+    task->request_id = request_id;
+    task->opcode = opcode;
+    task->on_complete = mux_task_done;
+    task->context = mux;
+
+    mux->inflight++;
+    if (worker_pool_run_inline(mux->worker_pool, task)) {
+        mux_answer(mux, task);
+    } else if (worker_pool_submit(mux->worker_pool, task) == -1) {
+        snprintf(task->result_message, sizeof(task->result_message),
+                 "ERROR: Server overloaded\n");
+        task->result_code = -1;
+        mux_answer(mux, task);
+    }
+}
+
+static void mux_submit(Multiplexer *mux, uint32_t request_id, uint16_t opcode,
+                       const char *line) {
+    mux_collect(mux, MULTIPLEX_MAX_INFLIGHT - 1);
+
+    Task *task = session_create_task(line, mux->socket, mux->user_id);
+    if (!task) {
+        mux_reply(mux, request_id, opcode, MULTIPLEX_FLAG_ERROR, "ERROR: Out of memory\n");
+        return;
+    }
+    mux_run(mux, task, request_id, opcode);
+}
+
+/* Check an upload request; its DATA frames are stored once it passes */
+static void mux_begin_upload(Multiplexer *mux, uint32_t request_id, uint16_t opcode,
+                             const char *line, const char *size_line) {
+    mux_collect(mux, MULTIPLEX_MAX_INFLIGHT - 1);
+
+    const char *err = NULL;
+    if (mux_find_upload(mux, request_id)) {
+        err = "ERROR: Request ID already in use\n";
+    } else if (mux->upload_count >= MULTIPLEX_MAX_UPLOADS) {
+        err = "ERROR: Too many uploads at once\n";
+    }
+    if (err) {
+        mux_reply(mux, request_id, opcode, MULTIPLEX_FLAG_ERROR, err);
+        return;
+    }
+
+    MultiplexUpload *u = multiplex_upload_create(request_id, line, size_line,
+                                                 mux->socket, mux->user_id);
+    if (!u) {
+        mux_reply(mux, request_id, opcode, MULTIPLEX_FLAG_ERROR, "ERROR: Out of memory\n");
+        return;
+    }
+    u->next = mux->uploads;
+    mux->uploads = u;
+    mux->upload_count++;
+    mux_run(mux, u->task, request_id, opcode);
+}
+
+/* Store a DATA frame's payload in its upload */
+static void mux_upload_data(Multiplexer *mux, uint32_t request_id, size_t len) {
+    /* Bytes sent right behind their request wait for its check */
+    MultiplexUpload *u;
+    for (;;) {
+        mux_answer_finished(mux);
+        u = mux_find_upload(mux, request_id);
+        if (!u || u->receiving) break;
+        mux_wait_finished(mux);
+    }
+    if (!u) return; // Refused: its bytes are dropped
+
+    char reply[256];
+    if (multiplex_upload_write(u, mux->data, len, reply, sizeof(reply)) == -1) {
+        multiplex_upload_drop(mux->user_mgr, u);
+        mux_reply(mux, request_id, u->task->opcode, MULTIPLEX_FLAG_ERROR, reply);
+        mux_remove_upload(mux, u);
+        return;
+    }
+    if (u->transfer.remaining == 0) mux_upload_done(mux, u);
+}
+
+/* Connection ends: uploads still missing bytes keep their partials */
+static void mux_drop_uploads(Multiplexer *mux) {
+    while (mux->uploads) {
+        MultiplexUpload *u = mux->uploads;
+        multiplex_upload_drop(mux->user_mgr, u);
+        mux_reply(mux, u->request_id, u->task->opcode, MULTIPLEX_FLAG_ERROR,
+                  "ERROR: Upload incomplete\n");
+        mux_remove_upload(mux, u);
+    }
+}
+
+int multiplex_serve(LineReader *reader, UserManager *user_mgr,
+                    WorkerThreadPool *worker_pool, int user_id) {
+    int socket = reader->fd;
+    int wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        perror("eventfd");
+        return -1;
+    }
+
+    char *data = malloc(MULTIPLEX_DATA_FRAME);
+    char *frame = malloc(MULTIPLEX_DATA_FRAME);
+    if (!data || !frame) {
+        free(data);
+        free(frame);
+        close(wake_fd);
+        return -1;
+    }
+
+    Multiplexer mux;
+    mux.socket = socket;
+    mux.user_mgr = user_mgr;
+    mux.worker_pool = worker_pool;
+    mux.user_id = user_id;
+    mux.broken = 0;
+    mux.inflight = 0;
+    mux.finished = NULL;
+    mux.wake_fd = wake_fd;
+    mux.uploads = NULL;
+    mux.upload_count = 0;
+    mux.data = data;
+    mux.streams = NULL;
+    mux.frame = frame;
+    pthread_mutex_init(&mux.mutex, NULL);
+
+    printf("[Multiplex] Socket %d switched to protocol 2\n", socket);
+
+    char payload[MULTIPLEX_MAX_REQUEST + 1];
+    char line[MULTIPLEX_MAX_REQUEST + 32];
+    char size_line[32];
+    long requests = 0;
+    int status = -1;
+
+    for (;;) {
+        unsigned char header[MULTIPLEX_HEADER_SIZE];
+        if (mux_wait_request(&mux, reader) == -1) break;
+        if (line_reader_read_all(reader, header, sizeof(header)) == -1) break;
+
+        uint32_t length, request_id;
+        uint16_t opcode, flags;
+        multiplex_unpack_header(header, &length, &request_id, &opcode, &flags);
+
+        if (opcode == MULTIPLEX_OP_DATA) {
+            if (length > MULTIPLEX_DATA_FRAME) {
+                printf("[Multiplex] DATA frame of %u bytes is too long, closing\n", length);
+                break;
+            }
+            if (line_reader_read_all(reader, data, length) == -1) break;
+            mux_upload_data(&mux, request_id, length);
+            continue;
+        }
+
+        if (length > MULTIPLEX_MAX_REQUEST) {
+            printf("[Multiplex] Request %u of %u bytes is too long, closing\n",
+                   request_id, length);
+            break;
+        }
+        if (line_reader_read_all(reader, payload, length) == -1) break;
+        payload[length] = '\0';
+        requests++;
+
+        if (opcode == MULTIPLEX_OP_QUIT) {
+            mux_collect(&mux, 0);
+            mux_finish_streams(&mux);
+            mux_drop_uploads(&mux);
+            mux_reply(&mux, request_id, opcode, 0, "Goodbye!\n");
+            status = 0;
+            break;
+        }
+
+        if (multiplex_request_line(opcode, payload, line, sizeof(line),
+                                   size_line, sizeof(size_line)) == -1) {
+            mux_reply(&mux, request_id, opcode, MULTIPLEX_FLAG_ERROR,
+                      "ERROR: Unknown opcode\n");
+            continue;
+        }
+
+        if (opcode == MULTIPLEX_OP_LIST) {
+            mux_list(&mux, request_id, line);
+        } else if (multiplex_is_upload(opcode)) {
+            mux_begin_upload(&mux, request_id, opcode, line, size_line);
+        } else {
+            mux_submit(&mux, request_id, opcode, line);
+        }
+    }
+
+    mux_collect(&mux, 0);
+    mux_finish_streams(&mux);
+    mux_drop_uploads(&mux);
+    printf("[Multiplex] Socket %d done after %ld requests\n", socket, requests);
+
+    pthread_mutex_destroy(&mux.mutex);
+    close(wake_fd);
+    free(data);
+    free(frame);
+    return status;
+}
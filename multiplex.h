@@ -0,0 +1,120 @@
+#ifndef MULTIPLEX_H
+#define MULTIPLEX_H
+
+#include <stdint.h>
+#include "linereader.h"
+#include "threadpool.h"
+#include "transfer.h"
+#include "utils.h"
+
+/* Protocol v2: binary frames that let one connection carry many
+ * requests at once. A logged-in v1 session asks for it with the line
+ * "PROTOCOL 2"; after that line (and the "OK: PROTOCOL 2" reply) both
+ * directions are frames:
+ *
+ *   u32 length | u32 request_id | u16 opcode | u16 flags | payload
+ *
+ * all big-endian, length counting the payload only. A request carries
+ * its v1 arguments as payload ("<file> [<offset> [<length>]]" for
+ * DOWNLOAD). Replies echo the request ID and opcode and carry the v1
+ * reply text; they come back as requests complete, not in request order
+ * (requests in flight together are not ordered against each other).
+ * LIST answers with one frame per batch, DOWNLOAD with its SIZE line and
+ * then DATA frames; every frame but a request's last is flagged MORE.
+ *
+ * Uploads send their bytes as DATA frames carrying the upload request's
+ * ID, in as many frames as the client likes and interleaved with other
+ * requests: UPLOAD and UPLOAD_RESUME take "<file> <size>", UPLOAD_CHUNK
+ * takes "<id> <index>" of an UPLOAD_INIT. The DATA frames may follow the
+ * request right away; the upload ends, and is answered, once the
+ * announced bytes are in (UPLOAD_RESUME first answers "OFFSET <n>",
+ * flagged MORE, and takes the bytes from n on). An upload that is refused
+ * gets its ERROR reply and the DATA frames sent for it are dropped, so a
+ * request ID must not be reused before all of its DATA frames are sent.
+ * Both the client threads and the reactors serve v2. */
+
+#define MULTIPLEX_NEGOTIATE "PROTOCOL 2"
+#define MULTIPLEX_HEADER_SIZE 12
+#define MULTIPLEX_MAX_REQUEST 1024          // Longest request payload accepted
+#define MULTIPLEX_DATA_FRAME (64 * 1024)    // Download bytes per DATA frame
+#define MULTIPLEX_MAX_INFLIGHT 256          // Requests per connection at once
+#define MULTIPLEX_MAX_UPLOADS 16            // Uploads per connection at once
+
+typedef enum {
+    MULTIPLEX_OP_LIST = 1,
+    MULTIPLEX_OP_DOWNLOAD = 2,
+    MULTIPLEX_OP_DELETE = 3,
+    MULTIPLEX_OP_UPLOAD_INIT = 4,
+    MULTIPLEX_OP_UPLOAD_COMMIT = 5,
+    MULTIPLEX_OP_UPLOAD_ABORT = 6,
+    MULTIPLEX_OP_QUIT = 7,              // Replied once every other request is
+    MULTIPLEX_OP_UPLOAD = 8,
+    MULTIPLEX_OP_UPLOAD_RESUME = 9,
+    MULTIPLEX_OP_UPLOAD_CHUNK = 10,
+    MULTIPLEX_OP_DATA = 0x100           // Bytes of a download or an upload
+} MultiplexOpcode;
+
+#define MULTIPLEX_FLAG_ERROR 0x1        // Reply text is an ERROR
+#define MULTIPLEX_FLAG_MORE 0x2         // More frames follow for this request
+
+/* One upload of a v2 connection, from its request to its last byte.
+ * The request is checked like any other (a task, maybe on a worker);
+ * once it passes, the upload is opened and DATA payloads go to transfer.
+ * Owned by the front-end thread of its connection. */
+typedef struct MultiplexUpload {
+    uint32_t request_id;
+    Task *task;                 // The request; then the file, offset and size
+    char size_line[32];         // "SIZE <size>" for session_upload_begin
+    int receiving;              // Opened: DATA payloads are stored
+    FileTransfer transfer;
+    struct MultiplexUpload *next;
+} MultiplexUpload;
+
+void multiplex_pack_header(unsigned char *header, uint32_t length, uint32_t request_id,
+                           uint16_t opcode, uint16_t flags);
+void multiplex_unpack_header(const unsigned char *header, uint32_t *length,
+                             uint32_t *request_id, uint16_t *opcode, uint16_t *flags);
+
+/* Turn a request into its v1 command line (-1 for an unknown opcode).
+ * An upload's size goes to size_line instead, which may be NULL for
+ * other opcodes. */
+int multiplex_request_line(uint16_t opcode, const char *payload, char *line, size_t size,
+                           char *size_line, size_t size_line_len);
+
+int multiplex_is_upload(uint16_t opcode);
+
+/* New upload for a request line (NULL if out of memory) */
+MultiplexUpload* multiplex_upload_create(uint32_t request_id, const char *line,
+                                         const char *size_line, int client_id,
+                                         int user_id);
+
+/* Once the upload's task passed: reserve the quota and open the file or
+ * chunk (0), or -1 with the error in reply. reply is empty on success,
+ * or the OFFSET line an UPLOAD_RESUME answers first. */
+int multiplex_upload_open(UserManager *mgr, MultiplexUpload *u, char *reply, size_t size);
+
+/* Store one DATA payload: -1 if it holds more than the bytes still
+ * announced or cannot be written (reply says which) */
+int multiplex_upload_write(MultiplexUpload *u, const char *data, size_t len,
+                           char *reply, size_t size);
+
+/* Every byte is in: store the file or chunk and format the reply. An
+ * unknown CRC32 is left to a background job on pool. */
+void multiplex_upload_finish(UserManager *mgr, WorkerThreadPool *pool, MultiplexUpload *u,
+                             char *reply, size_t size);
+
+/* Give up on an open upload: the reservation is released and the
+ * partial kept for UPLOAD_RESUME, or the chunk marked missing again */
+void multiplex_upload_drop(UserManager *mgr, MultiplexUpload *u);
+
+/* Close and free an upload that is not open (anymore) */
+void multiplex_upload_free(MultiplexUpload *u);
+
+/* Serve a v2 connection on a client thread until QUIT (0) or until the
+ * peer disconnects or breaks the framing (-1). Frames the client sent
+ * right behind the PROTOCOL line are taken from reader first. Returns
+ * only once every request it submitted has been answered. */
+int multiplex_serve(LineReader *reader, UserManager *user_mgr,
+                    WorkerThreadPool *worker_pool, int user_id);
+
+#endif
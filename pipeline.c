@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include "pipeline.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include "session.h"
+
+/* One window of the ring and the task that flushes it */
+typedef struct {
+    Task *task;
+    int fd;
+    off_t offset;
+    off_t len;
+    int busy;                   // Submitted and not yet waited for
+    int failed;                 // Set by the worker
+} PipelineSlot;
+
+/* Runs on a worker (or, with the pool saturated, on the session thread):
+ * write the window back and wait until it is on disk */
+static void pipeline_flush(Task *task) {
+    PipelineSlot *slot = task->context;
+    int flags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                SYNC_FILE_RANGE_WAIT_AFTER;
+    while (sync_file_range(slot->fd, slot->offset, slot->len, flags) == -1) {
+        if (errno != EINTR) {
+            slot->failed = 1;
+            return;
+        }
+    }
+}
+
+/* Wait until the slot's window is on disk (-1 if its writeback failed) */
+static int pipeline_wait(PipelineSlot *slot) {
+    Task *task = slot->task;
+    pthread_mutex_lock(&task->result_mutex);
+    while (!task->result_ready) {
+        pthread_cond_wait(&task->result_cond, &task->result_mutex);
+    }
+    pthread_mutex_unlock(&task->result_mutex);
+    slot->busy = 0;
+    return slot->failed ? -1 : 0;
+}
+
+/* Hand slots[next] to the pool. worker_pool_submit fails when the pool
+ * shuts down or every bulk deque and the overflow queue are full; then
+ * this upload waits for its own oldest flushes, like a full ring, and
+ * tries again. Only with none of them left does the flush run here,
+ * counted in the pool's stats. Returns -1 if a flush waited for failed
+ * (its offset in *bad_offset). */
+static int pipeline_submit(PipelineSlot *slots, int next, WorkerThreadPool *pool,
+                           off_t *bad_offset) {
+    PipelineSlot *slot = &slots[next];
+    int status = 0;
+    slot->busy = 1;
+    slot->failed = 0;
+    slot->task->result_ready = 0;
+
+    for (int i = 1; worker_pool_submit(pool, slot->task) == -1; i++) {
+        if (i == PIPELINE_BUFFERS) {
+            pipeline_flush(slot->task);
+            slot->task->result_ready = 1;
+            atomic_fetch_add_explicit(&pool->flushed_inline, 1, memory_order_relaxed);
+            break;
+        }
+        PipelineSlot *oldest = &slots[(next + i) % PIPELINE_BUFFERS];
+        if (oldest->busy && pipeline_wait(oldest) == -1) {
+            if (*bad_offset == -1 || oldest->offset < *bad_offset) {
+                *bad_offset = oldest->offset;
+            }
+            status = -1;
+        }
+    }
+    return status;
+}
+
+int pipeline_recv_all(FileTransfer *t, int sock, WorkerThreadPool *pool) {
+    PipelineSlot slots[PIPELINE_BUFFERS];
+    memset(slots, 0, sizeof(slots));
+
+    off_t bad_offset = -1;      // First window whose writeback failed
+    int status = 0;
+
+    for (int next = 0; t->remaining > 0; next = (next + 1) % PIPELINE_BUFFERS) {
+        PipelineSlot *slot = &slots[next];
+        if (slot->busy && pipeline_wait(slot) == -1) {
+            bad_offset = slot->offset;
+            status = -1;
+            break;
+        }
+        if (!slot->task) {
+            slot->task = session_create_job(pipeline_flush, slot);
+            if (!slot->task) {
+                status = -1;
+                break;
+            }
+            slot->fd = t->file_fd;
+        }
+
+        /* Receive one window through the usual splice path */
+        long window = t->remaining < PIPELINE_BUFFER_SIZE ? t->remaining
+                                                          : PIPELINE_BUFFER_SIZE;
+        long after = t->remaining - window;
+        slot->offset = t->offset;
+        t->remaining = window;
+        while (t->remaining > 0) {
+            if (transfer_recv(t, sock) < 0) {
+                status = -1;
+                break;
+            }
+        }
+        t->remaining += after;
+        slot->len = t->offset - slot->offset;
+
+        if (status == -1) break;
+        if (pipeline_submit(slots, next, pool, &bad_offset) == -1) {
+            status = -1;
+            break;
+        }
+    }
+
+    for (int i = 0; i < PIPELINE_BUFFERS; i++) {
+        PipelineSlot *slot = &slots[i];
+        if (slot->busy && pipeline_wait(slot) == -1 &&
+            (bad_offset == -1 || slot->offset < bad_offset)) {
+            bad_offset = slot->offset;
+            status = -1;
+        }
+        session_destroy_task(slot->task);
+    }
+
+    /* Flushes finish out of order: after a failed one only the bytes
+     * before it are known to be in the file */
+    if (bad_offset != -1) t->offset = bad_offset;
+    return status;
+}
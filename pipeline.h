@@ -0,0 +1,23 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "threadpool.h"
+#include "transfer.h"
+
+/* Pipelined upload receive for the blocking client threads. The thread
+ * splices the socket into the file a window at a time, as transfer_recv
+ * does everywhere else, and hands each finished window to the worker
+ * pool, which writes it back to disk and waits for that. The disk
+ * flushes one window while the socket fills the next, instead of the
+ * thread stalling on writeback once the page cache is full of the
+ * upload. Unflushed data per upload is bounded by the ring. */
+
+#define PIPELINE_BUFFERS 4                  // Windows in flight per upload
+#define PIPELINE_BUFFER_SIZE (1024 * 1024)  // Bytes per window
+
+/* Receive the rest of the upload t from sock (0 on success, -1 on
+ * error). Every window received is flushed before returning; after a
+ * failed flush t->offset is the end of the part known to be stored. */
+int pipeline_recv_all(FileTransfer *t, int sock, WorkerThreadPool *pool);
+
+#endif
@@ -1,183 +1,402 @@
 #include "queue.h"
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define RING_SPIN_LIMIT 64      // Retries before parking on the futex
+
+/* Spinning only helps when the other side runs on another CPU */
+static int ring_spin_limit = -1;
+
+/* ===== LOCK-FREE RING ===== */
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static void futex_wait(atomic_uint *addr, unsigned int expected) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+#define LOT_WAITER (1ULL << 32)
+
+/* Wake one parked thread, but only pay for the syscall if some waiter
+ * is not already being woken */
+static void parking_wake(ParkingLot *lot) {
+    /* Order the caller's publish before reading the waiter count; pairs
+     * with the registration in ring_park() */
+    atomic_thread_fence(memory_order_seq_cst);
+
+    unsigned long long state = atomic_load_explicit(&lot->state, memory_order_relaxed);
+    for (;;) {
+        if ((state >> 32) <= (state & 0xffffffffULL)) return;
+        if (atomic_compare_exchange_weak(&lot->state, &state, state + 1)) break;
+    }
+
+    atomic_fetch_add(&lot->seq, 1);
+    futex_wake(&lot->seq, 1);
+}
+
+static atomic_size_t* slot_seq(Ring *ring, size_t pos) {
+    return (atomic_size_t*)(ring->slots + (pos % ring->capacity) * ring->slot_size);
+}
+
+static void* slot_data(Ring *ring, size_t pos) {
+    return ring->slots + (pos % ring->capacity) * ring->slot_size + sizeof(atomic_size_t);
+}
+
+static int ring_init(Ring *ring, size_t capacity, size_t elem_size) {
+    size_t slot_size = sizeof(atomic_size_t) + elem_size;
+    slot_size = (slot_size + sizeof(atomic_size_t) - 1) & ~(sizeof(atomic_size_t) - 1);
+
+    ring->slots = malloc(slot_size * capacity);
+    if (!ring->slots) return -1;
+
+    if (ring_spin_limit < 0) {
+        ring_spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPIN_LIMIT : 0;
+    }
+
+    ring->slot_size = slot_size;
+    ring->elem_size = elem_size;
+    ring->capacity = capacity;
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(slot_seq(ring, i), i);
+    }
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->not_empty.seq, 0);
+    atomic_init(&ring->not_empty.state, 0);
+    atomic_init(&ring->not_full.seq, 0);
+    atomic_init(&ring->not_full.state, 0);
+    atomic_init(&ring->shutdown, 0);
+    return 0;
+}
+
+/* Returns 1 on success, 0 if the ring is full */
+static int ring_try_push(Ring *ring, const void *elem) {
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    for (;;) {
+        atomic_size_t *seq = slot_seq(ring, pos);
+        size_t s = atomic_load_explicit(seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)s - (intptr_t)pos;
+
+        if (diff == 0) {
+            /* Slot is free for this lap: claim the position */
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                memcpy(slot_data(ring, pos), elem, ring->elem_size);
+                atomic_store_explicit(seq, pos + 1, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0; // Consumer has not freed this slot yet
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+}
+
+/* Returns 1 on success, 0 if the ring is empty */
+static int ring_try_pop(Ring *ring, void *elem) {
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    for (;;) {
+        atomic_size_t *seq = slot_seq(ring, pos);
+        size_t s = atomic_load_explicit(seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)s - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                memcpy(elem, slot_data(ring, pos), ring->elem_size);
+                /* Hand the slot to the producer of the next lap */
+                atomic_store_explicit(seq, pos + ring->capacity, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0; // Producer has not filled this slot yet
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+}
+
+/* Sleep until the lot is signalled, unless ready() already holds after
+ * registering as a waiter (no lost wakeups) */
+static void ring_park(Ring *ring, ParkingLot *lot, int (*ready)(Ring*)) {
+    unsigned int seq = atomic_load(&lot->seq);
+    atomic_fetch_add(&lot->state, LOT_WAITER);
+    if (!ready(ring) && !atomic_load(&ring->shutdown)) {
+        futex_wait(&lot->seq, seq);
+    }
+
+    /* Leave, consuming one in-flight wakeup if there is one */
+    unsigned long long state = atomic_load(&lot->state);
+    for (;;) {
+        unsigned long long next = state - LOT_WAITER;
+        if (state & 0xffffffffULL) next--;
+        if (atomic_compare_exchange_weak(&lot->state, &state, next)) break;
+    }
+}
+
+static int ring_has_items(Ring *ring) {
+    size_t head = atomic_load(&ring->head);
+    return atomic_load(slot_seq(ring, head)) == head + 1;
+}
+
+static int ring_has_space(Ring *ring) {
+    size_t tail = atomic_load(&ring->tail);
+    return atomic_load(slot_seq(ring, tail)) == tail;
+}
+
+/* Blocks while full (0 on success, -1 after shutdown) */
+static int ring_push(Ring *ring, const void *elem) {
+    for (int spins = 0; ; spins++) {
+        if (atomic_load_explicit(&ring->shutdown, memory_order_acquire)) return -1;
+
+        if (ring_try_push(ring, elem)) {
+            parking_wake(&ring->not_empty);
+            if (ring_has_space(ring)) parking_wake(&ring->not_full);
+            return 0;
+        }
+
+        if (spins < ring_spin_limit) {
+            cpu_relax();
+        } else {
+            ring_park(ring, &ring->not_full, ring_has_space);
+        }
+    }
+}
+
+/* Never blocks (0 on success, -1 if full or shut down) */
+static int ring_offer(Ring *ring, const void *elem) {
+    if (atomic_load_explicit(&ring->shutdown, memory_order_acquire)) return -1;
+    if (!ring_try_push(ring, elem)) return -1;
+    parking_wake(&ring->not_empty);
+    return 0;
+}
+
+/* Blocks while empty (0 on success, -1 once shut down and drained) */
+static int ring_pop(Ring *ring, void *elem) {
+    for (int spins = 0; ; spins++) {
+        if (ring_try_pop(ring, elem)) {
+            parking_wake(&ring->not_full);
+            /* Pass the baton: a wakeup covers one item, so a consumer
+             * that leaves items behind wakes the next sleeper */
+            if (ring_has_items(ring)) parking_wake(&ring->not_empty);
+            return 0;
+        }
+
+        if (atomic_load_explicit(&ring->shutdown, memory_order_acquire)) {
+            /* Items pushed before shutdown are still delivered */
+            if (ring_try_pop(ring, elem)) return 0;
+            return -1;
+        }
+
+        if (spins < ring_spin_limit) {
+            cpu_relax();
+        } else {
+            ring_park(ring, &ring->not_empty, ring_has_items);
+        }
+    }
+}
+
+static void ring_shutdown(Ring *ring) {
+    atomic_store(&ring->shutdown, 1);
+    atomic_fetch_add(&ring->not_empty.seq, 1);
+    atomic_fetch_add(&ring->not_full.seq, 1);
+    futex_wake(&ring->not_empty.seq, INT_MAX);
+    futex_wake(&ring->not_full.seq, INT_MAX);
+}
+
+/* Elements queued (a snapshot: others may push and pop meanwhile) */
+static size_t ring_count(Ring *ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+/* ===== QUEUE DELAY SHEDDING ===== */
+
+uint64_t queue_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void codel_init(Codel *c, long target_ms, long interval_ms) {
+    memset(c, 0, sizeof(*c));
+    c->target = (uint64_t)target_ms * 1000000;
+    c->interval = (uint64_t)interval_ms * 1000000;
+}
+
+/* t + interval / sqrt(count) */
+static uint64_t codel_control_law(const Codel *c, uint64_t t) {
+    unsigned int root = 1;
+    while ((root + 1) * (root + 1) <= c->count) root++;
+    return t + c->interval / root;
+}
+
+long codel_shed(Codel *c, uint64_t now, uint64_t queued, size_t backlog) {
+    if (c->target == 0) return 0;
+    c->delay = now > queued ? now - queued : 0;
+    
+    /* The last element out never counts: the queue is draining */
+    int above = 0;
+    if (c->delay < c->target || backlog == 0) {
+        c->first_above = 0;
+    } else if (c->first_above == 0) {
+        c->first_above = now + c->interval;
+    } else if (now >= c->first_above) {
+        above = 1;
+    }
+    
+    if (c->dropping) {
+        if (!above) {
+            c->dropping = 0;
+            return 0;
+        }
+        if (now < c->drop_next) return 0;
+        c->count++;
+        c->drop_next = codel_control_law(c, c->drop_next);
+    } else {
+        if (!above) return 0;
+        c->dropping = 1;
+        /* Overloaded again soon after: pick up near the last rate */
+        unsigned int delta = c->count - c->last_count;
+        c->count = delta > 1 && (int64_t)(now - c->drop_next) < (int64_t)(16 * c->interval)
+                   ? delta : 1;
+        c->last_count = c->count;
+        c->drop_next = codel_control_law(c, now);
+    }
+    
+    c->shed++;
+    return codel_retry_after_ms(c);
+}
+
+long codel_retry_after_ms(const Codel *c) {
+    uint64_t hint = c->delay > c->interval ? c->delay : c->interval;
+    long ms = (long)(hint / 1000000);
+    return ms > 0 ? ms : 1;
+}
 
 /* ===== CLIENT QUEUE ===== */
 
 ClientQueue* client_queue_create(int capacity) {
-    ClientQueue *queue = malloc(sizeof(ClientQueue));
+    ClientQueue *queue = aligned_alloc(CACHE_LINE_SIZE, sizeof(ClientQueue));
     if (!queue) return NULL;
-    
-    queue->connections = malloc(sizeof(ClientConnection) * capacity);
-    if (!queue->connections) {
+
+    if (ring_init(&queue->ring, capacity, sizeof(ClientConnection)) == -1) {
         free(queue);
         return NULL;
     }
-    
-    queue->front = 0;
-    queue->rear = 0;
-    queue->count = 0;
-    queue->capacity = capacity;
-    queue->shutdown = 0;
-    
-    pthread_mutex_init(&queue->mutex, NULL);
-    pthread_cond_init(&queue->not_empty, NULL);
-    pthread_cond_init(&queue->not_full, NULL);
-    
+    pthread_mutex_init(&queue->codel_mutex, NULL);
+    codel_init(&queue->codel, CLIENT_QUEUE_TARGET_MS, CLIENT_QUEUE_INTERVAL_MS);
+
     return queue;
 }
 
 void client_queue_destroy(ClientQueue *queue) {
     if (!queue) return;
-    
-    free(queue->connections);
-    pthread_mutex_destroy(&queue->mutex);
-    pthread_cond_destroy(&queue->not_empty);
-    pthread_cond_destroy(&queue->not_full);
+
+    pthread_mutex_destroy(&queue->codel_mutex);
+    free(queue->ring.slots);
     free(queue);
 }
 
-/* Producer: push client connection (blocks if full) */
+/* Producer: push client connection. The accept loop must never stall
+ * behind busy client threads, so a full queue is a rejection. */
 int client_queue_push(ClientQueue *queue, ClientConnection conn) {
-    pthread_mutex_lock(&queue->mutex);
-    
-    /* Wait while queue is full and not shutting down */
-    while (queue->count >= queue->capacity && !queue->shutdown) {
-        pthread_cond_wait(&queue->not_full, &queue->mutex);
-    }
-    
-    if (queue->shutdown) {
-        pthread_mutex_unlock(&queue->mutex);
-        return -1;
-    }
-    
-    queue->connections[queue->rear] = conn;
-    queue->rear = (queue->rear + 1) % queue->capacity;
-    queue->count++;
-    
-    pthread_cond_signal(&queue->not_empty);
-    pthread_mutex_unlock(&queue->mutex);
-    
-    return 0;
+    conn.queued_ns = queue_clock_ns();
+    return ring_offer(&queue->ring, &conn);
 }
 
 /* Consumer: pop client connection (blocks if empty) */
 int client_queue_pop(ClientQueue *queue, ClientConnection *conn) {
-    pthread_mutex_lock(&queue->mutex);
-    
-    /* Wait while queue is empty and not shutting down */
-    while (queue->count == 0 && !queue->shutdown) {
-        pthread_cond_wait(&queue->not_empty, &queue->mutex);
-    }
-    
-    if (queue->shutdown && queue->count == 0) {
-        pthread_mutex_unlock(&queue->mutex);
-        return -1;
-    }
-    
-    *conn = queue->connections[queue->front];
-    queue->front = (queue->front + 1) % queue->capacity;
-    queue->count--;
-    
-    pthread_cond_signal(&queue->not_full);
-    pthread_mutex_unlock(&queue->mutex);
-    
-    return 0;
+    return ring_pop(&queue->ring, conn);
+}
+
+long client_queue_shed(ClientQueue *queue, const ClientConnection *conn) {
+    uint64_t now = queue_clock_ns();
+    pthread_mutex_lock(&queue->codel_mutex);
+    long retry_ms = codel_shed(&queue->codel, now, conn->queued_ns,
+                               ring_count(&queue->ring));
+    pthread_mutex_unlock(&queue->codel_mutex);
+    return retry_ms;
+}
+
+long client_queue_retry_after_ms(ClientQueue *queue) {
+    pthread_mutex_lock(&queue->codel_mutex);
+    long retry_ms = codel_retry_after_ms(&queue->codel);
+    pthread_mutex_unlock(&queue->codel_mutex);
+    return retry_ms;
 }
 
 void client_queue_shutdown(ClientQueue *queue) {
-    pthread_mutex_lock(&queue->mutex);
-    queue->shutdown = 1;
-    pthread_cond_broadcast(&queue->not_empty);
-    pthread_cond_broadcast(&queue->not_full);
-    pthread_mutex_unlock(&queue->mutex);
+    ring_shutdown(&queue->ring);
 }
 
 /* ===== TASK QUEUE ===== */
 
 TaskQueue* task_queue_create(int capacity) {
-    TaskQueue *queue = malloc(sizeof(TaskQueue));
+    TaskQueue *queue = aligned_alloc(CACHE_LINE_SIZE, sizeof(TaskQueue));
     if (!queue) return NULL;
-    
-    queue->tasks = malloc(sizeof(Task*) * capacity);
-    if (!queue->tasks) {
+
+    if (ring_init(&queue->ring, capacity, sizeof(Task*)) == -1) {
         free(queue);
         return NULL;
     }
-    
-    queue->front = 0;
-    queue->rear = 0;
-    queue->count = 0;
-    queue->capacity = capacity;
-    queue->shutdown = 0;
-    
-    pthread_mutex_init(&queue->mutex, NULL);
-    pthread_cond_init(&queue->not_empty, NULL);
-    pthread_cond_init(&queue->not_full, NULL);
-    
+
     return queue;
 }
 
 void task_queue_destroy(TaskQueue *queue) {
     if (!queue) return;
-    
-    free(queue->tasks);
-    pthread_mutex_destroy(&queue->mutex);
-    pthread_cond_destroy(&queue->not_empty);
-    pthread_cond_destroy(&queue->not_full);
+
+    free(queue->ring.slots);
     free(queue);
 }
 
 /* Producer: push task pointer (blocks if full) */
 int task_queue_push(TaskQueue *queue, Task *task) {
-    pthread_mutex_lock(&queue->mutex);
-    
-    while (queue->count >= queue->capacity && !queue->shutdown) {
-        pthread_cond_wait(&queue->not_full, &queue->mutex);
-    }
-    
-    if (queue->shutdown) {
-        pthread_mutex_unlock(&queue->mutex);
-        return -1;
-    }
-    
-    queue->tasks[queue->rear] = task;
-    queue->rear = (queue->rear + 1) % queue->capacity;
-    queue->count++;
-    
-    pthread_cond_signal(&queue->not_empty);
-    pthread_mutex_unlock(&queue->mutex);
-    
-    return 0;
+    return ring_push(&queue->ring, &task);
+}
+
+/* Producer: push task pointer if there is room */
+int task_queue_try_push(TaskQueue *queue, Task *task) {
+    return ring_offer(&queue->ring, &task);
 }
 
 /* Consumer: pop task pointer (blocks if empty) */
 Task* task_queue_pop(TaskQueue *queue) {
-    pthread_mutex_lock(&queue->mutex);
-    
-    while (queue->count == 0 && !queue->shutdown) {
-        pthread_cond_wait(&queue->not_empty, &queue->mutex);
-    }
-    
-    if (queue->shutdown && queue->count == 0) {
-        pthread_mutex_unlock(&queue->mutex);
-        return NULL;
-    }
-    
-    Task *task = queue->tasks[queue->front];
-    queue->front = (queue->front + 1) % queue->capacity;
-    queue->count--;
-    
-    pthread_cond_signal(&queue->not_full);
-    pthread_mutex_unlock(&queue->mutex);
-    
+    Task *task;
+    if (ring_pop(&queue->ring, &task) == -1) return NULL;
+    return task;
+}
+
+/* Consumer: pop task pointer if one is ready */
+Task* task_queue_try_pop(TaskQueue *queue) {
+    Task *task;
+    if (!ring_try_pop(&queue->ring, &task)) return NULL;
+    parking_wake(&queue->ring.not_full);
     return task;
 }
 
 void task_queue_shutdown(TaskQueue *queue) {
-    pthread_mutex_lock(&queue->mutex);
-    queue->shutdown = 1;
-    pthread_cond_broadcast(&queue->not_empty);
-    pthread_cond_broadcast(&queue->not_full);
-    pthread_mutex_unlock(&queue->mutex);
-}
\ No newline at end of file
+    ring_shutdown(&queue->ring);
+}
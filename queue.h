@@ -2,59 +2,133 @@
 #define QUEUE_H
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <netinet/in.h>
 
+#define CACHE_LINE_SIZE 64
+#define CLIENT_QUEUE_TARGET_MS 50       // Wait for a client thread before shedding starts
+#define CLIENT_QUEUE_INTERVAL_MS 200    // ... if it lasts this long
+
 /* Client connection structure pushed to client queue */
 typedef struct {
     int client_socket;
     struct sockaddr_in addr;
+    uint64_t queued_ns;         // Set by client_queue_push (queue delay)
 } ClientConnection;
 
 /* Task structure for worker threads */
-typedef struct {
+typedef struct Task {
     int client_id;              // Unique client thread ID
     int user_id;                // Authenticated user ID
-    char command[16];           // UPLOAD, DOWNLOAD, DELETE, LIST
-    char filename[256];         // Target filename
+    char command[16];           // UPLOAD, UPLOAD-RESUME, UPLOAD-INIT, UPLOAD-CHUNK,
+                                // UPLOAD-COMMIT, UPLOAD-ABORT, DOWNLOAD, DELETE
+    char filename[256];         // Target filename (chunked uploads: upload ID)
     int result_ready;           // Flag: 0=pending, 1=done
     int result_code;            // 0=success, -1=error
     char result_message[512];   // Error/success message
+    long file_size;             // DOWNLOAD: bytes asked for (-1 = to the end),
+                                // then bytes announced in "SIZE:";
+                                // UPLOAD-RESUME: bytes already received;
+                                // UPLOAD-INIT: declared size (-1 = missing);
+                                // UPLOAD-CHUNK: bytes of the chunk
+    long offset;                // DOWNLOAD: first byte sent; UPLOAD-CHUNK: chunk
+                                // index, then its first byte (-1 = bad arguments)
+    uint32_t checksum;          // UPLOAD: CRC32 of the data received (0 = not known)
+    uint32_t request_id;        // Protocol v2: echoed in the reply with opcode
+    uint16_t opcode;
+    uint64_t queued_ns;         // When it was queued for a worker (queue delay)
+    void (*execute)(struct Task *task);     // Set: run by the worker instead of command
     pthread_mutex_t result_mutex;
     pthread_cond_t result_cond;
+    void (*on_complete)(struct Task *task); // Set: called instead of signalling result_cond
+    void *context;              // Owner data for on_complete
+    struct Task *next;          // Link for the owner's completion list
 } Task;
 
-/* Thread-safe client queue (circular buffer) */
+/* Queue-delay based load shedding (CoDel). Once the time elements
+ * spend queued has stayed above target for a whole interval, dequeued
+ * elements are shed, more often the longer the delay persists
+ * (interval / sqrt(drops) apart), until it falls below target again or
+ * the queue empties. A queue that is merely busy keeps its short
+ * bursts; one that has a standing backlog sheds it instead of making
+ * everyone behind it wait. Not thread-safe: callers serialize. */
+typedef struct {
+    uint64_t target;            // ns, 0 = never shed
+    uint64_t interval;          // ns
+    uint64_t delay;             // Queue delay of the last element dequeued
+    uint64_t first_above;       // When being above target starts to count
+    uint64_t drop_next;         // Next shed while dropping
+    int dropping;
+    unsigned int count;         // Sheds in this dropping state
+    unsigned int last_count;
+    long shed;                  // Elements shed in total
+} Codel;
+
+/* Futex parking spot, only used while a ring is empty or full */
+typedef struct {
+    atomic_uint seq;            // Futex word, bumped on every wakeup
+    atomic_ullong state;        // Waiters (high 32 bits), wakeups in flight (low 32)
+} ParkingLot;
+
+/* Bounded lock-free multi-producer/multi-consumer ring. Every slot
+ * carries a sequence number that tells producers and consumers whose
+ * turn it is, so push/pop are a CAS on head or tail plus a copy.
+ * head and tail live on separate cache lines. */
 typedef struct {
-    ClientConnection *connections;
-    int front, rear, count, capacity;
-    pthread_mutex_t mutex;
-    pthread_cond_t not_empty;
-    pthread_cond_t not_full;
-    int shutdown;               // Signal for shutdown
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;   // Next position to pop
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;   // Next position to push
+    _Alignas(CACHE_LINE_SIZE) ParkingLot not_empty; // Consumers wait here
+    _Alignas(CACHE_LINE_SIZE) ParkingLot not_full;  // Producers wait here
+    _Alignas(CACHE_LINE_SIZE) unsigned char *slots; // Read-only after create
+    size_t slot_size;
+    size_t elem_size;
+    size_t capacity;
+    atomic_int shutdown;
+} Ring;
+
+/* Thread-safe client queue */
+typedef struct {
+    Ring ring;                  // Holds ClientConnection values
+    pthread_mutex_t codel_mutex;
+    Codel codel;                // Wait of popped connections (codel_mutex)
 } ClientQueue;
 
-/* Thread-safe task queue (circular buffer) */
+/* Thread-safe task queue */
 typedef struct {
-    Task **tasks;               // Array of pointers to tasks
-    int front, rear, count, capacity;
-    pthread_mutex_t mutex;
-    pthread_cond_t not_empty;
-    pthread_cond_t not_full;
-    int shutdown;
+    Ring ring;                  // Holds Task pointers
 } TaskQueue;
 
+/* Queue delay shedding */
+uint64_t queue_clock_ns(void);  // Monotonic clock
+void codel_init(Codel *c, long target_ms, long interval_ms);
+
+/* An element queued at queued is dequeued at now with backlog elements
+ * left behind it: 0 to serve it, else shed it and pass this retry-after
+ * hint (ms) on to its client */
+long codel_shed(Codel *c, uint64_t now, uint64_t queued, size_t backlog);
+
+/* When a client turned away should try again: the queue delay, at
+ * least one interval (ms) */
+long codel_retry_after_ms(const Codel *c);
+
 /* Client queue operations */
 ClientQueue* client_queue_create(int capacity);
 void client_queue_destroy(ClientQueue *queue);
-int client_queue_push(ClientQueue *queue, ClientConnection conn);
+int client_queue_push(ClientQueue *queue, ClientConnection conn);  // -1 if full, never blocks
 int client_queue_pop(ClientQueue *queue, ClientConnection *conn);
+long client_queue_shed(ClientQueue *queue, const ClientConnection *conn);  // codel_shed()
+long client_queue_retry_after_ms(ClientQueue *queue);
 void client_queue_shutdown(ClientQueue *queue);
 
 /* Task queue operations */
 TaskQueue* task_queue_create(int capacity);
 void task_queue_destroy(TaskQueue *queue);
 int task_queue_push(TaskQueue *queue, Task *task);
+int task_queue_try_push(TaskQueue *queue, Task *task);  // -1 if full, never blocks
 Task* task_queue_pop(TaskQueue *queue);
+Task* task_queue_try_pop(TaskQueue *queue);  // NULL if empty, never blocks
 void task_queue_shutdown(TaskQueue *queue);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1502 @@
+#include "reactor.h"
+#include "multiplex.h"
+#include "session.h"
+#include "transfer.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define REACTOR_MAX_EVENTS 256
+#define CONN_BUFFER_SIZE 4096
+#define CONN_PUMP_STEPS 16
+
+/* Per-connection protocol state */
+typedef enum {
+    CONN_AUTH,                  // Waiting for REGISTER/LOGIN
+    CONN_COMMAND,               // Waiting for a command line
+    CONN_TASK,                  // Task is with the worker pool
+    CONN_UPLOAD_SIZE,           // Waiting for "SIZE <bytes>"
+    CONN_UPLOAD_DATA,           // Receiving file data
+    CONN_DOWNLOAD,              // Streaming file data
+    CONN_LIST,                  // Streaming a LIST reply
+    CONN_FRAMES,                // Protocol 2: many requests at once
+    CONN_CLOSING                // Flushing output, then close
+} ConnState;
+
+/* A protocol 2 LIST or DOWNLOAD reply being sent */
+typedef struct ConnStream {
+    uint32_t request_id;
+    uint16_t opcode;
+    ListCursor list;
+    FileTransfer transfer;
+    struct ConnStream *next;
+} ConnStream;
+
+struct Connection {
+    int fd;
+    ConnState state;
+    int user_id;
+    Reactor *reactor;
+    Task *task;                 // Current command (owned while not CONN_TASK)
+    char in[CONN_BUFFER_SIZE];  // Bytes received but not yet consumed
+    size_t in_len;
+    char *out;                  // Bytes queued for a writable socket
+    size_t out_len, out_off, out_cap;
+    FileTransfer transfer;      // Zero-copy file stream (upload/download)
+    long file_size;
+    ListCursor list;            // LIST reply in progress
+    char *auth_line;            // REGISTER line while a worker runs it
+    /* CONN_FRAMES */
+    int tasks;                  // Requests with the worker pool
+    int stalled;                // Input waits for a request to come back
+    int quitting;               // QUIT read: answered once the rest are
+    uint32_t quit_id;
+    uint32_t frame_left;        // DATA payload bytes not read yet...
+    MultiplexUpload *frame_upload;  // ... and their upload (NULL = dropped)
+    MultiplexUpload *uploads;   // Being checked, receiving or stored
+    ConnStream *streams;        // Replies being sent, a frame each in turn
+    char *frame;                // DATA payload buffer
+    unsigned int events;        // Current epoll interest mask
+    int closed;                 // Socket closed; memory freed once safe
+    int processing;             // Inside conn_process_input()
+    uint64_t queued_ns;         // When the accept loop handed it over
+    Connection *prev, *next;
+};
+
+/* Forward declarations */
+static void* reactor_thread_func(void *arg);
+static void conn_process_input(Connection *conn);
+static void conn_on_task_done(Connection *conn, Task *task);
+static void conn_frames_close(Connection *conn);
+static void reactor_task_done(Task *task);
+
+static void reactor_wake(Reactor *r) {
+    uint64_t one = 1;
+    ssize_t ret = write(r->event_fd, &one, sizeof(one));
+    (void)ret; // Counter saturation still leaves the fd readable
+}
+
+/* ===== REACTOR POOL ===== */
+
+ReactorPool* reactor_pool_create(int num_threads, WorkerThreadPool *wp, UserManager *um) {
+    ReactorPool *pool = malloc(sizeof(ReactorPool));
+    if (!pool) return NULL;
+
+    pool->reactors = calloc(num_threads, sizeof(Reactor));
+    if (!pool->reactors) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->num_threads = num_threads;
+    pool->next = 0;
+    pthread_mutex_init(&pool->next_mutex, NULL);
+
+    for (int i = 0; i < num_threads; i++) {
+        Reactor *r = &pool->reactors[i];
+        r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        r->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (r->epoll_fd < 0 || r->event_fd < 0) {
+            perror("reactor");
+            if (r->epoll_fd >= 0) close(r->epoll_fd);
+            if (r->event_fd >= 0) close(r->event_fd);
+            /* Undo the reactors set up so far; no loop has started yet */
+            while (--i >= 0) {
+                close(pool->reactors[i].epoll_fd);
+                close(pool->reactors[i].event_fd);
+                pthread_mutex_destroy(&pool->reactors[i].inbox_mutex);
+            }
+            pthread_mutex_destroy(&pool->next_mutex);
+            free(pool->reactors);
+            free(pool);
+            return NULL;
+        }
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL; // NULL marks the wakeup fd
+        epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->event_fd, &ev);
+
+        pthread_mutex_init(&r->inbox_mutex, NULL);
+        codel_init(&r->codel, CLIENT_QUEUE_TARGET_MS, CLIENT_QUEUE_INTERVAL_MS);
+        r->worker_pool = wp;
+        r->user_mgr = um;
+    }
+
+    /* Start loops only once every reactor is fully initialized */
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&pool->reactors[i].thread, NULL, reactor_thread_func,
+                       &pool->reactors[i]);
+    }
+
+    return pool;
+}
+
+/* Hand an accepted socket to the next reactor (round robin) */
+int reactor_pool_add(ReactorPool *pool, ClientConnection client) {
+    Connection *conn = calloc(1, sizeof(Connection));
+    if (!conn) return -1;
+
+    conn->fd = client.client_socket;
+    conn->state = CONN_AUTH;
+    conn->user_id = -1;
+    conn->queued_ns = queue_clock_ns();
+    transfer_init(&conn->transfer);
+
+    pthread_mutex_lock(&pool->next_mutex);
+    Reactor *r = &pool->reactors[pool->next];
+    pool->next = (pool->next + 1) % pool->num_threads;
+    pthread_mutex_unlock(&pool->next_mutex);
+
+    conn->reactor = r;
+
+    pthread_mutex_lock(&r->inbox_mutex);
+    if (r->shutdown) {
+        pthread_mutex_unlock(&r->inbox_mutex);
+        free(conn);
+        return -1;
+    }
+    conn->next = r->incoming;
+    r->incoming = conn;
+    pthread_mutex_unlock(&r->inbox_mutex);
+
+    reactor_wake(r);
+    return 0;
+}
+
+void reactor_pool_shutdown(ReactorPool *pool) {
+    if (!pool) return;
+    for (int i = 0; i < pool->num_threads; i++) {
+        Reactor *r = &pool->reactors[i];
+        pthread_mutex_lock(&r->inbox_mutex);
+        r->shutdown = 1;
+        pthread_mutex_unlock(&r->inbox_mutex);
+        reactor_wake(r);
+    }
+}
+
+void reactor_pool_destroy(ReactorPool *pool) {
+    if (!pool) return;
+
+    /* Wait for all loops to drain their connections */
+    long shed = 0;
+    for (int i = 0; i < pool->num_threads; i++) {
+        Reactor *r = &pool->reactors[i];
+        pthread_join(r->thread, NULL);
+        close(r->epoll_fd);
+        close(r->event_fd);
+        pthread_mutex_destroy(&r->inbox_mutex);
+        shed += r->codel.shed;
+    }
+    printf("[Reactor] Admission: %ld connections turned away after waiting for a loop\n",
+           shed);
+
+    pthread_mutex_destroy(&pool->next_mutex);
+    free(pool->reactors);
+    free(pool);
+}
+
+/* ===== CONNECTION I/O ===== */
+
+static void conn_update_events(Connection *conn) {
+    if (conn->closed) return;
+
+    unsigned int want = 0;
+    if (conn->state == CONN_AUTH || conn->state == CONN_COMMAND ||
+        conn->state == CONN_UPLOAD_SIZE || conn->state == CONN_UPLOAD_DATA) {
+        want |= EPOLLIN;
+    }
+    if (conn->state == CONN_FRAMES && !conn->stalled && !conn->quitting &&
+        conn->in_len < sizeof(conn->in)) {
+        want |= EPOLLIN;
+    }
+    if (conn->out_len > conn->out_off || conn->state == CONN_DOWNLOAD ||
+        conn->state == CONN_LIST || conn->state == CONN_CLOSING ||
+        (conn->state == CONN_FRAMES && conn->streams)) {
+        want |= EPOLLOUT;
+    }
+
+    if (want != conn->events) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = want;
+        ev.data.ptr = conn;
+        epoll_ctl(conn->reactor->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->events = want;
+    }
+}
+
+/* In CONN_UPLOAD_DATA: one chunk of a chunked upload, not a whole file */
+static int conn_receiving_chunk(Connection *conn) {
+    return strcmp(conn->task->command, "UPLOAD-CHUNK") == 0;
+}
+
+static void conn_close(Connection *conn) {
+    if (conn->closed) return;
+    Reactor *r = conn->reactor;
+
+    /* A worker storing an upload still holds the partial's lock through
+     * the transfer: conn_free closes it once the task is back */
+    if (conn->state != CONN_TASK) transfer_close(&conn->transfer);
+    if (conn->state == CONN_UPLOAD_DATA && conn_receiving_chunk(conn)) {
+        char reply[256];
+        session_chunked_done(conn->task->filename, conn->task->offset, 0, 0,
+                             reply, sizeof(reply));
+        printf("[Reactor] Chunk of upload %s incomplete\n", conn->task->filename);
+    } else if (conn->state == CONN_UPLOAD_DATA) {
+        /* The partial file stays for UPLOAD-RESUME */
+        session_upload_abort(r->user_mgr, conn->user_id, conn->file_size);
+        printf("[Reactor] Upload incomplete, partial kept\n");
+    } else if (conn->state == CONN_FRAMES) {
+        conn_frames_close(conn);
+    }
+
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->closed = 1;
+    printf("[Reactor] Closed connection %d\n", conn->fd);
+
+    /* Unlink from the live list */
+    if (conn->prev) conn->prev->next = conn->next;
+    else r->connections = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    conn->prev = conn->next = NULL;
+    r->connection_count--;
+
+    /* A task still with the workers keeps the connection alive */
+    if (conn->state != CONN_TASK) {
+        session_destroy_task(conn->task);
+        conn->task = NULL;
+    }
+}
+
+/* Nothing of the connection is with the workers */
+static int conn_idle(Connection *conn) {
+    return conn->state != CONN_TASK && conn->tasks == 0;
+}
+
+static void conn_free(Connection *conn) {
+    transfer_close(&conn->transfer);
+    session_destroy_task(conn->task);
+    free(conn->auth_line);
+    while (conn->uploads) {
+        MultiplexUpload *u = conn->uploads;
+        conn->uploads = u->next;
+        multiplex_upload_free(u);
+    }
+    free(conn->frame);
+    free(conn->out);
+    free(conn);
+}
+
+/* Write what the socket accepts, queue the rest */
+static void conn_send(Connection *conn, const char *data, size_t len) {
+    if (conn->closed) return;
+
+    if (conn->out_len == conn->out_off) {
+        conn->out_len = conn->out_off = 0;
+        ssize_t n = send(conn->fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn_close(conn);
+                return;
+            }
+            n = 0;
+        }
+        data += n;
+        len -= n;
+        if (len == 0) return;
+    }
+
+    if (conn->out_len + len > conn->out_cap) {
+        size_t cap = conn->out_cap ? conn->out_cap : CONN_BUFFER_SIZE;
+        while (cap < conn->out_len + len) cap *= 2;
+        char *out = realloc(conn->out, cap);
+        if (!out) {
+            conn_close(conn);
+            return;
+        }
+        conn->out = out;
+        conn->out_cap = cap;
+    }
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+}
+
+/* Returns 1 once the output queue is empty */
+static int conn_flush(Connection *conn) {
+    while (conn->out_off < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out + conn->out_off,
+                         conn->out_len - conn->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            conn_close(conn);
+            return 0;
+        }
+        conn->out_off += n;
+    }
+    conn->out_len = conn->out_off = 0;
+    return 1;
+}
+
+/* Current command is done; go back to reading commands */
+static void conn_finish_command(Connection *conn) {
+    session_destroy_task(conn->task);
+    conn->task = NULL;
+    conn->state = CONN_COMMAND;
+}
+
+/* ===== PROTOCOL PHASES ===== */
+
+/* Called on a worker thread: the reply waits for the account's journal
+ * record to be synced */
+static void reactor_register(Task *task) {
+    Connection *conn = task->context;
+    session_auth(conn->reactor->user_mgr, conn->auth_line,
+                 task->result_message, sizeof(task->result_message));
+}
+
+static void conn_register(Connection *conn, const char *line) {
+    Reactor *r = conn->reactor;
+    Task *task = session_create_job(reactor_register, conn);
+    conn->auth_line = strdup(line);
+    if (task && conn->auth_line) {
+        task->on_complete = reactor_task_done;
+        conn->task = task;
+        conn->state = CONN_TASK;
+        r->outstanding++;
+        if (worker_pool_submit(r->worker_pool, task) == 0) return;
+        r->outstanding--;
+        conn->task = NULL;
+        conn->state = CONN_AUTH;
+    }
+    session_destroy_task(task);
+    free(conn->auth_line);
+    conn->auth_line = NULL;
+
+    const char *err = "ERROR: Server overloaded\n";
+    conn_send(conn, err, strlen(err));
+}
+
+/* Registered, refused or shed: either way the client logs in next */
+static void conn_registered(Connection *conn, Task *task) {
+    conn_send(conn, task->result_message, strlen(task->result_message));
+    free(conn->auth_line);
+    conn->auth_line = NULL;
+    session_destroy_task(task);
+    conn->task = NULL;
+    conn->state = CONN_AUTH;
+}
+
+/* Called on a worker thread */
+static void reactor_load_files(Task *task) {
+    Connection *conn = task->context;
+    user_file_index(conn->reactor->user_mgr, task->user_id);
+}
+
+/* The first user_file_index() of a user scans their directory: a worker
+ * builds it before the first command, so LIST and the lookups answered
+ * inline never do that on the loop. The login reply waits for it. */
+static void conn_load_files(Connection *conn, const char *reply) {
+    Reactor *r = conn->reactor;
+    Task *task = session_create_job(reactor_load_files, conn);
+    if (task) {
+        task->user_id = conn->user_id;
+        task->on_complete = reactor_task_done;
+        snprintf(task->result_message, sizeof(task->result_message), "%s", reply);
+        conn->task = task;
+        conn->state = CONN_TASK;
+        r->outstanding++;
+        if (worker_pool_submit(r->worker_pool, task) == 0) return;
+        r->outstanding--;
+        session_destroy_task(task);
+        conn->task = NULL;
+    }
+
+    const char *err = "ERROR: Server overloaded\n";
+    conn_send(conn, err, strlen(err));
+    conn->user_id = -1;
+    conn->state = CONN_AUTH;
+}
+
+/* Index built (or the job shed): finish the login it held back */
+static void conn_files_loaded(Connection *conn, Task *task) {
+    conn_send(conn, task->result_message, strlen(task->result_message));
+    if (task->result_code == 0) {
+        conn->state = CONN_COMMAND;
+    } else {
+        conn->user_id = -1; // Shed: the client logs in again later
+        conn->state = CONN_AUTH;
+    }
+    session_destroy_task(task);
+    conn->task = NULL;
+}
+
+static void conn_submit_task(Connection *conn, const char *line) {
+    Reactor *r = conn->reactor;
+
+    Task *task = session_create_task(line, conn->fd, conn->user_id);
+    if (!task) return;
+
+    task->on_complete = reactor_task_done;
+    task->context = conn;
+    conn->task = task;
+
+    /* Lookups are answered without leaving the loop */
+    if (worker_pool_run_inline(r->worker_pool, task)) {
+        conn_on_task_done(conn, task);
+        return;
+    }
+
+    conn->state = CONN_TASK;
+    r->outstanding++;
+
+    if (worker_pool_submit(r->worker_pool, task) == -1) {
+        r->outstanding--;
+        const char *err = "ERROR: Server overloaded\n";
+        conn_send(conn, err, strlen(err));
+        conn_finish_command(conn);
+    }
+}
+
+static void conn_begin_upload(Connection *conn, const char *line) {
+    UserManager *mgr = conn->reactor->user_mgr;
+    Task *task = conn->task;
+    char reply[256];
+    long file_size;
+
+    if (session_upload_begin(mgr, conn->user_id, line, task->file_size,
+                             &file_size, reply, sizeof(reply)) == -1 ||
+        session_upload_open(mgr, conn->user_id, task->filename, task->file_size,
+                            file_size, &conn->transfer,
+                            reply, sizeof(reply)) == -1) {
+        conn_send(conn, reply, strlen(reply));
+        conn_finish_command(conn);
+        return;
+    }
+
+    conn_send(conn, reply, strlen(reply));
+    conn->file_size = file_size;
+    conn->state = CONN_UPLOAD_DATA;
+}
+
+/* Runs on a worker: splitting into the chunk store reads the whole file */
+static void reactor_store_upload(Task *task) {
+    Connection *conn = task->context;
+    session_upload_finish(conn->reactor->user_mgr, task->user_id, task->filename,
+                          task->file_size, task->checksum,
+                          task->result_message, sizeof(task->result_message));
+    if (task->checksum == 0) {
+        worker_pool_checksum(conn->reactor->worker_pool, task->user_id, task->filename);
+    }
+}
+
+static void conn_end_upload(Connection *conn) {
+    Reactor *r = conn->reactor;
+    char reply[256];
+
+    if (conn_receiving_chunk(conn)) {
+        transfer_close(&conn->transfer);
+        session_chunked_done(conn->task->filename, conn->task->offset, 1,
+                             transfer_checksum(&conn->transfer), reply, sizeof(reply));
+        conn_send(conn, reply, strlen(reply));
+        conn_finish_command(conn);
+        return;
+    }
+
+    /* Keep the lock until the file has left partial/: the transfer is
+     * closed only after session_upload_finish, here or once the worker
+     * hands the task back */
+    if (r->user_mgr->chunks) {
+        Task *task = conn->task;
+        task->execute = reactor_store_upload;
+        task->file_size = conn->file_size;
+        task->checksum = transfer_checksum(&conn->transfer);
+        conn->state = CONN_TASK;
+        r->outstanding++;
+        if (worker_pool_submit(r->worker_pool, task) == 0) return;
+
+        /* Pool is shutting down: store it here instead */
+        r->outstanding--;
+        task->execute = NULL;
+        conn->state = CONN_UPLOAD_DATA;
+    }
+
+    session_upload_finish(conn->reactor->user_mgr, conn->user_id,
+                          conn->task->filename, conn->file_size,
+                          transfer_checksum(&conn->transfer), reply, sizeof(reply));
+    if (transfer_checksum(&conn->transfer) == 0) {
+        worker_pool_checksum(r->worker_pool, conn->user_id, conn->task->filename);
+    }
+    transfer_close(&conn->transfer);
+    conn_send(conn, reply, strlen(reply));
+    conn_finish_command(conn);
+}
+
+/* Store upload bytes that arrived together with earlier input */
+static void conn_consume_upload(Connection *conn) {
+    long want = conn->transfer.remaining;
+    size_t take = conn->in_len < (size_t)want ? conn->in_len : (size_t)want;
+
+    if (transfer_write(&conn->transfer, conn->in, take) == -1) {
+        const char *err = "ERROR: Cannot write file\n";
+        conn_send(conn, err, strlen(err));
+        conn_close(conn); // Still CONN_UPLOAD_DATA: drops the reservation
+        return;
+    }
+
+    memmove(conn->in, conn->in + take, conn->in_len - take);
+    conn->in_len -= take;
+
+    if (conn->transfer.remaining == 0) {
+        conn_end_upload(conn);
+    }
+}
+
+/* Splice upload data straight from the socket into the file */
+static void conn_receive_upload(Connection *conn) {
+    long n = transfer_recv(&conn->transfer, conn->fd);
+    if (n < 0) {
+        printf("[Reactor] Client disconnected during upload (socket %d)\n", conn->fd);
+        conn_close(conn);
+        return;
+    }
+    if (conn->transfer.remaining == 0) {
+        conn_end_upload(conn);
+        conn_process_input(conn);
+    }
+}
+
+/* Produce LIST batches while the socket keeps up with them */
+static void conn_pump_list(Connection *conn) {
+    char chunk[SESSION_LIST_CHUNK];
+
+    for (int i = 0; i < CONN_PUMP_STEPS && !conn->closed &&
+         conn->out_len == conn->out_off; i++) {
+        if (conn->list.done) {
+            conn->state = CONN_COMMAND;
+            conn_process_input(conn);
+            return;
+        }
+
+        size_t len = session_list_next(conn->reactor->user_mgr, conn->user_id,
+                                       &conn->list, chunk, sizeof(chunk));
+        conn_send(conn, chunk, len);
+    }
+}
+
+static void conn_begin_list(Connection *conn, const char *line) {
+    char header[512];
+
+    /* Not built at login: building it here would scan on the loop */
+    if (!user_files_ready(conn->reactor->user_mgr, conn->user_id)) {
+        const char *err = "ERROR: Cannot read file list\n";
+        conn_send(conn, err, strlen(err));
+        return;
+    }
+
+    int status = session_list_begin(conn->reactor->user_mgr, conn->user_id, line,
+                                    &conn->list, header, sizeof(header));
+    conn_send(conn, header, strlen(header));
+    if (status == -1) return;
+
+    conn->state = CONN_LIST;
+    conn_pump_list(conn);
+}
+
+/* ===== PROTOCOL 2 ===== */
+
+static void conn_send_frame(Connection *conn, uint32_t request_id, uint16_t opcode,
+                            uint16_t flags, const char *payload, size_t len) {
+    unsigned char header[MULTIPLEX_HEADER_SIZE];
+    multiplex_pack_header(header, (uint32_t)len, request_id, opcode, flags);
+    conn_send(conn, (const char*)header, sizeof(header));
+    conn_send(conn, payload, len);
+}
+
+static void conn_reply_frame(Connection *conn, uint32_t request_id, uint16_t opcode,
+                             uint16_t flags, const char *text) {
+    conn_send_frame(conn, request_id, opcode, flags, text, strlen(text));
+}
+
+static uint16_t reply_flags(const char *text) {
+    return strncmp(text, "ERROR", 5) == 0 ? MULTIPLEX_FLAG_ERROR : 0;
+}
+
+static void conn_add_stream(Connection *conn, ConnStream *stream) {
+    ConnStream **link = &conn->streams;
+    while (*link) link = &(*link)->next;
+    stream->next = NULL;
+    *link = stream;
+}
+
+static MultiplexUpload* conn_find_upload(Connection *conn, uint32_t request_id) {
+    MultiplexUpload *u = conn->uploads;
+    while (u && u->request_id != request_id) u = u->next;
+    return u;
+}
+
+static void conn_remove_upload(Connection *conn, MultiplexUpload *u) {
+    MultiplexUpload **link = &conn->uploads;
+    while (*link != u) link = &(*link)->next;
+    *link = u->next;
+    multiplex_upload_free(u);
+}
+
+/* QUIT is answered last: once no request is with the workers or still
+ * sending its reply. Uploads missing bytes by then are given up. */
+static void conn_frames_check_quit(Connection *conn) {
+    if (!conn->quitting || conn->closed || conn->state != CONN_FRAMES ||
+        conn->tasks > 0 || conn->streams) {
+        return;
+    }
+
+    while (conn->uploads) {
+        MultiplexUpload *u = conn->uploads;
+        multiplex_upload_drop(conn->reactor->user_mgr, u);
+        conn_reply_frame(conn, u->request_id, u->task->opcode, MULTIPLEX_FLAG_ERROR,
+                         "ERROR: Upload incomplete\n");
+        conn_remove_upload(conn, u);
+    }
+    conn_reply_frame(conn, conn->quit_id, MULTIPLEX_OP_QUIT, 0, "Goodbye!\n");
+    conn->state = CONN_CLOSING;
+}
+
+/* Send LIST batches and DATA frames while the socket keeps up with
+ * them, one frame per reply in turn. Replies are only produced into an
+ * empty output queue, so a client that stops reading holds no more
+ * than a frame of them. */
+static void conn_pump_streams(Connection *conn) {
+    UserManager *mgr = conn->reactor->user_mgr;
+
+    for (int i = 0; i < CONN_PUMP_STEPS && !conn->closed && conn->streams &&
+         conn->out_len == conn->out_off; i++) {
+        ConnStream *stream = conn->streams;
+        conn->streams = stream->next;
+        int done;
+
+        if (stream->opcode == MULTIPLEX_OP_LIST) {
+            char chunk[SESSION_LIST_CHUNK];
+            size_t len = session_list_next(mgr, conn->user_id, &stream->list,
+                                           chunk, sizeof(chunk));
+            done = stream->list.done;
+            conn_send_frame(conn, stream->request_id, MULTIPLEX_OP_LIST,
+                            done ? 0 : MULTIPLEX_FLAG_MORE, chunk, len);
+        } else {
+            long n = transfer_read(&stream->transfer, conn->frame, MULTIPLEX_DATA_FRAME);
+            if (n <= 0) {
+                /* File ended early: the client must not wait for the rest */
+                conn_reply_frame(conn, stream->request_id, MULTIPLEX_OP_DATA,
+                                 MULTIPLEX_FLAG_ERROR, "ERROR: Cannot read file\n");
+                done = 1;
+            } else {
+                done = stream->transfer.remaining == 0;
+                conn_send_frame(conn, stream->request_id, MULTIPLEX_OP_DATA,
+                                done ? 0 : MULTIPLEX_FLAG_MORE, conn->frame, n);
+            }
+        }
+
+        if (done) {
+            transfer_close(&stream->transfer);
+            free(stream);
+        } else {
+            conn_add_stream(conn, stream);
+        }
+    }
+
+    conn_frames_check_quit(conn);
+}
+
+static void conn_frames_list(Connection *conn, uint32_t request_id, const char *line) {
+    char header[512];
+    if (!user_files_ready(conn->reactor->user_mgr, conn->user_id)) {
+        conn_reply_frame(conn, request_id, MULTIPLEX_OP_LIST, MULTIPLEX_FLAG_ERROR,
+                         "ERROR: Cannot read file list\n");
+        return;
+    }
+    ConnStream *stream = calloc(1, sizeof(ConnStream));
+    if (!stream) {
+        conn_reply_frame(conn, request_id, MULTIPLEX_OP_LIST, MULTIPLEX_FLAG_ERROR,
+                         "ERROR: Out of memory\n");
+        return;
+    }
+    transfer_init(&stream->transfer);
+
+    if (session_list_begin(conn->reactor->user_mgr, conn->user_id, line, &stream->list,
+                           header, sizeof(header)) == -1) {
+        conn_reply_frame(conn, request_id, MULTIPLEX_OP_LIST, MULTIPLEX_FLAG_ERROR, header);
+        free(stream);
+        return;
+    }
+    conn_reply_frame(conn, request_id, MULTIPLEX_OP_LIST, MULTIPLEX_FLAG_MORE, header);
+
+    stream->request_id = request_id;
+    stream->opcode = MULTIPLEX_OP_LIST;
+    conn_add_stream(conn, stream);
+}
+
+/* Reply to a finished request other than an upload and free its task */
+static void conn_frames_answer(Connection *conn, Task *task) {
+    /* Opened before SIZE goes out, as for v1; a cache miss is streamed
+     * from disk and filled by a worker */
+    ConnStream *stream = NULL;
+    if (strcmp(task->command, "DOWNLOAD") == 0 && task->result_code == 0 &&
+        task->file_size > 0) {
+        stream = calloc(1, sizeof(ConnStream));
+        int download = -1;
+        if (stream) {
+            transfer_init(&stream->transfer);
+            download = session_open_download(conn->reactor->user_mgr, conn->user_id,
+                                              task->filename, task->offset,
+                                              task->file_size, &stream->transfer, 0);
+        }
+        if (download == -1) {
+            snprintf(task->result_message, sizeof(task->result_message),
+                     "ERROR: Cannot open file\n");
+            task->result_code = -1;
+            free(stream);
+            stream = NULL;
+        } else if (download == 1) {
+            worker_pool_fill_cache(conn->reactor->worker_pool, conn->user_id,
+                                   task->filename);
+        }
+    }
+
+    uint16_t flags = (task->result_code != 0 ? MULTIPLEX_FLAG_ERROR : 0) |
+                     (stream ? MULTIPLEX_FLAG_MORE : 0);
+    conn_reply_frame(conn, task->request_id, task->opcode, flags, task->result_message);
+    if (stream) {
+        stream->request_id = task->request_id;
+        stream->opcode = MULTIPLEX_OP_DOWNLOAD;
+        conn_add_stream(conn, stream);
+    }
+    session_destroy_task(task);
+}
+
+/* Every byte of an upload is in: store it and answer its request */
+static void conn_frames_upload_done(Connection *conn, MultiplexUpload *u) {
+    Reactor *r = conn->reactor;
+    Task *task = u->task;
+    char reply[512];
+
+    /* Splitting into the chunk store reads the whole file: a worker does
+     * it while the transfer keeps the partial locked */
+    if (r->user_mgr->chunks && strcmp(task->command, "UPLOAD-CHUNK") != 0) {
+        u->receiving = 0;
+        task->execute = reactor_store_upload;
+        task->checksum = transfer_checksum(&u->transfer);
+        conn->tasks++;
+        r->outstanding++;
+        if (worker_pool_submit(r->worker_pool, task) == 0) return;
+
+        /* Pool is shutting down: store it here instead */
+        conn->tasks--;
+        r->outstanding--;
+        task->execute = NULL;
+        u->receiving = 1;
+    }
+
+    multiplex_upload_finish(r->user_mgr, r->worker_pool, u, reply, sizeof(reply));
+    conn_reply_frame(conn, u->request_id, task->opcode, reply_flags(reply), reply);
+    conn_remove_upload(conn, u);
+}
+
+/* An upload's request was checked: open the upload or refuse it */
+static void conn_frames_upload_checked(Connection *conn, MultiplexUpload *u) {
+    Task *task = u->task;
+    char reply[512];
+
+    if (task->result_code != 0) {
+        conn_reply_frame(conn, u->request_id, task->opcode, MULTIPLEX_FLAG_ERROR,
+                         task->result_message);
+        conn_remove_upload(conn, u);
+        return;
+    }
+    if (multiplex_upload_open(conn->reactor->user_mgr, u, reply, sizeof(reply)) == -1) {
+        conn_reply_frame(conn, u->request_id, task->opcode, MULTIPLEX_FLAG_ERROR, reply);
+        conn_remove_upload(conn, u);
+        return;
+    }
+
+    if (reply[0]) conn_reply_frame(conn, u->request_id, task->opcode, MULTIPLEX_FLAG_MORE, reply);
+    if (u->transfer.remaining == 0) conn_frames_upload_done(conn, u);
+}
+
+/* A request's task is back (or was run inline) */
+static void conn_frames_task_done(Connection *conn, Task *task) {
+    MultiplexUpload *u = conn->uploads;
+    while (u && u->task != task) u = u->next;
+
+    if (u && task->execute) {
+        /* Stored by a worker: the partial's lock goes only now */
+        transfer_close(&u->transfer);
+        conn_reply_frame(conn, u->request_id, task->opcode,
+                         reply_flags(task->result_message), task->result_message);
+        conn_remove_upload(conn, u);
+    } else if (u) {
+        conn_frames_upload_checked(conn, u);
+    } else {
+        conn_frames_answer(conn, task);
+    }
+    conn_frames_check_quit(conn);
+}
+
+/* Start one request; its reply goes out when it completes */
+static void conn_frames_request(Connection *conn, uint32_t request_id, uint16_t opcode,
+                                const char *payload) {
+    Reactor *r = conn->reactor;
+    char line[MULTIPLEX_MAX_REQUEST + 32];
+    char size_line[32];
+
+    if (opcode == MULTIPLEX_OP_QUIT) {
+        conn->quitting = 1;
+        conn->quit_id = request_id;
+        conn_frames_check_quit(conn);
+        return;
+    }
+    if (multiplex_request_line(opcode, payload, line, sizeof(line),
+                               size_line, sizeof(size_line)) == -1) {
+        conn_reply_frame(conn, request_id, opcode, MULTIPLEX_FLAG_ERROR,
+                         "ERROR: Unknown opcode\n");
+        return;
+    }
+    if (opcode == MULTIPLEX_OP_LIST) {
+        conn_frames_list(conn, request_id, line);
+        return;
+    }
+
+    Task *task;
+    if (multiplex_is_upload(opcode)) {
+        int count = 0;
+        for (MultiplexUpload *u = conn->uploads; u; u = u->next) count++;
+        const char *err = NULL;
+        if (conn_find_upload(conn, request_id)) {
+            err = "ERROR: Request ID already in use\n";
+        } else if (count >= MULTIPLEX_MAX_UPLOADS) {
+            err = "ERROR: Too many uploads at once\n";
+        }
+        if (err) {
+            conn_reply_frame(conn, request_id, opcode, MULTIPLEX_FLAG_ERROR, err);
+            return;
+        }
+
+        MultiplexUpload *u = multiplex_upload_create(request_id, line, size_line,
+                                                     conn->fd, conn->user_id);
+        task = u ? u->task : NULL;
+        if (u) {
+            u->next = conn->uploads;
+            conn->uploads = u;
+        }
+    } else {
+        task = session_create_task(line, conn->fd, conn->user_id);
+    }
+    if (!task) {
+        conn_reply_frame(conn, request_id, opcode, MULTIPLEX_FLAG_ERROR,
+                         "ERROR: Out of memory\n");
+        return;
+    }
+
+    task->request_id = request_id;
+    task->opcode = opcode;
+    task->on_complete = reactor_task_done;
+    task->context = conn;
+
+    if (worker_pool_run_inline(r->worker_pool, task)) {
+        conn_frames_task_done(conn, task);
+        return;
+    }
+
+    conn->tasks++;
+    r->outstanding++;
+    if (worker_pool_submit(r->worker_pool, task) == -1) {
+        conn->tasks--;
+        r->outstanding--;
+        snprintf(task->result_message, sizeof(task->result_message),
+                 "ERROR: Server overloaded\n");
+        task->result_code = -1;
+        conn_frames_task_done(conn, task);
+    }
+}
+
+/* Hand len bytes of the current DATA frame to its upload */
+static void conn_frames_data(Connection *conn, const char *data, size_t len) {
+    MultiplexUpload *u = conn->frame_upload;
+    conn->frame_left -= len;
+    if (!u) return; // Refused or failed upload: dropped
+
+    char reply[256];
+    if (multiplex_upload_write(u, data, len, reply, sizeof(reply)) == -1) {
+        multiplex_upload_drop(conn->reactor->user_mgr, u);
+        conn_reply_frame(conn, u->request_id, u->task->opcode, MULTIPLEX_FLAG_ERROR, reply);
+        conn_remove_upload(conn, u);
+        conn->frame_upload = NULL;
+        return;
+    }
+    if (u->transfer.remaining == 0) {
+        conn->frame_upload = NULL;
+        conn_frames_upload_done(conn, u);
+    }
+}
+
+static void conn_consume(Connection *conn, size_t len) {
+    memmove(conn->in, conn->in + len, conn->in_len - len);
+    conn->in_len -= len;
+}
+
+/* Handle the frames buffered in conn->in as far as they can go now.
+ * DATA payloads are taken as they arrive, not buffered whole. */
+static void conn_process_frames(Connection *conn) {
+    conn->stalled = 0;
+
+    while (!conn->closed && conn->state == CONN_FRAMES && !conn->quitting) {
+        if (conn->frame_left > 0) {
+            if (conn->in_len == 0) break;
+            size_t take = conn->in_len < conn->frame_left ? conn->in_len : conn->frame_left;
+            conn_frames_data(conn, conn->in, take);
+            conn_consume(conn, take);
+            continue;
+        }
+        if (conn->in_len < MULTIPLEX_HEADER_SIZE) break;
+
+        uint32_t length, request_id;
+        uint16_t opcode, flags;
+        multiplex_unpack_header((const unsigned char*)conn->in, &length, &request_id,
+                                &opcode, &flags);
+
+        if (opcode == MULTIPLEX_OP_DATA) {
+            if (length > MULTIPLEX_DATA_FRAME) {
+                printf("[Reactor] DATA frame of %u bytes is too long, closing\n", length);
+                conn_close(conn);
+                break;
+            }
+            MultiplexUpload *u = conn_find_upload(conn, request_id);
+            if (u && !u->receiving) {
+                conn->stalled = 1; // Its request is still with a worker
+                break;
+            }
+            if (u && length > u->transfer.remaining) {
+                multiplex_upload_drop(conn->reactor->user_mgr, u);
+                conn_reply_frame(conn, request_id, u->task->opcode, MULTIPLEX_FLAG_ERROR,
+                                 "ERROR: More data than announced\n");
+                conn_remove_upload(conn, u);
+                u = NULL;
+            }
+            conn_consume(conn, MULTIPLEX_HEADER_SIZE);
+            conn->frame_upload = u;
+            conn->frame_left = length;
+            continue;
+        }
+
+        if (length > MULTIPLEX_MAX_REQUEST) {
+            printf("[Reactor] Request %u of %u bytes is too long, closing\n",
+                   request_id, length);
+            conn_close(conn);
+            break;
+        }
+        if (conn->in_len < MULTIPLEX_HEADER_SIZE + length) break;
+        if (opcode != MULTIPLEX_OP_QUIT && conn->tasks >= MULTIPLEX_MAX_INFLIGHT) {
+            conn->stalled = 1;
+            break;
+        }
+
+        char payload[MULTIPLEX_MAX_REQUEST + 1];
+        memcpy(payload, conn->in + MULTIPLEX_HEADER_SIZE, length);
+        payload[length] = '\0';
+        conn_consume(conn, MULTIPLEX_HEADER_SIZE + length);
+        conn_frames_request(conn, request_id, opcode, payload);
+    }
+}
+
+/* DATA payload with nothing buffered before it: read it straight in */
+static void conn_receive_frame_data(Connection *conn) {
+    size_t want = conn->frame_left < MULTIPLEX_DATA_FRAME ? conn->frame_left
+                                                          : MULTIPLEX_DATA_FRAME;
+    ssize_t n = recv(conn->fd, conn->frame, want, 0);
+    if (n == 0) {
+        printf("[Reactor] Client disconnected (socket %d)\n", conn->fd);
+        conn_close(conn);
+        return;
+    }
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            conn_close(conn);
+        }
+        return;
+    }
+
+    conn_frames_data(conn, conn->frame, n);
+    conn_process_input(conn);
+}
+
+static void conn_begin_frames(Connection *conn) {
+    conn->frame = malloc(MULTIPLEX_DATA_FRAME);
+    if (!conn->frame) {
+        const char *err = "ERROR: Out of memory\n";
+        conn_send(conn, err, strlen(err));
+        return;
+    }
+
+    const char *ok = "OK: PROTOCOL 2\n";
+    conn_send(conn, ok, strlen(ok));
+    conn->state = CONN_FRAMES;
+    printf("[Reactor] Socket %d switched to protocol 2\n", conn->fd);
+}
+
+/* Connection closed: open uploads keep their partials, and streams end */
+static void conn_frames_close(Connection *conn) {
+    for (MultiplexUpload *u = conn->uploads; u; u = u->next) {
+        multiplex_upload_drop(conn->reactor->user_mgr, u);
+    }
+    while (conn->streams) {
+        ConnStream *stream = conn->streams;
+        conn->streams = stream->next;
+        transfer_close(&stream->transfer);
+        free(stream);
+    }
+}
+
+static void conn_handle_line(Connection *conn, char *line) {
+    char reply[256];
+
+    switch (conn->state) {
+    case CONN_AUTH:
+        if (session_is_command(line, "REGISTER")) {
+            conn_register(conn, line);
+            break;
+        }
+        conn->user_id = session_auth(conn->reactor->user_mgr, line,
+                                     reply, sizeof(reply));
+        if (conn->user_id != -1 &&
+            !user_files_ready(conn->reactor->user_mgr, conn->user_id)) {
+            conn_load_files(conn, reply);
+            break;
+        }
+        conn_send(conn, reply, strlen(reply));
+        if (conn->user_id != -1) conn->state = CONN_COMMAND;
+        break;
+    case CONN_COMMAND:
+        if (strcmp(line, "QUIT") == 0) {
+            const char *bye = "Goodbye!\n";
+            conn_send(conn, bye, strlen(bye));
+            conn->state = CONN_CLOSING;
+        } else if (strcmp(line, MULTIPLEX_NEGOTIATE) == 0) {
+            conn_begin_frames(conn);
+        } else if (session_is_command(line, "LIST")) {
+            conn_begin_list(conn, line);
+        } else {
+            conn_submit_task(conn, line);
+        }
+        break;
+    case CONN_UPLOAD_SIZE:
+        conn_begin_upload(conn, line);
+        if (conn->state == CONN_UPLOAD_DATA && conn->transfer.remaining == 0) {
+            conn_end_upload(conn);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* Consume as much buffered input as the current state allows. Not
+ * reentrant: a command finished inline returns to the loop below
+ * instead of recursing once per pipelined line. */
+static void conn_process_input(Connection *conn) {
+    if (conn->processing) return;
+    conn->processing = 1;
+
+    while (!conn->closed) {
+        if (conn->state == CONN_FRAMES) {
+            conn_process_frames(conn);
+            break;
+        }
+        if (conn->state == CONN_UPLOAD_DATA) {
+            if (conn->in_len == 0) break;
+            conn_consume_upload(conn);
+            continue;
+        }
+
+        if (conn->state != CONN_AUTH && conn->state != CONN_COMMAND &&
+            conn->state != CONN_UPLOAD_SIZE) {
+            break;
+        }
+
+        char *nl = memchr(conn->in, '\n', conn->in_len);
+        if (!nl) {
+            if (conn->in_len == sizeof(conn->in)) {
+                const char *err = "ERROR: Line too long\n";
+                conn_send(conn, err, strlen(err));
+                conn->state = CONN_CLOSING;
+            }
+            break;
+        }
+
+        char line[CONN_BUFFER_SIZE];
+        size_t len = nl - conn->in;
+        memcpy(line, conn->in, len);
+        line[len] = '\0';
+        line[strcspn(line, "\r")] = 0;
+        memmove(conn->in, nl + 1, conn->in_len - len - 1);
+        conn->in_len -= len + 1;
+
+        conn_handle_line(conn, line);
+    }
+
+    conn->processing = 0;
+}
+
+static void conn_on_readable(Connection *conn) {
+    if (conn->state == CONN_UPLOAD_DATA && conn->in_len == 0) {
+        conn_receive_upload(conn);
+        return;
+    }
+    if (conn->state == CONN_FRAMES && conn->frame_left > 0 && conn->in_len == 0) {
+        conn_receive_frame_data(conn);
+        return;
+    }
+
+    ssize_t n = recv(conn->fd, conn->in + conn->in_len,
+                     sizeof(conn->in) - conn->in_len, 0);
+    if (n == 0) {
+        printf("[Reactor] Client disconnected (socket %d)\n", conn->fd);
+        conn_close(conn);
+        return;
+    }
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            conn_close(conn);
+        }
+        return;
+    }
+
+    conn->in_len += n;
+    conn_process_input(conn);
+}
+
+/* Stream the next part of a download once the reply line has drained */
+static void conn_pump_download(Connection *conn) {
+    /* Bounded per wakeup so one fast reader cannot starve the loop */
+    for (int i = 0; i < CONN_PUMP_STEPS && !conn->closed &&
+         conn->out_len == conn->out_off; i++) {
+        if (conn->transfer.remaining == 0) {
+            transfer_close(&conn->transfer);
+            conn_finish_command(conn);
+            conn_process_input(conn);
+            return;
+        }
+
+        long n = transfer_send(&conn->transfer, conn->fd);
+        if (n < 0) {
+            /* Stream is out of sync with the announced size */
+            conn_close(conn);
+            return;
+        }
+        if (n == 0) return; // Socket full, wait for EPOLLOUT
+    }
+}
+
+static void conn_on_writable(Connection *conn) {
+    if (!conn_flush(conn)) return;
+
+    if (conn->state == CONN_DOWNLOAD) {
+        conn_pump_download(conn);
+    } else if (conn->state == CONN_LIST) {
+        conn_pump_list(conn);
+    } else if (conn->state == CONN_FRAMES) {
+        conn_pump_streams(conn);
+    } else if (conn->state == CONN_CLOSING) {
+        conn_close(conn);
+    }
+}
+
+/* Worker finished a task: resume the connection on its reactor */
+static void conn_on_task_done(Connection *conn, Task *task) {
+    if (conn->closed) return;
+
+    if (conn->state == CONN_FRAMES) {
+        conn_frames_task_done(conn, task);
+        conn_process_input(conn);
+        return;
+    }
+
+    if (task->execute == reactor_register || task->execute == reactor_load_files) {
+        if (task->execute == reactor_register) {
+            conn_registered(conn, task);
+        } else {
+            conn_files_loaded(conn, task);
+        }
+        conn_process_input(conn);
+        return;
+    }
+
+    conn->state = CONN_COMMAND; // Task is ours again
+
+    printf("[Reactor] Task completed: %s (code=%d)\n",
+           task->command, task->result_code);
+
+    /* A claimed chunk is opened before the client is told to send it */
+    int chunk_open = strcmp(task->command, "UPLOAD-CHUNK") == 0 && task->result_code == 0;
+    if (chunk_open && session_chunked_open(task->filename, task->offset, task->file_size,
+                                           &conn->transfer) == -1) {
+        snprintf(task->result_message, sizeof(task->result_message),
+                 "ERROR: Cannot open upload\n");
+        chunk_open = 0;
+    }
+
+    /* A download is opened before SIZE goes out, so a file that vanished
+     * meanwhile still gets an error instead of a short stream. A cache
+     * miss is streamed from disk; a worker reads the file into the cache
+     * for the next request, not this loop */
+    int download = -1;
+    if (strcmp(task->command, "DOWNLOAD") == 0 && task->result_code == 0) {
+        download = session_open_download(conn->reactor->user_mgr, conn->user_id,
+                                         task->filename, task->offset, task->file_size,
+                                         &conn->transfer, 0);
+        if (download == -1) {
+            snprintf(task->result_message, sizeof(task->result_message),
+                     "ERROR: Cannot open file\n");
+            task->result_code = -1;
+        }
+    }
+
+    /* Before the reply: a send that fails closes the connection, and only
+     * CONN_UPLOAD_DATA makes conn_close give the chunk back */
+    if (chunk_open) {
+        conn->file_size = task->file_size;
+        conn->state = CONN_UPLOAD_DATA;
+    }
+
+    conn_send(conn, task->result_message, strlen(task->result_message));
+
+    if (task->execute) {
+        transfer_close(&conn->transfer); // Upload stored by a worker
+        conn_finish_command(conn);
+    } else if ((strcmp(task->command, "UPLOAD") == 0 ||
+                strcmp(task->command, "UPLOAD-RESUME") == 0) && task->result_code == 0) {
+        conn->state = CONN_UPLOAD_SIZE;
+    } else if (chunk_open) {
+        /* Receiving the chunk, state set above */
+    } else if (download != -1) {
+        if (download == 1) {
+            worker_pool_fill_cache(conn->reactor->worker_pool, conn->user_id,
+                                   task->filename);
+        }
+        conn->state = CONN_DOWNLOAD;
+        conn_pump_download(conn);
+    } else {
+        conn_finish_command(conn);
+    }
+
+    conn_process_input(conn);
+}
+
+/* Called on a worker thread */
+static void reactor_task_done(Task *task) {
+    Connection *conn = task->context;
+    Reactor *r = conn->reactor;
+
+    pthread_mutex_lock(&r->inbox_mutex);
+    task->next = r->completed;
+    r->completed = task;
+    pthread_mutex_unlock(&r->inbox_mutex);
+
+    reactor_wake(r);
+}
+
+/* ===== REACTOR LOOP ===== */
+
+static void reactor_accept_incoming(Reactor *r, Connection *list) {
+    /* The inbox is newest first: take connections in arrival order */
+    Connection *ordered = NULL;
+    size_t waiting = 0;
+    while (list) {
+        Connection *conn = list;
+        list = list->next;
+        conn->next = ordered;
+        ordered = conn;
+        waiting++;
+    }
+    list = ordered;
+
+    uint64_t now = queue_clock_ns();
+    while (list) {
+        Connection *conn = list;
+        list = list->next;
+        waiting--;
+
+        /* Loop lagging behind a standing backlog: turn it away now. The
+         * inbox empties at every wakeup, so the backlog that counts is
+         * the connections the loop is already serving. */
+        long retry_ms = codel_shed(&r->codel, now, conn->queued_ns,
+                                   waiting + r->connection_count);
+        if (retry_ms > 0) {
+            client_pool_reject(conn->fd, retry_ms);
+            free(conn);
+            continue;
+        }
+
+        int flags = fcntl(conn->fd, F_GETFL, 0);
+        fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK);
+
+        conn->prev = NULL;
+        conn->next = r->connections;
+        if (r->connections) r->connections->prev = conn;
+        r->connections = conn;
+        r->connection_count++;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        conn->events = EPOLLIN;
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+            perror("epoll_ctl");
+            conn_close(conn);
+            conn_free(conn);
+            continue;
+        }
+
+        printf("[Reactor] Handling client on socket %d (%d open)\n",
+               conn->fd, r->connection_count);
+        conn_send(conn, SESSION_WELCOME, strlen(SESSION_WELCOME));
+        conn_update_events(conn);
+    }
+}
+
+/* Returns the connections closed while handling completions */
+static void reactor_drain_completed(Reactor *r, Task *list, Connection **dead) {
+    while (list) {
+        Task *task = list;
+        list = list->next;
+        task->next = NULL;
+
+        Connection *conn = task->context;
+        r->outstanding--;
+
+        if (conn->closed) {
+            /* Client went away while the worker was busy. A chunk the
+             * worker claimed would otherwise pin its upload for good. */
+            if (strcmp(task->command, "UPLOAD-CHUNK") == 0 && task->result_code == 0) {
+                char reply[256];
+                session_chunked_done(task->filename, task->offset, 0, 0,
+                                     reply, sizeof(reply));
+                printf("[Reactor] Chunk of upload %s dropped\n", task->filename);
+            }
+            if (conn->state == CONN_FRAMES) {
+                /* An upload's task goes with the upload in conn_free */
+                MultiplexUpload *u = conn->uploads;
+                while (u && u->task != task) u = u->next;
+                if (!u) session_destroy_task(task);
+                conn->tasks--;
+            } else {
+                conn->state = CONN_COMMAND;
+            }
+            if (conn_idle(conn)) {
+                conn->next = *dead;
+                *dead = conn;
+            }
+            continue;
+        }
+
+        if (conn->state == CONN_FRAMES) conn->tasks--;
+        conn_on_task_done(conn, task);
+        if (conn->closed) {
+            if (conn_idle(conn)) {
+                conn->next = *dead;
+                *dead = conn;
+            }
+        } else {
+            conn_update_events(conn);
+        }
+    }
+}
+
+static void* reactor_thread_func(void *arg) {
+    Reactor *r = (Reactor*)arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int stopping = 0;
+
+    while (!stopping || r->outstanding > 0) {
+        int n = epoll_wait(r->epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        /* Connections closed in this batch are freed only after it,
+         * since later events may still point at them */
+        Connection *dead = NULL;
+
+        for (int i = 0; i < n; i++) {
+            Connection *conn = events[i].data.ptr;
+
+            if (!conn) {
+                uint64_t count;
+                ssize_t ret = read(r->event_fd, &count, sizeof(count));
+                (void)ret;
+
+                pthread_mutex_lock(&r->inbox_mutex);
+                Connection *incoming = r->incoming;
+                Task *completed = r->completed;
+                r->incoming = NULL;
+                r->completed = NULL;
+                stopping = r->shutdown;
+                pthread_mutex_unlock(&r->inbox_mutex);
+
+                reactor_accept_incoming(r, incoming);
+                reactor_drain_completed(r, completed, &dead);
+                continue;
+            }
+
+            if (conn->closed) continue;
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                conn_close(conn);
+            } else {
+                if (events[i].events & EPOLLIN) conn_on_readable(conn);
+                if (!conn->closed && (events[i].events & EPOLLOUT)) {
+                    conn_on_writable(conn);
+                }
+            }
+
+            if (conn->closed) {
+                if (conn_idle(conn)) {
+                    conn->next = dead;
+                    dead = conn;
+                }
+            } else {
+                conn_update_events(conn);
+            }
+        }
+
+        /* Shutdown: drop every client, then wait for in-flight tasks */
+        if (stopping) {
+            while (r->connections) {
+                Connection *conn = r->connections;
+                conn_close(conn);
+                if (conn_idle(conn)) {
+                    conn->next = dead;
+                    dead = conn;
+                }
+            }
+        }
+
+        while (dead) {
+            Connection *conn = dead;
+            dead = dead->next;
+            conn_free(conn);
+        }
+    }
+
+    session_release_task_cache();
+    return NULL;
+}
@@ -0,0 +1,50 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+#include "queue.h"
+#include "threadpool.h"
+#include "utils.h"
+
+/* Event-driven front-end: a few reactor threads own non-blocking client
+ * sockets through epoll and drive each connection through the
+ * auth/command/upload/download phases. File operations still go to the
+ * worker pool; completions come back through an
+ * eventfd so no thread ever blocks on a single client. A loop that lags
+ * behind its inbox sheds new connections with the same CoDel rule the
+ * threaded client queue uses. */
+
+typedef struct Connection Connection;
+
+/* One epoll loop and the connections it owns */
+typedef struct {
+    pthread_t thread;
+    int epoll_fd;
+    int event_fd;               // Wakes the loop for new connections/completions
+    pthread_mutex_t inbox_mutex;// Protects the two inbox lists below
+    Connection *incoming;       // New sockets handed over by the accept loop
+    Task *completed;            // Finished tasks handed back by workers
+    Connection *connections;    // All live connections (owned by the thread)
+    int connection_count;
+    int outstanding;            // Tasks submitted but not yet completed
+    WorkerThreadPool *worker_pool;
+    UserManager *user_mgr;
+    int shutdown;               // Protected by inbox_mutex
+    Codel codel;                // Inbox wait of new connections (loop thread only)
+} Reactor;
+
+/* Reactor thread pool configuration */
+typedef struct {
+    Reactor *reactors;
+    int num_threads;
+    int next;                   // Round-robin cursor for new connections
+    pthread_mutex_t next_mutex;
+} ReactorPool;
+
+/* Reactor pool operations */
+ReactorPool* reactor_pool_create(int num_threads, WorkerThreadPool *wp, UserManager *um);
+int reactor_pool_add(ReactorPool *pool, ClientConnection conn);
+void reactor_pool_shutdown(ReactorPool *pool);
+void reactor_pool_destroy(ReactorPool *pool);
+
+#endif
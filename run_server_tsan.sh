@@ -3,7 +3,7 @@ make clean
 make
 
 # Clean data
-rm -rf users users.txt
+rm -rf users index chunks partial users.txt users.db users.journal
 
 # Run with Helgrind
 valgrind --tool=helgrind \
@@ -0,0 +1,213 @@
+#include "scheduler.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Rough relative cost of the commands that reach the workers: index
+ * lookups are 1, a file operation plus a journal record a few, a commit
+ * (rename, maybe a full dedup pass) the most */
+static const struct {
+    const char *command;
+    int cost;
+} task_costs[] = {
+    { "DOWNLOAD",      1 },
+    { "UPLOAD",        1 },
+    { "UPLOAD-CHUNK",  1 },
+    { "UPLOAD-RESUME", 1 },     // A stat() of the partial file
+    { "DELETE",        2 },
+    { "UPLOAD-ABORT",  2 },
+    { "UPLOAD-INIT",   4 },
+    { "UPLOAD-COMMIT", 8 },
+};
+
+int scheduler_task_cost(const Task *task) {
+    for (size_t i = 0; i < sizeof(task_costs) / sizeof(task_costs[0]); i++) {
+        if (strcmp(task->command, task_costs[i].command) == 0) return task_costs[i].cost;
+    }
+    return 1; // Unknown commands only produce an error reply
+}
+
+static size_t user_bucket(const Scheduler *s, int user_id) {
+    return ((unsigned int)user_id * 2654435761u) & (s->bucket_count - 1);
+}
+
+Scheduler* scheduler_create(long target_ms, long interval_ms) {
+    Scheduler *s = calloc(1, sizeof(Scheduler));
+    if (!s) return NULL;
+
+    s->bucket_count = SCHEDULER_MIN_BUCKETS;
+    s->buckets = calloc(s->bucket_count, sizeof(UserQueue*));
+    if (!s->buckets) {
+        free(s);
+        return NULL;
+    }
+    pthread_mutex_init(&s->mutex, NULL);
+    atomic_init(&s->pending, 0);
+    s->target_ms = target_ms;
+    s->interval_ms = interval_ms;
+    return s;
+}
+
+void scheduler_destroy(Scheduler *s) {
+    if (!s) return;
+    for (size_t i = 0; i < s->bucket_count; i++) {
+        UserQueue *q = s->buckets[i];
+        while (q) {
+            UserQueue *next = q->hash_next;
+            free(q);
+            q = next;
+        }
+    }
+    pthread_mutex_destroy(&s->mutex);
+    free(s->buckets);
+    free(s);
+}
+
+/* Double the user table once it is as full as it is wide */
+static void scheduler_grow(Scheduler *s) {
+    size_t count = s->bucket_count * 2;
+    UserQueue **buckets = calloc(count, sizeof(UserQueue*));
+    if (!buckets) return; // Longer chains, still correct
+
+    UserQueue **old = s->buckets;
+    size_t old_count = s->bucket_count;
+    s->buckets = buckets;
+    s->bucket_count = count;
+    for (size_t i = 0; i < old_count; i++) {
+        UserQueue *q = old[i];
+        while (q) {
+            UserQueue *next = q->hash_next;
+            size_t b = user_bucket(s, q->user_id);
+            q->hash_next = buckets[b];
+            buckets[b] = q;
+            q = next;
+        }
+    }
+    free(old);
+}
+
+/* The user's queue, created on first use (caller holds the mutex) */
+static UserQueue* scheduler_user(Scheduler *s, int user_id) {
+    size_t b = user_bucket(s, user_id);
+    for (UserQueue *q = s->buckets[b]; q; q = q->hash_next) {
+        if (q->user_id == user_id) return q;
+    }
+
+    UserQueue *q = calloc(1, sizeof(UserQueue));
+    if (!q) return NULL;
+    q->user_id = user_id;
+    codel_init(&q->codel, s->target_ms, s->interval_ms);
+    q->hash_next = s->buckets[b];
+    s->buckets[b] = q;
+    if (++s->user_count > s->bucket_count) scheduler_grow(s);
+    return q;
+}
+
+int scheduler_push(Scheduler *s, Task *task) {
+    task->queued_ns = queue_clock_ns();
+    pthread_mutex_lock(&s->mutex);
+    UserQueue *q = scheduler_user(s, task->user_id);
+    if (!q) {
+        pthread_mutex_unlock(&s->mutex);
+        return -1;
+    }
+
+    task->next = NULL;
+    if (q->tail) q->tail->next = task;
+    else q->head = task;
+    q->tail = task;
+    if (++q->depth > q->peak_depth) q->peak_depth = q->depth;
+
+    /* A user with new work joins the end of the round */
+    if (!q->active) {
+        q->active = 1;
+        q->credited = 0;
+        q->deficit = 0;
+        q->next_active = NULL;
+        if (s->active_tail) s->active_tail->next_active = q;
+        else s->active_head = q;
+        s->active_tail = q;
+    }
+
+    atomic_fetch_add_explicit(&s->pending, 1, memory_order_release);
+    pthread_mutex_unlock(&s->mutex);
+    return 0;
+}
+
+Task* scheduler_pop(Scheduler *s, long *shed_ms) {
+    *shed_ms = 0;
+    if (atomic_load_explicit(&s->pending, memory_order_acquire) == 0) return NULL;
+
+    pthread_mutex_lock(&s->mutex);
+    Task *task = NULL;
+    while (s->active_head) {
+        UserQueue *q = s->active_head;
+        if (!q->credited) {
+            q->deficit += SCHEDULER_QUANTUM;
+            q->credited = 1;
+        }
+
+        int cost = scheduler_task_cost(q->head);
+        if (cost > q->deficit) {
+            /* Turn used up: keep the credit left over, go to the next user */
+            q->credited = 0;
+            if (q != s->active_tail) {
+                s->active_head = q->next_active;
+                q->next_active = NULL;
+                s->active_tail->next_active = q;
+                s->active_tail = q;
+            }
+            continue;
+        }
+
+        task = q->head;
+        q->head = task->next;
+        if (!q->head) q->tail = NULL;
+        task->next = NULL;
+        q->depth--;
+        q->deficit -= cost;
+        q->served++;
+        q->cost += cost;
+        if (!task->execute) {
+            *shed_ms = codel_shed(&q->codel, queue_clock_ns(), task->queued_ns, q->depth);
+        }
+
+        /* No work left: leave the round, credit does not carry over */
+        if (q->depth == 0) {
+            s->active_head = q->next_active;
+            if (!s->active_head) s->active_tail = NULL;
+            q->next_active = NULL;
+            q->active = 0;
+            q->credited = 0;
+            q->deficit = 0;
+        }
+        atomic_fetch_sub_explicit(&s->pending, 1, memory_order_relaxed);
+        break;
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return task;
+}
+
+int scheduler_stats(Scheduler *s, UserQueueStats *stats, int max) {
+    int count = 0;
+    pthread_mutex_lock(&s->mutex);
+    for (size_t i = 0; i < s->bucket_count; i++) {
+        for (UserQueue *q = s->buckets[i]; q; q = q->hash_next) {
+            /* Insertion into the top max by peak depth */
+            int pos = count < max ? count : max;
+            while (pos > 0 && stats[pos - 1].peak_depth < q->peak_depth) {
+                if (pos < max) stats[pos] = stats[pos - 1];
+                pos--;
+            }
+            if (pos >= max) continue;
+            stats[pos].user_id = q->user_id;
+            stats[pos].depth = q->depth;
+            stats[pos].peak_depth = q->peak_depth;
+            stats[pos].served = q->served;
+            stats[pos].cost = q->cost;
+            stats[pos].shed = q->codel.shed;
+            if (count < max) count++;
+        }
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return count;
+}
@@ -0,0 +1,77 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include "queue.h"
+
+/* Per-user fair scheduling of worker tasks. Every user has a FIFO
+ * sub-queue; users with work wait in a round-robin list and are served
+ * deficit round robin: each turn adds SCHEDULER_QUANTUM credit and a
+ * task is taken while its estimated cost fits in the credit. A user who
+ * keeps thousands of requests queued then gets the same share of the
+ * workers as one with a single request, and the wait of the latter is
+ * bounded by one round over the users with work, not by the backlog.
+ * Each user's queue delay is watched by its own CoDel, so a backlog
+ * that does build up is shed from the users who built it. */
+
+#define SCHEDULER_QUANTUM 8         // Credit per turn, in cost units
+#define SCHEDULER_MIN_BUCKETS 64    // Initial user table size (power of two)
+
+/* Sub-queue and counters of one user (kept once seen) */
+typedef struct UserQueue {
+    int user_id;
+    Task *head, *tail;
+    int depth;                  // Tasks queued now
+    int peak_depth;             // Most tasks queued at once
+    long served;                // Tasks handed to workers
+    long cost;                  // Sum of their estimated costs
+    int deficit;                // Credit left in this turn
+    int credited;               // Got this turn's quantum
+    int active;                 // In the round-robin list
+    Codel codel;                // Queue delay of the user's commands
+    struct UserQueue *hash_next;
+    struct UserQueue *next_active;
+} UserQueue;
+
+/* Queue-depth snapshot of one user */
+typedef struct {
+    int user_id;
+    int depth;
+    int peak_depth;
+    long served;
+    long cost;
+    long shed;
+} UserQueueStats;
+
+typedef struct {
+    pthread_mutex_t mutex;      // Protects everything but pending
+    UserQueue **buckets;
+    size_t bucket_count;        // Power of two
+    size_t user_count;
+    UserQueue *active_head;     // Users with work, in serving order
+    UserQueue *active_tail;
+    atomic_int pending;         // Tasks queued (lock-free hint for idle workers)
+    long target_ms;             // Per-user CoDel settings (0 = never shed)
+    long interval_ms;
+} Scheduler;
+
+Scheduler* scheduler_create(long target_ms, long interval_ms);
+void scheduler_destroy(Scheduler *s);
+
+/* Queue task behind its user's earlier tasks (0, or -1 out of memory) */
+int scheduler_push(Scheduler *s, Task *task);
+
+/* Next task in deficit round-robin order (NULL if none is queued).
+ * *shed_ms is 0 to run it, else the command waited too long: answer it
+ * with that retry-after hint instead. Jobs are never shed. */
+Task* scheduler_pop(Scheduler *s, long *shed_ms);
+
+/* Estimated work of a command, in cost units (1 = an index lookup) */
+int scheduler_task_cost(const Task *task);
+
+/* Fill stats with up to max users, deepest peak first; returns how many */
+int scheduler_stats(Scheduler *s, UserQueueStats *stats, int max);
+
+#endif
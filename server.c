@@ -3,18 +3,25 @@
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include "queue.h"
 #include "threadpool.h"
+#include "reactor.h"
+#include "session.h"
 #include "utils.h"
 
 #define PORT 8080
 #define CLIENT_THREADS 8
 #define WORKER_THREADS 4
+#define REACTOR_THREADS 2
 #define CLIENT_QUEUE_SIZE 100
 #define TASK_QUEUE_SIZE 200
+#define LISTEN_BACKLOG 128      // Completed handshakes the kernel holds for accept()
 
 /* Global resources for signal handler */
 static volatile int server_running = 1;
@@ -23,7 +30,9 @@ static ClientQueue *client_queue = NULL;
 static TaskQueue *task_queue = NULL;
 static ClientThreadPool *client_pool = NULL;
 static WorkerThreadPool *worker_pool = NULL;
+static ReactorPool *reactor_pool = NULL;
 static UserManager *user_mgr = NULL;
+static long rejected = 0;       // Connections turned away by the accept loop
 
 /* Signal handler for graceful shutdown */
 void handle_shutdown(int sig) {
@@ -37,13 +46,103 @@ void handle_shutdown(int sig) {
     }
 }
 
+/* Allow as many sockets as the hard limit permits (reactor mode) */
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-m threads|reactor] [-r reactor_threads] [-w worker_threads]\n"
+            "          [-g sync_window_ms] [-d] [-c cache_mb] [-p inline|workers]\n"
+            "          [-b backlog] [port]\n"
+            "  -m  session handling: one client thread per session (threads, default)\n"
+            "      or epoll event loops owning many sessions each (reactor)\n"
+            "  -r  number of reactor threads (default %d)\n"
+            "  -w  number of worker threads (default: online CPUs, at least %d), split\n"
+            "      into interactive (metadata), bulk (file data) and background lanes\n"
+            "  -g  group commit window for account/quota changes (default %d ms)\n"
+            "  -d  store files as deduplicated content-defined chunks\n"
+            "  -c  memory for caching small files for DOWNLOAD (default %d MB, 0 = off)\n"
+            "  -p  dispatch: answer index lookups (DOWNLOAD, UPLOAD, UPLOAD-CHUNK) on\n"
+            "      the session's thread (inline, default) or send every command to\n"
+            "      the worker pool (workers)\n"
+            "  -b  listen backlog (default %d). Connections that find the client\n"
+            "      queue full, or wait too long for a client thread or event loop,\n"
+            "      are turned away with a retry-after hint\n",
+            prog, REACTOR_THREADS, WORKER_THREADS, JOURNAL_SYNC_WINDOW_MS,
+            FILECACHE_DEFAULT_MB, LISTEN_BACKLOG);
+}
+
 int main(int argc, char *argv[]) {
     struct sockaddr_in server_addr, client_addr;
     socklen_t client_len = sizeof(client_addr);
     int port = PORT;
+    int use_reactor = 0;
+    int reactor_threads = REACTOR_THREADS;
+    int worker_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    long sync_window_ms = JOURNAL_SYNC_WINDOW_MS;
+    int dedup = 0;
+    long cache_mb = FILECACHE_DEFAULT_MB;
+    DispatchPolicy dispatch = DISPATCH_INLINE;
+    int backlog = LISTEN_BACKLOG;
+    int opt;
+    
+    if (worker_threads < WORKER_THREADS) worker_threads = WORKER_THREADS;
     
-    if (argc > 1) {
-        port = atoi(argv[1]);
+    while ((opt = getopt(argc, argv, "m:r:w:g:dc:p:b:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "reactor") == 0) {
+                use_reactor = 1;
+            } else if (strcmp(optarg, "threads") != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'r':
+            reactor_threads = atoi(optarg);
+            if (reactor_threads < 1) reactor_threads = 1;
+            break;
+        case 'w':
+            worker_threads = atoi(optarg);
+            if (worker_threads < 1) worker_threads = 1;
+            break;
+        case 'g':
+            sync_window_ms = atol(optarg);
+            if (sync_window_ms < 0) sync_window_ms = 0;
+            break;
+        case 'd':
+            dedup = 1;
+            break;
+        case 'c':
+            cache_mb = atol(optarg);
+            if (cache_mb < 0) cache_mb = 0;
+            break;
+        case 'p':
+            if (strcmp(optarg, "workers") == 0) {
+                dispatch = DISPATCH_WORKERS;
+            } else if (strcmp(optarg, "inline") != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            if (backlog < 1) backlog = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (optind < argc) {
+        port = atoi(argv[optind]);
     }
     
     printf("=== Dropbox-Like File Server ===\n");
@@ -53,6 +152,9 @@ int main(int argc, char *argv[]) {
     signal(SIGINT, handle_shutdown);
     signal(SIGTERM, handle_shutdown);
     
+    /* A client vanishing mid-send must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+    
     /* Initialize user management */
     user_mgr = user_manager_create();
     if (!user_mgr) {
@@ -62,6 +164,34 @@ int main(int argc, char *argv[]) {
     printf("[Server] User manager initialized (%d users loaded)\n", 
            user_mgr->user_count);
     
+    /* Account and quota changes are made durable in batches */
+    if (user_manager_start_sync(user_mgr, sync_window_ms) == -1) {
+        fprintf(stderr, "Failed to start journal sync thread\n");
+        return 1;
+    }
+    printf("[Server] Group commit window: %ld ms\n", sync_window_ms);
+    
+    /* Uploads abandoned while the server was down */
+    session_sweep_partials();
+    
+    /* Must be in place before any file index is built */
+    if (dedup) {
+        if (user_manager_enable_dedup(user_mgr) == -1) {
+            fprintf(stderr, "Failed to open chunk store\n");
+            return 1;
+        }
+        printf("[Server] Deduplicated storage in %s/\n", CHUNKSTORE_DIR);
+    }
+    
+    if (cache_mb > 0) {
+        if (user_manager_enable_cache(user_mgr, (size_t)cache_mb * 1024 * 1024) == -1) {
+            fprintf(stderr, "Failed to create file cache\n");
+            return 1;
+        }
+        printf("[Server] Caching files up to %d KB in %ld MB\n",
+               FILECACHE_MAX_FILE / 1024, cache_mb);
+    }
+    
     /* Create thread-safe queues */
     client_queue = client_queue_create(CLIENT_QUEUE_SIZE);
     task_queue = task_queue_create(TASK_QUEUE_SIZE);
@@ -74,16 +204,35 @@ int main(int argc, char *argv[]) {
            CLIENT_QUEUE_SIZE, TASK_QUEUE_SIZE);
     
     /* Create thread pools */
-    client_pool = client_pool_create(CLIENT_THREADS, client_queue, 
-                                      task_queue, user_mgr);
-    worker_pool = worker_pool_create(WORKER_THREADS, task_queue, user_mgr);
+    worker_pool = worker_pool_create(worker_threads, task_queue, user_mgr);
+    if (use_reactor) {
+        raise_fd_limit();
+        reactor_pool = reactor_pool_create(reactor_threads, worker_pool, user_mgr);
+    } else {
+        client_pool = client_pool_create(CLIENT_THREADS, client_queue, 
+                                          worker_pool, user_mgr);
+    }
     
-    if (!client_pool || !worker_pool) {
+    if ((!client_pool && !reactor_pool) || !worker_pool) {
         fprintf(stderr, "Failed to create thread pools\n");
         return 1;
     }
-    printf("[Server] Thread pools created (client: %d, worker: %d)\n",
-           CLIENT_THREADS, WORKER_THREADS);
+    if (use_reactor) {
+        printf("[Server] Thread pools created (reactor: %d, worker: %d)\n",
+               reactor_threads, worker_threads);
+    } else {
+        printf("[Server] Thread pools created (client: %d, worker: %d)\n",
+               CLIENT_THREADS, worker_threads);
+    }
+    
+    /* No session is running yet: safe to set without a lock */
+    worker_pool->dispatch = dispatch;
+    printf("[Server] Dispatch: %s\n", dispatch == DISPATCH_INLINE ?
+           "index lookups inline, file work on workers" : "every command on workers");
+    printf("[Server] Worker lanes: %d %s, %d %s, %d %s\n",
+           worker_pool->lanes[LANE_INTERACTIVE].count, worker_lane_name(LANE_INTERACTIVE),
+           worker_pool->lanes[LANE_BULK].count, worker_lane_name(LANE_BULK),
+           worker_pool->lanes[LANE_BACKGROUND].count, worker_lane_name(LANE_BACKGROUND));
     
     /* Create TCP socket */
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -93,8 +242,8 @@ int main(int argc, char *argv[]) {
     }
     
     /* Set socket options to reuse address */
-    int opt = 1;
-    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    int reuse = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     
     /* Bind to port */
     memset(&server_addr, 0, sizeof(server_addr));
@@ -110,13 +259,13 @@ int main(int argc, char *argv[]) {
     }
     
     /* Listen for connections */
-    if (listen(server_socket, 10) < 0) {
+    if (listen(server_socket, backlog) < 0) {
         perror("listen");
         close(server_socket);
         return 1;
     }
     
-    printf("[Server] Listening on port %d\n", port);
+    printf("[Server] Listening on port %d (backlog %d)\n", port, backlog);
     printf("[Server] Press Ctrl+C to shutdown\n\n");
     
     /* Main accept loop */
@@ -132,6 +281,11 @@ int main(int argc, char *argv[]) {
             break;
         }
         
+        /* Replies are a short header line followed by the data: without
+         * NODELAY the data waits for the peer's delayed ACK of the header */
+        int nodelay = 1;
+        setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
         printf("[Server] Accepted connection from %s:%d (socket %d)\n",
                inet_ntoa(client_addr.sin_addr),
                ntohs(client_addr.sin_port),
@@ -142,9 +296,16 @@ int main(int argc, char *argv[]) {
         conn.client_socket = client_sock;
         conn.addr = client_addr;
         
-        if (client_queue_push(client_queue, conn) == -1) {
-            fprintf(stderr, "[Server] Client queue full, rejecting connection\n");
-            close(client_sock);
+        if (reactor_pool) {
+            if (reactor_pool_add(reactor_pool, conn) == -1) {
+                fprintf(stderr, "[Server] Reactor unavailable, rejecting connection\n");
+                close(client_sock);
+            }
+        } else if (client_queue_push(client_queue, conn) == -1) {
+            /* Every client thread is busy and the queue is full: a quick
+             * answer beats a connection that hangs until it times out */
+            client_pool_reject(client_sock, client_queue_retry_after_ms(client_queue));
+            rejected++;
         }
     }
     
@@ -155,6 +316,9 @@ int main(int argc, char *argv[]) {
     if (client_pool) {
         client_pool_shutdown(client_pool);
     }
+    if (reactor_pool) {
+        reactor_pool_shutdown(reactor_pool);
+    }
     if (worker_pool) {
         worker_pool_shutdown(worker_pool);
     }
@@ -164,11 +328,33 @@ int main(int argc, char *argv[]) {
         printf("[Server] Waiting for client threads...\n");
         client_pool_destroy(client_pool);
     }
+    if (reactor_pool) {
+        printf("[Server] Waiting for reactor threads...\n");
+        reactor_pool_destroy(reactor_pool);
+    }
     if (worker_pool) {
         printf("[Server] Waiting for worker threads...\n");
         worker_pool_destroy(worker_pool);
     }
     
+    if (!use_reactor) {
+        printf("[Server] Admission: %ld connections turned away when accepted, "
+               "%ld after queueing too long\n", rejected, client_queue->codel.shed);
+    }
+    
+    /* Every command after warm-up should have reused a cached task */
+    TaskStats stats;
+    session_task_stats(&stats);
+    printf("[Server] Tasks: %ld allocated, %ld reused, %ld freed\n",
+           stats.allocated, stats.reused, stats.freed);
+    
+    if (user_mgr && user_mgr->cache) {
+        FileCache *cache = user_mgr->cache;
+        printf("[Server] File cache: %ld hits, %ld misses, %ld evictions, %ld invalidations\n",
+               atomic_load(&cache->hits), atomic_load(&cache->misses),
+               atomic_load(&cache->evictions), atomic_load(&cache->invalidations));
+    }
+    
     /* Destroy queues */
     if (client_queue) {
         client_queue_destroy(client_queue);
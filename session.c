@@ -0,0 +1,986 @@
+#include "session.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+int session_file_path(UserManager *mgr, int user_id, const char *filename,
+                      char *path, size_t size) {
+    User *user = user_get_by_id(mgr, user_id);
+    if (!user) return -1;
+
+    snprintf(path, size, "users/%s/%s", user->username, filename);
+    return 0;
+}
+
+/* Handle one REGISTER/LOGIN line */
+int session_auth(UserManager *mgr, const char *line, char *reply, size_t size) {
+    char cmd[16], username[MAX_USERNAME], password[MAX_PASSWORD];
+    memset(cmd, 0, sizeof(cmd));
+    memset(username, 0, sizeof(username));
+    memset(password, 0, sizeof(password));
+
+    int parsed = sscanf(line, "%15s %63s %63s", cmd, username, password);
+
+    printf("[Session] Parsed %d fields: cmd='%s' user='%s'\n",
+           parsed, cmd, username);
+
+    if (parsed != 3) {
+        snprintf(reply, size, "ERROR: Invalid format. Use: REGISTER <username> <password>\n");
+        return -1;
+    }
+
+    if (strcmp(cmd, "REGISTER") == 0) {
+        printf("[Session] Attempting to register user '%s'\n", username);
+        int user_id = user_register(mgr, username, password);
+        if (user_id == -1) {
+            printf("[Session] Registration failed - username exists\n");
+            snprintf(reply, size, "ERROR: Username already exists\n");
+        } else if (user_id == -2) {
+            printf("[Session] Registration failed - not saved\n");
+            snprintf(reply, size, "ERROR: Registration could not be saved\n");
+        } else {
+            printf("[Session] Registration successful, user_id=%d\n", user_id);
+            snprintf(reply, size, "OK: Registered successfully. Please LOGIN.\n");
+        }
+        return -1; // Require login after registration
+    }
+
+    if (strcmp(cmd, "LOGIN") == 0) {
+        printf("[Session] Attempting to login user '%s'\n", username);
+        int user_id = user_login(mgr, username, password);
+        if (user_id == -1) {
+            printf("[Session] Login failed - invalid credentials\n");
+            snprintf(reply, size, "ERROR: Invalid credentials\n");
+        } else {
+            printf("[Session] Login successful, user_id=%d\n", user_id);
+            snprintf(reply, size, "OK: Logged in. Commands: UPLOAD <file>, UPLOAD-RESUME <file>, UPLOAD-INIT <file> <size>, DOWNLOAD <file> [<offset> [<length>]], DELETE <file>, LIST [<cursor> [<limit> [<prefix>]]], QUIT\n");
+        }
+        return user_id;
+    }
+
+    printf("[Session] Unknown command: '%s'\n", cmd);
+    snprintf(reply, size, "ERROR: Use REGISTER or LOGIN\n");
+    return -1;
+}
+
+/* Parse a command line into a task for the worker pool */
+/* ===== TASK CACHE ===== */
+
+/* Tasks are created and destroyed by the thread that owns the session
+ * (workers only fill in results), so each such thread keeps its own
+ * list of spare tasks with their mutex/condvar still initialized. */
+static __thread Task *task_cache = NULL;
+static __thread int task_cache_count = 0;
+
+static atomic_long tasks_allocated;     // malloc + mutex/cond init
+static atomic_long tasks_reused;        // Served from a thread's cache
+static atomic_long tasks_freed;         // Cache full or thread exiting
+
+static Task* task_get(void) {
+    Task *task = task_cache;
+    if (task) {
+        task_cache = task->next;
+        task_cache_count--;
+        atomic_fetch_add_explicit(&tasks_reused, 1, memory_order_relaxed);
+        return task;
+    }
+
+    task = malloc(sizeof(Task));
+    if (!task) return NULL;
+    pthread_mutex_init(&task->result_mutex, NULL);
+    pthread_cond_init(&task->result_cond, NULL);
+    atomic_fetch_add_explicit(&tasks_allocated, 1, memory_order_relaxed);
+    return task;
+}
+
+static void task_free(Task *task) {
+    pthread_mutex_destroy(&task->result_mutex);
+    pthread_cond_destroy(&task->result_cond);
+    free(task);
+    atomic_fetch_add_explicit(&tasks_freed, 1, memory_order_relaxed);
+}
+
+/* Up to max non-negative numbers ending the line (-1 if anything else) */
+static int parse_numbers(const char *p, long *values, int max) {
+    int count = 0;
+    while (*p == ' ') p++;
+    while (*p != '\0' && *p != '\r' && *p != '\n') {
+        char *end;
+        if (count == max || *p < '0' || *p > '9') return -1;
+        values[count++] = strtol(p, &end, 10);
+        p = end;
+        if (*p != ' ' && *p != '\0' && *p != '\r' && *p != '\n') return -1;
+        while (*p == ' ') p++;
+    }
+    return count;
+}
+
+Task* session_create_task(const char *line, int client_id, int user_id) {
+    char cmd[16], filename[256];
+    memset(cmd, 0, sizeof(cmd));
+    memset(filename, 0, sizeof(filename));
+
+    int args = 0;
+    int fields = sscanf(line, "%15s %255s %n", cmd, filename, &args);
+    if (fields < 1) return NULL;
+
+    Task *task = task_get();
+    if (!task) return NULL;
+    task->client_id = client_id;
+    task->user_id = user_id;
+    memcpy(task->command, cmd, sizeof(task->command));
+    if (fields >= 2) {
+        memcpy(task->filename, filename, sizeof(task->filename));
+    } else {
+        task->filename[0] = '\0';
+    }
+    task->result_ready = 0;
+    task->result_code = 0;
+    task->result_message[0] = '\0';
+    task->file_size = 0;
+    task->offset = 0;
+    task->checksum = 0;
+    task->request_id = 0;
+    task->opcode = 0;
+    task->execute = NULL;
+    task->on_complete = NULL;
+    task->context = NULL;
+    task->next = NULL;
+
+    /* Numeric arguments, checked against the file or upload later */
+    long values[2];
+    int count = fields >= 2 ? parse_numbers(line + args, values, 2) : 0;
+    if (strcmp(cmd, "DOWNLOAD") == 0) {
+        task->file_size = count == 2 ? values[1] : -1;
+        task->offset = count >= 1 ? values[0] : count == 0 ? 0 : -1;
+    } else if (strcmp(cmd, "UPLOAD-INIT") == 0) {
+        task->file_size = count == 1 ? values[0] : -1;
+    } else if (strcmp(cmd, "UPLOAD-CHUNK") == 0) {
+        task->offset = count == 1 ? values[0] : -1;
+    }
+
+    return task;
+}
+
+Task* session_create_job(void (*execute)(Task *task), void *context) {
+    Task *task = session_create_task("JOB", -1, -1);
+    if (!task) return NULL;
+    task->execute = execute;
+    task->context = context;
+    return task;
+}
+
+void session_free_job(Task *task) {
+    if (task) task_free(task);
+}
+
+void session_destroy_task(Task *task) {
+    if (!task) return;
+    if (task_cache_count >= TASK_CACHE_MAX) {
+        task_free(task);
+        return;
+    }
+    task->next = task_cache;
+    task_cache = task;
+    task_cache_count++;
+}
+
+void session_release_task_cache(void) {
+    while (task_cache) {
+        Task *task = task_cache;
+        task_cache = task->next;
+        task_free(task);
+    }
+    task_cache_count = 0;
+}
+
+void session_task_stats(TaskStats *stats) {
+    stats->allocated = atomic_load(&tasks_allocated);
+    stats->reused = atomic_load(&tasks_reused);
+    stats->freed = atomic_load(&tasks_freed);
+}
+
+int session_partial_path(UserManager *mgr, int user_id, const char *filename,
+                         char *path, size_t size) {
+    User *user = user_get_by_id(mgr, user_id);
+    if (!user) return -1;
+
+    snprintf(path, size, "%s/%s/%s", SESSION_PARTIAL_DIR, user->username, filename);
+    return 0;
+}
+
+/* ===== RESUMABLE UPLOADS =====
+ * Uploads are received into partial/<user>/<file> and renamed into the
+ * user's directory once complete. A dropped connection leaves the
+ * partial file behind; UPLOAD-RESUME reports its length and the next
+ * upload continues from there. Partials nobody resumes expire. */
+
+/* The partial is not read: a resumed upload's checksum stays unknown */
+long session_partial_offset(UserManager *mgr, int user_id, const char *filename) {
+    char path[512];
+    if (session_partial_path(mgr, user_id, filename, path, sizeof(path)) == -1) return -1;
+
+    struct stat st;
+    if (stat(path, &st) == -1) return errno == ENOENT ? 0 : -1;
+    return st.st_size;
+}
+
+/* Remove the partials in dir untouched for SESSION_PARTIAL_EXPIRY,
+ * skipping any an upload is writing right now */
+static int partials_expire(const char *dir, time_t now) {
+    DIR *d = opendir(dir);
+    if (!d) return 0;
+
+    int expired = 0;
+    struct dirent *dent;
+    while ((dent = readdir(d)) != NULL) {
+        if (dent->d_name[0] == '.') continue;
+
+        char path[600];
+        snprintf(path, sizeof(path), "%s/%s", dir, dent->d_name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) continue;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && now - st.st_mtime > SESSION_PARTIAL_EXPIRY &&
+            flock(fd, LOCK_EX | LOCK_NB) == 0 && unlink(path) == 0) {
+            expired++;
+        }
+        close(fd);
+    }
+    closedir(d);
+    return expired;
+}
+
+void session_expire_partials(UserManager *mgr, int user_id) {
+    User *user = user_get_by_id(mgr, user_id);
+    if (!user) return;
+
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s/%s", SESSION_PARTIAL_DIR, user->username);
+    int expired = partials_expire(dir, time(NULL));
+    if (expired > 0) {
+        printf("[Session] Expired %d partial uploads of %s\n", expired, user->username);
+    }
+}
+
+void session_sweep_partials(void) {
+    DIR *d = opendir(SESSION_PARTIAL_DIR);
+    if (!d) return;
+
+    int expired = 0;
+    time_t now = time(NULL);
+    struct dirent *dent;
+    while ((dent = readdir(d)) != NULL) {
+        if (dent->d_name[0] == '.') continue;
+
+        char dir[512];
+        snprintf(dir, sizeof(dir), "%s/%s", SESSION_PARTIAL_DIR, dent->d_name);
+        expired += partials_expire(dir, now);
+    }
+    closedir(d);
+    printf("[Session] Expired %d abandoned partial uploads\n", expired);
+}
+
+/* Reserve BEFORE accepting upload: parallel uploads cannot overshoot */
+static int upload_reserve(UserManager *mgr, int user_id, long file_size,
+                          char *reply, size_t size) {
+    printf("[Session] Attempting to upload %ld bytes for user %d\n",
+           file_size, user_id);
+
+    if (!user_get_by_id(mgr, user_id)) {
+        snprintf(reply, size, "ERROR: Invalid user\n");
+        return -1;
+    }
+
+    if (user_reserve_quota(mgr, user_id, file_size) == -1) {
+        long available = user_quota_available(mgr, user_id);
+        snprintf(reply, size,
+                 "ERROR: Quota exceeded. Available: %ld MB, Requested: %ld MB\n",
+                 available / (1024*1024), file_size / (1024*1024));
+        printf("[Session] Upload rejected - quota exceeded (available: %ld bytes)\n",
+               available);
+        return -1;
+    }
+    return 0;
+}
+
+/* Reserve the declared upload size against the user's quota */
+int session_upload_begin(UserManager *mgr, int user_id, const char *line,
+                         long offset, long *file_size, char *reply, size_t size) {
+    if (sscanf(line, "SIZE %ld", file_size) != 1 || *file_size < 0) {
+        snprintf(reply, size, "ERROR: Invalid SIZE format\n");
+        return -1;
+    }
+    if (*file_size < offset) {
+        snprintf(reply, size, "ERROR: SIZE is below the resume offset %ld\n", offset);
+        return -1;
+    }
+
+    if (upload_reserve(mgr, user_id, *file_size, reply, size) == -1) return -1;
+
+    snprintf(reply, size, "OK: Send file data\n");
+    return 0;
+}
+
+int session_upload_open(UserManager *mgr, int user_id, const char *filename,
+                        long offset, long file_size,
+                        FileTransfer *t, char *reply, size_t size) {
+    User *user = user_get_by_id(mgr, user_id);
+    char path[512];
+    if (!user || session_partial_path(mgr, user_id, filename, path, sizeof(path)) == -1) {
+        user_release_quota(mgr, user_id, file_size);
+        snprintf(reply, size, "ERROR: Invalid user\n");
+        return -1;
+    }
+
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s/%s", SESSION_PARTIAL_DIR, user->username);
+    mkdir(SESSION_PARTIAL_DIR, 0755);
+    mkdir(dir, 0755);
+
+    /* Create and preallocate before confirming, so a full volume is
+     * reported instead of swallowing the data */
+    if (transfer_open_write(t, path, offset, file_size) == -1) {
+        int err = errno;
+        user_release_quota(mgr, user_id, file_size);
+        if (err == ENOSPC) {
+            if (offset == 0) remove(path);
+            snprintf(reply, size, "ERROR: Not enough disk space\n");
+        } else if (err == EBUSY) {
+            snprintf(reply, size, "ERROR: Upload already in progress\n");
+        } else if (err == ESTALE) {
+            snprintf(reply, size, "ERROR: Partial upload changed, resume again\n");
+        } else {
+            snprintf(reply, size, "ERROR: Cannot create file\n");
+        }
+        printf("[Session] Upload of %s not started: %s", filename, reply);
+        return -1;
+    }
+
+    snprintf(reply, size, "OK: Send file data\n");
+    return 0;
+}
+
+/* Upload failed after session_upload_begin(): drop the reservation */
+void session_upload_abort(UserManager *mgr, int user_id, long file_size) {
+    user_release_quota(mgr, user_id, file_size);
+}
+
+/* Move the partial into place and commit the reservation (journaled).
+ * Runs without user_mutex: packing a large file into the chunk store
+ * would otherwise hold up every other upload of the user. The caller
+ * has claimed the name and indexes the file once this returns 0. */
+static int upload_store(UserManager *mgr, int user_id, const char *filename,
+                        long file_size, char *reply, size_t size) {
+    char partial[512], path[512];
+    session_partial_path(mgr, user_id, filename, partial, sizeof(partial));
+    session_file_path(mgr, user_id, filename, path, sizeof(path));
+    if (rename(partial, path) == -1) {
+        user_release_quota(mgr, user_id, file_size);
+        snprintf(reply, size, "ERROR: Cannot store file\n");
+        return -1;
+    }
+
+    if (mgr->cache) filecache_invalidate(mgr->cache, path);
+
+    if (mgr->chunks) {
+        if (chunkstore_pack(mgr->chunks, path) == -1) {
+            remove(path);
+            user_release_quota(mgr, user_id, file_size);
+            snprintf(reply, size, "ERROR: Cannot store file\n");
+            return -1;
+        }
+    }
+
+    long new_quota = user_commit_quota(mgr, user_id, file_size);
+    if (new_quota == -1) {
+        snprintf(reply, size, "ERROR: Invalid user\n");
+        return -1;
+    }
+
+    printf("[Session] Upload complete. New quota: %ld bytes (%.2f MB)\n",
+           new_quota, new_quota / (1024.0*1024.0));
+
+    snprintf(reply, size,
+             "SUCCESS: File uploaded (%ld bytes). Quota: %.2f / %d MB\n",
+             file_size, new_quota / (1024.0*1024.0), USER_QUOTA_MB);
+    return 0;
+}
+
+/* A name whose upload is being stored, on User.storing under user_mutex */
+typedef struct UploadClaim {
+    char name[FILEINDEX_MAX_NAME];
+    struct UploadClaim *next;
+} UploadClaim;
+
+/* Commit a completed upload. Two uploads of one name can both get this
+ * far: the partial lock only covers the file until it is renamed away.
+ * The first to finish stays, the later one is refused as if it had
+ * asked after it; replacing the file would leave the index, the quota
+ * and the chunk references of the first one behind. The name is claimed
+ * under user_mutex and only published to the index once stored. */
+void session_upload_finish(UserManager *mgr, int user_id, const char *filename,
+                           long file_size, uint32_t checksum,
+                           char *reply, size_t size) {
+    User *user = user_get_by_id(mgr, user_id);
+    if (!user) {
+        snprintf(reply, size, "ERROR: Invalid user\n");
+        return;
+    }
+    FileIndex *files = user_file_index(mgr, user_id); // Takes user_mutex itself
+
+    UploadClaim claim;
+    snprintf(claim.name, sizeof(claim.name), "%s", filename);
+
+    pthread_mutex_lock(&user->user_mutex);
+    int taken = files && fileindex_lookup(files, filename, NULL) == 0;
+    for (UploadClaim *c = user->storing; c && !taken; c = c->next) {
+        taken = strcmp(c->name, claim.name) == 0;
+    }
+    if (!taken) {
+        claim.next = user->storing;
+        user->storing = &claim;
+    }
+    pthread_mutex_unlock(&user->user_mutex);
+
+    if (taken) {
+        char partial[512];
+        session_partial_path(mgr, user_id, filename, partial, sizeof(partial));
+        remove(partial);
+        user_release_quota(mgr, user_id, file_size);
+        snprintf(reply, size, "ERROR: File already exists. Delete it first.\n");
+        printf("[Session] Upload of %s lost the race to another one\n", filename);
+        return;
+    }
+
+    int stored = upload_store(mgr, user_id, filename, file_size, reply, size);
+
+    /* Publish the file, or just give the name back */
+    pthread_mutex_lock(&user->user_mutex);
+    if (stored == 0 && files) {
+        FileEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        snprintf(entry.name, sizeof(entry.name), "%s", filename);
+        entry.size = file_size;
+        entry.mtime = time(NULL);
+        entry.checksum = checksum;
+        fileindex_put(files, &entry);
+    }
+    UploadClaim **link = &user->storing;
+    while (*link != &claim) link = &(*link)->next;
+    *link = claim.next;
+    pthread_mutex_unlock(&user->user_mutex);
+}
+
+void session_checksum_file(UserManager *mgr, int user_id, const char *filename) {
+    FileIndex *files = user_file_index(mgr, user_id);
+    FileEntry entry;
+    if (!files || fileindex_lookup(files, filename, &entry) == -1 ||
+        entry.checksum != 0 || entry.size == 0) {
+        return;
+    }
+
+    FileTransfer t;
+    transfer_init(&t);
+    char *buf = malloc(SESSION_CHECKSUM_BUFFER);
+    if (!buf || session_open_download(mgr, user_id, filename, 0, entry.size, &t, 0) == -1) {
+        free(buf);
+        return;
+    }
+
+    uint32_t crc = 0;
+    while (t.remaining > 0) {
+        long n = transfer_read(&t, buf, SESSION_CHECKSUM_BUFFER);
+        if (n <= 0) break; // Deleted meanwhile: nothing to record
+        crc = transfer_crc32(crc, buf, n);
+    }
+    int complete = t.remaining == 0;
+    transfer_close(&t);
+    free(buf);
+
+    /* A file replaced meanwhile keeps its own (unknown) checksum */
+    if (complete) fileindex_set_checksum(files, &entry, crc);
+}
+
+/* ===== CHUNKED UPLOADS =====
+ * Open chunked uploads live in a small table. Each keeps its partial file
+ * open under an exclusive flock, so UPLOAD, UPLOAD-RESUME and the partial
+ * expiry leave it alone; chunks are written through duplicates of that
+ * descriptor. An upload is only removed while none of its chunks is
+ * being received. */
+
+enum { CHUNK_MISSING, CHUNK_WRITING, CHUNK_STORED };
+
+typedef struct {
+    unsigned int id;            // 0 = free slot
+    int user_id;
+    char filename[256];
+    int fd;                     // Partial file, flock held
+    long file_size;
+    long chunk_count;
+    long stored;                // Chunks on disk
+    long writing;               // Chunks being received
+    unsigned char *state;       // CHUNK_* per chunk
+    uint32_t *crcs;             // CRC32 of each stored chunk
+    time_t last_active;
+} ChunkedUpload;
+
+static ChunkedUpload chunked[SESSION_MAX_CHUNKED];
+static pthread_mutex_t chunked_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int chunked_last_id;
+
+static long chunk_length(const ChunkedUpload *u, long index) {
+    long rest = u->file_size - index * SESSION_UPLOAD_CHUNK;
+    return rest < SESSION_UPLOAD_CHUNK ? rest : SESSION_UPLOAD_CHUNK;
+}
+
+/* Upload id of user_id, any owner for -1 (caller holds chunked_mutex) */
+static ChunkedUpload* chunked_find(const char *id, int user_id) {
+    char *end;
+    unsigned long value = strtoul(id, &end, 10);
+    if (end == id || *end != '\0' || value == 0) return NULL;
+
+    for (int i = 0; i < SESSION_MAX_CHUNKED; i++) {
+        ChunkedUpload *u = &chunked[i];
+        if (u->id == value && (user_id == -1 || u->user_id == user_id)) return u;
+    }
+    return NULL;
+}
+
+/* Free the slot; the caller closes or keeps the descriptor */
+static void chunked_release(ChunkedUpload *u) {
+    free(u->state);
+    free(u->crcs);
+    u->state = NULL;
+    u->crcs = NULL;
+    u->id = 0;
+}
+
+/* Delete the partial and return the reservation of an upload */
+static void chunked_discard(UserManager *mgr, ChunkedUpload *u) {
+    char path[512];
+    if (session_partial_path(mgr, u->user_id, u->filename, path, sizeof(path)) == 0) {
+        unlink(path);
+    }
+    close(u->fd);
+    user_release_quota(mgr, u->user_id, u->file_size);
+    chunked_release(u);
+}
+
+/* Drop uploads untouched for SESSION_PARTIAL_EXPIRY (caller holds chunked_mutex) */
+static void chunked_expire(UserManager *mgr, time_t now) {
+    for (int i = 0; i < SESSION_MAX_CHUNKED; i++) {
+        ChunkedUpload *u = &chunked[i];
+        if (u->id && u->writing == 0 && now - u->last_active > SESSION_PARTIAL_EXPIRY) {
+            printf("[Session] Chunked upload %u of %s expired\n", u->id, u->filename);
+            chunked_discard(mgr, u);
+        }
+    }
+}
+
+int session_chunked_init(UserManager *mgr, int user_id, const char *filename,
+                         long file_size, char *reply, size_t size) {
+    User *user = user_get_by_id(mgr, user_id);
+    char path[512];
+    if (!user || session_partial_path(mgr, user_id, filename, path, sizeof(path)) == -1) {
+        snprintf(reply, size, "ERROR: Invalid user\n");
+        return -1;
+    }
+    if (file_size < 0) {
+        snprintf(reply, size, "ERROR: Use: UPLOAD-INIT <file> <size>\n");
+        return -1;
+    }
+
+    long count = (file_size + SESSION_UPLOAD_CHUNK - 1) / SESSION_UPLOAD_CHUNK;
+    unsigned char *state = calloc(count ? count : 1, sizeof(unsigned char));
+    uint32_t *crcs = calloc(count ? count : 1, sizeof(uint32_t));
+    if (!state || !crcs) {
+        free(state);
+        free(crcs);
+        snprintf(reply, size, "ERROR: Server out of memory\n");
+        return -1;
+    }
+
+    if (upload_reserve(mgr, user_id, file_size, reply, size) == -1) {
+        free(state);
+        free(crcs);
+        return -1;
+    }
+
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s/%s", SESSION_PARTIAL_DIR, user->username);
+    mkdir(SESSION_PARTIAL_DIR, 0755);
+    mkdir(dir, 0755);
+
+    /* Chunks land in any order: size and allocate the whole file now */
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    const char *err = NULL;
+    if (fd == -1) {
+        err = "ERROR: Cannot create file\n";
+    } else if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        err = "ERROR: Upload already in progress\n";
+    } else if (ftruncate(fd, 0) == -1 || ftruncate(fd, file_size) == -1) {
+        err = "ERROR: Cannot create file\n";
+    } else if (file_size > 0 && posix_fallocate(fd, 0, file_size) == ENOSPC) {
+        unlink(path);
+        err = "ERROR: Not enough disk space\n";
+    }
+
+    ChunkedUpload *u = NULL;
+    pthread_mutex_lock(&chunked_mutex);
+    chunked_expire(mgr, time(NULL));
+    for (int i = 0; !err && i < SESSION_MAX_CHUNKED; i++) {
+        if (chunked[i].id == 0) u = &chunked[i];
+    }
+    if (!err && !u) {
+        unlink(path);
+        err = "ERROR: Too many chunked uploads in progress\n";
+    }
+    if (err) {
+        pthread_mutex_unlock(&chunked_mutex);
+        if (fd != -1) close(fd);
+        free(state);
+        free(crcs);
+        user_release_quota(mgr, user_id, file_size);
+        snprintf(reply, size, "%s", err);
+        return -1;
+    }
+
+    if (++chunked_last_id == 0) chunked_last_id = 1;
+    u->id = chunked_last_id;
+    u->user_id = user_id;
+    snprintf(u->filename, sizeof(u->filename), "%s", filename);
+    u->fd = fd;
+    u->file_size = file_size;
+    u->chunk_count = count;
+    u->stored = 0;
+    u->writing = 0;
+    u->state = state;
+    u->crcs = crcs;
+    u->last_active = time(NULL);
+    snprintf(reply, size, "OK: UPLOAD-ID %u CHUNK %d COUNT %ld\n",
+             u->id, SESSION_UPLOAD_CHUNK, count);
+    pthread_mutex_unlock(&chunked_mutex);
+
+    printf("[Session] Chunked upload of %s (%ld bytes, %ld chunks) opened\n",
+           filename, file_size, count);
+    return 0;
+}
+
+int session_chunked_claim(int user_id, const char *id, long *offset, long *length,
+                          char *reply, size_t size) {
+    long index = *offset;
+    int status = -1;
+
+    pthread_mutex_lock(&chunked_mutex);
+    ChunkedUpload *u = chunked_find(id, user_id);
+    if (!u) {
+        snprintf(reply, size, "ERROR: Unknown upload ID\n");
+    } else if (index < 0 || index >= u->chunk_count) {
+        snprintf(reply, size, "ERROR: Chunk index must be 0..%ld\n", u->chunk_count - 1);
+    } else if (u->state[index] == CHUNK_STORED) {
+        snprintf(reply, size, "ERROR: Chunk %ld already stored\n", index);
+    } else if (u->state[index] == CHUNK_WRITING) {
+        snprintf(reply, size, "ERROR: Chunk %ld is being received\n", index);
+    } else {
+        u->state[index] = CHUNK_WRITING;
+        u->writing++;
+        u->last_active = time(NULL);
+        *offset = index * SESSION_UPLOAD_CHUNK;
+        *length = chunk_length(u, index);
+        snprintf(reply, size, "READY: Send %ld bytes\n", *length);
+        status = 0;
+    }
+    pthread_mutex_unlock(&chunked_mutex);
+    return status;
+}
+
+int session_chunked_open(const char *id, long offset, long length, FileTransfer *t) {
+    int status = -1;
+
+    pthread_mutex_lock(&chunked_mutex);
+    ChunkedUpload *u = chunked_find(id, -1);
+    if (u) {
+        status = transfer_open_chunk(t, u->fd, offset, length);
+        if (status == -1) {
+            u->state[offset / SESSION_UPLOAD_CHUNK] = CHUNK_MISSING;
+            u->writing--;
+        }
+    }
+    pthread_mutex_unlock(&chunked_mutex);
+    return status;
+}
+
+void session_chunked_done(const char *id, long offset, int stored, uint32_t checksum,
+                          char *reply, size_t size) {
+    long index = offset / SESSION_UPLOAD_CHUNK;
+
+    pthread_mutex_lock(&chunked_mutex);
+    ChunkedUpload *u = chunked_find(id, -1);
+    if (!u) {
+        snprintf(reply, size, "ERROR: Unknown upload ID\n");
+    } else {
+        u->writing--;
+        u->last_active = time(NULL);
+        if (stored) {
+            u->state[index] = CHUNK_STORED;
+            u->crcs[index] = checksum;
+            u->stored++;
+            snprintf(reply, size, "OK: Chunk %ld stored (%ld/%ld)\n",
+                     index, u->stored, u->chunk_count);
+        } else {
+            u->state[index] = CHUNK_MISSING;
+            snprintf(reply, size, "ERROR: Chunk %ld incomplete, send it again\n", index);
+        }
+    }
+    pthread_mutex_unlock(&chunked_mutex);
+}
+
+int session_chunked_commit(UserManager *mgr, int user_id, const char *id,
+                           char *filename, size_t filename_len,
+                           char *reply, size_t size) {
+    pthread_mutex_lock(&chunked_mutex);
+    ChunkedUpload *u = chunked_find(id, user_id);
+    if (!u) {
+        pthread_mutex_unlock(&chunked_mutex);
+        snprintf(reply, size, "ERROR: Unknown upload ID\n");
+        return -1;
+    }
+    if (u->writing > 0 || u->stored < u->chunk_count) {
+        snprintf(reply, size, "ERROR: %ld of %ld chunks stored\n", u->stored, u->chunk_count);
+        pthread_mutex_unlock(&chunked_mutex);
+        return -1;
+    }
+
+    /* The file checksum follows from the chunk checksums, unless one of
+     * them is not known (0) */
+    uint32_t crc = 0;
+    for (long i = 0; i < u->chunk_count; i++) {
+        if (u->crcs[i] == 0) {
+            crc = 0;
+            break;
+        }
+        crc = transfer_crc32_combine(crc, u->crcs[i], chunk_length(u, i));
+    }
+    snprintf(filename, filename_len, "%s", u->filename);
+    long file_size = u->file_size;
+    int fd = u->fd;
+    chunked_release(u);
+    pthread_mutex_unlock(&chunked_mutex);
+
+    /* Keep the lock until the file has left partial/ */
+    session_upload_finish(mgr, user_id, filename, file_size, crc, reply, size);
+    close(fd);
+    return strncmp(reply, "SUCCESS", 7) == 0 ? 0 : -1;
+}
+
+int session_chunked_abort(UserManager *mgr, int user_id, const char *id,
+                          char *reply, size_t size) {
+    int status = -1;
+
+    pthread_mutex_lock(&chunked_mutex);
+    ChunkedUpload *u = chunked_find(id, user_id);
+    if (!u) {
+        snprintf(reply, size, "ERROR: Unknown upload ID\n");
+    } else if (u->writing > 0) {
+        snprintf(reply, size, "ERROR: Chunks are still being received\n");
+    } else {
+        chunked_discard(mgr, u);
+        snprintf(reply, size, "OK: Upload aborted\n");
+        status = 0;
+    }
+    pthread_mutex_unlock(&chunked_mutex);
+    return status;
+}
+
+/* Open path from disk, as stored plain or as a chunk recipe */
+static int open_stored(UserManager *mgr, const char *path, off_t offset, long length,
+                       FileTransfer *t) {
+    if (mgr->chunks) return chunkstore_open_read(mgr->chunks, path, offset, length, t);
+    return transfer_open_read(t, path, offset, length);
+}
+
+/* Read a whole small file into the cache (NULL on error) */
+static FileCacheEntry* cache_fill(UserManager *mgr, const char *path, long size) {
+    unsigned long generation = filecache_generation(mgr->cache, path);
+    char *data = malloc(size > 0 ? size : 1);
+    FileTransfer t;
+    if (!data || open_stored(mgr, path, 0, size, &t) == -1) {
+        free(data);
+        return NULL;
+    }
+
+    long done = 0;
+    while (done < size) {
+        long n = transfer_read(&t, data + done, size - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    transfer_close(&t);
+    if (done < size) {
+        free(data);
+        return NULL;
+    }
+    return filecache_put(mgr->cache, path, data, size, generation);
+}
+
+int session_open_download(UserManager *mgr, int user_id, const char *filename,
+                          off_t offset, long length, FileTransfer *t, int fill) {
+    char path[512];
+    if (session_file_path(mgr, user_id, filename, path, sizeof(path)) == -1) return -1;
+
+    /* Small files come from memory; the index knows the size for free */
+    FileEntry entry;
+    FileIndex *files = user_file_index(mgr, user_id);
+    int missed = 0;
+    if (mgr->cache && files && fileindex_lookup(files, filename, &entry) == 0 &&
+        entry.size <= FILECACHE_MAX_FILE) {
+        FileCacheEntry *e = filecache_get(mgr->cache, path);
+        if (e && e->size != entry.size) {
+            filecache_release(e); // Replaced meanwhile; the disk decides
+            e = NULL;
+        } else if (!e && fill) {
+            e = cache_fill(mgr, path, entry.size);
+        } else if (!e) {
+            missed = 1;
+        }
+        if (e && offset + length <= e->size) {
+            return transfer_open_memory(t, e->data, offset, length, filecache_release, e);
+        }
+        if (e) filecache_release(e);
+    }
+
+    if (open_stored(mgr, path, offset, length, t) == -1) return -1;
+    return missed;
+}
+
+void session_fill_cache(UserManager *mgr, int user_id, const char *filename) {
+    char path[512];
+    FileEntry entry;
+    FileIndex *files = user_file_index(mgr, user_id);
+    if (!mgr->cache || !files ||
+        session_file_path(mgr, user_id, filename, path, sizeof(path)) == -1 ||
+        fileindex_lookup(files, filename, &entry) == -1 || entry.size > FILECACHE_MAX_FILE) {
+        return;
+    }
+
+    /* A fill that lost the race to another one only served itself */
+    FileCacheEntry *e = cache_fill(mgr, path, entry.size);
+    if (e) filecache_release(e);
+}
+
+int session_remove_file(UserManager *mgr, const char *path) {
+    int status = mgr->chunks ? chunkstore_remove(mgr->chunks, path) : remove(path);
+
+    /* After the change: a fill that overlapped it sees a new generation */
+    if (mgr->cache) filecache_invalidate(mgr->cache, path);
+    return status;
+}
+
+/* ===== LIST ===== */
+
+#define LIST_BATCH 32           // Entries per session_list_next call
+#define LIST_RULE "------------------------------------------------------------\n"
+
+int session_is_command(const char *line, const char *command) {
+    size_t len = strlen(command);
+    return strncmp(line, command, len) == 0 && (line[len] == '\0' || line[len] == ' ');
+}
+
+int session_list_begin(UserManager *mgr, int user_id, const char *line,
+                       ListCursor *cursor, char *reply, size_t size) {
+    char cmd[16], after[FILEINDEX_MAX_NAME], limit[16], prefix[FILEINDEX_MAX_NAME];
+    after[0] = limit[0] = prefix[0] = '\0';
+
+    int fields = sscanf(line, "%15s %255s %15s %255s", cmd, after, limit, prefix);
+    char *end = limit;
+    long max = fields >= 3 ? strtol(limit, &end, 10) : 0;
+    if (fields < 1 || *end != '\0' || max < 0) {
+        snprintf(reply, size, "ERROR: Use: LIST [<cursor> [<limit> [<prefix>]]]\n");
+        return -1;
+    }
+
+    User *user = user_get_by_id(mgr, user_id);
+    if (!user || !user_file_index(mgr, user_id)) {
+        snprintf(reply, size, "ERROR: Cannot read file list\n");
+        return -1;
+    }
+
+    memset(cursor, 0, sizeof(*cursor));
+    if (strcmp(after, "-") != 0) memcpy(cursor->after, after, sizeof(cursor->after));
+    memcpy(cursor->prefix, prefix, sizeof(cursor->prefix));
+    cursor->remaining = max > 0 ? max : -1;
+
+    snprintf(reply, size, "Files for %s:\n%-40s %15s\n" LIST_RULE,
+             user->username, "Filename", "Size");
+    return 0;
+}
+
+size_t session_list_next(UserManager *mgr, int user_id, ListCursor *cursor,
+                         char *out, size_t size) {
+    FileIndex *files = user_file_index(mgr, user_id);
+    FileEntry entries[LIST_BATCH];
+    int want = LIST_BATCH;
+    int more = 0;
+    int n = 0;
+    size_t len = 0;
+
+    if (cursor->remaining >= 0 && cursor->remaining < want) want = cursor->remaining;
+    if (files) {
+        n = fileindex_list(files, cursor->after, cursor->prefix, entries, want, &more);
+    }
+
+    for (int i = 0; i < n; i++) {
+        /* Format file size nicely */
+        char size_str[32];
+        long file_size = entries[i].size;
+        if (file_size < 1024) {
+            snprintf(size_str, sizeof(size_str), "%ld B", file_size);
+        } else if (file_size < 1024*1024) {
+            snprintf(size_str, sizeof(size_str), "%.2f KB", file_size / 1024.0);
+        } else {
+            snprintf(size_str, sizeof(size_str), "%.2f MB", file_size / (1024.0*1024.0));
+        }
+        len += snprintf(out + len, size - len, "%-40.255s %15s\n", entries[i].name, size_str);
+    }
+
+    if (n > 0) {
+        memcpy(cursor->after, entries[n - 1].name, sizeof(cursor->after));
+        cursor->listed += n;
+        if (cursor->remaining > 0) cursor->remaining -= n;
+    }
+    if (more && cursor->remaining != 0) return len;
+
+    /* Last batch: totals cover all of the user's files, not just this page */
+    int file_count = 0;
+    long total_size = 0;
+    if (files) fileindex_totals(files, &file_count, &total_size);
+    long quota_used = user_quota_used(mgr, user_id);
+
+    if (cursor->listed == 0) len += snprintf(out + len, size - len, "(no files)\n");
+    len += snprintf(out + len, size - len,
+                    LIST_RULE "Total files: %d\n"
+                    "Quota used: %.2f / %d MB (%.1f%%)\n"
+                    "Available: %.2f MB\n",
+                    file_count, quota_used / (1024.0*1024.0), USER_QUOTA_MB,
+                    (quota_used * 100.0) / USER_QUOTA_BYTES,
+                    user_quota_available(mgr, user_id) / (1024.0*1024.0));
+    if (more) {
+        len += snprintf(out + len, size - len, "NEXT %.255s\n", cursor->after);
+    } else {
+        len += snprintf(out + len, size - len, "END\n");
+    }
+
+    cursor->done = 1;
+    return len;
+}
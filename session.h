@@ -0,0 +1,184 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "queue.h"
+#include "transfer.h"
+#include "utils.h"
+
+/* Protocol logic shared by the threaded and the reactor front-ends.
+ * Nothing in here touches a socket: callers pass in a received line and
+ * get back the reply text to send. */
+
+#define SESSION_WELCOME "Welcome! Commands: REGISTER <user> <pass>, LOGIN <user> <pass>\n"
+
+/* Load shedding replies, with a retry-after hint in ms: a connection
+ * turned away instead of the welcome, a command that was shed */
+#define SESSION_BUSY "ERROR: Server busy, retry after %ld ms\n"
+#define SESSION_OVERLOADED "ERROR: Server overloaded, retry after %ld ms\n"
+
+/* Build "users/<name>/<file>" for a user */
+int session_file_path(UserManager *mgr, int user_id, const char *filename,
+                      char *path, size_t size);
+
+/* Auth phase: handle REGISTER/LOGIN (returns user_id once logged in, else -1) */
+int session_auth(UserManager *mgr, const char *line, char *reply, size_t size);
+
+#define TASK_CACHE_MAX 64        // Spare tasks kept per session-owning thread
+
+/* Task allocation counters (process-wide) */
+typedef struct {
+    long allocated;             // Tasks obtained from malloc
+    long reused;                // Tasks recycled from a thread's cache
+    long freed;                 // Tasks returned to the heap
+} TaskStats;
+
+/* Command phase: build a task for the worker pool (NULL if the line is empty).
+ * "DOWNLOAD <file> [<offset> [<length>]]" fills in the requested range,
+ * UPLOAD-INIT its size and UPLOAD-CHUNK its index.
+ * Tasks are recycled per thread: destroy on the thread that created them. */
+Task* session_create_task(const char *line, int client_id, int user_id);
+void session_destroy_task(Task *task);
+
+/* A task that runs execute(task) on a worker, with context for it */
+Task* session_create_job(void (*execute)(Task *task), void *context);
+
+/* Free a job nobody hands back to its creator (a background job, on
+ * the worker that ran it): straight to the heap, not into this
+ * thread's cache, so workers do not hoard spares */
+void session_free_job(Task *task);
+
+/* Free the calling thread's spare tasks (call before the thread exits) */
+void session_release_task_cache(void);
+void session_task_stats(TaskStats *stats);
+
+#define SESSION_PARTIAL_DIR "partial"          // partial/<user>/<file>: uploads in progress
+#define SESSION_PARTIAL_EXPIRY (24 * 3600)     // Seconds an abandoned partial is kept
+#define SESSION_PARTIAL_SCAN_INTERVAL 600      // Seconds between expiry scans of one user
+
+/* Build "partial/<name>/<file>", where an upload is received */
+int session_partial_path(UserManager *mgr, int user_id, const char *filename,
+                         char *path, size_t size);
+
+/* UPLOAD-RESUME: bytes of filename already received (0 if none, -1 on
+ * error) */
+long session_partial_offset(UserManager *mgr, int user_id, const char *filename);
+
+/* Delete abandoned partial uploads: of one user (a background worker
+ * job, see worker_pool_expire_partials), or of everyone at startup */
+void session_expire_partials(UserManager *mgr, int user_id);
+void session_sweep_partials(void);
+
+/* Upload: reserve "SIZE <bytes>" against the quota (0 = send data, -1 = reply is an error).
+ * offset is what a resumed upload already holds. A successful begin must
+ * be followed by exactly one open that fails, finish or abort. */
+int session_upload_begin(UserManager *mgr, int user_id, const char *line,
+                         long offset, long *file_size, char *reply, size_t size);
+
+/* Upload: open the partial file to receive bytes offset..file_size. On
+ * failure the reservation is released and reply holds the error. */
+int session_upload_open(UserManager *mgr, int user_id, const char *filename,
+                        long offset, long file_size,
+                        FileTransfer *t, char *reply, size_t size);
+
+/* Upload: move a fully received file into place, commit its
+ * reservation, add it to the user's file index and format the reply.
+ * With deduplication on, the file is first split into the chunk store,
+ * which reads it once more: reactors hand this to a worker. If another
+ * upload of the same name is stored or being stored, this one is
+ * refused and its partial dropped. */
+void session_upload_finish(UserManager *mgr, int user_id, const char *filename,
+                           long file_size, uint32_t checksum,
+                           char *reply, size_t size);
+
+#define SESSION_CHECKSUM_BUFFER (256 * 1024)   // Bytes read at a time by session_checksum_file
+
+/* Upload: compute the CRC32 a stored file's upload left unknown (its
+ * bytes were spliced) and record it in the file index. Reads the whole
+ * file, so it runs as a background job (worker_pool_checksum). */
+void session_checksum_file(UserManager *mgr, int user_id, const char *filename);
+
+/* Upload: release the reservation of a failed upload (the partial
+ * file stays for UPLOAD-RESUME) */
+void session_upload_abort(UserManager *mgr, int user_id, long file_size);
+
+#define SESSION_UPLOAD_CHUNK (4 * 1024 * 1024)  // Bytes per UPLOAD-CHUNK
+#define SESSION_MAX_CHUNKED 64                  // Chunked uploads open at once
+
+/* Chunked upload, for sending one file over several connections:
+ *   UPLOAD-INIT <file> <size>  ->  OK: UPLOAD-ID <id> CHUNK <bytes> COUNT <n>
+ *   UPLOAD-CHUNK <id> <index>  ->  READY, the chunk's bytes, OK
+ *   UPLOAD-COMMIT <id> (once every chunk is stored) or UPLOAD-ABORT <id>
+ * Init reserves the whole size against the quota and locks the partial
+ * file, chunks are written at their offsets in any order and commit
+ * moves the file into place like a finished upload. */
+int session_chunked_init(UserManager *mgr, int user_id, const char *filename,
+                         long file_size, char *reply, size_t size);
+
+/* UPLOAD-CHUNK, on a worker: claim chunk *offset (an index) of upload id
+ * and turn it into its byte offset and length (-1 = reply is an error) */
+int session_chunked_claim(int user_id, const char *id, long *offset, long *length,
+                          char *reply, size_t size);
+
+/* UPLOAD-CHUNK, before sending READY: open the claimed chunk (-1 if the
+ * upload was aborted meanwhile; the claim is then dropped) */
+int session_chunked_open(const char *id, long offset, long length, FileTransfer *t);
+
+/* UPLOAD-CHUNK: record a chunk as stored (or, with stored 0, as missing
+ * again) and format the reply */
+void session_chunked_done(const char *id, long offset, int stored, uint32_t checksum,
+                          char *reply, size_t size);
+
+/* UPLOAD-COMMIT: store the file (0, its name in filename) or -1 */
+int session_chunked_commit(UserManager *mgr, int user_id, const char *id,
+                           char *filename, size_t filename_len,
+                           char *reply, size_t size);
+int session_chunked_abort(UserManager *mgr, int user_id, const char *id,
+                          char *reply, size_t size);
+
+/* Download: open length bytes of a stored file from offset for sending,
+ * reassembling them from the chunk store when deduplication is on.
+ * Small files come from the cache; on a miss, fill reads the file into
+ * it first. Event loops must not block on that read: they pass 0, get
+ * the file streamed from disk and 1 back, and leave the fill to a
+ * worker (session_fill_cache). Returns 0 or 1, -1 on error. */
+int session_open_download(UserManager *mgr, int user_id, const char *filename,
+                          off_t offset, long length, FileTransfer *t, int fill);
+
+/* Read a small stored file into the download cache */
+void session_fill_cache(UserManager *mgr, int user_id, const char *filename);
+
+/* Delete a stored file, dropping its chunk references (0 or -1) */
+int session_remove_file(UserManager *mgr, const char *path);
+
+#define SESSION_LIST_CHUNK 16384    // Buffer size for session_list_next
+
+/* Progress of one streamed LIST reply. The cursor is the last name sent:
+ * listings are sorted by name, so paging stays consistent while files
+ * come and go. */
+typedef struct {
+    char after[FILEINDEX_MAX_NAME];     // Last name sent ("" = from the start)
+    char prefix[FILEINDEX_MAX_NAME];    // Only names starting with this
+    long remaining;             // Entries still wanted (-1 = all)
+    int listed;                 // Entries sent so far
+    int done;                   // Footer and END/NEXT line sent
+} ListCursor;
+
+/* Is line the given command (first word)? */
+int session_is_command(const char *line, const char *command);
+
+/* LIST: parse "LIST [<cursor> [<limit> [<prefix>]]]" and format the header
+ * (0, or -1 if reply is an error). Cursor "-" starts at the beginning,
+ * limit 0 means no limit. */
+int session_list_begin(UserManager *mgr, int user_id, const char *line,
+                       ListCursor *cursor, char *reply, size_t size);
+
+/* LIST: format the next batch of entries into out (at least
+ * SESSION_LIST_CHUNK bytes) and return its length. The last batch ends
+ * with the totals and "NEXT <cursor>" if the limit cut the listing
+ * short, else "END"; cursor->done is set once it has been produced. */
+size_t session_list_next(UserManager *mgr, int user_id, ListCursor *cursor,
+                         char *out, size_t size);
+
+#endif
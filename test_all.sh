@@ -17,23 +17,21 @@ sleep 2
 
 # Run test clients
 echo "Running test clients..."
+CLIENT_PIDS=""
 for i in {1..3}; do
     {
         echo "REGISTER testuser$i pass$i"
-        sleep 0.3
         echo "LOGIN testuser$i pass$i"
-        sleep 0.3
         echo "UPLOAD utils.h"
-        sleep 0.5
         echo "LIST"
-        sleep 0.3
         echo "DELETE utils.h"
-        sleep 0.3
         echo "QUIT"
     } | ./client &
+    CLIENT_PIDS="$CLIENT_PIDS $!"
 done
 
-wait
+# Only the clients: the server is a background job too
+wait $CLIENT_PIDS
 
 # Shutdown server
 sleep 2
@@ -44,15 +42,27 @@ echo ""
 echo "Valgrind Report:"
 cat valgrind.log | grep -A 20 "LEAK SUMMARY"
 
+echo ""
+echo "========================================="
+echo "PROTOCOL TEST (resume, ranges, chunks, protocol 2)"
+echo "========================================="
+
+# Every front-end and storage mode; server output in protocol_server.log
+rm -f protocol_server.log
+for mode in "" "-m reactor" "-d" "-m reactor -d -p workers" "-p workers"; do
+    ./test_protocol.sh ./server $mode
+done
+
 echo ""
 echo "========================================="
 echo "RACE CONDITION TEST (ThreadSanitizer)"
 echo "========================================="
 
-# Rebuild with TSan
+# Rebuild with TSan; the clients stay a normal build
 make clean
+make client
 gcc -Wall -Wextra -pthread -g -fsanitize=thread \
-    -o server_tsan server.c queue.c threadpool.c utils.c
+    -o server_tsan server.c queue.c threadpool.c reactor.c session.c transfer.c pipeline.c multiplex.c linereader.c scheduler.c journal.c userdb.c fileindex.c chunkstore.c filecache.c sha256.c utils.c
 
 # Run with TSan
 ./server_tsan &
@@ -61,27 +71,23 @@ SERVER_PID=$!
 sleep 2
 
 # Concurrent stress test
+CLIENT_PIDS=""
 for i in {1..5}; do
     {
         echo "REGISTER racetest$i pass$i"
-        sleep 0.2
         echo "LOGIN racetest$i pass$i"
-        sleep 0.2
         echo "UPLOAD utils.h"
-        sleep 0.3
         echo "UPLOAD queue.c"
-        sleep 0.3
         echo "LIST"
-        sleep 0.2
         echo "DELETE utils.h"
-        sleep 0.2
         echo "LIST"
-        sleep 0.2
         echo "QUIT"
     } | ./client &
+    CLIENT_PIDS="$CLIENT_PIDS $!"
 done
 
-wait
+# Only the clients: the server is a background job too
+wait $CLIENT_PIDS
 
 sleep 2
 kill -INT $SERVER_PID
@@ -0,0 +1,288 @@
+#!/bin/bash
+# Protocol cases against one server instance:
+#
+#   ./test_protocol.sh <server binary> [server options...]
+#
+# Each case below names the protocol surface it covers. Runs in a
+# scratch directory; the server's output is appended to
+# protocol_server.log here. Exit status: failed cases.
+
+SERVER=$(realpath "$1")
+shift
+CLIENT=$(realpath ./client)
+PORT=${PORT:-8080}
+LOG=$(pwd)/protocol_server.log
+WORK=$(mktemp -d)
+FAILED=0
+
+check() {
+    if [ "$2" -eq 0 ]; then
+        echo "  PASS $1"
+    else
+        echo "  FAIL $1"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+# Run client commands, one per argument, inside directory $1
+client_in() {
+    local dir=$1
+    shift
+    (cd "$dir" && printf '%s\n' "$@" | timeout 300 "$CLIENT" 127.0.0.1 "$PORT") \
+        > "$dir/client.out" 2>&1
+}
+
+# Raw text session on fd 3; every reply line lands in LINE
+raw_open() {
+    exec 3<>/dev/tcp/127.0.0.1/"$PORT" && read -r -t 30 LINE <&3
+}
+raw() {
+    printf '%s\n' "$1" >&3
+    LINE=""
+    read -r -t 60 LINE <&3
+}
+raw_close() {
+    exec 3<&-
+}
+
+# One v2 frame: frame <request id> <opcode> [payload]
+frame() {
+    local id=$1 op=$2 payload=$3
+    local len=${#payload}
+    printf "$(printf '\\x%02x' $((len >> 24 & 255)) $((len >> 16 & 255)) \
+        $((len >> 8 & 255)) $((len & 255)) $((id >> 24 & 255)) $((id >> 16 & 255)) \
+        $((id >> 8 & 255)) $((id & 255)) $((op >> 8 & 255)) $((op & 255)) 0 0)"
+    printf '%s' "$payload"
+}
+
+cd "$WORK" || exit 1
+echo "=== $(basename "$SERVER") $* ===" >> "$LOG"
+"$SERVER" "$@" "$PORT" >> "$LOG" 2>&1 &
+SERVER_PID=$!
+
+# Sanitizer and valgrind builds take a while to listen
+for i in $(seq 150); do
+    (exec 3<>/dev/tcp/127.0.0.1/"$PORT") 2>/dev/null && break
+    sleep 0.2
+done
+if ! kill -0 "$SERVER_PID" 2>/dev/null; then
+    echo "  FAIL $(basename "$SERVER") $* did not start, see $LOG"
+    rm -rf "$WORK"
+    exit 1
+fi
+
+echo "Protocol cases: $(basename "$SERVER") $*"
+mkdir a b c
+head -c 9437184 /dev/urandom > a/big.bin      # Past 8 MB: chunked up, 4 streams down
+head -c 70000 /dev/urandom > a/small.bin
+
+client_in a "REGISTER proto pw" "LOGIN proto pw" "UPLOAD big.bin" "UPLOAD small.bin" \
+    "DOWNLOAD big.bin" "QUIT"
+
+# UPLOAD-INIT/CHUNK/COMMIT over several connections for a large file
+grep -q "SUCCESS: File uploaded (9437184 bytes)" a/client.out && grep -q "UPLOAD-ID" a/client.out
+check "chunked upload" $?
+
+# Parallel ranged DOWNLOAD streams of a large file
+grep -q "4 streams" a/client.out && cmp -s a/big.bin a/downloaded_big.bin
+check "parallel download" $?
+
+# Ranged DOWNLOAD
+raw_open
+raw "LOGIN proto pw"
+raw "DOWNLOAD small.bin 5 100"
+STATUS=1
+if [ "$LINE" = "SIZE: 100 RANGE 5/70000" ]; then
+    head -c 100 <&3 > range.out
+    tail -c +6 a/small.bin | head -c 100 | cmp -s - range.out
+    STATUS=$?
+fi
+raw "QUIT"
+raw_close
+check "ranged DOWNLOAD" $STATUS
+
+# UPLOAD-INIT then UPLOAD-ABORT: the ID is gone afterwards
+raw_open
+raw "LOGIN proto pw"
+raw "UPLOAD-INIT aborted.bin 5000000"
+ID=$(sed -n 's/^OK: UPLOAD-ID \([0-9]*\).*/\1/p' <<< "$LINE")
+raw "UPLOAD-ABORT $ID"
+ABORTED=$LINE
+raw "UPLOAD-COMMIT $ID"
+COMMITTED=$LINE
+raw "QUIT"
+raw_close
+[ -n "$ID" ] && [ "$ABORTED" = "OK: Upload aborted" ] && [[ $COMMITTED == ERROR* ]]
+check "UPLOAD-ABORT" $?
+
+# A connection dropped right after UPLOAD-CHUNK (a worker may be claiming
+# the chunk then) must not pin the upload: UPLOAD-ABORT has to go through.
+# The unread LIST reply turns each close into a reset.
+STATUS=0
+for attempt in $(seq 10); do
+    raw_open
+    raw "LOGIN proto pw"
+    raw "UPLOAD-INIT dropped.bin 5000000"
+    ID=$(sed -n 's/^OK: UPLOAD-ID \([0-9]*\).*/\1/p' <<< "$LINE")
+    printf 'LIST\n' >&3
+    sleep 0.1
+    printf 'UPLOAD-CHUNK %s 0\n' "$ID" >&3
+    raw_close
+    for i in $(seq 20); do
+        raw_open
+        raw "LOGIN proto pw"
+        raw "UPLOAD-ABORT $ID"
+        ABORTED=$LINE
+        raw "QUIT"
+        raw_close
+        [[ $ABORTED == *"still being received"* ]] || break
+        sleep 0.5
+    done
+    [ -n "$ID" ] && [ "$ABORTED" = "OK: Upload aborted" ] || STATUS=1
+done
+check "UPLOAD-CHUNK connection dropped" $STATUS
+
+# Connection dropped mid-upload, then UPLOAD-RESUME from the kept offset
+head -c 3000000 /dev/urandom > b/resume.bin
+raw_open
+raw "LOGIN proto pw"
+raw "UPLOAD resume.bin"
+raw "SIZE 3000000"
+head -c 1000000 b/resume.bin >&3
+sleep 0.3
+raw_close
+# The server may still be winding up the dropped session and hold the
+# partial: that resume is refused and has to be retried
+for i in $(seq 20); do
+    client_in b "LOGIN proto pw" "UPLOAD-RESUME resume.bin" "DOWNLOAD resume.bin" "QUIT"
+    grep -q "already in progress" b/client.out || break
+    sleep 0.5
+done
+grep -q "OFFSET [1-9]" b/client.out && cmp -s b/resume.bin b/downloaded_resume.bin
+check "UPLOAD-RESUME" $?
+
+# A DELETE during a DOWNLOAD does not cut it short, chunk store or not
+head -c 31457280 /dev/urandom > b/held.bin
+client_in b "LOGIN proto pw" "UPLOAD held.bin" "QUIT"
+raw_open
+raw "LOGIN proto pw"
+raw "DOWNLOAD held.bin"
+STATUS=1
+if [ "$LINE" = "SIZE: 31457280" ]; then
+    head -c 1048576 <&3 > held.out
+    client_in c "LOGIN proto pw" "DELETE held.bin" "QUIT"
+    timeout 60 head -c 30408704 <&3 >> held.out
+    grep -q "OK: File deleted" c/client.out && cmp -s b/held.bin held.out
+    STATUS=$?
+fi
+raw_close
+check "DELETE during DOWNLOAD" $STATUS
+
+# A SIZE line too long to read ends the session instead of leaving the
+# upload bytes to be taken as commands
+raw_open
+raw "LOGIN proto pw"
+raw "UPLOAD long.bin"
+raw "SIZE $(printf '%05000d' 1)"
+[ "$LINE" = "ERROR: Line too long" ]
+check "long SIZE line" $?
+raw_close
+
+# PROTOCOL 2: replies framed, out of order, ending with QUIT's
+raw_open
+raw "LOGIN proto pw"
+raw "PROTOCOL 2"
+STATUS=1
+if [ "$LINE" = "OK: PROTOCOL 2" ]; then
+    { frame 1 1; frame 2 2 small.bin; frame 3 2 missing.bin; frame 4 7; } >&3
+    timeout 60 cat <&3 > v2.out
+    grep -aq "Files for proto" v2.out && grep -aq "not found" v2.out &&
+        grep -aq "Goodbye!" v2.out && [ "$(stat -c %s v2.out)" -gt 70000 ]
+    STATUS=$?
+fi
+raw_close
+check "PROTOCOL 2 framing" $STATUS
+
+# v2 replies take turns: a LIST asked for while downloads are being
+# sent is answered before they end
+raw_open
+raw "LOGIN proto pw"
+raw "PROTOCOL 2"
+STATUS=1
+if [ "$LINE" = "OK: PROTOCOL 2" ]; then
+    { frame 1 2 big.bin; frame 2 2 big.bin; frame 3 2 big.bin; } >&3
+    sleep 1
+    { frame 4 1; frame 5 7; } >&3
+    timeout 60 cat <&3 > v2turns.out
+    AT=$(grep -abo "Files for proto" v2turns.out | head -1 | cut -d: -f1)
+    [ -n "$AT" ] && [ "$AT" -lt 18874368 ] && grep -aq "Goodbye!" v2turns.out &&
+        [ "$(stat -c %s v2turns.out)" -gt 28311552 ]
+    STATUS=$?
+fi
+raw_close
+check "PROTOCOL 2 replies take turns" $STATUS
+
+# v2 uploads in DATA frames: right behind their request, interleaved
+# with another upload's, after UPLOAD_RESUME's OFFSET, and one chunk of
+# an UPLOAD-INIT sent on the same connection before it switched
+raw_open
+raw "LOGIN proto pw"
+raw "UPLOAD-INIT v2chunk.bin 6"
+ID=$(sed -n 's/^OK: UPLOAD-ID \([0-9]*\).*/\1/p' <<< "$LINE")
+raw "PROTOCOL 2"
+{ frame 1 8 "v2a.bin 5"; frame 2 8 "v2b.bin 11"; frame 2 256 "hello "
+  frame 1 256 "apple"; frame 2 256 "world"; frame 3 10 "$ID 0"; frame 3 256 "chunk!"
+  frame 4 9 "v2c.bin 4"; } >&3
+sleep 1
+{ frame 4 256 "more"; frame 5 5 "$ID"; frame 6 7; } >&3
+timeout 60 cat <&3 > v2up.out
+raw_close
+client_in b "LOGIN proto pw" "DOWNLOAD v2a.bin" "DOWNLOAD v2b.bin" "DOWNLOAD v2c.bin" \
+    "DOWNLOAD v2chunk.bin" "QUIT"
+[ "$(grep -ac "SUCCESS: File uploaded" v2up.out)" -eq 4 ] && grep -aq "OFFSET 0" v2up.out &&
+    [ "$(cat b/downloaded_v2a.bin b/downloaded_v2b.bin b/downloaded_v2c.bin \
+        b/downloaded_v2chunk.bin)" = "applehello worldmorechunk!" ]
+check "PROTOCOL 2 uploads" $?
+
+# A v2 client that queues downloads and never reads them must only
+# stall its own session
+raw_open
+raw "LOGIN proto pw"
+raw "PROTOCOL 2"
+for i in $(seq 64); do frame "$i" 2 big.bin; done >&3
+sleep 1
+cp a/small.bin c/small.bin
+client_in c "REGISTER other pw" "LOGIN other pw" "UPLOAD small.bin" \
+    "DOWNLOAD small.bin" "QUIT"
+grep -q "SUCCESS: Download complete" c/client.out
+check "stalled v2 reader" $?
+raw_close
+
+# Concurrent uploads of one name: the stored file is one of them, whole
+STATUS=0
+for round in 1 2 3; do
+    PIDS=""
+    for i in 1 2 3 4; do
+        mkdir -p "race$i"
+        head -c $((200000 + i * 70001)) /dev/zero | tr '\0' "$i" > "race$i/same.bin"
+        client_in "race$i" "LOGIN proto pw" "UPLOAD same.bin" "QUIT" &
+        PIDS="$PIDS $!"
+    done
+    wait $PIDS
+    client_in c "LOGIN proto pw" "DOWNLOAD same.bin" "DELETE same.bin" "QUIT"
+    MATCH=1
+    for i in 1 2 3 4; do
+        cmp -s "race$i/same.bin" c/downloaded_same.bin && MATCH=0
+    done
+    [ $MATCH -eq 0 ] || STATUS=1
+    rm -f c/downloaded_same.bin
+done
+check "concurrent uploads of one name" $STATUS
+
+kill -INT "$SERVER_PID"
+wait "$SERVER_PID"
+check "clean shutdown" $?
+
+cd - > /dev/null
+rm -rf "$WORK"
+exit $FAILED
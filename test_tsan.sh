@@ -7,19 +7,22 @@ echo "========================================="
 # Build client first (normal build)
 echo "Building client..."
 gcc -Wall -Wextra -pthread -O2 -c client.c -o client.o
-gcc -pthread -o client client.o
+gcc -Wall -Wextra -pthread -O2 -c linereader.c -o linereader.o
+gcc -pthread -o client client.o linereader.o
 
 # Build server with ThreadSanitizer
 echo "Building server with ThreadSanitizer..."
 gcc -Wall -Wextra -pthread -g -fsanitize=thread \
-    -o server_tsan server.c queue.c threadpool.c utils.c
+    -o server_tsan server.c queue.c threadpool.c reactor.c session.c transfer.c pipeline.c multiplex.c linereader.c scheduler.c journal.c userdb.c fileindex.c chunkstore.c filecache.c sha256.c utils.c
 
 # Clean old data
-rm -rf users users.txt
+rm -rf users index chunks partial users.txt users.db users.journal
 
 echo ""
 echo "Starting server with ThreadSanitizer..."
-./server_tsan 2>&1 | tee tsan_output.txt &
+# Through a process substitution, so $! is the server: a piped tee would
+# take the SIGINT (and ignore it, being a background job)
+./server_tsan > >(tee tsan_output.txt) 2>&1 &
 SERVER_PID=$!
 
 sleep 3
@@ -27,24 +30,21 @@ sleep 3
 echo "Running 5 concurrent test clients..."
 
 # Run 5 clients concurrently
+CLIENT_PIDS=""
 for i in {1..5}; do
     {
         echo "REGISTER user$i pass$i"
-        sleep 0.3
         echo "LOGIN user$i pass$i"
-        sleep 0.3
         echo "UPLOAD utils.h"
-        sleep 0.5
         echo "LIST"
-        sleep 0.3
         echo "DELETE utils.h"
-        sleep 0.3
         echo "QUIT"
     } | ./client > /dev/null 2>&1 &
+    CLIENT_PIDS="$CLIENT_PIDS $!"
 done
 
-# Wait for all clients to finish
-wait
+# Wait for all clients to finish (the server is a background job too)
+wait $CLIENT_PIDS
 
 sleep 2
 
@@ -53,6 +53,13 @@ echo "Shutting down server..."
 kill -INT $SERVER_PID 2>/dev/null
 wait $SERVER_PID 2>/dev/null
 
+echo ""
+echo "Running the protocol cases (reactor with dedup storage, worker pipelines)..."
+rm -f protocol_server.log
+./test_protocol.sh ./server_tsan -m reactor -d
+./test_protocol.sh ./server_tsan -p workers
+cat protocol_server.log >> tsan_output.txt
+
 echo ""
 echo "========================================="
 echo "ThreadSanitizer Results:"
@@ -1,24 +1,32 @@
 #include "threadpool.h"
+#include "linereader.h"
+#include "multiplex.h"
+#include "pipeline.h"
+#include "session.h"
+#include "transfer.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <dirent.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+
 
 /* Forward declarations */
 static void* client_thread_func(void *arg);
 static void* worker_thread_func(void *arg);
 static int handle_client_session(int socket, UserManager *user_mgr, 
-                                   TaskQueue *task_queue);
-static void execute_task(Task *task, UserManager *user_mgr);
+                                   WorkerThreadPool *worker_pool);
+static void execute_task(Task *task, WorkerThreadPool *pool);
 
 /* ===== CLIENT THREAD POOL ===== */
 
 ClientThreadPool* client_pool_create(int num_threads, ClientQueue *cq,
-                                      TaskQueue *tq, UserManager *um) {
+                                      WorkerThreadPool *wp, UserManager *um) {
     ClientThreadPool *pool = malloc(sizeof(ClientThreadPool));
     if (!pool) return NULL;
     
@@ -30,7 +38,7 @@ ClientThreadPool* client_pool_create(int num_threads, ClientQueue *cq,
     
     pool->num_threads = num_threads;
     pool->client_queue = cq;
-    pool->task_queue = tq;
+    pool->worker_pool = wp;
     pool->user_mgr = um;
     pool->shutdown = 0;
     pthread_mutex_init(&pool->shutdown_mutex, NULL);
@@ -64,6 +72,14 @@ void client_pool_destroy(ClientThreadPool *pool) {
     free(pool);
 }
 
+/* Nothing has been sent on the socket yet, so the reply fits in its buffer */
+void client_pool_reject(int socket, long retry_ms) {
+    char reply[64];
+    int len = snprintf(reply, sizeof(reply), SESSION_BUSY, retry_ms);
+    send(socket, reply, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(socket);
+}
+
 /* Client thread: handles authentication and command dispatch */
 static void* client_thread_func(void *arg) {
     ClientThreadPool *pool = (ClientThreadPool*)arg;
@@ -77,10 +93,18 @@ static void* client_thread_func(void *arg) {
             break; // Shutdown signal
         }
         
+        /* Waited too long behind a standing backlog: turn it away now
+         * rather than serve it late */
+        long retry_ms = client_queue_shed(pool->client_queue, &conn);
+        if (retry_ms > 0) {
+            client_pool_reject(conn.client_socket, retry_ms);
+            continue;
+        }
+        
         printf("[ClientThread] Handling client on socket %d\n", conn.client_socket);
         
         /* Handle the client session (authentication + commands) */
-        handle_client_session(conn.client_socket, pool->user_mgr, pool->task_queue);
+        handle_client_session(conn.client_socket, pool->user_mgr, pool->worker_pool);
         
         /* Close socket when done */
         close(conn.client_socket);
@@ -92,91 +116,89 @@ static void* client_thread_func(void *arg) {
         pthread_mutex_unlock(&pool->shutdown_mutex);
     }
     
+    session_release_task_cache();
     return NULL;
 }
 
-/* Handle authentication and command loop for one client */
+/* Send a LIST reply as its batches are produced */
+static void stream_list(int socket, UserManager *user_mgr, int user_id,
+                        const char *line) {
+    char chunk[SESSION_LIST_CHUNK];
+    ListCursor cursor;
+    
+    int status = session_list_begin(user_mgr, user_id, line, &cursor,
+                                    chunk, sizeof(chunk));
+    send(socket, chunk, strlen(chunk), 0);
+    if (status == -1) return;
+    
+    while (!cursor.done) {
+        size_t len = session_list_next(user_mgr, user_id, &cursor, chunk, sizeof(chunk));
+        if (send(socket, chunk, len, MSG_NOSIGNAL) < 0) return;
+    }
+    
+    printf("[ClientThread] LIST sent %d entries\n", cursor.listed);
+}
+
+/* Store the upload bytes that arrived in the same recv() as the line
+ * before them, then let the pipeline receive the rest */
+static int receive_upload(FileTransfer *t, LineReader *reader, int socket,
+                          WorkerThreadPool *worker_pool) {
+    char early[LINEREADER_SIZE];
+    size_t len = line_reader_take(reader, early,
+                                  t->remaining < (long)sizeof(early) ? (size_t)t->remaining
+                                                                     : sizeof(early));
+    if (len > 0 && transfer_write(t, early, len) == -1) return -1;
+    return pipeline_recv_all(t, socket, worker_pool);
+}
+
+/* Reply to a line that overflowed the reader; the session ends after it */
+static void reject_long_line(int socket) {
+    const char *err = "ERROR: Line too long\n";
+    send(socket, err, strlen(err), MSG_NOSIGNAL);
+    printf("[ClientThread] Line too long on socket %d, closing\n", socket);
+}
+
+/* Handle authentication and command loop for one client. Commands are
+ * read through a buffered reader, so a client may pipeline several of
+ * them; they are answered in order. */
 static int handle_client_session(int socket, UserManager *user_mgr, 
-                                   TaskQueue *task_queue) {
+                                   WorkerThreadPool *worker_pool) {
     char buffer[1024];
+    char reply[256];
     int user_id = -1;
+    LineReader reader;
+    line_reader_init(&reader, socket);
     
     /* Send welcome message */
-    const char *welcome = "Welcome! Commands: REGISTER <user> <pass>, LOGIN <user> <pass>\n";
-    send(socket, welcome, strlen(welcome), 0);
+    send(socket, SESSION_WELCOME, strlen(SESSION_WELCOME), 0);
     
     /* Authentication loop */
     while (user_id == -1) {
-        memset(buffer, 0, sizeof(buffer));
-        int n = recv(socket, buffer, sizeof(buffer) - 1, 0);
+        int n = line_reader_next(&reader, buffer, sizeof(buffer));
         
-        printf("[ClientThread] Received %d bytes from socket %d\n", n, socket);
-        
-        if (n <= 0) {
+        if (n == -2) {
+            reject_long_line(socket);
+            return -1;
+        }
+        if (n < 0) {
             printf("[ClientThread] Client disconnected during auth (socket %d)\n", socket);
             return -1;
         }
         
-        /* Remove newline */
-        buffer[strcspn(buffer, "\r\n")] = 0;
-        
         printf("[ClientThread] Processing command: '%s'\n", buffer);
         
-        char cmd[16], username[MAX_USERNAME], password[MAX_PASSWORD];
-        memset(cmd, 0, sizeof(cmd));
-        memset(username, 0, sizeof(username));
-        memset(password, 0, sizeof(password));
-        
-        int parsed = sscanf(buffer, "%15s %63s %63s", cmd, username, password);
-        
-        printf("[ClientThread] Parsed %d fields: cmd='%s' user='%s' pass='%s'\n", 
-               parsed, cmd, username, password);
-        
-        if (parsed != 3) {
-            const char *err = "ERROR: Invalid format. Use: REGISTER <username> <password>\n";
-            send(socket, err, strlen(err), 0);
-            continue;
-        }
-        
-        if (strcmp(cmd, "REGISTER") == 0) {
-            printf("[ClientThread] Attempting to register user '%s'\n", username);
-            user_id = user_register(user_mgr, username, password);
-            if (user_id == -1) {
-                printf("[ClientThread] Registration failed - username exists\n");
-                const char *err = "ERROR: Username already exists\n";
-                send(socket, err, strlen(err), 0);
-            } else {
-                printf("[ClientThread] Registration successful, user_id=%d\n", user_id);
-                const char *ok = "OK: Registered successfully. Please LOGIN.\n";
-                send(socket, ok, strlen(ok), 0);
-                user_id = -1; // Require login after registration
-            }
-        } else if (strcmp(cmd, "LOGIN") == 0) {
-            printf("[ClientThread] Attempting to login user '%s'\n", username);
-            user_id = user_login(user_mgr, username, password);
-            if (user_id == -1) {
-                printf("[ClientThread] Login failed - invalid credentials\n");
-                const char *err = "ERROR: Invalid credentials\n";
-                send(socket, err, strlen(err), 0);
-            } else {
-                printf("[ClientThread] Login successful, user_id=%d\n", user_id);
-                const char *ok = "OK: Logged in. Commands: UPLOAD <file>, DOWNLOAD <file>, DELETE <file>, LIST, QUIT\n";
-                send(socket, ok, strlen(ok), 0);
-            }
-        } else {
-            printf("[ClientThread] Unknown command: '%s'\n", cmd);
-            const char *err = "ERROR: Use REGISTER or LOGIN\n";
-            send(socket, err, strlen(err), 0);
-        }
+        user_id = session_auth(user_mgr, buffer, reply, sizeof(reply));
+        send(socket, reply, strlen(reply), 0);
     }
     
     /* Command loop */
     while (1) {
-        memset(buffer, 0, sizeof(buffer));
-        int n = recv(socket, buffer, sizeof(buffer) - 1, 0);
-        if (n <= 0) break;
-        
-        buffer[strcspn(buffer, "\r\n")] = 0;
+        int n = line_reader_next(&reader, buffer, sizeof(buffer));
+        if (n == -2) {
+            reject_long_line(socket);
+            break;
+        }
+        if (n < 0) break;
         
         if (strcmp(buffer, "QUIT") == 0) {
             const char *bye = "Goodbye!\n";
@@ -184,178 +206,152 @@ static int handle_client_session(int socket, UserManager *user_mgr,
             break;
         }
         
-        /* Parse command */
-        char cmd[16], filename[256];
-        memset(filename, 0, sizeof(filename));
-        
-        int fields = sscanf(buffer, "%s %s", cmd, filename);
-        if (fields < 1) continue;
-        
-        /* Create task for worker */
-        Task *task = malloc(sizeof(Task));
-        memset(task, 0, sizeof(Task));
-        task->client_id = socket; // Use socket as unique ID
-        task->user_id = user_id;
-        strncpy(task->command, cmd, sizeof(task->command) - 1);
-        task->command[sizeof(task->command) - 1] = '\0';
-        if (fields >= 2) {
-            strncpy(task->filename, filename, sizeof(task->filename) - 1);
-            task->filename[sizeof(task->filename) - 1] = '\0';
+        /* Binary frames from here on, with many requests in flight */
+        if (strcmp(buffer, MULTIPLEX_NEGOTIATE) == 0) {
+            const char *ok = "OK: PROTOCOL 2\n";
+            send(socket, ok, strlen(ok), 0);
+            multiplex_serve(&reader, user_mgr, worker_pool, user_id);
+            break;
         }
-        task->result_ready = 0;
-        pthread_mutex_init(&task->result_mutex, NULL);
-        pthread_cond_init(&task->result_cond, NULL);
-        
-        /* Submit to task queue */
-        if (task_queue_push(task_queue, task) == -1) {
-            const char *err = "ERROR: Server overloaded\n";
-            send(socket, err, strlen(err), 0);
-            pthread_mutex_destroy(&task->result_mutex);
-            pthread_cond_destroy(&task->result_cond);
-            free(task);
+        
+        /* LIST is served from the in-memory index, batch by batch */
+        if (session_is_command(buffer, "LIST")) {
+            stream_list(socket, user_mgr, user_id, buffer);
             continue;
         }
         
-        /* Wait for worker to complete task */
-        pthread_mutex_lock(&task->result_mutex);
-        while (!task->result_ready) {
-            pthread_cond_wait(&task->result_cond, &task->result_mutex);
+        /* Create task for worker */
+        Task *task = session_create_task(buffer, socket, user_id);
+        if (!task) continue;
+        
+        /* Lookups run right here; everything else goes to the worker pool */
+        if (!worker_pool_run_inline(worker_pool, task)) {
+            if (worker_pool_submit(worker_pool, task) == -1) {
+                const char *err = "ERROR: Server overloaded\n";
+                send(socket, err, strlen(err), 0);
+                session_destroy_task(task);
+                continue;
+            }
+            
+            /* Wait for worker to complete task */
+            pthread_mutex_lock(&task->result_mutex);
+            while (!task->result_ready) {
+                pthread_cond_wait(&task->result_cond, &task->result_mutex);
+            }
+            pthread_mutex_unlock(&task->result_mutex);
         }
-        pthread_mutex_unlock(&task->result_mutex);
         
         printf("[ClientThread] Task completed: %s (code=%d)\n", 
                task->command, task->result_code);
         printf("[ClientThread] Result message: %s\n", task->result_message);
         
+        /* A claimed chunk is opened before the client is told to send it */
+        FileTransfer chunk;
+        int chunk_open = strcmp(task->command, "UPLOAD-CHUNK") == 0 && task->result_code == 0;
+        if (chunk_open && session_chunked_open(task->filename, task->offset,
+                                               task->file_size, &chunk) == -1) {
+            snprintf(task->result_message, sizeof(task->result_message),
+                     "ERROR: Cannot open upload\n");
+            chunk_open = 0;
+        }
+        
+        /* A download is opened before SIZE goes out, so a file that
+         * vanished meanwhile still gets an error instead of a short stream */
+        FileTransfer download;
+        if (strcmp(task->command, "DOWNLOAD") == 0 && task->result_code == 0 &&
+            session_open_download(user_mgr, user_id, task->filename, task->offset,
+                                  task->file_size, &download, 1) == -1) {
+            snprintf(task->result_message, sizeof(task->result_message),
+                     "ERROR: Cannot open file\n");
+            task->result_code = -1;
+        }
+        
         /* Send result to client */
         send(socket, task->result_message, strlen(task->result_message), 0);
         
-        /* Handle UPLOAD: receive file data after READY response */
-        if (strcmp(task->command, "UPLOAD") == 0 && task->result_code == 0) {
+        /* Handle UPLOAD-CHUNK: the chunk's bytes follow READY */
+        if (chunk_open) {
+            int status = receive_upload(&chunk, &reader, socket, worker_pool);
+            transfer_close(&chunk);
+            session_chunked_done(task->filename, task->offset, status == 0,
+                                 transfer_checksum(&chunk),
+                                 reply, sizeof(reply));
+            if (status == -1) {
+                printf("[ClientThread] Chunk of upload %s incomplete\n", task->filename);
+                session_destroy_task(task);
+                break;
+            }
+            send(socket, reply, strlen(reply), 0);
+        }
+        
+        /* Handle UPLOAD: receive file data after the READY (or, when
+         * resuming, OFFSET) response */
+        if ((strcmp(task->command, "UPLOAD") == 0 ||
+             strcmp(task->command, "UPLOAD-RESUME") == 0) && task->result_code == 0) {
             /* Expect: SIZE <bytes> */
-            memset(buffer, 0, sizeof(buffer));
-            n = recv(socket, buffer, sizeof(buffer) - 1, 0);
-            if (n > 0) {
-                buffer[strcspn(buffer, "\r\n")] = 0;
-                
+            n = line_reader_next(&reader, buffer, sizeof(buffer));
+            if (n == -2) {
+                /* Upload bytes would follow: the stream is out of step */
+                reject_long_line(socket);
+                session_destroy_task(task);
+                break;
+            }
+            if (n >= 0) {
                 long file_size;
-                if (sscanf(buffer, "SIZE %ld", &file_size) == 1) {
-                    printf("[ClientThread] Attempting to upload %ld bytes for user %d\n", 
-                           file_size, user_id);
+                FileTransfer transfer;
+                if (session_upload_begin(user_mgr, user_id, buffer, task->file_size,
+                                         &file_size, reply, sizeof(reply)) == -1 ||
+                    session_upload_open(user_mgr, user_id, task->filename,
+                                        task->file_size, file_size,
+                                        &transfer, reply, sizeof(reply)) == -1) {
+                    send(socket, reply, strlen(reply), 0);
+                } else {
+                    send(socket, reply, strlen(reply), 0);
+                    printf("[ClientThread] Receiving file data from offset %ld...\n",
+                           task->file_size);
                     
-                    User *user = user_get_by_id(user_mgr, user_id);
-                    if (!user) {
-                        const char *err = "ERROR: Invalid user\n";
-                        send(socket, err, strlen(err), 0);
-                    } else {
-                        /* Check quota BEFORE accepting upload */
-                        pthread_mutex_lock(&user->user_mutex);
-                        long current_quota = user->quota_used;
-                        long available = USER_QUOTA_BYTES - current_quota;
-                        pthread_mutex_unlock(&user->user_mutex);
-                        
-                        printf("[ClientThread] Current quota: %ld bytes, Available: %ld bytes, Requested: %ld bytes\n",
-                               current_quota, available, file_size);
-                        
-                        if (file_size > available) {
-                            char err[256];
-                            snprintf(err, sizeof(err), 
-                                    "ERROR: Quota exceeded. Available: %ld MB, Requested: %ld MB\n",
-                                    available / (1024*1024), file_size / (1024*1024));
-                            send(socket, err, strlen(err), 0);
-                            printf("[ClientThread] Upload rejected - quota exceeded\n");
-                        } else {
-                            /* Send confirmation */
-                            const char *ok = "OK: Send file data\n";
-                            send(socket, ok, strlen(ok), 0);
-                            
-                            /* Receive file data */
-                            char filepath[512];
-                            snprintf(filepath, sizeof(filepath), "users/%s/%s",
-                                    user->username, task->filename);
-                            
-                            FILE *fp = fopen(filepath, "wb");
-                            if (fp) {
-                                long received = 0;
-                                char chunk[4096];
-                                
-                                printf("[ClientThread] Receiving file data...\n");
-                                
-                                while (received < file_size) {
-                                    long to_recv = file_size - received;
-                                    if (to_recv > (long)sizeof(chunk)) to_recv = sizeof(chunk);
-                                    
-                                    int bytes = recv(socket, chunk, to_recv, 0);
-                                    if (bytes <= 0) break;
-                                    
-                                    fwrite(chunk, 1, bytes, fp);
-                                    received += bytes;
-                                }
-                                
-                                fclose(fp);
-                                
-                                if (received == file_size) {
-                                    /* Add to quota */
-                                    pthread_mutex_lock(&user->user_mutex);
-                                    user->quota_used += file_size;
-                                    long new_quota = user->quota_used;
-                                    pthread_mutex_unlock(&user->user_mutex);
-                                    
-                                    printf("[ClientThread] Upload complete. New quota: %ld bytes (%.2f MB)\n", 
-                                           new_quota, new_quota / (1024.0*1024.0));
-                                    
-                                    /* Save user data to persist quota - do this OUTSIDE the user mutex */
-                                    user_manager_save(user_mgr);
-                                    
-                                    char success[256];
-                                    snprintf(success, sizeof(success),
-                                            "SUCCESS: File uploaded (%ld bytes). Quota: %.2f / %d MB\n",
-                                            file_size, new_quota / (1024.0*1024.0), USER_QUOTA_MB);
-                                    send(socket, success, strlen(success), 0);
-                                } else {
-                                    const char *err = "ERROR: Incomplete upload\n";
-                                    send(socket, err, strlen(err), 0);
-                                    remove(filepath);
-                                    printf("[ClientThread] Upload failed - incomplete\n");
-                                }
-                            } else {
-                                const char *err = "ERROR: Cannot create file\n";
-                                send(socket, err, strlen(err), 0);
-                                printf("[ClientThread] Upload failed - cannot create file\n");
-                            }
+                    int status = receive_upload(&transfer, &reader, socket, worker_pool);
+                    if (status == -1 && ftruncate(transfer.file_fd, transfer.offset) == -1) {
+                        /* A resume could skip a hole left by a failed write */
+                        printf("[ClientThread] Cannot trim partial upload\n");
+                    }
+                    
+                    if (status == 0) {
+                        /* Keep the lock until the file has left partial/ */
+                        session_upload_finish(user_mgr, user_id, task->filename,
+                                              file_size, transfer_checksum(&transfer),
+                                              reply, sizeof(reply));
+                        if (transfer_checksum(&transfer) == 0) {
+                            worker_pool_checksum(worker_pool, user_id, task->filename);
                         }
+                        transfer_close(&transfer);
+                        send(socket, reply, strlen(reply), 0);
+                    } else {
+                        transfer_close(&transfer);
+                        /* Keep what arrived: UPLOAD-RESUME continues from it */
+                        const char *err = "ERROR: Incomplete upload, use UPLOAD-RESUME\n";
+                        send(socket, err, strlen(err), MSG_NOSIGNAL);
+                        session_upload_abort(user_mgr, user_id, file_size);
+                        printf("[ClientThread] Upload incomplete, partial kept\n");
                     }
-                } else {
-                    const char *err = "ERROR: Invalid SIZE format\n";
-                    send(socket, err, strlen(err), 0);
                 }
             }
         }
         
-        /* Handle DOWNLOAD: send file data after SIZE response */
+        /* Handle DOWNLOAD: stream exactly the announced SIZE bytes */
         if (strcmp(task->command, "DOWNLOAD") == 0 && task->result_code == 0) {
-            char filepath[512];
-            User *user = user_get_by_id(user_mgr, user_id);
-            snprintf(filepath, sizeof(filepath), "users/%s/%s",
-                    user->username, task->filename);
-            
-            FILE *fp = fopen(filepath, "rb");
-            if (fp) {
-                char chunk[4096];
-                size_t bytes;
-                
-                while ((bytes = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
-                    send(socket, chunk, bytes, 0);
-                }
-                
-                fclose(fp);
+            if (transfer_send_all(&download, socket) == -1) {
+                /* Stream is out of sync with the announced size */
+                printf("[ClientThread] Download of %s failed\n", task->filename);
+                transfer_close(&download);
+                session_destroy_task(task);
+                break;
             }
+            transfer_close(&download);
         }
         
         /* Cleanup task */
-        pthread_mutex_destroy(&task->result_mutex);
-        pthread_cond_destroy(&task->result_cond);
-        free(task);
+        session_destroy_task(task);
     }
     
     return 0;
@@ -363,13 +359,142 @@ static int handle_client_session(int socket, UserManager *user_mgr,
 
 /* ===== WORKER THREAD POOL ===== */
 
+/* Cheap per-thread xorshift for victim selection and placement */
+static unsigned int worker_rand(void) {
+    static __thread unsigned int state = 0;
+    if (state == 0) state = (unsigned int)(uintptr_t)&state | 1;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static int deque_push_back(WorkerDeque *dq, Task *task) {
+    pthread_mutex_lock(&dq->mutex);
+    if (dq->count == WORKER_DEQUE_SIZE) {
+        pthread_mutex_unlock(&dq->mutex);
+        return -1;
+    }
+    dq->tasks[(dq->front + dq->count) % WORKER_DEQUE_SIZE] = task;
+    dq->count++;
+    atomic_store_explicit(&dq->size, dq->count, memory_order_relaxed);
+    pthread_mutex_unlock(&dq->mutex);
+    return 0;
+}
+
+/* Owner end: oldest task first */
+static Task* deque_pop_front(WorkerDeque *dq) {
+    if (atomic_load_explicit(&dq->size, memory_order_relaxed) == 0) return NULL;
+
+    pthread_mutex_lock(&dq->mutex);
+    Task *task = NULL;
+    if (dq->count > 0) {
+        task = dq->tasks[dq->front];
+        dq->front = (dq->front + 1) % WORKER_DEQUE_SIZE;
+        dq->count--;
+        atomic_store_explicit(&dq->size, dq->count, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&dq->mutex);
+    return task;
+}
+
+/* Thief end: newest task, away from the owner */
+static Task* deque_steal_back(WorkerDeque *dq) {
+    if (atomic_load_explicit(&dq->size, memory_order_relaxed) == 0) return NULL;
+
+    pthread_mutex_lock(&dq->mutex);
+    Task *task = NULL;
+    if (dq->count > 0) {
+        dq->count--;
+        task = dq->tasks[(dq->front + dq->count) % WORKER_DEQUE_SIZE];
+        atomic_store_explicit(&dq->size, dq->count, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&dq->mutex);
+    return task;
+}
+
+/* Wake a parked worker that can run work of lane: one of its own, else
+ * one of a lower lane (they always borrow), else one of a higher lane
+ * (it may have a worker to lend). During shutdown wake them all so they
+ * can see the last submit drain. */
+static void worker_pool_notify(WorkerThreadPool *pool, WorkerLane lane) {
+    /* Pairs with the idle increment in worker_next_task() */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool->idle, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&pool->idle_mutex);
+        if (atomic_load(&pool->shutdown)) {
+            for (int i = 0; i < WORKER_LANES; i++) {
+                pthread_cond_broadcast(&pool->lanes[i].idle_cond);
+            }
+        } else {
+            WorkerLaneQueue *target = pool->lanes[lane].idle > 0 ? &pool->lanes[lane] : NULL;
+            for (int i = lane + 1; !target && i < WORKER_LANES; i++) {
+                if (pool->lanes[i].idle > 0) target = &pool->lanes[i];
+            }
+            for (int i = (int)lane - 1; !target && i >= 0; i--) {
+                if (pool->lanes[i].idle > 0) target = &pool->lanes[i];
+            }
+            if (target) pthread_cond_signal(&target->idle_cond);
+        }
+        pthread_mutex_unlock(&pool->idle_mutex);
+    }
+}
+
+static const char *lane_names[WORKER_LANES] = { "interactive", "bulk", "background" };
+
+/* Queue delay each lane's commands may keep up for an interval before
+ * they are shed (per user, see scheduler.h) */
+static const struct {
+    long target_ms;
+    long interval_ms;
+} lane_shedding[WORKER_LANES] = {
+    { 10, 100 },                // Interactive: the work takes microseconds
+    { 500, 5000 },              // Bulk: a COMMIT may hash a whole file
+    { 0, 0 },                   // Background: only jobs, never shed
+};
+
+const char* worker_lane_name(WorkerLane lane) {
+    return lane_names[lane];
+}
+
+/* Home workers per lane: a quarter (at least one) for metadata, one for
+ * maintenance once there are three, the rest for bulk I/O */
+static void worker_pool_assign_lanes(WorkerThreadPool *pool) {
+    int n = pool->num_threads;
+    int counts[WORKER_LANES];
+    counts[LANE_INTERACTIVE] = n / 4 > 1 ? n / 4 : 1;
+    counts[LANE_BACKGROUND] = n >= 3 ? 1 : 0;
+    counts[LANE_BULK] = n - counts[LANE_INTERACTIVE] - counts[LANE_BACKGROUND];
+    
+    int first = 0;
+    for (int lane = 0; lane < WORKER_LANES; lane++) {
+        pool->lanes[lane].first = first;
+        pool->lanes[lane].count = counts[lane];
+        for (int i = first; i < first + counts[lane]; i++) {
+            pool->deques[i].lane = lane;
+        }
+        first += counts[lane];
+    }
+}
+
 WorkerThreadPool* worker_pool_create(int num_threads, TaskQueue *tq,
                                       UserManager *um) {
     WorkerThreadPool *pool = malloc(sizeof(WorkerThreadPool));
     if (!pool) return NULL;
     
     pool->threads = malloc(sizeof(pthread_t) * num_threads);
-    if (!pool->threads) {
+    pool->deques = aligned_alloc(CACHE_LINE_SIZE, sizeof(WorkerDeque) * num_threads);
+    int schedulers = 0;
+    while (schedulers < WORKER_LANES &&
+           (pool->lanes[schedulers].scheduler =
+                scheduler_create(lane_shedding[schedulers].target_ms,
+                                 lane_shedding[schedulers].interval_ms)) != NULL) {
+        schedulers++;
+    }
+    if (!pool->threads || !pool->deques || schedulers < WORKER_LANES) {
+        while (schedulers > 0) scheduler_destroy(pool->lanes[--schedulers].scheduler);
+        free(pool->threads);
+        free(pool->deques);
         free(pool);
         return NULL;
     }
@@ -377,12 +502,42 @@ WorkerThreadPool* worker_pool_create(int num_threads, TaskQueue *tq,
     pool->num_threads = num_threads;
     pool->task_queue = tq;
     pool->user_mgr = um;
-    pool->shutdown = 0;
-    pthread_mutex_init(&pool->shutdown_mutex, NULL);
+    atomic_init(&pool->next, 0);
+    atomic_init(&pool->submitting, 0);
+    atomic_init(&pool->idle, 0);
+    atomic_init(&pool->steals, 0);
+    pool->dispatch = DISPATCH_INLINE;
+    atomic_init(&pool->inlined, 0);
+    atomic_init(&pool->flushed_inline, 0);
+    atomic_init(&pool->shutdown, 0);
+    pthread_mutex_init(&pool->idle_mutex, NULL);
+    
+    for (int lane = 0; lane < WORKER_LANES; lane++) {
+        WorkerLaneQueue *q = &pool->lanes[lane];
+        atomic_init(&q->lent, 0);
+        atomic_init(&q->ran, 0);
+        atomic_init(&q->borrowed, 0);
+        q->idle = 0;
+        pthread_cond_init(&q->idle_cond, NULL);
+    }
+    
+    for (int i = 0; i < num_threads; i++) {
+        WorkerDeque *dq = &pool->deques[i];
+        pthread_mutex_init(&dq->mutex, NULL);
+        dq->front = 0;
+        dq->count = 0;
+        atomic_init(&dq->size, 0);
+        dq->index = i;
+        dq->running = LANE_INTERACTIVE;
+        dq->lending = 0;
+        dq->shed_ms = 0;
+        dq->pool = pool;
+    }
+    worker_pool_assign_lanes(pool);
     
     /* Create worker threads */
     for (int i = 0; i < num_threads; i++) {
-        pthread_create(&pool->threads[i], NULL, worker_thread_func, pool);
+        pthread_create(&pool->threads[i], NULL, worker_thread_func, &pool->deques[i]);
     }
     
     return pool;
@@ -390,9 +545,12 @@ WorkerThreadPool* worker_pool_create(int num_threads, TaskQueue *tq,
 
 void worker_pool_shutdown(WorkerThreadPool *pool) {
     if (!pool) return;
-    pthread_mutex_lock(&pool->shutdown_mutex);
-    pool->shutdown = 1;
-    pthread_mutex_unlock(&pool->shutdown_mutex);
+    pthread_mutex_lock(&pool->idle_mutex);
+    atomic_store(&pool->shutdown, 1);
+    for (int i = 0; i < WORKER_LANES; i++) {
+        pthread_cond_broadcast(&pool->lanes[i].idle_cond);
+    }
+    pthread_mutex_unlock(&pool->idle_mutex);
     task_queue_shutdown(pool->task_queue);
 }
 
@@ -404,47 +562,357 @@ void worker_pool_destroy(WorkerThreadPool *pool) {
         pthread_join(pool->threads[i], NULL);
     }
     
-    pthread_mutex_destroy(&pool->shutdown_mutex);
+    printf("[Server] Worker pool: %ld tasks stolen between workers, %ld commands run inline\n",
+           atomic_load(&pool->steals), atomic_load(&pool->inlined));
+    printf("[Server] Worker pool: %ld upload flushes run by their session, pool full\n",
+           atomic_load(&pool->flushed_inline));
+    
+    for (int lane = 0; lane < WORKER_LANES; lane++) {
+        WorkerLaneQueue *q = &pool->lanes[lane];
+        printf("[Server] Lane %s: %d workers ran %ld tasks, other lanes' workers %ld\n",
+               lane_names[lane], q->count, atomic_load(&q->ran), atomic_load(&q->borrowed));
+        
+        UserQueueStats stats[WORKER_STATS_USERS];
+        int users = scheduler_stats(q->scheduler, stats, WORKER_STATS_USERS);
+        for (int i = 0; i < users; i++) {
+            printf("[Server] Scheduler: user %d queued at most %d %s tasks, "
+                   "ran %ld (cost %ld), shed %ld\n",
+                   stats[i].user_id, stats[i].peak_depth, lane_names[lane],
+                   stats[i].served, stats[i].cost, stats[i].shed);
+        }
+        scheduler_destroy(q->scheduler);
+        pthread_cond_destroy(&q->idle_cond);
+    }
+    
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_mutex_destroy(&pool->deques[i].mutex);
+    }
+    pthread_mutex_destroy(&pool->idle_mutex);
+    free(pool->deques);
     free(pool->threads);
     free(pool);
 }
 
+/* QoS class of a task: metadata unless it moves a whole file's bytes */
+static WorkerLane worker_task_lane(const Task *task) {
+    if (task->execute) return LANE_BULK;                  // Upload writes, index scans,
+                                                          // REGISTER journal syncs
+    if (strcmp(task->command, "UPLOAD-COMMIT") == 0) {    // Stores (maybe dedups) the file
+        return LANE_BULK;
+    }
+    return LANE_INTERACTIVE;
+}
+
+/* Deques a lane's jobs are placed on: its home workers', or everyone's
+ * if it has none */
+static void lane_deques(WorkerThreadPool *pool, WorkerLane lane, int *first, int *count) {
+    *first = pool->lanes[lane].count > 0 ? pool->lanes[lane].first : 0;
+    *count = pool->lanes[lane].count > 0 ? pool->lanes[lane].count : pool->num_threads;
+}
+
+/* Queue a command behind its user's earlier ones in its lane; a bulk job
+ * (or a command the scheduler has no memory for) goes on the shorter of
+ * two candidate bulk deques (0, or -1 after shutdown or if all is full) */
+static int worker_pool_push(WorkerThreadPool *pool, Task *task, WorkerLane lane) {
+    atomic_fetch_add(&pool->submitting, 1);
+    if (atomic_load(&pool->shutdown)) {
+        atomic_fetch_sub(&pool->submitting, 1);
+        worker_pool_notify(pool, lane); // Workers may be waiting for this submit to drain
+        return -1;
+    }
+    
+    if ((!task->execute || lane != LANE_BULK) &&
+        scheduler_push(pool->lanes[lane].scheduler, task) == 0) {
+        atomic_fetch_sub(&pool->submitting, 1);
+        worker_pool_notify(pool, lane);
+        return 0;
+    }
+    
+    int first, n;
+    lane_deques(pool, LANE_BULK, &first, &n);
+    WorkerDeque *a = &pool->deques[first + atomic_fetch_add(&pool->next, 1) % n];
+    WorkerDeque *b = &pool->deques[first + worker_rand() % n];
+    if (atomic_load_explicit(&b->size, memory_order_relaxed) <
+        atomic_load_explicit(&a->size, memory_order_relaxed)) {
+        WorkerDeque *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    
+    int status = 0;
+    if (deque_push_back(a, task) == -1 && deque_push_back(b, task) == -1) {
+        /* Both full: fall back to the shared queue. If that is full too
+         * the submit fails rather than stall a session or reactor thread
+         * (a pipelined upload then waits for its own flushes). */
+        status = task_queue_try_push(pool->task_queue, task);
+    }
+    
+    atomic_fetch_sub(&pool->submitting, 1);
+    worker_pool_notify(pool, LANE_BULK);
+    return status;
+}
+
+int worker_pool_submit(WorkerThreadPool *pool, Task *task) {
+    return worker_pool_push(pool, task, worker_task_lane(task));
+}
+
+static void expire_partials_job(Task *task) {
+    WorkerThreadPool *pool = task->context;
+    session_expire_partials(pool->user_mgr, task->user_id);
+}
+
+/* Nobody waits for a background job: it is freed where it ran, outside
+ * the task caches (its creator may be another worker or a session) */
+static void background_job_done(Task *task) {
+    session_free_job(task);
+}
+
+void worker_pool_expire_partials(WorkerThreadPool *pool, int user_id) {
+    User *user = user_get_by_id(pool->user_mgr, user_id);
+    if (!user) return;
+    
+    /* Claiming the user's timestamp also keeps a second job for them
+     * from being queued while one is */
+    long now = (long)time(NULL);
+    long last = atomic_load_explicit(&user->partials_scanned, memory_order_relaxed);
+    if (now - last < SESSION_PARTIAL_SCAN_INTERVAL ||
+        !atomic_compare_exchange_strong(&user->partials_scanned, &last, now)) {
+        return;
+    }
+    
+    Task *task = session_create_job(expire_partials_job, pool);
+    if (task) {
+        task->user_id = user_id;
+        task->on_complete = background_job_done;
+    }
+    if (!task || worker_pool_push(pool, task, LANE_BACKGROUND) == -1) {
+        session_destroy_task(task);
+        atomic_store(&user->partials_scanned, last); // A later upload tries again
+    }
+}
+
+static void fill_cache_job(Task *task) {
+    WorkerThreadPool *pool = task->context;
+    UserManager *mgr = pool->user_mgr;
+    char path[512];
+    session_fill_cache(mgr, task->user_id, task->filename);
+    if (session_file_path(mgr, task->user_id, task->filename, path, sizeof(path)) == 0) {
+        filecache_end_fill(mgr->cache, path);
+    }
+}
+
+void worker_pool_fill_cache(WorkerThreadPool *pool, int user_id, const char *filename) {
+    UserManager *mgr = pool->user_mgr;
+    char path[512];
+    
+    /* Misses on a hot file keep coming until it is read: queue one fill */
+    if (!mgr->cache ||
+        session_file_path(mgr, user_id, filename, path, sizeof(path)) == -1 ||
+        !filecache_begin_fill(mgr->cache, path)) {
+        return;
+    }
+    
+    Task *task = session_create_job(fill_cache_job, pool);
+    if (task) {
+        task->user_id = user_id;
+        snprintf(task->filename, sizeof(task->filename), "%s", filename);
+        task->on_complete = background_job_done;
+    }
+    if (!task || worker_pool_push(pool, task, LANE_BACKGROUND) == -1) {
+        session_destroy_task(task);
+        filecache_end_fill(mgr->cache, path);
+    }
+}
+
+static void checksum_job(Task *task) {
+    WorkerThreadPool *pool = task->context;
+    session_checksum_file(pool->user_mgr, task->user_id, task->filename);
+}
+
+void worker_pool_checksum(WorkerThreadPool *pool, int user_id, const char *filename) {
+    Task *task = session_create_job(checksum_job, pool);
+    if (!task) return;
+    task->user_id = user_id;
+    snprintf(task->filename, sizeof(task->filename), "%s", filename);
+    task->on_complete = background_job_done;
+    if (worker_pool_push(pool, task, LANE_BACKGROUND) == -1) {
+        session_destroy_task(task);
+    }
+}
+
+/* Commands whose work is a lookup in memory: the file index for
+ * DOWNLOAD/UPLOAD, the chunked upload table for UPLOAD-CHUNK. Anything
+ * that touches files or waits for the journal stays on the workers,
+ * and so does the first command of a user whose index is not built:
+ * building it scans the user's directory. */
+static int task_is_cheap(const Task *task) {
+    return strcmp(task->command, "DOWNLOAD") == 0 ||
+           strcmp(task->command, "UPLOAD") == 0 ||
+           strcmp(task->command, "UPLOAD-CHUNK") == 0;
+}
+
+int worker_pool_run_inline(WorkerThreadPool *pool, Task *task) {
+    if (pool->dispatch != DISPATCH_INLINE || task->execute || !task_is_cheap(task) ||
+        !user_files_ready(pool->user_mgr, task->user_id)) {
+        return 0;
+    }
+    
+    execute_task(task, pool);
+    atomic_fetch_add_explicit(&pool->inlined, 1, memory_order_relaxed);
+    return 1;
+}
+
+/* Work of one lane: its users' commands, and for the bulk lane the own
+ * deque first, then other workers' deques and the overflow queue */
+static Task* lane_take(WorkerThreadPool *pool, WorkerDeque *self, WorkerLane lane) {
+    self->shed_ms = 0;
+    Task *task = lane == LANE_BULK ? deque_pop_front(self) : NULL;
+    if (task) return task;
+    
+    task = scheduler_pop(pool->lanes[lane].scheduler, &self->shed_ms);
+    if (task || lane != LANE_BULK) return task;
+    
+    int n = pool->num_threads;
+    int start = worker_rand() % n;
+    for (int i = 0; i < n; i++) {
+        WorkerDeque *victim = &pool->deques[(start + i) % n];
+        if (victim == self) continue;
+        task = deque_steal_back(victim);
+        if (task) {
+            atomic_fetch_add_explicit(&pool->steals, 1, memory_order_relaxed);
+            return task;
+        }
+    }
+    
+    return task_queue_try_pop(pool->task_queue);
+}
+
+/* Claim one of the home lane's workers for lower-priority work; the
+ * last one is never lent */
+static int lane_try_lend(WorkerLaneQueue *home) {
+    int lent = atomic_load(&home->lent);
+    while (lent < home->count - 1) {
+        if (atomic_compare_exchange_weak(&home->lent, &lent, lent + 1)) return 1;
+    }
+    return 0;
+}
+
+/* Own lane first, then the others by priority. Work of a lane without
+ * workers of its own is everyone's. */
+static Task* worker_find_task(WorkerThreadPool *pool, WorkerDeque *self) {
+    WorkerLaneQueue *home = &pool->lanes[self->lane];
+    Task *task = lane_take(pool, self, self->lane);
+    if (task) {
+        self->running = self->lane;
+        self->lending = 0;
+        return task;
+    }
+    
+    for (int lane = 0; lane < WORKER_LANES; lane++) {
+        if (lane == (int)self->lane) continue;
+        int lending = lane > (int)self->lane && pool->lanes[lane].count > 0;
+        if (lending && !lane_try_lend(home)) continue;
+        
+        task = lane_take(pool, self, lane);
+        if (task) {
+            self->running = lane;
+            self->lending = lending;
+            return task;
+        }
+        if (lending) atomic_fetch_sub(&home->lent, 1);
+    }
+    return NULL;
+}
+
+/* Next task for this worker; NULL once shut down and fully drained */
+static Task* worker_next_task(WorkerThreadPool *pool, WorkerDeque *self) {
+    WorkerLaneQueue *home = &pool->lanes[self->lane];
+    for (;;) {
+        Task *task = worker_find_task(pool, self);
+        if (task) return task;
+        
+        pthread_mutex_lock(&pool->idle_mutex);
+        home->idle++;
+        atomic_fetch_add(&pool->idle, 1);
+        
+        /* Re-check after announcing ourselves idle (no lost wakeups) */
+        task = worker_find_task(pool, self);
+        if (!task) {
+            if (atomic_load(&pool->shutdown) && atomic_load(&pool->submitting) == 0) {
+                home->idle--;
+                atomic_fetch_sub(&pool->idle, 1);
+                pthread_mutex_unlock(&pool->idle_mutex);
+                return worker_find_task(pool, self);
+            }
+            pthread_cond_wait(&home->idle_cond, &pool->idle_mutex);
+        }
+        
+        home->idle--;
+        atomic_fetch_sub(&pool->idle, 1);
+        pthread_mutex_unlock(&pool->idle_mutex);
+        if (task) return task;
+    }
+}
+
 /* Worker thread: executes file operations */
 static void* worker_thread_func(void *arg) {
-    WorkerThreadPool *pool = (WorkerThreadPool*)arg;
+    WorkerDeque *self = (WorkerDeque*)arg;
+    WorkerThreadPool *pool = self->pool;
     
-    int should_shutdown = 0;
-    while (!should_shutdown) {
-        /* Pop task from queue (blocks until available) */
-        Task *task = task_queue_pop(pool->task_queue);
-        if (!task) break; // Shutdown signal
+    for (;;) {
+        Task *task = worker_next_task(pool, self);
+        if (!task) break; // Shutdown and nothing left to run
         
-        printf("[WorkerThread] Processing %s for user %d\n", 
-               task->command, task->user_id);
+        printf("[WorkerThread %d] Processing %s for user %d\n", 
+               self->index, task->command, task->user_id);
         
-        /* Execute the task */
-        execute_task(task, pool->user_mgr);
+        /* Execute the task, unless it is shed: then the answer is a
+         * cheap rejection its client can retry */
+        if (self->shed_ms > 0) {
+            snprintf(task->result_message, sizeof(task->result_message),
+                     SESSION_OVERLOADED, self->shed_ms);
+            task->result_code = -1;
+        } else if (task->execute) {
+            task->execute(task);
+        } else {
+            execute_task(task, pool);
+        }
         
-        /* Signal client thread that result is ready */
-        pthread_mutex_lock(&task->result_mutex);
-        task->result_ready = 1;
-        pthread_cond_signal(&task->result_cond);
-        pthread_mutex_unlock(&task->result_mutex);
+        /* Hand the result back: event-driven owners get a callback,
+         * blocking client threads are woken through the condvar */
+        if (task->on_complete) {
+            task->on_complete(task);
+        } else {
+            pthread_mutex_lock(&task->result_mutex);
+            task->result_ready = 1;
+            pthread_cond_signal(&task->result_cond);
+            pthread_mutex_unlock(&task->result_mutex);
+        }
         
-        /* Check shutdown flag safely */
-        pthread_mutex_lock(&pool->shutdown_mutex);
-        should_shutdown = pool->shutdown;
-        pthread_mutex_unlock(&pool->shutdown_mutex);
+        WorkerLaneQueue *lane = &pool->lanes[self->running];
+        if (self->running == self->lane) {
+            atomic_fetch_add_explicit(&lane->ran, 1, memory_order_relaxed);
+        } else {
+            atomic_fetch_add_explicit(&lane->borrowed, 1, memory_order_relaxed);
+        }
+        if (self->lending) atomic_fetch_sub(&pool->lanes[self->lane].lent, 1);
     }
     
+    session_release_task_cache(); // Spares of tasks this worker destroyed, if any
     return NULL;
 }
 
 
-/* Execute file operation (UPLOAD, DOWNLOAD, DELETE, LIST) */
-static void execute_task(Task *task, UserManager *user_mgr) {
+/* Execute file operation (UPLOAD, UPLOAD-RESUME, the chunked UPLOAD-*
+ * commands, DOWNLOAD, DELETE). Existence and sizes come from the user's
+ * file index, not from the directory. Runs on a worker of the lane
+ * worker_task_lane() picks, or on the session's thread for the commands
+ * task_is_cheap() accepts. Partial expiry is queued, never run here. */
+static void execute_task(Task *task, WorkerThreadPool *pool) {
+    UserManager *user_mgr = pool->user_mgr;
     User *user = user_get_by_id(user_mgr, task->user_id);
-    if (!user) {
+    FileIndex *files = user_file_index(user_mgr, task->user_id);
+    if (!user || !files) {
         snprintf(task->result_message, sizeof(task->result_message),
                  "ERROR: Invalid user\n");
         task->result_code = -1;
@@ -455,64 +923,108 @@ static void execute_task(Task *task, UserManager *user_mgr) {
     snprintf(filepath, sizeof(filepath), "users/%s/%s", 
              user->username, task->filename);
     
-    if (strcmp(task->command, "UPLOAD") == 0) {
-        /* Lock for quota check */
-        pthread_mutex_lock(&user->user_mutex);
-        
+    FileEntry entry;
+    
+    if (strcmp(task->command, "UPLOAD") == 0 || strcmp(task->command, "UPLOAD-RESUME") == 0 ||
+        strcmp(task->command, "UPLOAD-INIT") == 0) {
         /* Check if filename is provided */
         if (strlen(task->filename) == 0) {
-            pthread_mutex_unlock(&user->user_mutex);
             snprintf(task->result_message, sizeof(task->result_message),
                      "ERROR: No filename specified\n");
             task->result_code = -1;
-        } else {
-            pthread_mutex_unlock(&user->user_mutex);
-            
-            /* Check if file already exists */
-            struct stat st;
-            if (stat(filepath, &st) == 0) {
+        } else if (task->filename[0] == '.' || strcmp(task->filename, "-") == 0) {
+            /* Hidden names are never listed or indexed; "-" is the LIST
+             * start cursor */
+            snprintf(task->result_message, sizeof(task->result_message),
+                     "ERROR: Invalid filename\n");
+            task->result_code = -1;
+        } else if (fileindex_lookup(files, task->filename, NULL) == 0) {
+            snprintf(task->result_message, sizeof(task->result_message),
+                     "ERROR: File already exists. Delete it first.\n");
+            task->result_code = -1;
+        } else if (strcmp(task->command, "UPLOAD-RESUME") == 0) {
+            /* file_size carries the resume offset to the receiving side */
+            worker_pool_expire_partials(pool, task->user_id);
+            task->file_size = session_partial_offset(user_mgr, task->user_id,
+                                                     task->filename);
+            if (task->file_size == -1) {
                 snprintf(task->result_message, sizeof(task->result_message),
-                         "ERROR: File already exists. Delete it first.\n");
+                         "ERROR: Cannot read partial upload\n");
                 task->result_code = -1;
             } else {
                 snprintf(task->result_message, sizeof(task->result_message),
-                         "READY: Send file size as: SIZE <bytes>\\n\n");
+                         "OFFSET %ld\n", task->file_size);
                 task->result_code = 0;
             }
+        } else if (strcmp(task->command, "UPLOAD-INIT") == 0) {
+            worker_pool_expire_partials(pool, task->user_id);
+            task->result_code = session_chunked_init(user_mgr, task->user_id, task->filename,
+                                                     task->file_size, task->result_message,
+                                                     sizeof(task->result_message));
+        } else {
+            /* Abandoned partials are expired on the background lane, so
+             * this stays a pure index lookup */
+            worker_pool_expire_partials(pool, task->user_id);
+            snprintf(task->result_message, sizeof(task->result_message),
+                     "READY: Send file size as: SIZE <bytes>\\n\n");
+            task->result_code = 0;
         }
-        } else if (strcmp(task->command, "DOWNLOAD") == 0) {
-        FILE *fp = fopen(filepath, "rb");
-        if (!fp) {
+    } else if (strcmp(task->command, "UPLOAD-CHUNK") == 0) {
+        /* The chunk's bytes follow the READY reply on this connection */
+        task->result_code = session_chunked_claim(task->user_id, task->filename,
+                                                  &task->offset, &task->file_size,
+                                                  task->result_message,
+                                                  sizeof(task->result_message));
+    } else if (strcmp(task->command, "UPLOAD-COMMIT") == 0) {
+        char stored[256];
+        task->result_code = session_chunked_commit(user_mgr, task->user_id, task->filename,
+                                                   stored, sizeof(stored),
+                                                   task->result_message,
+                                                   sizeof(task->result_message));
+        /* Spliced chunks leave the file's CRC32 to a background job */
+        if (task->result_code == 0) worker_pool_checksum(pool, task->user_id, stored);
+    } else if (strcmp(task->command, "UPLOAD-ABORT") == 0) {
+        task->result_code = session_chunked_abort(user_mgr, task->user_id, task->filename,
+                                                  task->result_message,
+                                                  sizeof(task->result_message));
+    } else if (strcmp(task->command, "DOWNLOAD") == 0) {
+        if (fileindex_lookup(files, task->filename, &entry) != 0) {
             snprintf(task->result_message, sizeof(task->result_message),
                      "ERROR: File not found\n");
             task->result_code = -1;
-        } else {
-            fseek(fp, 0, SEEK_END);
-            long size = ftell(fp);
-            fclose(fp);
+        } else if (task->offset < 0 || task->offset > entry.size) {
             snprintf(task->result_message, sizeof(task->result_message),
-                     "SIZE: %ld\n", size);
+                     "ERROR: Invalid range (file has %ld bytes)\n", entry.size);
+            task->result_code = -1;
+        } else {
+            /* A range is announced with its place in the file */
+            long rest = entry.size - task->offset;
+            int ranged = task->file_size >= 0 || task->offset > 0;
+            if (task->file_size < 0 || task->file_size > rest) task->file_size = rest;
+            if (ranged) {
+                snprintf(task->result_message, sizeof(task->result_message),
+                         "SIZE: %ld RANGE %ld/%ld\n", task->file_size,
+                         task->offset, entry.size);
+            } else {
+                snprintf(task->result_message, sizeof(task->result_message),
+                         "SIZE: %ld\n", task->file_size);
+            }
             task->result_code = 0;
         }
     }
      else if (strcmp(task->command, "DELETE") == 0) {
-        struct stat st;
-        if (stat(filepath, &st) == 0) {
-            long file_size = st.st_size;
-            if (remove(filepath) == 0) {
-                /* Update quota */
-                pthread_mutex_lock(&user->user_mutex);
-                user->quota_used -= file_size;
-                if (user->quota_used < 0) user->quota_used = 0;
-                long new_quota = user->quota_used;
-                pthread_mutex_unlock(&user->user_mutex);
+        if (fileindex_lookup(files, task->filename, &entry) == 0) {
+            long file_size = entry.size;
+            if (session_remove_file(user_mgr, filepath) == 0) {
+                fileindex_remove(files, task->filename, NULL);
+                
+                /* Update quota (journaled) */
+                user_remove_quota(user_mgr, task->user_id, file_size);
+                long new_quota = user_quota_used(user_mgr, task->user_id);
                 
                 printf("[WorkerThread] File deleted. New quota: %ld bytes (%.2f MB)\n",
                        new_quota, new_quota / (1024.0*1024.0));
                 
-                /* Save user data to persist quota */
-                user_manager_save(user_mgr);
-                
                 snprintf(task->result_message, sizeof(task->result_message),
                          "OK: File deleted (%ld bytes freed). Quota: %.2f / %d MB\n", 
                          file_size, new_quota / (1024.0*1024.0), USER_QUOTA_MB);
@@ -528,101 +1040,6 @@ static void execute_task(Task *task, UserManager *user_mgr) {
             task->result_code = -1;
         }
         
-    } else if (strcmp(task->command, "LIST") == 0) {
-        printf("[WorkerThread] Processing LIST for user %d (%s)\n", 
-               task->user_id, user->username);
-        
-        char user_dir[256];
-        snprintf(user_dir, sizeof(user_dir), "users/%s", user->username);
-        
-        char result[4096];
-        memset(result, 0, sizeof(result));
-        
-        snprintf(result, sizeof(result), "Files for %s:\n", user->username);
-        snprintf(result + strlen(result), sizeof(result) - strlen(result),
-                 "%-40s %15s\n", "Filename", "Size");
-        snprintf(result + strlen(result), sizeof(result) - strlen(result),
-                 "------------------------------------------------------------\n");
-        
-        printf("[WorkerThread] Opening directory: %s\n", user_dir);
-        
-        /* Read directory */
-        DIR *dir = opendir(user_dir);
-        if (dir) {
-            struct dirent *entry;
-            int file_count = 0;
-            long total_size = 0;
-            
-            printf("[WorkerThread] Directory opened successfully\n");
-            
-            while ((entry = readdir(dir)) != NULL) {
-                if (entry->d_name[0] == '.') continue; // Skip hidden files
-                
-                char full_path[512];
-                snprintf(full_path, sizeof(full_path), "%s/%s", user_dir, entry->d_name);
-                
-                struct stat st;
-                if (stat(full_path, &st) == 0 && S_ISREG(st.st_mode)) {
-                    /* Format file size nicely */
-                    char size_str[32];
-                    if (st.st_size < 1024) {
-                        snprintf(size_str, sizeof(size_str), "%ld B", st.st_size);
-                    } else if (st.st_size < 1024*1024) {
-                        snprintf(size_str, sizeof(size_str), "%.2f KB", st.st_size / 1024.0);
-                    } else {
-                        snprintf(size_str, sizeof(size_str), "%.2f MB", st.st_size / (1024.0*1024.0));
-                    }
-                    
-                    snprintf(result + strlen(result), sizeof(result) - strlen(result),
-                             "%-40s %15s\n", entry->d_name, size_str);
-                    file_count++;
-                    total_size += st.st_size;
-                    
-                    printf("[WorkerThread] Found file: %s (%ld bytes)\n", 
-                           entry->d_name, st.st_size);
-                }
-            }
-            closedir(dir);
-            
-            printf("[WorkerThread] Found %d files\n", file_count);
-            
-            if (file_count == 0) {
-                snprintf(result + strlen(result), sizeof(result) - strlen(result),
-                         "(no files)\n");
-            }
-            
-            snprintf(result + strlen(result), sizeof(result) - strlen(result),
-                     "------------------------------------------------------------\n");
-            snprintf(result + strlen(result), sizeof(result) - strlen(result),
-                     "Total files: %d\n", file_count);
-        } else {
-            printf("[WorkerThread] Failed to open directory\n");
-            snprintf(result + strlen(result), sizeof(result) - strlen(result),
-                     "(directory error)\n");
-        }
-        
-        printf("[WorkerThread] Getting quota information\n");
-        
-        /* Get current quota from user structure - just read, no lock needed for display */
-        long quota_used = user->quota_used;
-        
-        printf("[WorkerThread] Quota used: %ld bytes\n", quota_used);
-        
-        snprintf(result + strlen(result), sizeof(result) - strlen(result),
-                 "Quota used: %.2f / %d MB (%.1f%%)\n",
-                 quota_used / (1024.0*1024.0), USER_QUOTA_MB,
-                 (quota_used * 100.0) / USER_QUOTA_BYTES);
-        snprintf(result + strlen(result), sizeof(result) - strlen(result),
-                 "Available: %.2f MB\n",
-                 (USER_QUOTA_BYTES - quota_used) / (1024.0*1024.0));
-        
-        printf("[WorkerThread] Preparing result message (length: %zu)\n", strlen(result));
-        
-        snprintf(task->result_message, sizeof(task->result_message), "%s", result);
-        task->result_code = 0;
-        
-        printf("[WorkerThread] LIST command completed\n");
-        
     } else {
         snprintf(task->result_message, sizeof(task->result_message),
                  "ERROR: Unknown command\n");
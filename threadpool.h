@@ -2,40 +2,128 @@
 #define THREADPOOL_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include "queue.h"
+#include "scheduler.h"
 #include "utils.h"
 
-/* Client thread pool configuration */
+#define WORKER_DEQUE_SIZE 256
+#define WORKER_STATS_USERS 5     // Users listed in the shutdown report
+
+typedef struct WorkerThreadPool WorkerThreadPool;
+
+/* Where commands run once a session has parsed them */
+typedef enum {
+    DISPATCH_INLINE,            // Index lookups run on the session's own thread
+    DISPATCH_WORKERS            // Every command is a worker pool round trip
+} DispatchPolicy;
+
+/* Quality-of-service classes of worker work, highest priority first */
+typedef enum {
+    LANE_INTERACTIVE,           // Metadata: lookups, DELETE, RESUME, chunked upload bookkeeping
+    LANE_BULK,                  // File data: upload writes, COMMIT, index scans, REGISTER
+    LANE_BACKGROUND,            // Maintenance: partial expiry, cache fills, upload CRCs
+    WORKER_LANES
+} WorkerLane;
+
+/* Per-worker task deque: the owner takes from the front, idle workers
+ * steal from the back. Padded so neighbouring deques never share a line. */
 typedef struct {
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t mutex;
+    Task *tasks[WORKER_DEQUE_SIZE];
+    int front, count;
+    atomic_int size;            // Lock-free hint of count for placement/stealing
+    int index;
+    WorkerLane lane;            // Home lane
+    WorkerLane running;         // Lane of the task being run (owner only)
+    int lending;                // It is a lower lane's work (owner only)
+    long shed_ms;               // Shed it with this retry-after hint (owner only)
+    WorkerThreadPool *pool;
+} WorkerDeque;
+
+/* One QoS lane: its queued work and the workers reserved for it. A
+ * worker runs its own lane's work first and then borrows: higher lanes'
+ * work is short, so it is always taken; a lower lane's only while one
+ * home worker stays free for the lane's own work. */
+typedef struct {
+    Scheduler *scheduler;       // Commands (and background jobs), fair-shared between users
+    int first, count;           // Home workers: deques[first .. first + count)
+    atomic_int lent;            // Home workers running a lower lane's work
+    atomic_long ran;            // Tasks run by home workers
+    atomic_long borrowed;       // Tasks run by other lanes' workers
+    int idle;                   // Home workers parked on idle_cond (idle_mutex)
+    pthread_cond_t idle_cond;
+} WorkerLaneQueue;
+
+/* Worker thread pool configuration. Commands wait in per-user queues of
+ * their lane, served deficit round robin; pipelined upload flushes go
+ * to the bulk workers' deques with work stealing. */
+struct WorkerThreadPool {
     pthread_t *threads;
     int num_threads;
-    ClientQueue *client_queue;
-    TaskQueue *task_queue;
+    WorkerDeque *deques;        // One per worker, grouped by home lane
+    WorkerLaneQueue lanes[WORKER_LANES];
+    TaskQueue *task_queue;      // Overflow when the chosen deques are full (bulk)
     UserManager *user_mgr;
-    int shutdown;
-    pthread_mutex_t shutdown_mutex;  // Protect shutdown flag
-} ClientThreadPool;
+    atomic_uint next;           // Placement cursor
+    atomic_int submitting;      // Submits in progress (shutdown drain)
+    atomic_int idle;            // Workers parked on their lane's idle_cond
+    atomic_long steals;         // Tasks taken from another worker's deque
+    DispatchPolicy dispatch;    // Set before sessions start (default inline)
+    atomic_long inlined;        // Commands run without a worker
+    atomic_long flushed_inline; // Upload windows flushed by their session (pool full)
+    pthread_mutex_t idle_mutex;
+    atomic_int shutdown;
+};
 
-/* Worker thread pool configuration */
+/* Client thread pool configuration */
 typedef struct {
     pthread_t *threads;
     int num_threads;
-    TaskQueue *task_queue;
+    ClientQueue *client_queue;
+    WorkerThreadPool *worker_pool;
     UserManager *user_mgr;
     int shutdown;
     pthread_mutex_t shutdown_mutex;  // Protect shutdown flag
-} WorkerThreadPool;
+} ClientThreadPool;
 
 /* Client thread pool operations */
 ClientThreadPool* client_pool_create(int num_threads, ClientQueue *cq, 
-                                      TaskQueue *tq, UserManager *um);
+                                      WorkerThreadPool *wp, UserManager *um);
 void client_pool_destroy(ClientThreadPool *pool);
 void client_pool_shutdown(ClientThreadPool *pool);
 
+/* Turn a connection away before its session starts: send SESSION_BUSY
+ * with the retry-after hint and close it, never blocking */
+void client_pool_reject(int socket, long retry_ms);
+
 /* Worker thread pool operations */
 WorkerThreadPool* worker_pool_create(int num_threads, TaskQueue *tq, 
                                       UserManager *um);
 void worker_pool_destroy(WorkerThreadPool *pool);
 void worker_pool_shutdown(WorkerThreadPool *pool);
+int worker_pool_submit(WorkerThreadPool *pool, Task *task);
+
+/* Expire user_id's abandoned partial uploads on the background lane,
+ * at most once per SESSION_PARTIAL_SCAN_INTERVAL for each user (best
+ * effort, never blocks) */
+void worker_pool_expire_partials(WorkerThreadPool *pool, int user_id);
+
+/* Read a small file into the download cache on the background lane, for
+ * event loops that must not block on the read (best effort; a path
+ * already being filled is skipped) */
+void worker_pool_fill_cache(WorkerThreadPool *pool, int user_id, const char *filename);
+
+/* Compute the CRC32 of a stored file on the background lane, for an
+ * upload whose spliced bytes left it unknown (best effort, never blocks;
+ * a file whose checksum is known by then is skipped) */
+void worker_pool_checksum(WorkerThreadPool *pool, int user_id, const char *filename);
+
+const char* worker_lane_name(WorkerLane lane);
+
+/* Run task on the calling thread if the dispatch policy allows it for
+ * this command (cheap and non-blocking: no file I/O, no journal wait).
+ * Returns 1 with the result filled in, 0 if it must be submitted. */
+int worker_pool_run_inline(WorkerThreadPool *pool, Task *task);
 
 #endif
\ No newline at end of file
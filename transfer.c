@@ -0,0 +1,470 @@
+#define _GNU_SOURCE
+#include "transfer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define TRANSFER_STEP (1L << 20)        // Max bytes per call, keeps event loops fair
+#define TRANSFER_COPY_CHUNK 65536
+#define RECV_WINDOW_MIN (64 * 1024)         // First receive size
+#define RECV_WINDOW_MAX (1024 * 1024)       // Windows double up to this
+
+void transfer_init(FileTransfer *t) {
+    t->file_fd = -1;
+    t->offset = 0;
+    t->remaining = 0;
+    t->method = TRANSFER_SENDFILE;
+    t->pipe_fd[0] = t->pipe_fd[1] = -1;
+    t->in_pipe = 0;
+    t->window = RECV_WINDOW_MIN;
+    t->buffer = NULL;
+    t->crc = 0;
+    t->crc_known = 1;
+    t->memory = NULL;
+    t->part_left = 0;
+    t->next_part = NULL;
+    t->release = NULL;
+    t->part_ctx = NULL;
+}
+
+int transfer_open_read(FileTransfer *t, const char *path, off_t offset, long length) {
+    transfer_init(t);
+    t->file_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (t->file_fd == -1) return -1;
+
+    t->offset = offset;
+    t->remaining = length;
+    t->part_left = length;
+
+    /* Let the kernel read ahead aggressively */
+    posix_fadvise(t->file_fd, offset, length, POSIX_FADV_SEQUENTIAL);
+    return 0;
+}
+
+/* Move on to the next file of a multi-part download */
+static int transfer_next_file(FileTransfer *t) {
+    if (!t->next_part) return -1;
+    if (t->file_fd != -1) close(t->file_fd);
+
+    t->file_fd = t->next_part(t->part_ctx, &t->offset, &t->part_left);
+    if (t->file_fd == -1 || t->part_left <= 0) return -1;
+    if (t->part_left > t->remaining) t->part_left = t->remaining;
+
+    posix_fadvise(t->file_fd, t->offset, t->part_left, POSIX_FADV_SEQUENTIAL);
+    return 0;
+}
+
+int transfer_open_parts(FileTransfer *t, long length, TransferNextPartFn next_part,
+                        void (*release)(void *ctx), void *ctx) {
+    transfer_init(t);
+    t->remaining = length;
+    t->next_part = next_part;
+    t->release = release;
+    t->part_ctx = ctx;
+
+    if (length > 0 && transfer_next_file(t) == -1) {
+        transfer_close(t);
+        return -1;
+    }
+    return 0;
+}
+
+void transfer_close(FileTransfer *t) {
+    if (t->file_fd != -1) close(t->file_fd);
+    if (t->pipe_fd[0] != -1) close(t->pipe_fd[0]);
+    if (t->pipe_fd[1] != -1) close(t->pipe_fd[1]);
+    free(t->buffer);
+    if (t->release) t->release(t->part_ctx);
+    t->file_fd = t->pipe_fd[0] = t->pipe_fd[1] = -1;
+    t->in_pipe = 0;
+    t->buffer = NULL;
+    t->release = NULL;
+    t->part_ctx = NULL;
+}
+
+/* Bytes to read from the current file in one call */
+static size_t transfer_step(FileTransfer *t) {
+    return t->part_left < TRANSFER_STEP ? (size_t)t->part_left : TRANSFER_STEP;
+}
+
+/* Page cache -> socket in one syscall */
+static long send_sendfile(FileTransfer *t, int sock) {
+    ssize_t n = sendfile(sock, t->file_fd, &t->offset, transfer_step(t));
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+        if (errno == EINVAL || errno == ENOSYS) {
+            t->method = TRANSFER_SPLICE;
+            return -2; // Retry with splice
+        }
+        return -1;
+    }
+    if (n == 0) return -1; // File shorter than announced
+    t->remaining -= n;
+    t->part_left -= n;
+    return n;
+}
+
+/* Page cache -> pipe -> socket, still without touching userspace */
+static long send_splice(FileTransfer *t, int sock) {
+    if (t->pipe_fd[0] == -1 && pipe2(t->pipe_fd, O_CLOEXEC | O_NONBLOCK) == -1) {
+        t->method = TRANSFER_COPY;
+        return -2;
+    }
+
+    if (t->in_pipe == 0) {
+        ssize_t n = splice(t->file_fd, &t->offset, t->pipe_fd[1], NULL,
+                           transfer_step(t), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) return 0;
+            if (errno == EINVAL) {
+                t->method = TRANSFER_COPY;
+                return -2;
+            }
+            return -1;
+        }
+        if (n == 0) return -1;
+        t->in_pipe = n;
+        t->part_left -= n;
+    }
+
+    ssize_t n = splice(t->pipe_fd[0], NULL, sock, NULL, t->in_pipe,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+        return -1;
+    }
+    t->in_pipe -= n;
+    t->remaining -= n;
+    return n;
+}
+
+/* Last resort: bounce through a userspace buffer */
+static long send_copy(FileTransfer *t, int sock) {
+    char chunk[TRANSFER_COPY_CHUNK];
+    size_t want = transfer_step(t);
+    if (want > sizeof(chunk)) want = sizeof(chunk);
+
+    ssize_t n = pread(t->file_fd, chunk, want, t->offset);
+    if (n < 0) return errno == EINTR ? 0 : -1;
+    if (n == 0) return -1;
+
+    ssize_t sent = send(sock, chunk, n, MSG_NOSIGNAL);
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+        return -1;
+    }
+    t->offset += sent;
+    t->remaining -= sent;
+    t->part_left -= sent;
+    return sent;
+}
+
+int transfer_open_memory(FileTransfer *t, const char *data, off_t offset, long length,
+                         void (*release)(void *ctx), void *ctx) {
+    transfer_init(t);
+    t->method = TRANSFER_MEMORY;
+    t->memory = data;
+    t->offset = offset;
+    t->remaining = length;
+    t->part_left = length;
+    t->release = release;
+    t->part_ctx = ctx;
+    return 0;
+}
+
+static long send_memory(FileTransfer *t, int sock) {
+    ssize_t sent = send(sock, t->memory + t->offset, transfer_step(t), MSG_NOSIGNAL);
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+        return -1;
+    }
+    t->offset += sent;
+    t->remaining -= sent;
+    t->part_left -= sent;
+    return sent;
+}
+
+long transfer_read(FileTransfer *t, char *buf, size_t len) {
+    if (t->remaining <= 0) return 0;
+    if (t->part_left == 0 && transfer_next_file(t) == -1) return -1;
+
+    size_t want = transfer_step(t);
+    if (want > len) want = len;
+    ssize_t n;
+    if (t->method == TRANSFER_MEMORY) {
+        memcpy(buf, t->memory + t->offset, want);
+        n = want;
+    } else {
+        do {
+            n = pread(t->file_fd, buf, want, t->offset);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) return -1;
+    }
+
+    t->offset += n;
+    t->remaining -= n;
+    t->part_left -= n;
+    return n;
+}
+
+long transfer_send(FileTransfer *t, int sock) {
+    if (t->remaining <= 0) return 0;
+    if (t->part_left == 0 && t->in_pipe == 0 && transfer_next_file(t) == -1) return -1;
+
+    for (;;) {
+        long n;
+        switch (t->method) {
+        case TRANSFER_SENDFILE: n = send_sendfile(t, sock); break;
+        case TRANSFER_SPLICE:   n = send_splice(t, sock); break;
+        case TRANSFER_MEMORY:   n = send_memory(t, sock); break;
+        default:                n = send_copy(t, sock); break;
+        }
+        if (n != -2) return n;
+    }
+}
+
+int transfer_send_all(FileTransfer *t, int sock) {
+    while (t->remaining > 0) {
+        if (transfer_send(t, sock) < 0) return -1;
+    }
+    return 0;
+}
+
+/* ===== CHECKSUM ===== */
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+uint32_t transfer_crc32(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&crc_once, crc_init);
+
+    const unsigned char *p = data;
+    crc = ~crc;
+    while (len--) crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* Multiply the 32x32 GF(2) matrix mat by vec */
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, mat++) {
+        if (vec & 1) sum ^= *mat;
+    }
+    return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++) square[n] = gf2_times(mat, mat[n]);
+}
+
+/* Shift crc_a over len_b zero bytes by squaring the one-bit shift
+ * operator (zlib's method), then fold in crc_b: O(log len_b) */
+uint32_t transfer_crc32_combine(uint32_t crc_a, uint32_t crc_b, long len_b) {
+    if (len_b <= 0) return crc_a;
+
+    uint32_t even[32], odd[32];
+    odd[0] = 0xEDB88320u;       // Operator for one zero bit
+    for (int n = 1; n < 32; n++) odd[n] = 1u << (n - 1);
+    gf2_square(even, odd);      // Two zero bits
+    gf2_square(odd, even);      // Four zero bits
+
+    do {
+        gf2_square(even, odd);
+        if (len_b & 1) crc_a = gf2_times(even, crc_a);
+        len_b >>= 1;
+        if (len_b == 0) break;
+
+        gf2_square(odd, even);
+        if (len_b & 1) crc_a = gf2_times(odd, crc_a);
+        len_b >>= 1;
+    } while (len_b != 0);
+
+    return crc_a ^ crc_b;
+}
+
+/* ===== RECEIVE (UPLOAD) ===== */
+
+int transfer_open_write(FileTransfer *t, const char *path, off_t offset, long length) {
+    transfer_init(t);
+    t->file_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (t->file_fd == -1) return -1;
+
+    /* One writer per file; the lock dies with the descriptor */
+    int err = 0;
+    struct stat st;
+    if (flock(t->file_fd, LOCK_EX | LOCK_NB) == -1) {
+        err = EBUSY;
+    } else if (fstat(t->file_fd, &st) == -1 || st.st_size < offset) {
+        err = ESTALE; // Fewer bytes than the caller resumes from
+    } else if (ftruncate(t->file_fd, offset) == -1) {
+        err = errno;
+    } else if (length > offset &&
+               fallocate(t->file_fd, FALLOC_FL_KEEP_SIZE, offset, length - offset) == -1 &&
+               errno == ENOSPC) {
+        /* Reserve the blocks up front: one extent instead of piecemeal
+         * growth, and a full volume is reported before any data is
+         * accepted. The size stays at what was really received. */
+        err = ENOSPC;
+    }
+    if (err) {
+        close(t->file_fd);
+        t->file_fd = -1;
+        errno = err;
+        return -1;
+    }
+
+    t->method = TRANSFER_SPLICE;
+    t->offset = offset;
+    t->remaining = length - offset;
+    t->crc_known = offset == 0; // The kept bytes are not read for it
+    return 0;
+}
+
+int transfer_open_chunk(FileTransfer *t, int fd, off_t offset, long length) {
+    transfer_init(t);
+    t->file_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (t->file_fd == -1) return -1;
+
+    /* Writes carry their own offsets, so the shared file position is unused */
+    t->method = TRANSFER_SPLICE;
+    t->offset = offset;
+    t->remaining = length;
+    return 0;
+}
+
+/* Ask for more per call once the sender keeps filling the window */
+static void grow_window(FileTransfer *t) {
+    if (t->window >= RECV_WINDOW_MAX) return;
+
+    size_t window = t->window * 2;
+    if (t->method == TRANSFER_SPLICE) {
+        int size = fcntl(t->pipe_fd[0], F_SETPIPE_SZ, (int)window);
+        if (size <= 0) return; // Pipe limit reached, keep the current window
+        window = size;
+    } else {
+        char *buffer = realloc(t->buffer, window);
+        if (!buffer) return;
+        t->buffer = buffer;
+    }
+    t->window = window;
+}
+
+static size_t recv_step(FileTransfer *t) {
+    return t->remaining < (long)t->window ? (size_t)t->remaining : t->window;
+}
+
+int transfer_write(FileTransfer *t, const char *data, size_t len) {
+    if (t->crc_known) t->crc = transfer_crc32(t->crc, data, len);
+    while (len > 0) {
+        ssize_t n = pwrite(t->file_fd, data, len, t->offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+        t->offset += n;
+        t->remaining -= n;
+    }
+    return 0;
+}
+
+/* Socket -> pipe -> file without a userspace copy on the way in. The
+ * bytes never reach userspace, so the upload's CRC32 becomes unknown:
+ * reading every piece back just for it would cost the copy splice
+ * saves. */
+static long recv_splice(FileTransfer *t, int sock) {
+    if (t->pipe_fd[0] == -1) {
+        if (pipe2(t->pipe_fd, O_CLOEXEC | O_NONBLOCK) == -1) {
+            t->method = TRANSFER_COPY;
+            return -2;
+        }
+        int size = fcntl(t->pipe_fd[0], F_SETPIPE_SZ, (int)t->window);
+        if (size > 0) t->window = size;
+    }
+
+    size_t want = recv_step(t);
+    ssize_t n = splice(sock, NULL, t->pipe_fd[1], NULL, want,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+        if (errno == EINVAL) {
+            t->method = TRANSFER_COPY;
+            return -2;
+        }
+        return -1;
+    }
+    if (n == 0) return -1; // Peer hung up early
+
+    /* Drain the pipe completely so it is empty between calls */
+    t->crc_known = 0;
+    t->in_pipe = n;
+    while (t->in_pipe > 0) {
+        ssize_t m = splice(t->pipe_fd[0], NULL, t->file_fd, &t->offset,
+                           t->in_pipe, SPLICE_F_MOVE);
+        if (m < 0 && errno == EINTR) continue;
+        if (m <= 0) return -1;
+        t->in_pipe -= m;
+    }
+
+    t->remaining -= n;
+    if ((size_t)n == want && want == t->window) grow_window(t);
+    return n;
+}
+
+/* Fallback: recv into a buffer that grows with the transfer */
+static long recv_copy(FileTransfer *t, int sock) {
+    if (!t->buffer) {
+        t->window = RECV_WINDOW_MIN;
+        t->buffer = malloc(t->window);
+        if (!t->buffer) return -1;
+    }
+
+    size_t want = recv_step(t);
+    ssize_t n = recv(sock, t->buffer, want, 0);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+        return -1;
+    }
+    if (n == 0) return -1;
+
+    if (transfer_write(t, t->buffer, n) == -1) return -1;
+    if ((size_t)n == want && want == t->window) grow_window(t);
+    return n;
+}
+
+long transfer_recv(FileTransfer *t, int sock) {
+    if (t->remaining <= 0) return 0;
+
+    for (;;) {
+        long n = t->method == TRANSFER_SPLICE ? recv_splice(t, sock)
+                                              : recv_copy(t, sock);
+        if (n != -2) return n;
+    }
+}
+
+int transfer_recv_all(FileTransfer *t, int sock) {
+    while (t->remaining > 0) {
+        if (transfer_recv(t, sock) < 0) return -1;
+    }
+    return 0;
+}
+
+uint32_t transfer_checksum(const FileTransfer *t) {
+    return t->crc_known ? t->crc : 0;
+}
@@ -0,0 +1,104 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Zero-copy file transfer engine. Data moves between the page cache and
+ * a socket inside the kernel: sendfile() first, splice() through a pipe
+ * if the file system refuses sendfile, and plain read/send only as the
+ * last resort. Uploads go socket -> pipe -> file with splice() into a
+ * preallocated file, falling back to recv/write. Bytes that pass through
+ * userspace are checksummed on the way; spliced bytes are never seen,
+ * so such an upload's CRC32 is left unknown rather than read back. */
+
+typedef enum {
+    TRANSFER_SENDFILE,
+    TRANSFER_SPLICE,
+    TRANSFER_COPY,
+    TRANSFER_MEMORY             // Download from a buffer, no file at all
+} TransferMethod;
+
+/* Opens the next file of a multi-part download: returns its fd and sets
+ * where its bytes start and how many there are (-1 on error) */
+typedef int (*TransferNextPartFn)(void *ctx, off_t *offset, long *length);
+
+/* State of one file <-> socket transfer */
+typedef struct {
+    int file_fd;
+    off_t offset;               // Next file offset to transfer
+    long remaining;             // Bytes still to transfer
+    long part_left;             // Download: bytes still to read from file_fd
+    TransferMethod method;
+    int pipe_fd[2];             // Splice pipe (-1 until needed)
+    size_t in_pipe;             // Bytes sitting in the pipe
+    size_t window;              // Upload: bytes asked for per receive, grows
+    char *buffer;               // Upload copy fallback buffer (window bytes)
+    uint32_t crc;               // Upload: CRC32 of the bytes stored so far
+    int crc_known;              // Upload: crc covers them all (no splice, no resume)
+    const char *memory;         // TRANSFER_MEMORY: the bytes, sent from offset
+    TransferNextPartFn next_part;   // Download: more files follow (NULL = one)
+    void (*release)(void *ctx);     // Frees part_ctx on close
+    void *part_ctx;
+} FileTransfer;
+
+/* Reset to the closed state (safe to transfer_close) */
+void transfer_init(FileTransfer *t);
+
+/* Open path for sending length bytes starting at offset */
+int transfer_open_read(FileTransfer *t, const char *path, off_t offset, long length);
+void transfer_close(FileTransfer *t);
+
+/* Open a download of length bytes spread over several files, fetched
+ * one after another through next_part (release(ctx) runs on close) */
+int transfer_open_parts(FileTransfer *t, long length, TransferNextPartFn next_part,
+                        void (*release)(void *ctx), void *ctx);
+
+/* Open a download of length bytes held in memory from data + offset
+ * (release(ctx) runs on close, e.g. to drop a cache reference) */
+int transfer_open_memory(FileTransfer *t, const char *data, off_t offset, long length,
+                         void (*release)(void *ctx), void *ctx);
+
+/* Read the next bytes of a download into buf instead of sending them:
+ * returns bytes read, 0 once done, -1 on error or if the file ended early */
+long transfer_read(FileTransfer *t, char *buf, size_t len);
+
+/* Send the next piece to sock: returns bytes moved, 0 if sock would
+ * block, -1 on error or if the file ended early */
+long transfer_send(FileTransfer *t, int sock);
+
+/* Blocking helper: send everything (0 on success, -1 on error) */
+int transfer_send_all(FileTransfer *t, int sock);
+
+/* Open path for receiving bytes offset..length, keeping the first offset
+ * bytes already there, and preallocate the rest. Fails with errno EBUSY
+ * if another transfer is writing path, ESTALE if it holds fewer than
+ * offset bytes and ENOSPC if the volume cannot hold the file. */
+int transfer_open_write(FileTransfer *t, const char *path, off_t offset, long length);
+
+/* Open one piece of a file that several transfers fill at once: bytes
+ * offset..offset+length go into a duplicate of fd, no lock taken */
+int transfer_open_chunk(FileTransfer *t, int fd, off_t offset, long length);
+
+/* Receive the next piece from sock into the file: returns bytes moved,
+ * 0 if sock would block, -1 on error or if the peer hung up early */
+long transfer_recv(FileTransfer *t, int sock);
+
+/* Store bytes that were already read into userspace (e.g. with the
+ * SIZE line) before switching to transfer_recv */
+int transfer_write(FileTransfer *t, const char *data, size_t len);
+
+/* Blocking helper: receive everything (0 on success, -1 on error) */
+int transfer_recv_all(FileTransfer *t, int sock);
+
+/* Upload: CRC32 of every byte received, 0 (not known) if any of them
+ * were spliced or were already in the file when it was opened */
+uint32_t transfer_checksum(const FileTransfer *t);
+
+/* zlib-compatible CRC32: crc32(crc32(0, a), b) == crc32(0, a + b) */
+uint32_t transfer_crc32(uint32_t crc, const void *data, size_t len);
+
+/* CRC32 of a + b from crc32(0, a), crc32(0, b) and the length of b */
+uint32_t transfer_crc32_combine(uint32_t crc_a, uint32_t crc_b, long len_b);
+
+#endif
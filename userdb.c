@@ -0,0 +1,97 @@
+#include "userdb.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+int userdb_open(UserDb *db, const char *path) {
+    memset(db, 0, sizeof(UserDb));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(UserDbHeader)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const UserDbHeader *h = map;
+    uint64_t size = st.st_size;
+    int valid = memcmp(h->magic, USERDB_MAGIC, sizeof(h->magic)) == 0 &&
+                h->version == USERDB_VERSION &&
+                h->record_size == sizeof(UserDbRecord) &&
+                h->index_size > 0 && (h->index_size & (h->index_size - 1)) == 0 &&
+                h->index_size <= size && h->user_count * 2 <= h->index_size &&
+                h->records_offset <= size && h->index_offset <= size &&
+                h->records_offset >= sizeof(UserDbHeader) &&
+                h->records_offset + h->user_count * sizeof(UserDbRecord) <= size &&
+                h->index_offset + h->index_size * sizeof(int32_t) <= size &&
+                h->records_offset % sizeof(int64_t) == 0 &&
+                h->index_offset % sizeof(int32_t) == 0;
+    if (!valid) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    db->map = map;
+    db->size = st.st_size;
+    db->header = h;
+    db->records = (const UserDbRecord*)((const char*)map + h->records_offset);
+    db->index = (const int32_t*)((const char*)map + h->index_offset);
+    return 0;
+}
+
+void userdb_close(UserDb *db) {
+    if (db->map) munmap(db->map, db->size);
+    memset(db, 0, sizeof(UserDb));
+}
+
+int userdb_write(const char *path, int64_t checkpoint_lsn, int user_count,
+                 UserDbFillFn fill, void *ctx,
+                 const int32_t *index, int index_size) {
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) return -1;
+
+    UserDbHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, USERDB_MAGIC, sizeof(h.magic));
+    h.version = USERDB_VERSION;
+    h.record_size = sizeof(UserDbRecord);
+    h.user_count = user_count;
+    h.checkpoint_lsn = checkpoint_lsn;
+    h.index_size = index_size;
+    h.records_offset = sizeof(UserDbHeader);
+    h.index_offset = h.records_offset + (uint64_t)user_count * sizeof(UserDbRecord);
+
+    int status = fwrite(&h, sizeof(h), 1, fp) == 1 ? 0 : -1;
+
+    UserDbRecord record;
+    for (int i = 0; i < user_count && status == 0; i++) {
+        memset(&record, 0, sizeof(record));
+        fill(ctx, i, &record);
+        if (fwrite(&record, sizeof(record), 1, fp) != 1) status = -1;
+    }
+
+    if (status == 0 && fwrite(index, sizeof(int32_t), index_size, fp) != (size_t)index_size) {
+        status = -1;
+    }
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) status = -1;
+    if (fclose(fp) != 0) status = -1;
+
+    if (status == 0 && rename(tmp, path) == 0) return 0;
+    unlink(tmp);
+    return -1;
+}
@@ -0,0 +1,61 @@
+#ifndef USERDB_H
+#define USERDB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Binary user database (users.db), the checkpoint the journal is
+ * replayed on. Layout, in native byte order:
+ *
+ *   header | user_count fixed-size records (record i is user id i)
+ *          | index_size hash slots (int32 user id, -1 = empty)
+ *
+ * The index uses the same hashing and probing as the in-memory one, so
+ * a start-up maps the file, copies the index region and reads records
+ * in place, without parsing or rehashing anything. */
+
+#define USERDB_MAGIC "DBXUSERS"
+#define USERDB_VERSION 1
+#define USERDB_NAME_SIZE 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;       // sizeof(UserDbRecord) when written
+    uint64_t user_count;
+    int64_t checkpoint_lsn;     // Last journal record the file covers
+    uint64_t index_size;        // Hash slots, power of two
+    uint64_t records_offset;
+    uint64_t index_offset;
+} UserDbHeader;
+
+typedef struct {
+    char username[USERDB_NAME_SIZE];
+    char password[USERDB_NAME_SIZE];
+    int64_t quota_used;
+} UserDbRecord;
+
+/* A validated, read-only mapping of the file */
+typedef struct {
+    void *map;
+    size_t size;
+    const UserDbHeader *header;
+    const UserDbRecord *records;
+    const int32_t *index;
+} UserDb;
+
+/* Map and validate path (-1 with errno ENOENT if it does not exist,
+ * EINVAL if it is not a database this build can read) */
+int userdb_open(UserDb *db, const char *path);
+void userdb_close(UserDb *db);
+
+/* Fills the record of one user while the file is written */
+typedef void (*UserDbFillFn)(void *ctx, int user_id, UserDbRecord *record);
+
+/* Write a complete database next to path, fsync it and rename it into
+ * place, so readers see either the old or the new file (0 or -1) */
+int userdb_write(const char *path, int64_t checkpoint_lsn, int user_count,
+                 UserDbFillFn fill, void *ctx,
+                 const int32_t *index, int index_size);
+
+#endif
@@ -4,26 +4,187 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
 
-#define USERS_FILE "users.txt"
+#define USERS_DB "users.db"                 // Checkpoint: full user table
+#define JOURNAL_FILE "users.journal"        // Changes since the checkpoint
+#define USERS_TEXT "users.txt"              // Old text format, converted once
+#define USERS_TEXT_CONVERTED "users.txt.converted"
+
+_Static_assert(sizeof(int) == sizeof(int32_t), "index slots are stored as int32");
+_Static_assert(MAX_USERNAME == USERDB_NAME_SIZE && MAX_PASSWORD == USERDB_NAME_SIZE,
+               "users.db record layout");
+
+/* Journal record types */
+#define RECORD_REGISTER 'R'                 // "<username> <password>"
+#define RECORD_QUOTA 'Q'                    // "<user_id> <delta bytes>"
+
+static void user_checkpoint_if_due(UserManager *mgr);
+static void user_set_quota(User *user, long quota_used);
+
+/* FNV-1a over the username (at most MAX_USERNAME bytes: names may come
+ * straight from users.db) */
+static unsigned int user_hash(const char *username) {
+    unsigned int hash = 2166136261u;
+    const unsigned char *end = (const unsigned char*)username + MAX_USERNAME;
+    for (const unsigned char *p = (const unsigned char*)username; p < end && *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Segment seg, allocated on first use. Segments covering users.db are
+ * filled from its mapped records then, so a start-up touches none of
+ * them; two threads racing here keep the first published copy. */
+static User* user_segment(UserManager *mgr, int seg) {
+    User *segment = atomic_load_explicit(&mgr->segments[seg], memory_order_acquire);
+    if (segment) return segment;
+    
+    segment = malloc(sizeof(User) * USER_SEGMENT_SIZE);
+    if (!segment) return NULL;
+    for (int i = 0; i < USER_SEGMENT_SIZE; i++) {
+        pthread_mutex_init(&segment[i].user_mutex, NULL);
+        atomic_init(&segment[i].files, NULL);
+        segment[i].storing = NULL;
+        atomic_init(&segment[i].partials_scanned, 0);
+        
+        int user_id = seg * USER_SEGMENT_SIZE + i;
+        if (user_id < mgr->db_users) {
+            const UserDbRecord *record = &mgr->db.records[user_id];
+            segment[i].id = user_id;
+            memcpy(segment[i].username, record->username, MAX_USERNAME);
+            segment[i].username[MAX_USERNAME - 1] = '\0';
+            memcpy(segment[i].password, record->password, MAX_PASSWORD);
+            segment[i].password[MAX_PASSWORD - 1] = '\0';
+            user_set_quota(&segment[i], record->quota_used);
+        }
+    }
+    
+    User *published = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&mgr->segments[seg], &published, segment,
+                                                 memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        for (int i = 0; i < USER_SEGMENT_SIZE; i++) {
+            pthread_mutex_destroy(&segment[i].user_mutex);
+        }
+        free(segment);
+        return published;
+    }
+    return segment;
+}
+
+/* User user_id, its segment filled in if needed (NULL if out of memory) */
+static User* user_slot(UserManager *mgr, int user_id) {
+    User *segment = user_segment(mgr, user_id / USER_SEGMENT_SIZE);
+    return segment ? &segment[user_id % USER_SEGMENT_SIZE] : NULL;
+}
+
+/* Username of user_id, read from users.db while its segment is not in
+ * the table, so lookups do not fill segments they only probe past */
+static const char* user_name(UserManager *mgr, int user_id) {
+    User *segment = atomic_load_explicit(&mgr->segments[user_id / USER_SEGMENT_SIZE],
+                                         memory_order_acquire);
+    if (segment) return segment[user_id % USER_SEGMENT_SIZE].username;
+    return mgr->db.records[user_id].username;
+}
+
+/* Index slot holding username, or the empty slot where it would go
+ * (caller holds mgr->lock) */
+static int index_find(UserManager *mgr, const char *username) {
+    unsigned int mask = mgr->index_size - 1;
+    unsigned int i = user_hash(username) & mask;
+    
+    while (mgr->index[i] != -1 &&
+           strncmp(user_name(mgr, mgr->index[i]), username, MAX_USERNAME) != 0) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/* Double the index and rehash every user (caller holds the write lock) */
+static int index_grow(UserManager *mgr) {
+    int size = mgr->index_size * 2;
+    int *index = malloc(sizeof(int) * size);
+    if (!index) return -1;
+    
+    for (int i = 0; i < size; i++) index[i] = -1;
+    
+    int count = atomic_load_explicit(&mgr->user_count, memory_order_relaxed);
+    for (int id = 0; id < count; id++) {
+        unsigned int slot = user_hash(user_name(mgr, id)) & (size - 1);
+        while (index[slot] != -1) slot = (slot + 1) & (size - 1);
+        index[slot] = id;
+    }
+    
+    free(mgr->index);
+    mgr->index = index;
+    mgr->index_size = size;
+    return 0;
+}
+
+/* Append a user and index it (returns user_id, -1 if taken or full;
+ * caller holds the write lock) */
+static int user_insert(UserManager *mgr, const char *username,
+                       const char *password, long quota_used) {
+    int slot = index_find(mgr, username);
+    if (mgr->index[slot] != -1) return -1; // Username taken
+    
+    int user_id = atomic_load_explicit(&mgr->user_count, memory_order_relaxed);
+    int seg = user_id / USER_SEGMENT_SIZE;
+    if (seg >= USER_MAX_SEGMENTS) return -1;
+    
+    if (!user_segment(mgr, seg)) return -1;
+    
+    /* Keep the index at most half full */
+    if ((user_id + 1) * 2 > mgr->index_size) {
+        if (index_grow(mgr) == -1) return -1;
+        slot = index_find(mgr, username);
+    }
+    
+    User *user = user_slot(mgr, user_id);
+    user->id = user_id;
+    strncpy(user->username, username, MAX_USERNAME - 1);
+    user->username[MAX_USERNAME - 1] = '\0';
+    strncpy(user->password, password, MAX_PASSWORD - 1);
+    user->password[MAX_PASSWORD - 1] = '\0';
+    user_set_quota(user, quota_used);
+    mgr->index[slot] = user_id;
+    
+    /* Lock-free readers (user_get_by_id) see the user only once it is complete */
+    atomic_store_explicit(&mgr->user_count, user_id + 1, memory_order_release);
+    return user_id;
+}
 
 UserManager* user_manager_create(void) {
-    UserManager *mgr = malloc(sizeof(UserManager));
+    UserManager *mgr = calloc(1, sizeof(UserManager));
     if (!mgr) return NULL;
     
-    mgr->user_count = 0;
-    pthread_mutex_init(&mgr->mutex, NULL);
-    
-    /* Initialize per-user mutexes */
-    for (int i = 0; i < MAX_USERS; i++) {
-        pthread_mutex_init(&mgr->users[i].user_mutex, NULL);
+    mgr->index_size = USER_INDEX_MIN;
+    mgr->index = malloc(sizeof(int) * mgr->index_size);
+    if (!mgr->index) {
+        free(mgr);
+        return NULL;
     }
+    for (int i = 0; i < mgr->index_size; i++) mgr->index[i] = -1;
+    
+    atomic_init(&mgr->user_count, 0);
+    pthread_rwlock_init(&mgr->lock, NULL);
     
-    /* Create users directory if not exists */
+    /* Create users and file index directories if not exist */
     mkdir("users", 0755);
+    mkdir(FILEINDEX_DIR, 0755);
     
     /* Load existing users */
-    user_manager_load(mgr);
+    if (user_manager_load(mgr) == -1) {
+        userdb_close(&mgr->db);
+        pthread_rwlock_destroy(&mgr->lock);
+        free(mgr->index);
+        free(mgr);
+        return NULL;
+    }
     
     return mgr;
 }
@@ -31,163 +192,401 @@ UserManager* user_manager_create(void) {
 void user_manager_destroy(UserManager *mgr) {
     if (!mgr) return;
     
-    /* Save before shutdown */
+    /* Flush pending records, then checkpoint so the next start has
+     * nothing to replay */
+    journal_stop_sync(&mgr->journal);
     user_manager_save(mgr);
+    journal_close(&mgr->journal);
     
-    /* Destroy per-user mutexes */
-    for (int i = 0; i < MAX_USERS; i++) {
-        pthread_mutex_destroy(&mgr->users[i].user_mutex);
+    /* Destroy segments, their per-user mutexes and saved file indexes;
+     * segments of users.db nobody touched were never allocated */
+    for (int seg = 0; seg < USER_MAX_SEGMENTS; seg++) {
+        User *segment = atomic_load(&mgr->segments[seg]);
+        if (!segment) continue;
+        for (int i = 0; i < USER_SEGMENT_SIZE; i++) {
+            fileindex_close(atomic_load(&segment[i].files));
+            pthread_mutex_destroy(&segment[i].user_mutex);
+        }
+        free(segment);
     }
+    userdb_close(&mgr->db);
     
-    pthread_mutex_destroy(&mgr->mutex);
+    chunkstore_close(mgr->chunks);
+    filecache_destroy(mgr->cache);
+    pthread_rwlock_destroy(&mgr->lock);
+    free(mgr->index);
     free(mgr);
 }
 
 /* Register new user (returns user_id or -1 on error) */
 int user_register(UserManager *mgr, const char *username, const char *password) {
-    pthread_mutex_lock(&mgr->mutex);
+    long lsn = -1;
     
-    /* Check if username already exists */
-    for (int i = 0; i < mgr->user_count; i++) {
-        if (strcmp(mgr->users[i].username, username) == 0) {
-            pthread_mutex_unlock(&mgr->mutex);
-            return -1; // Username taken
+    pthread_rwlock_wrlock(&mgr->lock);
+    int user_id = user_insert(mgr, username, password, 0);
+    if (user_id != -1) {
+        char record[JOURNAL_MAX_RECORD];
+        User *user = user_slot(mgr, user_id);
+        snprintf(record, sizeof(record), "%s %s", user->username, user->password);
+        lsn = journal_append(&mgr->journal, RECORD_REGISTER, record);
+        if (lsn == -1) {
+            /* Unjournaled, the account would vanish at the next start:
+             * take it back out. It is the newest entry, so no other
+             * name probes past its index slot. */
+            perror("[UserManager] journal_append");
+            mgr->index[index_find(mgr, user->username)] = -1;
+            atomic_store_explicit(&mgr->user_count, user_id, memory_order_release);
+            user_id = -2;
         }
     }
+    pthread_rwlock_unlock(&mgr->lock);
     
-    if (mgr->user_count >= MAX_USERS) {
-        pthread_mutex_unlock(&mgr->mutex);
-        return -1;
-    }
+    if (user_id < 0) return user_id;
     
-    /* Create new user */
-    int user_id = mgr->user_count;
-    mgr->users[user_id].id = user_id;
-    strncpy(mgr->users[user_id].username, username, MAX_USERNAME - 1);
-    mgr->users[user_id].username[MAX_USERNAME - 1] = '\0';
-    strncpy(mgr->users[user_id].password, password, MAX_PASSWORD - 1);
-    mgr->users[user_id].password[MAX_PASSWORD - 1] = '\0';
-    mgr->users[user_id].quota_used = 0;
-    mgr->user_count++;
+    /* An account must survive a crash once the client is told it exists;
+     * concurrent registrations share one sync */
+    int synced = journal_wait(&mgr->journal, lsn);
+    if (synced == -1) {
+        fprintf(stderr, "[UserManager] Registration of %s is not durable\n", username);
+    }
     
     /* Create user directory */
     char user_dir[256];
     snprintf(user_dir, sizeof(user_dir), "users/%s", username);
     mkdir(user_dir, 0755);
     
-    /* Save to file - must unlock first to avoid deadlock */
-    pthread_mutex_unlock(&mgr->mutex);
-    user_manager_save(mgr);
+    user_checkpoint_if_due(mgr);
     
-    return user_id;
+    return synced == -1 ? -2 : user_id;
 }
 
 /* Authenticate user (returns user_id or -1 on failure) */
 int user_login(UserManager *mgr, const char *username, const char *password) {
-    pthread_mutex_lock(&mgr->mutex);
+    int user_id = -1;
     
-    for (int i = 0; i < mgr->user_count; i++) {
-        if (strcmp(mgr->users[i].username, username) == 0 &&
-            strcmp(mgr->users[i].password, password) == 0) {
-            pthread_mutex_unlock(&mgr->mutex);
-            return mgr->users[i].id;
+    pthread_rwlock_rdlock(&mgr->lock);
+    int slot = index_find(mgr, username);
+    if (mgr->index[slot] != -1) {
+        User *user = user_slot(mgr, mgr->index[slot]);
+        if (user && strcmp(user->password, password) == 0) {
+            user_id = user->id;
         }
     }
+    pthread_rwlock_unlock(&mgr->lock);
     
-    pthread_mutex_unlock(&mgr->mutex);
-    return -1;
+    return user_id;
 }
 
-/* Get user by ID (not thread-safe, caller must lock if needed) */
+/* Get user by ID (lock-free: users never move or disappear) */
 User* user_get_by_id(UserManager *mgr, int user_id) {
-    if (user_id < 0 || user_id >= mgr->user_count) {
+    if (user_id < 0 ||
+        user_id >= atomic_load_explicit(&mgr->user_count, memory_order_acquire)) {
         return NULL;
     }
-    return &mgr->users[user_id];
+    return user_slot(mgr, user_id);
 }
 
-/* Add to user's quota (returns 0 on success, -1 if exceeds quota) */
-int user_add_quota(UserManager *mgr, int user_id, long bytes) {
+/* Built under user_mutex so two first requests do not both scan */
+FileIndex* user_file_index(UserManager *mgr, int user_id) {
     User *user = user_get_by_id(mgr, user_id);
-    if (!user) return -1;
+    if (!user) return NULL;
+    
+    FileIndex *files = atomic_load_explicit(&user->files, memory_order_acquire);
+    if (files) return files;
     
     pthread_mutex_lock(&user->user_mutex);
+    files = atomic_load_explicit(&user->files, memory_order_relaxed);
+    if (!files) {
+        char dir[128], path[128];
+        snprintf(dir, sizeof(dir), "users/%s", user->username);
+        snprintf(path, sizeof(path), "%s/%s", FILEINDEX_DIR, user->username);
+        files = fileindex_open(dir, path, mgr->chunks ? chunkstore_file_size : NULL);
+        atomic_store_explicit(&user->files, files, memory_order_release);
+    }
+    pthread_mutex_unlock(&user->user_mutex);
     
-    if (user->quota_used + bytes > USER_QUOTA_BYTES) {
-        pthread_mutex_unlock(&user->user_mutex);
-        return -1;
+    return files;
+}
+
+int user_files_ready(UserManager *mgr, int user_id) {
+    User *user = user_get_by_id(mgr, user_id);
+    return user && atomic_load_explicit(&user->files, memory_order_acquire) != NULL;
+}
+
+/* ===== QUOTA =====
+ * quota_charged is what admission looks at: committed bytes plus every
+ * outstanding reservation. Reserving is a CAS on it, so parallel
+ * uploads of one user can never overshoot USER_QUOTA_BYTES. Only
+ * changes to quota_used are journaled; reservations die with the
+ * process. */
+
+/* Journal a committed change; the read lock keeps checkpoints out
+ * between the change and its record */
+static void user_journal_quota(UserManager *mgr, int user_id, long delta) {
+    char record[64];
+    snprintf(record, sizeof(record), "%d %ld", user_id, delta);
+    if (journal_append(&mgr->journal, RECORD_QUOTA, record) == -1) {
+        perror("[UserManager] journal_append");
     }
+}
+
+/* Reserve bytes for an upload (0, or -1 if it would exceed the quota) */
+int user_reserve_quota(UserManager *mgr, int user_id, long bytes) {
+    User *user = user_get_by_id(mgr, user_id);
+    if (!user || bytes < 0) return -1;
     
-    user->quota_used += bytes;
-    pthread_mutex_unlock(&user->user_mutex);
+    long charged = atomic_load_explicit(&user->quota_charged, memory_order_relaxed);
+    do {
+        if (charged + bytes > USER_QUOTA_BYTES) return -1;
+    } while (!atomic_compare_exchange_weak(&user->quota_charged, &charged, charged + bytes));
     
     return 0;
 }
 
-/* Remove from user's quota */
+/* Turn a reservation into used space (returns new quota_used or -1) */
+long user_commit_quota(UserManager *mgr, int user_id, long bytes) {
+    User *user = user_get_by_id(mgr, user_id);
+    if (!user) return -1;
+    
+    pthread_rwlock_rdlock(&mgr->lock);
+    long used = atomic_fetch_add(&user->quota_used, bytes) + bytes;
+    if (bytes != 0) user_journal_quota(mgr, user_id, bytes);
+    pthread_rwlock_unlock(&mgr->lock);
+    
+    user_checkpoint_if_due(mgr);
+    return used;
+}
+
+/* Give back a reservation whose upload failed */
+void user_release_quota(UserManager *mgr, int user_id, long bytes) {
+    User *user = user_get_by_id(mgr, user_id);
+    if (!user) return;
+    
+    atomic_fetch_sub(&user->quota_charged, bytes);
+}
+
+/* Add to user's quota (returns 0 on success, -1 if exceeds quota) */
+int user_add_quota(UserManager *mgr, int user_id, long bytes) {
+    if (user_reserve_quota(mgr, user_id, bytes) == -1) return -1;
+    return user_commit_quota(mgr, user_id, bytes) == -1 ? -1 : 0;
+}
+
+/* Remove from user's quota (never below zero) */
 int user_remove_quota(UserManager *mgr, int user_id, long bytes) {
     User *user = user_get_by_id(mgr, user_id);
     if (!user) return -1;
     
-    pthread_mutex_lock(&user->user_mutex);
-    user->quota_used -= bytes;
-    if (user->quota_used < 0) user->quota_used = 0;
-    pthread_mutex_unlock(&user->user_mutex);
+    pthread_rwlock_rdlock(&mgr->lock);
+    long used = atomic_load_explicit(&user->quota_used, memory_order_relaxed);
+    long freed;
+    do {
+        freed = bytes < used ? bytes : used;
+    } while (!atomic_compare_exchange_weak(&user->quota_used, &used, used - freed));
+    atomic_fetch_sub(&user->quota_charged, freed);
+    if (freed != 0) user_journal_quota(mgr, user_id, -freed);
+    pthread_rwlock_unlock(&mgr->lock);
     
+    user_checkpoint_if_due(mgr);
     return 0;
 }
 
-/* Load users from file */
-int user_manager_load(UserManager *mgr) {
-    FILE *fp = fopen(USERS_FILE, "r");
-    if (!fp) return 0; // No file yet
+long user_quota_used(UserManager *mgr, int user_id) {
+    User *user = user_get_by_id(mgr, user_id);
+    return user ? atomic_load(&user->quota_used) : -1;
+}
+
+/* Bytes a new reservation could still get */
+long user_quota_available(UserManager *mgr, int user_id) {
+    User *user = user_get_by_id(mgr, user_id);
+    if (!user) return 0;
+    long available = USER_QUOTA_BYTES - atomic_load(&user->quota_charged);
+    return available > 0 ? available : 0;
+}
+
+/* Set both counters while no reservations exist (load, replay) */
+static void user_set_quota(User *user, long quota_used) {
+    if (quota_used < 0) quota_used = 0;
+    atomic_store_explicit(&user->quota_used, quota_used, memory_order_relaxed);
+    atomic_store_explicit(&user->quota_charged, quota_used, memory_order_relaxed);
+}
+
+/* Re-apply one journal record on top of the checkpoint */
+static void user_replay(void *ctx, char type, const char *payload) {
+    UserManager *mgr = ctx;
+    char username[MAX_USERNAME], password[MAX_PASSWORD];
+    int user_id;
+    long delta;
+    
+    if (type == RECORD_REGISTER &&
+        sscanf(payload, "%63s %63s", username, password) == 2) {
+        user_insert(mgr, username, password, 0);
+    } else if (type == RECORD_QUOTA &&
+               sscanf(payload, "%d %ld", &user_id, &delta) == 2) {
+        User *user = user_get_by_id(mgr, user_id);
+        if (!user) return;
+        user_set_quota(user, atomic_load(&user->quota_used) + delta);
+    }
+}
+
+/* Take users.db over as the table: the index region is copied, the
+ * records stay mapped and fill each segment on its first use, so
+ * nothing is parsed, rehashed or copied per user (caller holds the
+ * write lock) */
+static int user_load_db(UserManager *mgr, long *checkpoint_lsn) {
+    UserDb db;
+    if (userdb_open(&db, USERS_DB) == -1) return -1;
+    
+    const UserDbHeader *h = db.header;
+    if (h->user_count > (uint64_t)USER_SEGMENT_SIZE * USER_MAX_SEGMENTS ||
+        h->index_size > INT_MAX / 2) {
+        userdb_close(&db);
+        errno = EINVAL;
+        return -1;
+    }
     
-    pthread_mutex_lock(&mgr->mutex);
+    int count = (int)h->user_count;
+    int index_size = (int)h->index_size;
+    int *index = malloc(sizeof(int) * index_size);
+    if (!index) {
+        userdb_close(&db);
+        return -1;
+    }
+    
+    for (int i = 0; i < index_size; i++) {
+        index[i] = db.index[i];
+        if (index[i] < -1 || index[i] >= count) {
+            free(index);
+            userdb_close(&db);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    
+    free(mgr->index);
+    mgr->index = index;
+    mgr->index_size = index_size;
+    mgr->db = db;
+    mgr->db_users = count;
+    *checkpoint_lsn = h->checkpoint_lsn;
+    atomic_store_explicit(&mgr->user_count, count, memory_order_release);
+    return 0;
+}
+
+/* Parse the old users.txt (returns 1 if there was one to convert) */
+static int user_load_text(UserManager *mgr, long *checkpoint_lsn) {
+    FILE *fp = fopen(USERS_TEXT, "r");
+    if (!fp) return 0;
     
-    mgr->user_count = 0;
+    char line[256];
     char username[MAX_USERNAME], password[MAX_PASSWORD];
     long quota_used;
     
-    while (fscanf(fp, "%s %s %ld\n", username, password, &quota_used) == 3) {
-        if (mgr->user_count >= MAX_USERS) break;
-        
-        int id = mgr->user_count;
-        mgr->users[id].id = id;
-        strncpy(mgr->users[id].username, username, MAX_USERNAME - 1);
-        mgr->users[id].username[MAX_USERNAME - 1] = '\0';
-        strncpy(mgr->users[id].password, password, MAX_PASSWORD - 1);
-        mgr->users[id].password[MAX_PASSWORD - 1] = '\0';
-        mgr->users[id].quota_used = quota_used;
-        mgr->user_count++;
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#') {
+            sscanf(line, "#checkpoint %ld", checkpoint_lsn);
+        } else if (sscanf(line, "%63s %63s %ld", username, password, &quota_used) == 3) {
+            user_insert(mgr, username, password, quota_used); // Duplicates are skipped
+        }
     }
-    
-    pthread_mutex_unlock(&mgr->mutex);
     fclose(fp);
     
-    return 0;
+    return 1;
 }
 
-/* Save users to file */
-int user_manager_save(UserManager *mgr) {
-    FILE *fp = fopen(USERS_FILE, "w");
-    if (!fp) return -1;
+/* Load the checkpoint, then replay the journal on top of it */
+int user_manager_load(UserManager *mgr) {
+    long checkpoint_lsn = 0;
+    int convert = 0;
     
-    pthread_mutex_lock(&mgr->mutex);
+    pthread_rwlock_wrlock(&mgr->lock);
     
-    for (int i = 0; i < mgr->user_count; i++) {
-        /* Lock individual user to safely read quota_used */
-        pthread_mutex_lock(&mgr->users[i].user_mutex);
-        long quota = mgr->users[i].quota_used;
-        pthread_mutex_unlock(&mgr->users[i].user_mutex);
-        
-        fprintf(fp, "%s %s %ld\n",
-                mgr->users[i].username,
-                mgr->users[i].password,
-                quota);
+    int status = user_load_db(mgr, &checkpoint_lsn);
+    if (status == -1 && errno == ENOENT) {
+        convert = user_load_text(mgr, &checkpoint_lsn);
+        status = 0;
+    } else if (status == -1) {
+        fprintf(stderr, "[UserManager] Cannot load %s: %s\n", USERS_DB, strerror(errno));
     }
     
-    pthread_mutex_unlock(&mgr->mutex);
-    fclose(fp);
+    if (status == 0) {
+        status = journal_open(&mgr->journal, JOURNAL_FILE, checkpoint_lsn,
+                              user_replay, mgr);
+        if (status == -1) perror("[UserManager] journal_open");
+    }
     
-    return 0;
-}
\ No newline at end of file
+    pthread_rwlock_unlock(&mgr->lock);
+    
+    /* One-time conversion: from now on only users.db is read */
+    if (convert && user_manager_save(mgr) == 0) {
+        rename(USERS_TEXT, USERS_TEXT_CONVERTED);
+        printf("[UserManager] Converted %s to %s (%d users)\n",
+               USERS_TEXT, USERS_DB, atomic_load(&mgr->user_count));
+    }
+    
+    return status;
+}
+
+static void user_fill_record(void *ctx, int user_id, UserDbRecord *record) {
+    UserManager *mgr = ctx;
+    User *user = atomic_load(&mgr->segments[user_id / USER_SEGMENT_SIZE]);
+    if (!user) {
+        /* Untouched since the last load: the mapped record is current */
+        *record = mgr->db.records[user_id];
+        return;
+    }
+    user += user_id % USER_SEGMENT_SIZE;
+    long quota = atomic_load(&user->quota_used);
+    
+    strncpy(record->username, user->username, sizeof(record->username));
+    strncpy(record->password, user->password, sizeof(record->password));
+    record->quota_used = quota;
+}
+
+/* Checkpoint: write users.db with the LSN it covers, then empty the
+ * journal. The write lock keeps registrations and quota changes out
+ * until the journal is reset. */
+int user_manager_save(UserManager *mgr) {
+    pthread_rwlock_wrlock(&mgr->lock);
+    
+    int status = userdb_write(USERS_DB, journal_last_lsn(&mgr->journal),
+                              atomic_load(&mgr->user_count),
+                              user_fill_record, mgr,
+                              (const int32_t*)mgr->index, mgr->index_size);
+    if (status == 0) {
+        /* A crash before this point replays records the checkpoint
+         * already covers; their LSNs make replay skip them */
+        journal_reset(&mgr->journal);
+    }
+    
+    pthread_rwlock_unlock(&mgr->lock);
+    return status;
+}
+
+/* Group-commit thread callback */
+static void user_checkpoint(void *ctx) {
+    printf("[UserManager] Checkpointing user table\n");
+    user_manager_save((UserManager*)ctx);
+}
+
+int user_manager_start_sync(UserManager *mgr, long window_ms) {
+    return journal_start_sync(&mgr->journal, window_ms, JOURNAL_SYNC_RECORDS,
+                              user_checkpoint, mgr);
+}
+
+int user_manager_enable_dedup(UserManager *mgr) {
+    mgr->chunks = chunkstore_open(CHUNKSTORE_DIR, "users");
+    return mgr->chunks ? 0 : -1;
+}
+
+int user_manager_enable_cache(UserManager *mgr, size_t capacity) {
+    mgr->cache = filecache_create(capacity);
+    return mgr->cache ? 0 : -1;
+}
+
+/* Compact the journal once it has grown enough (without a sync thread) */
+static void user_checkpoint_if_due(UserManager *mgr) {
+    if (journal_checkpoint_due(&mgr->journal)) {
+        printf("[UserManager] Checkpointing user table\n");
+        user_manager_save(mgr);
+    }
+}
@@ -2,44 +2,97 @@
 #define UTILS_H
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include "journal.h"
+#include "userdb.h"
+#include "fileindex.h"
+#include "chunkstore.h"
+#include "filecache.h"
 
-#define MAX_USERS 1000
 #define MAX_USERNAME 64
 #define MAX_PASSWORD 64
 #define USER_QUOTA_MB 100
 #define USER_QUOTA_BYTES (USER_QUOTA_MB * 1024 * 1024)
 
+#define USER_SEGMENT_SIZE 4096      // Users per table segment
+#define USER_MAX_SEGMENTS 4096      // Segment directory size (16M users)
+#define USER_INDEX_MIN 1024         // Initial hash index slots (power of two)
+
 /* User account structure */
 typedef struct {
     int id;
     char username[MAX_USERNAME];
     char password[MAX_PASSWORD];
-    long quota_used;            // Bytes used
+    atomic_long quota_used;     // Bytes used (committed, persisted)
+    atomic_long quota_charged;  // quota_used + outstanding reservations
     pthread_mutex_t user_mutex; // Per-user lock for file operations
+    FileIndex *_Atomic files;   // Built on first use, see user_file_index()
+    struct UploadClaim *storing; // Uploads being stored, under user_mutex (session.c)
+    atomic_long partials_scanned; // time() the last expiry of partial/<user> was queued
 } User;
 
-/* User management system */
+/* User management system. Users live in fixed-size segments that are
+ * allocated on first use, so a User never moves once created and
+ * lookups by id need no lock. Segments of users loaded from users.db
+ * are filled from its mapping when first touched. Usernames are found
+ * through an open-addressing hash index of user ids; logins share the
+ * read lock and only registration takes it exclusively. */
 typedef struct {
-    User users[MAX_USERS];
-    int user_count;
-    pthread_mutex_t mutex;      // Protects user_count and array
+    User *_Atomic segments[USER_MAX_SEGMENTS];
+    atomic_int user_count;      // Published after the user is filled in
+    UserDb db;                  // users.db as loaded, kept mapped
+    int db_users;               // Users 0..db_users-1 come from db
+    int *index;                 // Hash slots holding user ids (-1 = empty)
+    int index_size;             // Slot count, power of two, at most half full
+    pthread_rwlock_t lock;      // Protects index and registration; held
+                                // shared by quota changes, exclusive by checkpoints
+    Journal journal;            // Registrations and quota deltas since users.db
+    ChunkStore *chunks;         // Deduplicated file storage (NULL = whole files)
+    FileCache *cache;           // Hot small files for DOWNLOAD (NULL = off)
 } UserManager;
 
 /* Initialize user management */
 UserManager* user_manager_create(void);
 void user_manager_destroy(UserManager *mgr);
 
-/* User operations */
+/* User operations. user_register returns the new ID, -1 if the name is
+ * taken, or -2 if the account could not be saved: not journaled (it was
+ * taken back out) or not synced (it exists, but may not survive a
+ * crash). */
 int user_register(UserManager *mgr, const char *username, const char *password);
 int user_login(UserManager *mgr, const char *username, const char *password);
 User* user_get_by_id(UserManager *mgr, int user_id);
 
-/* File size tracking */
+/* Metadata index of the user's files, built on first call (NULL on error) */
+FileIndex* user_file_index(UserManager *mgr, int user_id);
+
+/* Whether user_file_index() would return without scanning the directory */
+int user_files_ready(UserManager *mgr, int user_id);
+
+/* File size tracking. Uploads reserve their size up front, then either
+ * commit it once the file is stored or release it if the upload fails. */
+int user_reserve_quota(UserManager *mgr, int user_id, long bytes);
+long user_commit_quota(UserManager *mgr, int user_id, long bytes);
+void user_release_quota(UserManager *mgr, int user_id, long bytes);
 int user_add_quota(UserManager *mgr, int user_id, long bytes);
 int user_remove_quota(UserManager *mgr, int user_id, long bytes);
+long user_quota_used(UserManager *mgr, int user_id);
+long user_quota_available(UserManager *mgr, int user_id);
 
-/* Persistence */
+/* Persistence: users.db is a checkpoint, users.journal holds every
+ * change since; save writes a new checkpoint and empties the journal.
+ * An old users.txt is converted to users.db on first load. */
 int user_manager_load(UserManager *mgr);
 int user_manager_save(UserManager *mgr);
 
+/* Move journal fsyncs and checkpoints to a group-commit thread that
+ * batches changes for up to window_ms */
+int user_manager_start_sync(UserManager *mgr, long window_ms);
+
+/* Store files as deduplicated chunks from now on (call before serving) */
+int user_manager_enable_dedup(UserManager *mgr);
+
+/* Serve small files from a read cache of capacity bytes (call before serving) */
+int user_manager_enable_cache(UserManager *mgr, size_t capacity);
+
 #endif
\ No newline at end of file